@@ -94,6 +94,14 @@ namespace gaia {
 				return (size_type)m_items.capacity();
 			}
 
+			//! Makes sure there is enough space for \param cnt more items
+			//! so they can be allocated without reallocating the list.
+			void reserve_more(size_type cnt) {
+				if (cnt <= m_freeItems)
+					return;
+				m_items.reserve(size() + (cnt - m_freeItems));
+			}
+
 			GAIA_NODISCARD iterator begin() const noexcept {
 				return {(pointer)m_items.data()};
 			}
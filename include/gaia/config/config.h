@@ -28,6 +28,13 @@
 	#define GAIA_ECS_CHUNK_ALLOCATOR 1
 #endif
 
+//! If enabled, memory pages of the chunk allocator are carved out of 2 MiB regions backed by huge pages
+//! where the platform supports it (transparent huge pages on Linux). This reduces TLB misses when iterating
+//! over many chunks. Requires GAIA_ECS_CHUNK_ALLOCATOR.
+#ifndef GAIA_ECS_CHUNK_ALLOCATOR_HUGE_PAGES
+	#define GAIA_ECS_CHUNK_ALLOCATOR_HUGE_PAGES 0
+#endif
+
 //! Hashing algorithm. GAIA_ECS_HASH_FNV1A or GAIA_ECS_HASH_MURMUR2A
 #ifndef GAIA_ECS_HASH
 	#define GAIA_ECS_HASH GAIA_ECS_HASH_MURMUR2A
@@ -38,6 +45,12 @@
 	#define GAIA_USE_PREFETCH 1
 #endif
 
+//! Size of the inline storage of job functions (mt::Job, mt::JobParallel) in bytes.
+//! Jobs never allocate memory for their callables. Callables not fitting the storage fail to compile.
+#ifndef GAIA_JOB_FUNC_SIZE
+	#define GAIA_JOB_FUNC_SIZE 64
+#endif
+
 //------------------------------------------------------------------------------
 
 #include "config_core_end.h"
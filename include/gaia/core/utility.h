@@ -158,7 +158,7 @@ namespace gaia {
 		void call_dtor(T* pData) {
 			GAIA_ASSERT(pData != nullptr);
 			if constexpr (!std::is_trivially_destructible_v<T>) {
-				pData.~T();
+				pData->~T();
 			}
 		}
 
@@ -1,10 +1,12 @@
 #pragma once
 #include "../config/config.h"
 
+#include <atomic>
 #include <cinttypes>
 #include <cstdint>
 
 #include "../cnt/darray.h"
+#include "../cnt/darray_ext.h"
 #include "../cnt/dbitset.h"
 #include "../cnt/sarray.h"
 #include "../cnt/sarray_ext.h"
@@ -27,6 +29,7 @@ namespace gaia {
 
 		const ComponentCache& comp_cache(const World& world);
 		Entity entity_from_id(const World& world, EntityId id);
+		Entity entity_from_rec(const World& world, EntityId id);
 		const char* entity_name(const World& world, Entity entity);
 		const char* entity_name(const World& world, EntityId entityId);
 
@@ -41,6 +44,64 @@ namespace gaia {
 			}
 		};
 
+		//! Bloom filter of entity ids forming an archetype or queried by a query.
+		//! Each id sets two bits picked by its hash. If some bit of an id is not set in a signature the id is
+		//! certainly not in it. If all of them are set the id is most likely in it but it needs to be confirmed
+		//! by comparing the ids. The bits are processed a word at a time without branching so compilers can turn
+		//! the checks into a few SIMD instructions.
+		class ArchetypeSignature {
+			static constexpr uint32_t Bits = 256;
+			static constexpr uint32_t Words = Bits / 64;
+
+			uint64_t m_data[Words]{};
+
+			void set(uint32_t bit) {
+				m_data[bit / 64] |= (uint64_t)1 << (bit % 64);
+			}
+
+		public:
+			//! Adds \param entity to the signature
+			void add(Entity entity) {
+				// Only the parts compared when matching pairs are hashed. Pairs can be formed from entities
+				// of different kinds.
+				const uint64_t key = ((uint64_t)entity.id() << 32) | entity.gen();
+				const auto hash = core::calculate_hash64(key + (uint64_t)entity.pair());
+				set((uint32_t)(hash % Bits));
+				set((uint32_t)((hash >> 32) % Bits));
+			}
+
+			//! Adds all wildcard pairs matching the \param pair to the signature
+			void add_wildcards(Entity pair) {
+				GAIA_ASSERT(pair.pair());
+				// (*, tgt)
+				add(Entity(All.id(), pair.gen(), false, true, EntityKind::EK_Gen));
+				// (rel, *)
+				add(Entity(pair.id(), All.id(), false, true, EntityKind::EK_Gen));
+				// (*, *)
+				add(Entity(All.id(), All.id(), false, true, EntityKind::EK_Gen));
+			}
+
+			GAIA_NODISCARD bool empty() const {
+				uint64_t bits = 0;
+				GAIA_FOR(Words) bits |= m_data[i];
+				return bits == 0;
+			}
+
+			//! Returns true if all bits of \param other are set in this signature
+			GAIA_NODISCARD bool contains(const ArchetypeSignature& other) const {
+				uint64_t missing = 0;
+				GAIA_FOR(Words) missing |= other.m_data[i] & ~m_data[i];
+				return missing == 0;
+			}
+
+			//! Returns true if some bit of \param other is set in this signature
+			GAIA_NODISCARD bool intersects(const ArchetypeSignature& other) const {
+				uint64_t common = 0;
+				GAIA_FOR(Words) common |= other.m_data[i] & m_data[i];
+				return common != 0;
+			}
+		};
+
 		GAIA_NODISCARD inline bool cmp_comps(EntitySpan comps, EntitySpan compsOther) {
 			// Size has to match
 			GAIA_FOR(EntityKind::EK_Count) {
@@ -76,12 +137,27 @@ namespace gaia {
 			using LookupHash = core::direct_hash_key<uint64_t>;
 
 			struct Properties {
-				//! The number of data entities this archetype can take (e.g 5 = 5 entities with all their components)
+				//! The number of data entities the biggest chunk of this archetype can take
+				//! (e.g 5 = 5 entities with all their components)
 				uint16_t capacity;
-				//! How many bytes of data is needed for a fully utilized chunk
+				//! How many bytes of data is needed for a fully utilized biggest chunk
 				ChunkDataOffset chunkDataBytes;
 				//! The number of generic entities/components
 				uint8_t genEntities;
+				//! Size type of the smallest chunk the archetype allocates
+				uint8_t minSizeType;
+				//! Size type of the biggest chunk the archetype allocates
+				uint8_t maxSizeType;
+			};
+
+			//! Layout of the data area of chunks of one size type
+			struct ChunkLayout {
+				//! The number of data entities the chunk can take. Zero if not even one entity fits.
+				uint16_t capacity;
+				//! How many bytes of data is needed for a fully utilized chunk
+				ChunkDataOffset chunkDataBytes;
+				//! List of components offset indices
+				Chunk::ComponentOffsetArray compOffs;
 			};
 
 		private:
@@ -93,25 +169,37 @@ namespace gaia {
 			const ComponentCache& m_cc;
 			//! Stable reference to parent world's world version
 			uint32_t& m_worldVersion;
+			//! Most recent version of each component among all chunks of the archetype.
+			//! Makes it possible to skip the whole archetype when no chunk has changed.
+			//! Chunks of the archetype can be written to by different worker threads at once, hence the atomics.
+			std::atomic<ComponentVersion> m_compVersions[Chunk::MAX_COMPONENTS];
 
 			//! List of chunks allocated by this archetype
 			cnt::darray<Chunk*> m_chunks;
+			//! Incremented every time the list of chunks changes or the archetype is requested to be deleted
+			uint32_t m_chunksVersion = 0;
 			//! Mask of chunks with disabled entities
 			// cnt::dbitset m_disabledMask;
 			//! Graph of archetypes linked with this one
 			ArchetypeGraph m_graph;
+			//! Archetypes this one cached a column mapping for
+			cnt::darray<Archetype*> m_columnMapDsts;
+			//! Archetypes which cached a column mapping for this one
+			cnt::darray<Archetype*> m_columnMapSrcs;
 
 			//! Offsets to various parts of data inside chunk
 			ChunkDataOffsets m_dataOffsets;
 			//! List of entities used to identify the archetype
 			Chunk::EntityArray m_ids;
+			//! Signature of m_ids, including wildcard forms of pairs
+			ArchetypeSignature m_signature;
 			//! List of indices to Is relationship pairs in m_ids.
 			//! Compressed as Chunk::MAX_COMPONENTS_BITS per item.
 			AsPairsIndexBuffer m_pairs_as_index_buffer;
 			//! List of component ids
 			Chunk::ComponentArray m_comps;
-			//! List of components offset indices
-			Chunk::ComponentOffsetArray m_compOffs;
+			//! Layouts of chunks for each chunk size type
+			cnt::sarray<ChunkLayout, MemoryBlockSizeTypes> m_layouts{};
 
 			//! Hash of components within this archetype - used for lookups
 			LookupHash m_hashLookup = {0};
@@ -138,7 +226,10 @@ namespace gaia {
 			Archetype(const ComponentCache& cc, uint32_t& worldVersion):
 					m_cc(cc), m_worldVersion(worldVersion),
 					//
-					m_deleteReq(0), m_lifespanCountdown(0), m_dead(0), m_pairCnt(0), m_pairCnt_is(0) {}
+					m_deleteReq(0), m_lifespanCountdown(0), m_dead(0), m_pairCnt(0), m_pairCnt_is(0) {
+				for (auto& v: m_compVersions)
+					v.store(0, std::memory_order_relaxed);
+			}
 
 			//! Calulcates offsets in memory at which important chunk data is going to be stored.
 			//! These offsets are use to setup the chunk data area layout.
@@ -209,7 +300,11 @@ namespace gaia {
 					if (nextOffset >= maxDataOffset) {
 						const auto subtractItems = (nextOffset - maxDataOffset + comp.size()) / comp.size();
 						GAIA_ASSERT(subtractItems > 0);
-						GAIA_ASSERT(maxItems > subtractItems);
+						// Not even a single entity fits
+						if (maxItems <= subtractItems) {
+							maxItems = 0;
+							return true;
+						}
 						maxItems -= subtractItems;
 						return false;
 					}
@@ -221,13 +316,8 @@ namespace gaia {
 			};
 
 			static void reg_components(
-					Archetype& arch, EntitySpan ids, ComponentSpan comps, uint8_t from, uint8_t to, uint32_t& currOff,
+					Chunk::ComponentOffsetArray& ofs, ComponentSpan comps, uint8_t from, uint8_t to, uint32_t& currOff,
 					uint32_t count) {
-				auto& ofs = arch.m_compOffs;
-
-				// Set component ids
-				GAIA_FOR2(from, to) arch.m_ids[i] = ids[i];
-
 				// Calulate offsets and assign them indices according to our mappings
 				GAIA_FOR2(from, to) {
 					const auto comp = comps[i];
@@ -246,6 +336,63 @@ namespace gaia {
 				}
 			}
 
+			//! Calculates the \param layout of chunks with \param maxDataOffsetTarget bytes of data area.
+			//! \return False if not even a single entity fits into such chunk
+			static bool calc_layout(
+					const ComponentCache& cc, ComponentSpan comps, uint32_t entsGeneric, const ChunkDataOffsets& offs,
+					uint32_t maxEntities, uint32_t maxDataOffsetTarget, ChunkLayout& layout) {
+				// Calculate the number of entities per chunks precisely so we can
+				// fit as many of them into chunk as possible.
+
+				uint32_t genCompsSize = 0;
+				uint32_t uniCompsSize = 0;
+				GAIA_FOR(entsGeneric) genCompsSize += comps[i].size();
+				GAIA_FOR2(entsGeneric, comps.size()) uniCompsSize += comps[i].size();
+
+				const uint32_t minDataBytes =
+						offs.firstByte_EntityData + uniCompsSize + genCompsSize + (uint32_t)sizeof(Entity);
+				if (maxDataOffsetTarget <= minDataBytes)
+					return false;
+
+				// Theoretical maximum number of components we can fit into one chunk.
+				// This can be further reduced due alignment and padding.
+				auto maxGenItemsInArchetype = (maxDataOffsetTarget - offs.firstByte_EntityData - uniCompsSize - 1) /
+																			(genCompsSize + (uint32_t)sizeof(Entity));
+
+			recalculate:
+				auto currOff = offs.firstByte_EntityData + (uint32_t)sizeof(Entity) * maxGenItemsInArchetype;
+
+				// Adjust the maximum number of entities. Recalculation happens at most once when the original guess
+				// for entity count is not right (most likely because of padding or usage of SoA components).
+				if (!est_max_entities_per_archetype(
+								cc, currOff, maxGenItemsInArchetype, comps.subspan(0, entsGeneric), maxGenItemsInArchetype,
+								maxDataOffsetTarget))
+					goto recalculate;
+				if (!est_max_entities_per_archetype(
+								cc, currOff, maxGenItemsInArchetype, comps.subspan(entsGeneric), 1, maxDataOffsetTarget))
+					goto recalculate;
+				if (maxGenItemsInArchetype == 0)
+					return false;
+
+				// Limit the number of entities to a certain number so we can make use of smaller
+				// chunks where it makes sense.
+				if (maxGenItemsInArchetype > maxEntities) {
+					maxGenItemsInArchetype = maxEntities;
+					goto recalculate;
+				}
+
+				// Update the offsets according to the recalculated maxGenItemsInArchetype
+				currOff = offs.firstByte_EntityData + (uint32_t)sizeof(Entity) * maxGenItemsInArchetype;
+				layout.compOffs.resize((uint32_t)comps.size());
+				reg_components(layout.compOffs, comps, (uint8_t)0, (uint8_t)entsGeneric, currOff, maxGenItemsInArchetype);
+				reg_components(layout.compOffs, comps, (uint8_t)entsGeneric, (uint8_t)comps.size(), currOff, 1);
+
+				GAIA_ASSERT(currOff < maxDataOffsetTarget);
+				layout.capacity = (uint16_t)maxGenItemsInArchetype;
+				layout.chunkDataBytes = (ChunkDataOffset)currOff;
+				return true;
+			}
+
 		public:
 			Archetype(Archetype&&) = delete;
 			Archetype(const Archetype&) = delete;
@@ -273,7 +420,6 @@ namespace gaia {
 
 				newArch->m_ids.resize((uint32_t)ids.size());
 				newArch->m_comps.resize((uint32_t)ids.size());
-				newArch->m_compOffs.resize((uint32_t)ids.size());
 
 				auto as_comp = [&](Entity entity) {
 					const auto* pDesc = cc.find(entity);
@@ -288,7 +434,9 @@ namespace gaia {
 					if (ids[i].pair()) {
 						// When using pairs we need to decode the storage type from them.
 						// This is what pair<Rel, Tgt>::type actually does to determine what type to use at compile-time.
-						Entity pairEntities[] = {entity_from_id(world, ids[i].id()), entity_from_id(world, ids[i].gen())};
+						// Only the entity records are needed. The entities might not be placed in any chunk yet
+						// when the archetype is restored from a snapshot.
+						Entity pairEntities[] = {entity_from_rec(world, ids[i].id()), entity_from_rec(world, ids[i].gen())};
 						Component pairComponents[] = {as_comp(pairEntities[0]), as_comp(pairEntities[1])};
 						const uint32_t idx = (pairComponents[0].size() != 0U || pairComponents[1].size() == 0U) ? 0 : 1;
 						comps[i] = pairComponents[idx];
@@ -330,69 +478,45 @@ namespace gaia {
 					}
 				}
 
-				// Calculate the number of entities per chunks precisely so we can
-				// fit as many of them into chunk as possible.
-
-				uint32_t genCompsSize = 0;
-				uint32_t uniCompsSize = 0;
-				GAIA_FOR(entsGeneric) genCompsSize += newArch->m_comps[i].size();
-				GAIA_FOR2(entsGeneric, ids.size()) uniCompsSize += newArch->m_comps[i].size();
-
-				const uint32_t size0 = Chunk::chunk_data_bytes(mem_block_size(0));
-				const uint32_t size1 = Chunk::chunk_data_bytes(mem_block_size(1));
-				const auto sizeM = (size0 + size1) / 2;
-
-				uint32_t maxDataOffsetTarget = size1;
-				// Theoretical maximum number of components we can fit into one chunk.
-				// This can be further reduced due alignment and padding.
-				auto maxGenItemsInArchetype = (maxDataOffsetTarget - offs.firstByte_EntityData - uniCompsSize - 1) /
-																			(genCompsSize + (uint32_t)sizeof(Entity));
-
-				bool finalCheck = false;
-			recalculate:
-				auto currOff = offs.firstByte_EntityData + (uint32_t)sizeof(Entity) * maxGenItemsInArchetype;
-
-				// Adjust the maximum number of entities. Recalculation happens at most once when the original guess
-				// for entity count is not right (most likely because of padding or usage of SoA components).
-				if (!est_max_entities_per_archetype(
-								cc, currOff, maxGenItemsInArchetype, comps.subspan(0, entsGeneric), maxGenItemsInArchetype,
-								maxDataOffsetTarget))
-					goto recalculate;
-				if (!est_max_entities_per_archetype(
-								cc, currOff, maxGenItemsInArchetype, comps.subspan(entsGeneric), 1, maxDataOffsetTarget))
-					goto recalculate;
-
-				// Limit the number of entities to a certain number so we can make use of smaller
-				// chunks where it makes sense.
-				// TODO:
-				// Tweak this so the full remaining capacity is used. So if we occupy 7000 B we still
-				// have 1000 B left to fill.
-				if (maxGenItemsInArchetype > maxEntities) {
-					maxGenItemsInArchetype = maxEntities;
-					goto recalculate;
+				GAIA_EACH(ids) {
+					newArch->m_ids[i] = ids[i];
+					newArch->m_signature.add(ids[i]);
+					if (ids[i].pair())
+						newArch->m_signature.add_wildcards(ids[i]);
 				}
 
-				// We create chunks of either 8K or 16K but might end up with requested capacity 8.1K. Allocating a 16K chunk
-				// in this case would be wasteful. Therefore, let's find the middle ground. Anything 12K or smaller we'll
-				// allocate into 8K chunks so we avoid wasting too much memory.
-				if (!finalCheck && currOff < sizeM) {
-					finalCheck = true;
-					maxDataOffsetTarget = size0;
+				// Calculate the layout of chunks of each size. Sizes past the one reaching the entity limit
+				// would only waste memory.
+				auto& props = newArch->m_properties;
+				props.minSizeType = (uint8_t)MemoryBlockSizeTypes;
+				GAIA_FOR(MemoryBlockSizeTypes) {
+					auto& layout = newArch->m_layouts[i];
+					const uint32_t maxDataOffsetTarget = Chunk::chunk_data_bytes(mem_block_size(i));
+					if (!calc_layout(cc, comps, entsGeneric, offs, maxEntities, maxDataOffsetTarget, layout))
+						continue;
 
-					maxGenItemsInArchetype = (maxDataOffsetTarget - offs.firstByte_EntityData - uniCompsSize - 1) /
-																	 (genCompsSize + (uint32_t)sizeof(Entity));
-					goto recalculate;
+					if (props.minSizeType == MemoryBlockSizeTypes)
+						props.minSizeType = (uint8_t)i;
+					props.maxSizeType = (uint8_t)i;
+					if (layout.capacity >= maxEntities)
+						break;
+				}
+				GAIA_ASSERT(props.minSizeType < MemoryBlockSizeTypes && "Archetype doesn't fit into any chunk");
+
+				// The biggest chunk might need just a bit more than the next smaller size offers. E.g. allocating
+				// a 16K chunk for 8.1K worth of data would be wasteful. Therefore, let's find the middle ground.
+				// Anything 12K or smaller we'll allocate into 8K chunks so we avoid wasting too much memory.
+				if (props.maxSizeType > props.minSizeType) {
+					const uint32_t size0 = Chunk::chunk_data_bytes(mem_block_size(props.maxSizeType - 1U));
+					const uint32_t size1 = Chunk::chunk_data_bytes(mem_block_size(props.maxSizeType));
+					if (newArch->m_layouts[props.maxSizeType].chunkDataBytes < (size0 + size1) / 2)
+						--props.maxSizeType;
 				}
 
-				// Update the offsets according to the recalculated maxGenItemsInArchetype
-				currOff = offs.firstByte_EntityData + (uint32_t)sizeof(Entity) * maxGenItemsInArchetype;
-				reg_components(*newArch, ids, comps, (uint8_t)0, (uint8_t)entsGeneric, currOff, maxGenItemsInArchetype);
-				reg_components(*newArch, ids, comps, (uint8_t)entsGeneric, (uint8_t)ids.size(), currOff, 1);
-
-				GAIA_ASSERT(Chunk::chunk_total_bytes((ChunkDataOffset)currOff) < mem_block_size(currOff));
-				newArch->m_properties.capacity = (uint16_t)maxGenItemsInArchetype;
-				newArch->m_properties.chunkDataBytes = (ChunkDataOffset)currOff;
-				newArch->m_properties.genEntities = (uint8_t)entsGeneric;
+				const auto& layout = newArch->m_layouts[props.maxSizeType];
+				props.capacity = layout.capacity;
+				props.chunkDataBytes = layout.chunkDataBytes;
+				props.genEntities = (uint8_t)entsGeneric;
 
 				return newArch;
 			}
@@ -438,6 +562,7 @@ namespace gaia {
 				// index with the current chunk's index and then do the swapping.
 				m_chunks.back()->set_idx(chunkIndex);
 				core::erase_fast(m_chunks, chunkIndex);
+				++m_chunksVersion;
 
 				// Delete the chunk now. Otherwise, if the chunk happend to be the last
 				// one we would end up overriding released memory.
@@ -465,11 +590,57 @@ namespace gaia {
 				}
 			}
 
-			//! Defragments the chunk.
-			//! \param maxEntites Maximum number of entities moved per call
+			//! Returns how much of the allocator page holding \param pChunk is in use, from 0 to 1
+			static float chunk_page_usage([[maybe_unused]] const Chunk* pChunk) {
+#if GAIA_ECS_CHUNK_ALLOCATOR
+				return ChunkAllocator::get().page_usage(pChunk);
+#else
+				return 0.f;
+#endif
+			}
+
+			//! Moves the last \param cnt entities of \param pSrcChunk to \param pDstChunk.
+			//! Entities keep their enabled state.
+			void move_last_entities(
+					Chunk* pSrcChunk, Chunk* pDstChunk, uint32_t cnt, cnt::darray<Chunk*>& chunksToDelete,
+					EntityContainers& recs) {
+				GAIA_FOR(cnt) {
+					const auto lastEntityIdx = (uint16_t)(pSrcChunk->size() - 1);
+					const auto entity = pSrcChunk->entity_view()[lastEntityIdx];
+
+					auto& ec = recs[entity];
+					const bool wasEnabled = !ec.dis;
+
+					// Make sure the old entity becomes enabled now
+					enable_entity(pSrcChunk, ec.row, true, recs);
+					// We go back-to-front in the chunk so enabling the entity is not expected to change its row
+					GAIA_ASSERT(ec.row == lastEntityIdx);
+					const auto oldRow = ec.row;
+
+					// Move the entity and its data to the new chunk
+					const auto newRow = pDstChunk->add_entity(entity);
+					pDstChunk->move_entity_data(entity, newRow, recs);
+
+					// Remove the entity record from the old chunk
+					pSrcChunk->remove_entity(oldRow, recs, chunksToDelete);
+					ec.pChunk = pDstChunk;
+					ec.row = newRow;
+
+					// Transfer the original enabled state to the new chunk
+					enable_entity(pDstChunk, newRow, wasEnabled, recs);
+				}
+			}
+
+			//! Defragments the chunks of the archetype.
+			//! Entities are moved out of the chunks which are the least full and which live in the least used
+			//! allocator pages into the fullest chunks, regardless of their size class. Emptied chunks are released
+			//! once they die which eventually lets whole allocator pages become free.
+			//! \param maxEntities Maximum number of entities moved per call
 			//! \param chunksToDelete Container of chunks ready for removal
-			//! \param entities Container with entities
-			void defrag(uint32_t& maxEntities, cnt::darray<Chunk*>& chunksToDelete, EntityContainers& recs) {
+			//! \param recs Container with entities
+			//! \param stats Defragmentation statistics to update
+			void defrag(
+					uint32_t& maxEntities, cnt::darray<Chunk*>& chunksToDelete, EntityContainers& recs, DefragStats& stats) {
 				// Assuming the following chunk layout:
 				//   Chunk_1: 10/10
 				//   Chunk_2:  1/10
@@ -478,13 +649,10 @@ namespace gaia {
 				//   Chunk_5:  9/10
 				// After full defragmentation we end up with:
 				//   Chunk_1: 10/10
-				//   Chunk_2: 10/10 (7 entities from Chunk_3 + 2 entities from Chunk_5)
-				//   Chunk_3:  0/10 (empty, ready for removal)
+				//   Chunk_2:  0/10 (empty, ready for removal)
+				//   Chunk_3:  7/10
 				//   Chunk_4: 10/10
-				//   Chunk_5:  7/10
-				// TODO:
-				// Implement mask of semi-full chunks so we can pick one easily when searching
-				// for a chunk to fill with a new entity and when defragmenting.
+				//   Chunk_5: 10/10 (1 entity from Chunk_2)
 				// NOTE 1:
 				// Even though entity movement might be present during defragmentation, we do
 				// not update the world version here because no real structural changes happen.
@@ -494,83 +662,86 @@ namespace gaia {
 				// Therefore, we won't defragment them unless their uni components contain matching
 				// values.
 
-				if (m_chunks.empty())
+				if (maxEntities == 0)
 					return;
 
-				uint32_t front = 0;
-				uint32_t back = m_chunks.size() - 1;
+				// Only chunks that are neither empty nor full take part. Empty chunks are waiting to be
+				// released and full chunks have no room left. At least two of them are necessary for any
+				// entities to move.
+				uint32_t candidateCnt = 0;
+				for (auto* pChunk: m_chunks)
+					candidateCnt += (uint32_t)(!pChunk->empty() && !pChunk->full());
+				if (candidateCnt < 2)
+					return;
 
-				// Find the first semi-empty chunk in the front
-				while (front < back && !m_chunks[front++]->is_semi())
-					;
+				struct DefragItem {
+					Chunk* pChunk;
+					float score;
+				};
+				cnt::darray_ext<DefragItem, 32> items;
+				items.reserve(candidateCnt);
+				for (auto* pChunk: m_chunks) {
+					if (pChunk->empty() || pChunk->full())
+						continue;
 
-				auto* pDstChunk = m_chunks[front];
+					// The less full the chunk and its allocator page are, the sooner the chunk is emptied
+					const float fill = (float)pChunk->size() / (float)pChunk->capacity();
+					items.push_back({pChunk, fill + chunk_page_usage(pChunk)});
+				}
+				core::sort(items, [](const DefragItem& a, const DefragItem& b) {
+					return a.score < b.score;
+				});
 
 				const bool hasUniEnts = !m_ids.empty() && m_ids.back().kind() == EntityKind::EK_Uni;
 
-				// Find the first semi-empty chunk in the back
-				while (front < back && m_chunks[--back]->is_semi()) {
-					auto* pSrcChunk = m_chunks[back];
-
-					// Make sure chunk components have matching values
-					if (hasUniEnts) {
-						auto rec = pSrcChunk->comp_rec_view();
-						bool res = true;
-						GAIA_FOR2(m_properties.genEntities, m_ids.size()) {
-							const auto* pSrcVal = (const void*)pSrcChunk->comp_ptr(i, 0);
-							const auto* pDstVal = (const void*)pDstChunk->comp_ptr(i, 0);
-							if (rec[i].pDesc->cmp(pSrcVal, pDstVal)) {
-								res = false;
-								break;
-							}
-						}
-
-						// When there is not a match we move to the next chunk
-						if (!res) {
-							++front;
-
-							// We reached the source chunk which means this archetype has been defragmented
-							if (front >= back)
-								return;
-						}
+				// Make sure chunk components have matching values
+				auto uniMatch = [&](Chunk* pSrcChunk, Chunk* pDstChunk) {
+					auto rec = pSrcChunk->comp_rec_view();
+					GAIA_FOR2(m_properties.genEntities, m_ids.size()) {
+						const auto* pSrcVal = (const void*)pSrcChunk->comp_ptr(i, 0);
+						const auto* pDstVal = (const void*)pDstChunk->comp_ptr(i, 0);
+						if (rec[i].pDesc->cmp(pSrcVal, pDstVal))
+							return false;
 					}
+					return true;
+				};
 
-					const uint32_t entitiesInChunk = pSrcChunk->size();
-					const uint32_t entitiesToMove = entitiesInChunk > maxEntities ? maxEntities : entitiesInChunk;
-					GAIA_FOR(entitiesToMove) {
-						const auto lastEntityIdx = entitiesInChunk - i - 1;
-						const auto entity = pSrcChunk->entity_view()[lastEntityIdx];
-
-						const auto& ec = recs[entity];
-
-						const auto oldRow = ec.row;
-						const auto newRow = pDstChunk->add_entity(entity);
-						const bool wasEnabled = !ec.dis;
-
-						// Make sure the old entity becomes enabled now
-						enable_entity(pSrcChunk, oldRow, true, recs);
-						// We go back-to-front in the chunk so enabling the entity is not expected to change its row
-						GAIA_ASSERT(oldRow == ec.row);
-
-						// Transfer the original enabled state to the new chunk
-						enable_entity(pDstChunk, newRow, wasEnabled, recs);
-
-						// Remove the entity record from the old chunk
-						pSrcChunk->remove_entity(oldRow, recs, chunksToDelete);
-
-						// The destination chunk is full, we need to move to the next one
-						if (pDstChunk->size() == m_properties.capacity) {
-							++front;
+				// Empty the chunks from the front into the chunks in the back
+				uint32_t srcIdx = 0;
+				uint32_t dstIdx = (uint32_t)items.size() - 1;
+				while (srcIdx < dstIdx && maxEntities > 0) {
+					auto* pSrcChunk = items[srcIdx].pChunk;
+
+					// Find the fullest chunk with some room left
+					uint32_t i = dstIdx;
+					while (i > srcIdx && (items[i].pChunk->full() || (hasUniEnts && !uniMatch(pSrcChunk, items[i].pChunk))))
+						--i;
+					if (i == srcIdx) {
+						// Without uni components all chunks in the back are full so we are done.
+						// Otherwise, there still might be a place for entities of the next chunk.
+						if (!hasUniEnts)
+							break;
 
-							// We reached the source chunk which means this archetype has been defragmented
-							if (front >= back) {
-								maxEntities -= i + 1;
-								return;
-							}
-						}
+						++srcIdx;
+						continue;
+					}
+					if (!hasUniEnts)
+						dstIdx = i;
+
+					auto* pDstChunk = items[i].pChunk;
+					uint32_t cnt = pSrcChunk->size();
+					cnt = core::get_min(cnt, (uint32_t)(pDstChunk->capacity() - pDstChunk->size()));
+					cnt = core::get_min(cnt, maxEntities);
+					move_last_entities(pSrcChunk, pDstChunk, cnt, chunksToDelete, recs);
+
+					maxEntities -= cnt;
+					stats.entities_moved += cnt;
+
+					if (pSrcChunk->empty()) {
+						++stats.chunks_emptied;
+						stats.mem_reclaimed += mem_block_size(pSrcChunk->size_type());
+						++srcIdx;
 					}
-
-					maxEntities -= entitiesToMove;
 				}
 			}
 
@@ -595,15 +766,47 @@ namespace gaia {
 						return pEmptyChunk;
 				}
 
+				// No free space found anywhere. Let's create a new chunk.
+				return add_chunk();
+			}
+
+			//! Returns the size type of the next chunk to allocate. Chunks grow with the population of the archetype
+			//! so sparsely populated archetypes don't waste memory while the crowded ones get the biggest chunks.
+			GAIA_NODISCARD uint32_t next_size_type() const {
+				uint32_t entCnt = 0;
+				for (const auto* pChunk: m_chunks)
+					entCnt += pChunk->size();
+
+				// A new chunk should be able to take at least as many entities as there already are
+				uint32_t sizeType = m_properties.minSizeType;
+				while (sizeType < m_properties.maxSizeType && m_layouts[sizeType].capacity < entCnt)
+					++sizeType;
+				return sizeType;
+			}
+
+			//! Allocates a new empty chunk and appends it to the archetype.
+			//! \return Newly created chunk
+			GAIA_NODISCARD Chunk* add_chunk() {
+				return add_chunk(next_size_type());
+			}
+
+			//! Allocates a new empty chunk of the size type \param sizeType and appends it to the archetype.
+			//! \return Newly created chunk
+			GAIA_NODISCARD Chunk* add_chunk(uint32_t sizeType) {
+				GAIA_ASSERT(sizeType >= m_properties.minSizeType && sizeType <= m_properties.maxSizeType);
+
+				const auto chunkCnt = m_chunks.size();
+
 				// Make sure not too many chunks are allocated
 				GAIA_ASSERT(chunkCnt < UINT32_MAX);
 
-				// No free space found anywhere. Let's create a new chunk.
+				const auto& layout = m_layouts[sizeType];
 				auto* pChunk = Chunk::create(
-						m_cc, chunkCnt, props().capacity, props().genEntities, m_properties.chunkDataBytes, m_worldVersion,
-						m_dataOffsets, m_ids, m_comps, m_compOffs);
+						m_cc, chunkCnt, layout.capacity, props().genEntities, (uint8_t)sizeType, m_worldVersion, m_dataOffsets,
+						m_ids, m_comps, layout.compOffs, m_compVersions);
 
 				m_chunks.push_back(pChunk);
+				++m_chunksVersion;
 				return pChunk;
 			}
 
@@ -615,6 +818,12 @@ namespace gaia {
 				return m_chunks;
 			}
 
+			//! Returns the version of the list of chunks. It changes every time a chunk is added or removed
+			//! or the archetype is requested to be deleted.
+			GAIA_NODISCARD uint32_t chunks_version() const {
+				return m_chunksVersion;
+			}
+
 			GAIA_NODISCARD LookupHash lookup_hash() const {
 				return m_hashLookup;
 			}
@@ -627,8 +836,20 @@ namespace gaia {
 				return m_comps;
 			}
 
-			GAIA_NODISCARD const Chunk::ComponentOffsetArray& comp_offs() const {
-				return m_compOffs;
+			GAIA_NODISCARD const ArchetypeSignature& signature() const {
+				return m_signature;
+			}
+
+			//! Returns the layout of chunks of the size type \param sizeType
+			GAIA_NODISCARD const ChunkLayout& chunk_layout(uint32_t sizeType) const {
+				GAIA_ASSERT(sizeType >= m_properties.minSizeType && sizeType <= m_properties.maxSizeType);
+				return m_layouts[sizeType];
+			}
+
+			//! Returns true if the component at the index \param compIdx changed in any chunk of the archetype
+			//! since the provided \param version.
+			GAIA_NODISCARD bool changed(uint32_t version, uint32_t compIdx) const {
+				return version_changed(m_compVersions[compIdx].load(std::memory_order_relaxed), version);
 			}
 
 			GAIA_NODISCARD uint32_t pairs() const {
@@ -685,14 +906,62 @@ namespace gaia {
 				GAIA_ASSERT(pArchetypeRight != this);
 
 				m_graph.del_edge_right(entity);
+				del_column_map(*pArchetypeRight);
 				pArchetypeRight->del_graph_edges_left(this, entity);
 			}
 
-			void del_graph_edges_left([[maybe_unused]] Archetype* pArchetypeLeft, Entity entity) {
+			void del_graph_edges_left(Archetype* pArchetypeLeft, Entity entity) {
 				// Loops can't happen
 				GAIA_ASSERT(pArchetypeLeft != this);
 
 				m_graph.del_edge_left(entity);
+				del_column_map(*pArchetypeLeft);
+			}
+
+			//! Returns the column mapping for moving entities from \param srcChunk of this archetype
+			//! to \param dstChunk of \param dstArchetype. The mapping is computed on first use and cached.
+			GAIA_NODISCARD const Chunk::ColumnMap&
+			column_map(Archetype& dstArchetype, const Chunk& srcChunk, const Chunk& dstChunk) {
+				GAIA_ASSERT(&dstArchetype != this);
+
+				const ArchetypeIdLookupKey key(dstArchetype.id(), dstArchetype.id_hash());
+				const auto* pMap = m_graph.find_column_map(key);
+				if GAIA_LIKELY (pMap != nullptr)
+					return *pMap;
+
+				// Both sides remember the mapping so it can be dropped when either archetype is deleted.
+				// Archetype ids are never reused so a stale mapping would otherwise stay around forever.
+				m_columnMapDsts.push_back(&dstArchetype);
+				dstArchetype.m_columnMapSrcs.push_back(this);
+
+				Chunk::ColumnMap map;
+				Chunk::build_column_map(srcChunk, dstChunk, map);
+				return m_graph.add_column_map(key, map);
+			}
+
+			//! Deletes the column mapping cached for moving entities to \param dstArchetype.
+			void del_column_map(Archetype& dstArchetype) {
+				const auto idx = core::get_index(m_columnMapDsts, &dstArchetype);
+				if (idx == BadIndex)
+					return;
+
+				core::erase_fast(m_columnMapDsts, idx);
+				core::erase_fast(dstArchetype.m_columnMapSrcs, core::get_index(dstArchetype.m_columnMapSrcs, this));
+				m_graph.del_column_map(ArchetypeIdLookupKey(dstArchetype.id(), dstArchetype.id_hash()));
+			}
+
+			//! Deletes all column mappings cached for moves from and to this archetype.
+			//! Called when the archetype is about to be deleted.
+			void del_column_maps() {
+				while (!m_columnMapSrcs.empty())
+					m_columnMapSrcs.back()->del_column_map(*this);
+				while (!m_columnMapDsts.empty())
+					del_column_map(*m_columnMapDsts.back());
+			}
+
+			//! Returns the number of column mappings cached for moves from this archetype.
+			GAIA_NODISCARD uint32_t column_map_cnt() const {
+				return m_columnMapDsts.size();
 			}
 
 			//! Checks if an archetype graph "add" edge with entity \param entity exists.
@@ -714,6 +983,7 @@ namespace gaia {
 
 			void req_del() {
 				m_deleteReq = 1;
+				++m_chunksVersion;
 			}
 
 			GAIA_NODISCARD bool is_req_del() const {
@@ -746,6 +1016,7 @@ namespace gaia {
 				GAIA_ASSERT(!dead());
 				m_lifespanCountdown = 0;
 				m_deleteReq = 0;
+				++m_chunksVersion;
 			}
 
 			//! Updates internal lifetime
@@ -799,11 +1070,12 @@ namespace gaia {
 				GAIA_LOG_N(
 						"aid:%u, "
 						"hash:%016" PRIx64 ", "
-						"chunks:%u (%uK), data:%u/%u/%u B, "
+						"chunks:%u (%u-%uK), data:%u/%u/%u B, "
 						"entities:%u/%u/%u",
 						archetype.id(), archetype.lookup_hash().hash, (uint32_t)archetype.chunks().size(),
-						Chunk::chunk_total_bytes(archetype.props().chunkDataBytes) <= 8192 ? 8 : 16, genCompsSize, uniCompsSize,
-						archetype.props().chunkDataBytes, entCnt, entCntDisabled, archetype.props().capacity);
+						mem_block_size(archetype.props().minSizeType) / 1024, mem_block_size(archetype.props().maxSizeType) / 1024,
+						genCompsSize, uniCompsSize, archetype.props().chunkDataBytes, entCnt, entCntDisabled,
+						archetype.props().capacity);
 
 				if (!ids.empty()) {
 					GAIA_LOG_N("  Components - count:%u", ids.size());
@@ -897,5 +1169,19 @@ namespace gaia {
 				return m_pArchetypeBase == other.m_pArchetypeBase;
 			}
 		};
+
+		//! Returns the index of the first archetype in \param archetypes with an id not smaller than \param id.
+		//! The search starts at the index \param lo. Archetypes in the list need to be sorted by their id.
+		GAIA_NODISCARD inline uint32_t archetype_lower_bound(const ArchetypeList& archetypes, ArchetypeId id, uint32_t lo = 0) {
+			uint32_t hi = archetypes.size();
+			while (lo < hi) {
+				const uint32_t mid = (lo + hi) / 2;
+				if (archetypes[mid]->id() < id)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			return lo;
+		}
 	} // namespace ecs
 } // namespace gaia
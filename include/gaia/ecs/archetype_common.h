@@ -26,6 +26,18 @@ namespace gaia {
 			}
 		};
 
+		//! Statistics of chunk defragmentation
+		struct DefragStats {
+			//! Number of entities moved to a different chunk
+			uint32_t entities_moved;
+			//! Number of chunks emptied
+			uint32_t chunks_emptied;
+			//! Memory of the emptied chunks. It is returned to the chunk allocator once the chunks are released.
+			uint64_t mem_reclaimed;
+			//! Time spent defragmenting in microseconds
+			uint32_t time_us;
+		};
+
 		static constexpr ArchetypeId ArchetypeIdBad = (ArchetypeId)-1;
 		static constexpr ArchetypeIdHashPair ArchetypeIdHashPairBad = {ArchetypeIdBad, {0}};
 
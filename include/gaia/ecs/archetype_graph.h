@@ -5,6 +5,7 @@
 #include "../cnt/map.h"
 #include "../config/logging.h"
 #include "archetype_common.h"
+#include "chunk.h"
 #include "component.h"
 #include "id.h"
 
@@ -18,11 +19,14 @@ namespace gaia {
 
 		class ArchetypeGraph {
 			using EdgeMap = cnt::map<EntityLookupKey, ArchetypeGraphEdge>;
+			using ColumnMapMap = cnt::map<ArchetypeIdLookupKey, Chunk::ColumnMap>;
 
 			//! Map of edges in the archetype graph when adding components
 			EdgeMap m_edgesAdd;
 			//! Map of edges in the archetype graph when removing components
 			EdgeMap m_edgesDel;
+			//! Column mappings used when moving entities to other archetypes
+			ColumnMapMap m_columnMaps;
 
 		private:
 			void add_edge(EdgeMap& edges, Entity entity, ArchetypeId archetypeId, ArchetypeIdHash hash) {
@@ -77,6 +81,26 @@ namespace gaia {
 				return find_edge(m_edgesDel, entity);
 			}
 
+			//! Returns the column mapping for moving entities to the archetype \param archetypeId.
+			//! \return Column mapping if found. nullptr otherwise.
+			GAIA_NODISCARD const Chunk::ColumnMap* find_column_map(ArchetypeIdLookupKey archetypeId) const {
+				const auto it = m_columnMaps.find(archetypeId);
+				return it != m_columnMaps.end() ? &it->second : nullptr;
+			}
+
+			//! Stores the column mapping for moving entities to the archetype \param archetypeId.
+			//! \return Stored column mapping.
+			const Chunk::ColumnMap& add_column_map(ArchetypeIdLookupKey archetypeId, const Chunk::ColumnMap& map) {
+				const auto ret = m_columnMaps.try_emplace(archetypeId, map);
+				GAIA_ASSERT(ret.second);
+				return ret.first->second;
+			}
+
+			//! Deletes the column mapping for moving entities to the archetype \param archetypeId.
+			void del_column_map(ArchetypeIdLookupKey archetypeId) {
+				m_columnMaps.erase(archetypeId);
+			}
+
 			void diag(const World& world) const {
 				auto diagEdge = [&](const auto& edges) {
 					for (const auto& edge: edges) {
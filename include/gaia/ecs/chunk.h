@@ -1,6 +1,7 @@
 #pragma once
 #include "../config/config.h"
 
+#include <atomic>
 #include <cstdint>
 #include <tuple>
 #include <type_traits>
@@ -17,6 +18,7 @@
 #include "component_cache.h"
 #include "component_desc.h"
 #include "component_utils.h"
+#include "data_buffer.h"
 #include "entity_container.h"
 #include "id.h"
 
@@ -32,6 +34,32 @@ namespace gaia {
 			using ComponentArray = cnt::sarray_ext<Component, MAX_COMPONENTS>;
 			using ComponentOffsetArray = cnt::sarray_ext<ChunkDataOffset, MAX_COMPONENTS>;
 
+			//! Describes how component data is moved between chunks of two different archetypes
+			struct ColumnMap {
+				enum class Op : uint8_t {
+					//! Raw memory copy of the component data
+					Relocate,
+					//! Move-construct the component data in the destination chunk
+					Move,
+					//! Default-construct the component data in the destination chunk
+					Ctor
+				};
+
+				struct Item {
+					//! Column index in the source chunk
+					uint8_t srcIdx;
+					//! Column index in the destination chunk
+					uint8_t dstIdx;
+					//! Operation to perform
+					Op op;
+				};
+
+				//! Operations on columns of the destination chunk
+				cnt::sarray_ext<Item, MAX_COMPONENTS> items;
+				//! Columns of the source chunk which need to be destroyed once their data is moved
+				cnt::sarray_ext<uint8_t, MAX_COMPONENTS> dtors;
+			};
+
 			// TODO: Make this private
 			//! Chunk header
 			ChunkHeader m_header;
@@ -74,12 +102,13 @@ namespace gaia {
 
 			void init(
 					const EntityArray& ids, const ComponentArray& comps, const ChunkDataOffsets& headerOffsets,
-					const ComponentOffsetArray& compOffs) {
+					const ComponentOffsetArray& compOffs, std::atomic<ComponentVersion>* pArchetypeVersions) {
 				m_header.componentCount = (uint8_t)ids.size();
 
 				// Cache pointers to versions
 				if (!ids.empty()) {
 					m_records.pVersions = (ComponentVersion*)&data(headerOffsets.firstByte_Versions);
+					m_records.pArchetypeVersions = pArchetypeVersions;
 				}
 
 				// Cache entity ids
@@ -115,6 +144,8 @@ namespace gaia {
 						if (rec.comp.size() == 0)
 							continue;
 
+						m_header.hasAnyRowChanges |= rec.pDesc->trackRowChanges;
+
 						if (rec.entity.kind() == EntityKind::EK_Gen) {
 							m_header.hasAnyCustomGenCtor |= (rec.pDesc->func_ctor != nullptr);
 							m_header.hasAnyCustomGenDtor |= (rec.pDesc->func_dtor != nullptr);
@@ -143,6 +174,54 @@ namespace gaia {
 				return {m_records.pEntities, size()};
 			}
 
+			//! Returns the row change tracking data of the component at the index \param compIdx.
+			//! \return Tracking data or nullptr if no changes of the component were tracked per row yet.
+			GAIA_NODISCARD ChunkRowChanges* row_changes(uint32_t compIdx) const {
+				if (m_records.pRowChanges == nullptr)
+					return nullptr;
+
+				return m_records.pRowChanges[compIdx];
+			}
+
+			//! Marks rows in the range [\param from, \param to) of the component at the index \param compIdx
+			//! as changed. Needs to be called before the version of the component is updated.
+			void update_row_changes(uint32_t compIdx, uint32_t from, uint32_t to) {
+				const auto& rec = m_records.pRecords[compIdx];
+				if (rec.comp.size() == 0 || !rec.pDesc->trackRowChanges)
+					return;
+				// Nobody filters the component per row so there is no need to track it
+				if (!rec.pDesc->rowChangesFiltered.load(std::memory_order_relaxed))
+					return;
+
+				auto versions = comp_version_view();
+
+				// Tracking data is allocated lazily. Nothing was recorded so far so it starts recording
+				// after the most recent write of the component.
+				if (m_records.pRowChanges == nullptr)
+					m_records.pRowChanges = new ChunkRowChanges*[m_header.componentCount]{};
+				auto*& pRowChanges = m_records.pRowChanges[compIdx];
+				if (pRowChanges == nullptr) {
+					pRowChanges = new ChunkRowChanges();
+					pRowChanges->since = versions[compIdx];
+				}
+
+				auto& rowChanges = *pRowChanges;
+				if (rowChanges.consumed) {
+					rowChanges.rows.reset();
+					rowChanges.since = versions[compIdx];
+					rowChanges.consumed = false;
+				}
+
+				// A change of a unique component affects all entities in the chunk
+				if (rec.entity.kind() == EntityKind::EK_Uni) {
+					from = 0;
+					to = m_header.count;
+				}
+
+				for (auto row = from; row < to; ++row)
+					rowChanges.rows.set(row);
+			}
+
 			/*!
 			Returns a read-only span of the component data.
 			\warning It is expected the component \tparam T is present. Undefined behavior otherwise.
@@ -216,7 +295,7 @@ namespace gaia {
 
 					// Update version number if necessary so we know RW access was used on the chunk
 					if constexpr (WorldVersionUpdateWanted)
-						update_world_version(compIdx);
+						update_world_version(compIdx, from, to);
 
 					if constexpr (kind == EntityKind::EK_Gen) {
 						return {comp_ptr_mut(compIdx, from), to - from};
@@ -235,7 +314,7 @@ namespace gaia {
 
 					// Update version number if necessary so we know RW access was used on the chunk
 					if constexpr (WorldVersionUpdateWanted)
-						update_world_version(compIdx);
+						update_world_version(compIdx, from, to);
 
 					if constexpr (kind == EntityKind::EK_Gen) {
 						return {comp_ptr_mut(compIdx, from), to - from};
@@ -287,7 +366,13 @@ namespace gaia {
 			Chunk(Chunk&& chunk) = delete;
 			Chunk& operator=(const Chunk& chunk) = delete;
 			Chunk& operator=(Chunk&& chunk) = delete;
-			~Chunk() = default;
+			~Chunk() {
+				if (m_records.pRowChanges != nullptr) {
+					for (uint32_t i = 0; i < m_header.componentCount; ++i)
+						delete m_records.pRowChanges[i];
+					delete[] m_records.pRowChanges;
+				}
+			}
 
 			static constexpr uint16_t chunk_header_size() {
 				const auto dataAreaOffset =
@@ -299,11 +384,11 @@ namespace gaia {
 				return dataAreaOffset;
 			}
 
-			static constexpr uint16_t chunk_total_bytes(uint16_t dataSize) {
+			static constexpr uint32_t chunk_total_bytes(uint32_t dataSize) {
 				return chunk_header_size() + dataSize;
 			}
 
-			static constexpr uint16_t chunk_data_bytes(uint16_t totalSize) {
+			static constexpr uint32_t chunk_data_bytes(uint32_t totalSize) {
 				return totalSize - chunk_header_size();
 			}
 
@@ -320,10 +405,11 @@ namespace gaia {
 			/*!
 			Allocates memory for a new chunk.
 			\param chunkIndex Index of this chunk within the parent archetype
+			\param sizeType Size type of the memory block backing the chunk, see mem_block_size
 			\return Newly allocated chunk
 			*/
 			static Chunk* create(
-					const ComponentCache& cc, uint32_t chunkIndex, uint16_t capacity, uint8_t genEntities, uint16_t dataBytes,
+					const ComponentCache& cc, uint32_t chunkIndex, uint16_t capacity, uint8_t genEntities, uint8_t sizeType,
 					uint32_t& worldVersion,
 					// data offsets
 					const ChunkDataOffsets& offsets,
@@ -332,20 +418,20 @@ namespace gaia {
 					// component
 					const ComponentArray& comps,
 					// component offsets
-					const ComponentOffsetArray& compOffs) {
-				const auto totalBytes = chunk_total_bytes(dataBytes);
-				const auto sizeType = mem_block_size_type(totalBytes);
+					const ComponentOffsetArray& compOffs,
+					// component versions of the parent archetype
+					std::atomic<ComponentVersion>* pArchetypeVersions) {
+				GAIA_ASSERT(sizeType < MemoryBlockSizeTypes);
+				const auto allocSize = mem_block_size(sizeType);
 #if GAIA_ECS_CHUNK_ALLOCATOR
-				auto* pChunk = (Chunk*)ChunkAllocator::get().alloc(totalBytes);
+				auto* pChunk = (Chunk*)ChunkAllocator::get().alloc(allocSize);
 				new (pChunk) Chunk(cc, chunkIndex, capacity, genEntities, sizeType, worldVersion);
 #else
-				GAIA_ASSERT(totalBytes <= MaxMemoryBlockSize);
-				const auto allocSize = mem_block_size(sizeType);
 				auto* pChunkMem = new uint8_t[allocSize];
 				auto* pChunk = new (pChunkMem) Chunk(cc, chunkIndex, capacity, genEntities, sizeType, worldVersion);
 #endif
 
-				pChunk->init(ids, comps, offsets, compOffs);
+				pChunk->init(ids, comps, offsets, compOffs, pArchetypeVersions);
 				return pChunk;
 			}
 
@@ -370,7 +456,7 @@ namespace gaia {
 #else
 				pChunk->~Chunk();
 				auto* pChunkMem = (uint8_t*)pChunk;
-				delete pChunkMem;
+				delete[] pChunkMem;
 #endif
 			}
 
@@ -380,7 +466,13 @@ namespace gaia {
 			\param chunksToDelete Container of chunks ready for deletion
 			*/
 			void remove_last_entity(cnt::darray<Chunk*>& chunksToDelete) {
-				remove_last_entity_inter();
+				remove_last_entities(1, chunksToDelete);
+			}
+
+			//! Removes the last \param entCnt entities from the chunk.
+			//! \warning It is expected the data of the entities was already moved or destroyed.
+			void remove_last_entities(uint32_t entCnt, cnt::darray<Chunk*>& chunksToDelete) {
+				GAIA_FOR(entCnt) remove_last_entity_inter();
 
 				// TODO: This needs cleaning up.
 				//       Chunk should have no idea of the world and also should not store
@@ -406,7 +498,7 @@ namespace gaia {
 
 			//! Updates the version numbers for this chunk.
 			void update_versions() {
-				update_version(m_header.worldVersion);
+				bump_world_version(m_header.worldVersion);
 				update_world_version();
 			}
 
@@ -565,7 +657,7 @@ namespace gaia {
 				++m_header.countEnabled;
 				entity_view_mut()[row] = entity;
 
-				update_version(m_header.worldVersion);
+				bump_world_version(m_header.worldVersion);
 				update_world_version();
 
 				return row;
@@ -621,65 +713,119 @@ namespace gaia {
 				}
 			}
 
-			static void move_foreign_entity_data(Chunk* pOldChunk, uint32_t oldRow, Chunk* pNewChunk, uint32_t newRow) {
-				GAIA_PROF_SCOPE(Chunk::move_foreign_entity_data);
+			/*!
+			Builds the column mapping used when moving entities from \param oldChunk to \param newChunk.
+			The mapping only depends on the archetypes of both chunks so it can be computed once and reused
+			for any pair of chunks of the same two archetypes.
+			\param[out] map Column mapping
+			*/
+			static void build_column_map(const Chunk& oldChunk, const Chunk& newChunk, ColumnMap& map) {
+				GAIA_PROF_SCOPE(Chunk::build_column_map);
 
-				GAIA_ASSERT(pOldChunk != nullptr);
-				GAIA_ASSERT(pNewChunk != nullptr);
-				GAIA_ASSERT(oldRow < pOldChunk->size());
-				GAIA_ASSERT(newRow < pNewChunk->size());
+				map.items.clear();
+				map.dtors.clear();
 
-				auto oldIds = pOldChunk->ents_id_view();
-				auto newIds = pNewChunk->ents_id_view();
-				auto newRecs = pNewChunk->comp_rec_view();
+				auto oldIds = oldChunk.ents_id_view();
+				auto newIds = newChunk.ents_id_view();
+				auto oldRecs = oldChunk.comp_rec_view();
+				auto newRecs = newChunk.comp_rec_view();
+
+				auto addDtor = [&](uint32_t compIdx) {
+					const auto& rec = oldRecs[compIdx];
+					if (rec.comp.size() != 0U && rec.pDesc != nullptr && rec.pDesc->func_dtor != nullptr)
+						map.dtors.push_back((uint8_t)compIdx);
+				};
+
+				auto addCtor = [&](uint32_t compIdx) {
+					const auto& rec = newRecs[compIdx];
+					if (rec.comp.size() != 0U && rec.pDesc != nullptr && rec.pDesc->func_ctor != nullptr)
+						map.items.push_back({0, (uint8_t)compIdx, ColumnMap::Op::Ctor});
+				};
 
 				// Find intersection of the two component lists.
 				// Arrays are sorted so we can do linear intersection lookup.
-				// Call constructor on each match.
-				{
-					uint32_t i = 0;
-					uint32_t j = 0;
-					while (i < pOldChunk->m_header.genEntities && j < pNewChunk->m_header.genEntities) {
-						const auto oldId = oldIds[i];
-						const auto newId = newIds[j];
-
-						if (oldId == newId) {
-							const auto& rec = newRecs[j];
-							GAIA_ASSERT(rec.entity == newId);
-							if (rec.comp.size() != 0U) {
-								auto* pSrc = (void*)pOldChunk->comp_ptr_mut(i, oldRow);
-								auto* pDst = (void*)pNewChunk->comp_ptr_mut(j, newRow);
-								rec.pDesc->ctor_from(pSrc, pDst);
-							}
+				uint32_t i = 0;
+				uint32_t j = 0;
+				while (i < oldChunk.m_header.genEntities && j < newChunk.m_header.genEntities) {
+					const auto oldId = oldIds[i];
+					const auto newId = newIds[j];
 
-							++i;
-							++j;
-						} else if (SortComponentCond{}.operator()(oldId, newId)) {
-							++i;
-						} else {
-							// No match with the old chunk. Construct the component
-							const auto& rec = newRecs[j];
-							GAIA_ASSERT(rec.entity == newId);
-							if (rec.pDesc != nullptr && rec.pDesc->func_ctor != nullptr) {
-								auto* pDst = (void*)pNewChunk->comp_ptr_mut(j, newRow);
-								rec.pDesc->func_ctor(pDst, 1);
+					if (oldId == newId) {
+						const auto& rec = newRecs[j];
+						GAIA_ASSERT(rec.entity == newId);
+						if (rec.comp.size() != 0U) {
+							const auto& desc = *rec.pDesc;
+							// Trivially movable and destructible data can be relocated without calling any constructors
+							const bool relocatable =
+									desc.func_move_ctor == nullptr && desc.func_dtor == nullptr && rec.comp.soa() == 0;
+							if (relocatable) {
+								map.items.push_back({(uint8_t)i, (uint8_t)j, ColumnMap::Op::Relocate});
+							} else {
+								map.items.push_back({(uint8_t)i, (uint8_t)j, ColumnMap::Op::Move});
+								addDtor(i);
 							}
-
-							++j;
 						}
+
+						++i;
+						++j;
+					} else if (SortComponentCond{}.operator()(oldId, newId)) {
+						// No match with the new chunk. The component is going to be destroyed
+						addDtor(i);
+						++i;
+					} else {
+						// No match with the old chunk. Construct the component
+						addCtor(j);
+						++j;
 					}
+				}
 
-					// Initialize the rest of the components if they are generic.
-					for (; j < pNewChunk->m_header.genEntities; ++j) {
-						const auto& rec = newRecs[j];
-						if (rec.pDesc != nullptr && rec.pDesc->func_ctor != nullptr) {
-							auto* pDst = (void*)pNewChunk->comp_ptr_mut(j, newRow);
+				// Destroy the rest of the components of the old chunk and initialize the rest of
+				// components of the new chunk
+				for (; i < oldChunk.m_header.genEntities; ++i)
+					addDtor(i);
+				for (; j < newChunk.m_header.genEntities; ++j)
+					addCtor(j);
+			}
+
+			/*!
+			Moves all data associated with the entity at \param oldRow in \param pOldChunk to \param pNewChunk
+			so it is stored at the row \param newRow.
+			\param map Column mapping between the two chunks. See build_column_map.
+			\warning Data left behind in \param pOldChunk is not destroyed. This is up to the caller.
+			*/
+			static void move_foreign_entity_data(
+					Chunk* pOldChunk, uint32_t oldRow, Chunk* pNewChunk, uint32_t newRow, const ColumnMap& map) {
+				GAIA_PROF_SCOPE(Chunk::move_foreign_entity_data);
+
+				GAIA_ASSERT(pOldChunk != nullptr);
+				GAIA_ASSERT(pNewChunk != nullptr);
+				GAIA_ASSERT(oldRow < pOldChunk->size());
+				GAIA_ASSERT(newRow < pNewChunk->size());
+
+				auto newRecs = pNewChunk->comp_rec_view();
+				for (const auto& item: map.items) {
+					const auto& rec = newRecs[item.dstIdx];
+					auto* pDst = (void*)pNewChunk->comp_ptr_mut(item.dstIdx, newRow);
+					switch (item.op) {
+						case ColumnMap::Op::Relocate:
+							memcpy(pDst, (const void*)pOldChunk->comp_ptr(item.srcIdx, oldRow), rec.comp.size());
+							break;
+						case ColumnMap::Op::Move:
+							rec.pDesc->ctor_from((void*)pOldChunk->comp_ptr_mut(item.srcIdx, oldRow), pDst);
+							break;
+						case ColumnMap::Op::Ctor:
 							rec.pDesc->func_ctor(pDst, 1);
-						}
+							break;
 					}
 				}
 			}
 
+			static void move_foreign_entity_data(Chunk* pOldChunk, uint32_t oldRow, Chunk* pNewChunk, uint32_t newRow) {
+				ColumnMap map;
+				build_column_map(*pOldChunk, *pNewChunk, map);
+				move_foreign_entity_data(pOldChunk, oldRow, pNewChunk, newRow, map);
+			}
+
 			/*!
 			Moves all data associated with \param entity into the chunk so that it is stored at the row \param row.
 			*/
@@ -690,6 +836,53 @@ namespace gaia {
 				move_foreign_entity_data(ec.pChunk, ec.row, this, row);
 			}
 
+			/*!
+			Moves data of \param entCnt entities starting at \param oldRow in \param pOldChunk
+			to \param pNewChunk so they are stored starting at \param newRow.
+			Data is moved column by column. Relocatable components are moved using a single memcpy per column.
+			Data left behind in \param pOldChunk is destroyed.
+			\param map Column mapping between the two chunks. See build_column_map.
+			\warning It is expected the rows in both chunks are valid. Undefined behavior otherwise.
+			*/
+			static void move_foreign_entities_data(
+					Chunk* pOldChunk, uint32_t oldRow, Chunk* pNewChunk, uint32_t newRow, uint32_t entCnt,
+					const ColumnMap& map) {
+				GAIA_PROF_SCOPE(Chunk::move_foreign_entities_data);
+
+				GAIA_ASSERT(pOldChunk != nullptr);
+				GAIA_ASSERT(pNewChunk != nullptr);
+				GAIA_ASSERT(oldRow + entCnt <= pOldChunk->size());
+				GAIA_ASSERT(newRow + entCnt <= pNewChunk->size());
+
+				auto oldRecs = pOldChunk->comp_rec_view();
+				auto newRecs = pNewChunk->comp_rec_view();
+				for (const auto& item: map.items) {
+					const auto& rec = newRecs[item.dstIdx];
+					auto* pDst = pNewChunk->comp_ptr_mut(item.dstIdx, newRow);
+					switch (item.op) {
+						case ColumnMap::Op::Relocate:
+							// Relocate the whole column range at once
+							memcpy(
+									(void*)pDst, (const void*)pOldChunk->comp_ptr(item.srcIdx, oldRow),
+									(size_t)rec.comp.size() * entCnt);
+							break;
+						case ColumnMap::Op::Move: {
+							auto* pSrc = pOldChunk->comp_ptr_mut(item.srcIdx, oldRow);
+							const auto compSize = (uintptr_t)rec.comp.size();
+							GAIA_FOR(entCnt) {
+								rec.pDesc->ctor_from((void*)(pSrc + compSize * i), (void*)(pDst + compSize * i));
+							}
+						} break;
+						case ColumnMap::Op::Ctor:
+							rec.pDesc->func_ctor((void*)pDst, entCnt);
+							break;
+					}
+				}
+
+				for (auto compIdx: map.dtors)
+					oldRecs[compIdx].pDesc->func_dtor((void*)pOldChunk->comp_ptr_mut(compIdx, oldRow), entCnt);
+			}
+
 			/*!
 			Tries to remove the entity at \param row.
 			Removal is done via swapping with last entity in chunk.
@@ -722,6 +915,7 @@ namespace gaia {
 #endif
 
 					ev[rowA] = entityB;
+					++m_header.rowVersion;
 
 					// Move component data from entityB to entityA
 					auto recView = comp_rec_view();
@@ -770,11 +964,9 @@ namespace gaia {
 				GAIA_PROF_SCOPE(Chunk::remove_entity);
 
 				if (enabled(row)) {
-					// Entity was previously enabled. Swap with the last entity
+					// Entity was previously enabled. Swap with the last entity.
+					// The last entity is enabled as well so the disabled range stays intact.
 					remove_entity_inter(row, recs);
-					// If this was the first enabled entity make sure to update the row
-					if (m_header.rowFirstEnabledEntity > 0 && row == m_header.rowFirstEnabledEntity)
-						--m_header.rowFirstEnabledEntity;
 				} else {
 					// Entity was previously disabled. Swap with the last disabled entity
 					const uint16_t pivot = size_disabled() - 1;
@@ -818,6 +1010,7 @@ namespace gaia {
 
 				ev[rowA] = entityB;
 				ev[rowB] = entityA;
+				++m_header.rowVersion;
 
 				// Swap component data
 				auto recView = comp_rec_view();
@@ -886,6 +1079,146 @@ namespace gaia {
 				return row >= (uint16_t)m_header.rowFirstEnabledEntity;
 			}
 
+			/*!
+			Marks the first \param cnt rows of the chunk as disabled.
+			Used when restoring a chunk where disabled entities are already stored at the front.
+			\param cnt Number of disabled rows
+			\param recs Entity container records
+			*/
+			void set_disabled(uint16_t cnt, EntityContainers& recs) {
+				GAIA_ASSERT(m_header.rowFirstEnabledEntity == 0);
+				GAIA_ASSERT(cnt <= m_header.count);
+
+				m_header.rowFirstEnabledEntity = cnt;
+				m_header.countEnabled = m_header.count - cnt;
+
+				const auto ents = entity_view();
+				GAIA_FOR(cnt) recs[ents[i]].dis = 1;
+			}
+
+			/*!
+			Writes component data of all rows in the chunk to \param s.
+			SoA and trivially copyable components are written as contiguous blocks of raw memory.
+			Other components are written using their save function. If they do not have any, nothing is written.
+			\param s Serialization buffer
+			*/
+			void save(SerializationBuffer& s) const {
+				GAIA_PROF_SCOPE(Chunk::save);
+
+				auto recs = comp_rec_view();
+				GAIA_EACH(recs) {
+					const auto& rec = recs[i];
+					if (rec.comp.size() == 0U)
+						continue;
+
+					const auto* pDesc = rec.pDesc;
+					const uint32_t cnt = (rec.entity.kind() == EntityKind::EK_Gen) ? m_header.count : 1U;
+					if (rec.comp.soa() != 0U)
+						s.save(rec.pData, pDesc->calc_new_mem_offset(0, m_header.capacity));
+					else if (pDesc == nullptr || pDesc->trivial)
+						s.save(rec.pData, rec.comp.size() * cnt);
+					else if (pDesc->func_save != nullptr)
+						pDesc->func_save(s, rec.pData, cnt);
+				}
+			}
+
+			/*!
+			Reads component data of all rows in the chunk from \param s.
+			Counterpart of save. Entities are expected to be added to the chunk already.
+			Non-trivial components without a load function are left default-constructed.
+			\param s Serialization buffer
+			*/
+			void load(SerializationBuffer& s) {
+				GAIA_PROF_SCOPE(Chunk::load);
+
+				auto recs = comp_rec_view();
+				GAIA_EACH(recs) {
+					const auto& rec = recs[i];
+					if (rec.comp.size() == 0U)
+						continue;
+
+					const auto* pDesc = rec.pDesc;
+					const uint32_t cnt = (rec.entity.kind() == EntityKind::EK_Gen) ? m_header.count : 1U;
+					if (rec.comp.soa() != 0U)
+						s.load(rec.pData, pDesc->calc_new_mem_offset(0, m_header.capacity));
+					else if (pDesc == nullptr || pDesc->trivial)
+						s.load(rec.pData, rec.comp.size() * cnt);
+					else {
+						// Unique components are constructed already when the chunk is created
+						if (pDesc->func_ctor != nullptr && rec.entity.kind() == EntityKind::EK_Gen)
+							pDesc->func_ctor(rec.pData, cnt);
+						if (pDesc->func_load != nullptr)
+							pDesc->func_load(s, rec.pData, cnt);
+					}
+				}
+			}
+
+			//! Returns true if the component record \param rec can be a part of a delta snapshot.
+			//! SoA components and components holding pointers into the world are left out.
+			GAIA_NODISCARD static bool delta_comp(const ComponentRecord& rec) {
+				if (rec.comp.size() == 0U || rec.comp.soa() != 0U || rec.entity == GAIA_ID(EntityDesc))
+					return false;
+
+				const auto* pDesc = rec.pDesc;
+				return pDesc == nullptr || pDesc->trivial || (pDesc->func_save != nullptr && pDesc->func_load != nullptr);
+			}
+
+			/*!
+			Writes data of components which changed since \param version to \param s.
+			Only the changed components are written, each of them for all rows in the chunk.
+			\param s Serialization buffer
+			\param version World version to compare component versions with
+			*/
+			void save_delta(SerializationBuffer& s, uint32_t version) const {
+				GAIA_PROF_SCOPE(Chunk::save_delta);
+
+				auto recs = comp_rec_view();
+				uint32_t compCnt = 0;
+				GAIA_EACH(recs) {
+					if (delta_comp(recs[i]) && changed(version, i))
+						++compCnt;
+				}
+				s.save(compCnt);
+
+				GAIA_EACH(recs) {
+					const auto& rec = recs[i];
+					if (!delta_comp(rec) || !changed(version, i))
+						continue;
+
+					const auto* pDesc = rec.pDesc;
+					const uint32_t cnt = (rec.entity.kind() == EntityKind::EK_Gen) ? m_header.count : 1U;
+					s.save(rec.entity);
+					if (pDesc == nullptr || pDesc->trivial)
+						s.save(rec.pData, rec.comp.size() * cnt);
+					else
+						pDesc->func_save(s, rec.pData, cnt);
+				}
+			}
+
+			/*!
+			Reads a single value of the component at the index \param compIdx written by save_delta
+			from \param s and marks it as changed at the current world version.
+			\param s Serialization buffer
+			\param compIdx Component index
+			\param row Row of the entity. Ignored for unique components.
+			*/
+			void load_delta(SerializationBuffer& s, uint32_t compIdx, uint16_t row) {
+				const auto& rec = m_records.pRecords[compIdx];
+				GAIA_ASSERT(delta_comp(rec));
+
+				if (rec.entity.kind() != EntityKind::EK_Gen)
+					row = 0;
+
+				auto* pData = rec.pData + (uintptr_t)rec.comp.size() * row;
+				const auto* pDesc = rec.pDesc;
+				if (pDesc == nullptr || pDesc->trivial)
+					s.load(pData, rec.comp.size());
+				else
+					pDesc->func_load(s, pData, 1);
+
+				update_world_version(compIdx, row, row + 1U);
+			}
+
 			/*!
 			Returns a mutable pointer to chunk data.
 			\param offset Offset into chunk data
@@ -1019,10 +1352,12 @@ namespace gaia {
 						"Set providing a row can only be used with generic components");
 
 				// Update the world version
-				update_version(m_header.worldVersion);
+				bump_world_version(m_header.worldVersion);
 
 				GAIA_ASSERT(row < m_header.capacity);
-				view_mut<T>()[row] = GAIA_FWD(value);
+				sview_mut<T>()[row] = GAIA_FWD(value);
+				// Only the row that was set is marked as changed
+				update_world_version(comp_idx<T>(), row, row + 1U);
 			}
 
 			/*!
@@ -1042,7 +1377,7 @@ namespace gaia {
 				GAIA_ASSERT(type.kind() == entity_kind_v<T>);
 
 				// Update the world version
-				update_version(m_header.worldVersion);
+				bump_world_version(m_header.worldVersion);
 
 				GAIA_ASSERT(row < m_header.capacity);
 
@@ -1053,7 +1388,9 @@ namespace gaia {
 				// const uint32_t col = comp_idx(type);
 				//(void)col;
 
-				view_mut<T>()[row] = GAIA_FWD(value);
+				sview_mut<T>()[row] = GAIA_FWD(value);
+				// Only the row that was set is marked as changed
+				update_world_version(comp_idx<T>(), row, row + 1U);
 			}
 
 			/*!
@@ -1138,6 +1475,22 @@ namespace gaia {
 				return ecs::comp_idx<MAX_COMPONENTS>(m_records.pCompEntities, entity);
 			}
 
+			/*!
+			 Returns the internal index of the component \tparam T.
+			 \tparam T Component or pair
+			 \return Component index if the component was found. -1 otherwise.
+			 */
+			template <typename T>
+			GAIA_NODISCARD uint32_t comp_idx() const {
+				if constexpr (is_pair<T>::value) {
+					const auto rel = m_header.cc->get<typename T::rel>().entity;
+					const auto tgt = m_header.cc->get<typename T::tgt>().entity;
+					return comp_idx((Entity)Pair(rel, tgt));
+				} else {
+					return comp_idx(m_header.cc->get<T>().entity);
+				}
+			}
+
 			//----------------------------------------------------------------------
 
 			//! Sets the index of this chunk in its archetype's storage
@@ -1198,19 +1551,20 @@ namespace gaia {
 			//! If true locks the chunk for structural changed.
 			//! While locked, no new entities or component can be added or removed.
 			//! While locked, no entities can be enabled or disabled.
+			//! Locks are counted and can be acquired and released by multiple threads at once.
 			void lock(bool value) {
 				if (value) {
-					GAIA_ASSERT(m_header.structuralChangesLocked < ChunkHeader::MAX_CHUNK_LOCKS);
-					++m_header.structuralChangesLocked;
+					[[maybe_unused]] const auto prev = m_header.structuralChangesLocked.fetch_add(1, std::memory_order_relaxed);
+					GAIA_ASSERT(prev < ChunkHeader::MAX_CHUNK_LOCKS);
 				} else {
-					GAIA_ASSERT(m_header.structuralChangesLocked > 0);
-					--m_header.structuralChangesLocked;
+					[[maybe_unused]] const auto prev = m_header.structuralChangesLocked.fetch_sub(1, std::memory_order_relaxed);
+					GAIA_ASSERT(prev > 0);
 				}
 			}
 
 			//! Checks if the chunk is locked for structural changes.
 			bool locked() const {
-				return m_header.structuralChangesLocked != 0;
+				return m_header.structuralChangesLocked.load(std::memory_order_relaxed) != 0;
 			}
 
 			//! Checks is the full capacity of the has has been reached
@@ -1254,29 +1608,110 @@ namespace gaia {
 				return mem_block_size(m_header.sizeType);
 			}
 
+			//! Returns the size type of the memory block the chunk spans over, see mem_block_size
+			GAIA_NODISCARD uint8_t size_type() const {
+				return (uint8_t)m_header.sizeType;
+			}
+
+			//! Returns the version of the component at the index \param compIdx
+			GAIA_NODISCARD ComponentVersion comp_version(uint32_t compIdx) const {
+				return comp_version_view()[compIdx];
+			}
+
+			//! Returns a number which changes whenever entities of the chunk are moved to different rows.
+			//! Entities added to or removed from the end of the chunk do not change it.
+			GAIA_NODISCARD uint32_t row_version() const {
+				return m_header.rowVersion;
+			}
+
+			//! Returns true if any component of the chunk changed after \param version
+			GAIA_NODISCARD bool changed(uint32_t version) const {
+				auto versions = comp_version_view();
+				GAIA_EACH(versions) {
+					if (version_changed(versions[i], version))
+						return true;
+				}
+				return false;
+			}
+
 			//! Returns true if the provided version is newer than the one stored internally
 			GAIA_NODISCARD bool changed(uint32_t version, uint32_t compIdx) const {
 				auto versions = comp_version_view();
 				return version_changed(versions[compIdx], version);
 			}
 
-			//! Update the version of a component at the index \param compIdx
-			GAIA_FORCEINLINE void update_world_version(uint32_t compIdx) {
+			//! Returns true if the component at the index \param compIdx changed at \param row after \param version.
+			//! Components which do not track changes per row report all rows of a changed chunk.
+			GAIA_NODISCARD bool changed(uint32_t version, uint32_t compIdx, uint16_t row) const {
+				if (!changed(version, compIdx))
+					return false;
+
+				const auto* pRowChanges = row_changes(compIdx);
+				// Rows written to before the tracking started are unknown
+				if (pRowChanges == nullptr || version_changed(pRowChanges->since, version))
+					return true;
+
+				return pRowChanges->rows.test(row);
+			}
+
+			//! Calls \param func for each row in the range [\param from, \param to) at which the component
+			//! at the index \param compIdx changed after \param version.
+			//! Components which do not track changes per row report all rows of a changed chunk.
+			template <typename Func>
+			void each_changed(uint32_t version, uint32_t compIdx, uint16_t from, uint16_t to, Func func) {
+				if (!changed(version, compIdx))
+					return;
+
+				auto* pRowChanges = row_changes(compIdx);
+				if (pRowChanges != nullptr) {
+					// Writes coming after this are recorded from scratch
+					pRowChanges->consumed = true;
+
+					if (!version_changed(pRowChanges->since, version)) {
+						for (auto row: pRowChanges->rows) {
+							if (row >= to)
+								break;
+							if (row >= from)
+								func((uint16_t)row);
+						}
+						return;
+					}
+				}
+
+				// Rows written to before the tracking started are unknown
+				for (uint16_t row = from; row < to; ++row)
+					func(row);
+			}
+
+			//! Update the version of a component at the index \param compIdx.
+			//! Rows in the range [\param from, \param to) are marked as changed.
+			GAIA_FORCEINLINE void update_world_version(uint32_t compIdx, uint32_t from, uint32_t to) {
+				if (m_header.hasAnyRowChanges)
+					update_row_changes(compIdx, from, to);
+
+				const auto version = curr_world_version(m_header.worldVersion);
 				auto versions = comp_version_view_mut();
-				versions[compIdx] = m_header.worldVersion;
+				versions[compIdx] = version;
+				m_records.pArchetypeVersions[compIdx].store(version, std::memory_order_relaxed);
 			}
 
-			//! Update the version of all components
+			//! Update the version of all components. All rows are marked as changed.
 			GAIA_FORCEINLINE void update_world_version() {
+				const auto version = curr_world_version(m_header.worldVersion);
 				auto versions = comp_version_view_mut();
-				for (auto& v: versions)
-					v = m_header.worldVersion;
+				GAIA_EACH(versions) {
+					if (m_header.hasAnyRowChanges)
+						update_row_changes(i, 0, m_header.count);
+
+					versions[i] = version;
+					m_records.pArchetypeVersions[i].store(version, std::memory_order_relaxed);
+				}
 			}
 
 			void diag() const {
 				GAIA_LOG_N(
-						"  Chunk #%04u, entities:%u/%u, lifespanCountdown:%u", m_header.index, m_header.count, m_header.capacity,
-						m_header.lifespanCountdown);
+						"  Chunk #%04u (%uK), entities:%u/%u, lifespanCountdown:%u", m_header.index, bytes() / 1024, m_header.count,
+						m_header.capacity, m_header.lifespanCountdown);
 			}
 		};
 	} // namespace ecs
@@ -5,6 +5,8 @@
 
 #if GAIA_ECS_CHUNK_ALLOCATOR
 	#include <cinttypes>
+	#include <atomic>
+	#include <mutex>
 
 	#include "../cnt/darray.h"
 	#include "../cnt/sarray.h"
@@ -17,21 +19,34 @@
 	#include "../core/utility.h"
 	#include "../mem/mem_alloc.h"
 	#include "common.h"
+
+	#if GAIA_PLATFORM_LINUX
+		#include <sys/mman.h>
+		#include <unistd.h>
+	#endif
 #endif
 
 namespace gaia {
 	namespace ecs {
-		//! Size of one allocated block of memory
-		static constexpr uint32_t MaxMemoryBlockSize = 16384;
+		//! Number of block size classes. Block sizes are powers of two between MinMemoryBlockSize and MaxMemoryBlockSize.
+		static constexpr uint32_t MemoryBlockSizeTypes = 7;
+		//! Size of the smallest allocated block of memory
+		static constexpr uint32_t MinMemoryBlockSize = 1024;
+		//! Size of the largest allocated block of memory
+		static constexpr uint32_t MaxMemoryBlockSize = MinMemoryBlockSize << (MemoryBlockSizeTypes - 1);
 		//! Unusable area at the beggining of the allocated block designated for special purposes
 		static constexpr uint32_t MemoryBlockUsableOffset = sizeof(uintptr_t);
 
-		inline constexpr uint16_t mem_block_size(uint32_t sizeType) {
-			return sizeType != 0 ? MaxMemoryBlockSize : MaxMemoryBlockSize / 2;
+		inline constexpr uint32_t mem_block_size(uint32_t sizeType) {
+			return MinMemoryBlockSize << sizeType;
 		}
 
+		//! Returns the smallest block size type able to hold \param sizeBytes bytes
 		inline constexpr uint8_t mem_block_size_type(uint32_t sizeBytes) {
-			return (uint8_t)(sizeBytes > MaxMemoryBlockSize / 2);
+			uint8_t sizeType = 0;
+			while (sizeType + 1U < MemoryBlockSizeTypes && mem_block_size(sizeType) < sizeBytes)
+				++sizeType;
+			return sizeType;
 		}
 
 #if GAIA_ECS_CHUNK_ALLOCATOR
@@ -47,7 +62,25 @@ namespace gaia {
 		};
 
 		struct ChunkAllocatorStats final {
-			ChunkAllocatorPageStats stats[2];
+			ChunkAllocatorPageStats stats[MemoryBlockSizeTypes];
+			//! Memory released back to the system by trimming so far
+			uint64_t mem_trimmed;
+		};
+
+		//! Controls how much memory held by empty pages the chunk allocator keeps around for reuse.
+		//! Memory of empty pages above the low watermark is released once it stays there for decay_ticks
+		//! trim ticks. Memory above the high watermark is released on the next tick.
+		struct ChunkAllocatorTrimPolicy final {
+			//! Memory of empty pages that is always kept
+			uint64_t low_watermark = 8 * 1024 * 1024;
+			//! Memory of empty pages above which trimming happens right away
+			uint64_t high_watermark = 64 * 1024 * 1024;
+			//! Number of trim ticks memory needs to stay above the low watermark before it is released.
+			//! Zero disables the decay so only the high watermark triggers trimming.
+			uint32_t decay_ticks = 300;
+			//! When true, World::update() performs one trim tick. Turn it off when calling trim() manually,
+			//! e.g. from a low-priority job.
+			bool auto_trim = true;
 		};
 
 		namespace detail {
@@ -59,6 +92,8 @@ namespace gaia {
 
 			/*!
 			Allocator for ECS Chunks. Memory is organized in pages of chunks.
+			The allocator is thread-safe. Each thread keeps a small cache of free blocks in front of the shared
+			page lists so most allocations and releases don't need to take the lock.
 			*/
 			class ChunkAllocatorImpl {
 				friend gaia::ecs::ChunkAllocator;
@@ -75,8 +110,9 @@ namespace gaia {
 					void* m_data;
 					//! Index in the list of pages
 					uint32_t m_idx;
-					//! Block size type, 0=8K, 1=16K blocks
-					uint32_t m_sizeType : 1;
+					//! Block size type, 0=1K, 1=2K, ..., 6=64K blocks.
+					//! Kept outside of the bit field below so it can be read without holding the allocator's lock.
+					uint8_t m_sizeType;
 					//! Number of blocks in the block array
 					uint32_t m_blockCnt: NBlocks_Bits;
 					//! Number of used blocks out of NBlocks
@@ -86,7 +122,7 @@ namespace gaia {
 					//! Number of blocks to recycle
 					uint32_t m_freeBlocks: NBlocks_Bits;
 					//! Free bits to use in the future
-					uint32_t m_unused : 7;
+					uint32_t m_unused : 8;
 					//! Implicit list of blocks
 					BlockArray m_blocks;
 
@@ -191,17 +227,111 @@ namespace gaia {
 					}
 				};
 
+	#if GAIA_ECS_CHUNK_ALLOCATOR_HUGE_PAGES
+				//! Memory region backed by a huge page. Data of memory pages is carved out of it in slots.
+				struct HugePageRegion {
+					//! Size of the region. Matches the size of a huge page on x86-64 and ARM64.
+					static constexpr uint32_t Size = 2 * 1024 * 1024;
+					static constexpr uint32_t NSlots = 32;
+					static constexpr uint32_t SlotSize = Size / NSlots;
+
+					//! Pointer to the region
+					void* m_data;
+					//! Bit mask of used slots
+					uint32_t m_usedSlots;
+				};
+
+				//! Number of region slots taken by the data of a memory page of the given size type.
+				//! Data of pages bigger than a region takes more than HugePageRegion::NSlots slots and is allocated
+				//! separately.
+				static constexpr uint32_t huge_page_slots(uint32_t sizeType) {
+					return (mem_block_size(sizeType) * MemoryPage::NBlocks + HugePageRegion::SlotSize - 1) /
+								 HugePageRegion::SlotSize;
+				}
+
+				//! Regions page data is allocated from
+				cnt::darray<HugePageRegion> m_regions;
+	#endif
+
+				//! Per-thread cache of free blocks. Blocks are taken from and returned to it without taking
+				//! the allocator lock. The cache is refilled from and spilled to the shared pages in batches.
+				struct BlockCache {
+					//! Maximum number of blocks cached per size type
+					static constexpr uint32_t MaxBlocks = 8;
+					//! Maximum number of bytes cached per size type. Limits the number of big blocks kept around.
+					static constexpr uint32_t MaxBytes = 128 * 1024;
+
+					//! Returns the maximum number of blocks cached for the size type \param sizeType
+					static constexpr uint32_t max_blocks(uint32_t sizeType) {
+						const auto cnt = MaxBytes / mem_block_size(sizeType);
+						return cnt < 2 ? 2 : (cnt > MaxBlocks ? MaxBlocks : cnt);
+					}
+
+					//! Returns the number of blocks moved between the cache and the pages at once
+					static constexpr uint32_t batch_blocks(uint32_t sizeType) {
+						return max_blocks(sizeType) / 2;
+					}
+
+					//! Allocator the cache is registered with
+					ChunkAllocatorImpl* m_pAllocator = nullptr;
+					//! Set when the cache is destroyed on thread exit
+					bool* m_pDestroyed;
+					//! Guards the cached blocks. Only the owning thread uses it most of the time so it is
+					//! rarely contended. Other threads take it when draining the cache.
+					std::mutex m_lock;
+					//! Cached blocks for each size type
+					cnt::sarray_ext<void*, MaxBlocks> m_blocks[MemoryBlockSizeTypes];
+
+					BlockCache(bool* pDestroyed): m_pDestroyed(pDestroyed) {}
+
+					~BlockCache() {
+						*m_pDestroyed = true;
+						if (m_pAllocator != nullptr)
+							m_pAllocator->unreg_cache(*this);
+					}
+
+					BlockCache(BlockCache&&) = delete;
+					BlockCache(const BlockCache&) = delete;
+					BlockCache& operator=(BlockCache&&) = delete;
+					BlockCache& operator=(const BlockCache&) = delete;
+				};
+
 				//! Container for pages storing various-sized chunks
-				MemoryPageContainer m_pages[2];
+				MemoryPageContainer m_pages[MemoryBlockSizeTypes];
+				//! Guards the page lists and the trimming state
+				mutable std::mutex m_lock;
+				//! Guards the list of block caches. Taken before the lock of any cache and before m_lock.
+				mutable std::mutex m_cachesLock;
+				//! Block caches of all threads that used the allocator
+				cnt::darray<BlockCache*> m_caches;
+
+				//! Policy for releasing empty pages
+				ChunkAllocatorTrimPolicy m_trimPolicy{};
+				//! Number of consecutive trim ticks memory of empty pages stayed above the low watermark
+				uint32_t m_trimTicks = 0;
+				//! Memory released by trimming so far
+				uint64_t m_memTrimmed = 0;
 
 				//! When true, destruction has been requested
-				bool m_isDone = false;
+				std::atomic_bool m_isDone = false;
 
 			private:
 				ChunkAllocatorImpl() = default;
 
 				void on_delete() {
-					flush();
+					(void)drain_caches();
+					{
+						std::scoped_lock lock(m_lock);
+						(void)release_empty_pages(0);
+					}
+
+					// Caches of threads still running must not call into the allocator anymore
+					{
+						std::scoped_lock lock(m_cachesLock);
+						for (auto* pCache: m_caches)
+							pCache->m_pAllocator = nullptr;
+						m_caches.clear();
+					}
 
 					// Make sure there are no leaks
 					auto memStats = stats();
@@ -230,10 +360,317 @@ namespace gaia {
 				void* alloc(uint32_t bytesWanted) {
 					GAIA_ASSERT(bytesWanted <= MaxMemoryBlockSize);
 
+					const auto sizeType = mem_block_size_type(bytesWanted);
+
+					auto* pCache = thread_cache();
+					if (pCache == nullptr || m_isDone) {
+						std::scoped_lock lock(m_lock);
+						return alloc_inter(sizeType);
+					}
+
+					if (pCache->m_pAllocator != this)
+						reg_cache(*pCache);
+
+					std::scoped_lock cacheLock(pCache->m_lock);
+					auto& blocks = pCache->m_blocks[sizeType];
+					if (!blocks.empty()) {
+						auto* pBlock = blocks.back();
+						blocks.pop_back();
+						return pBlock;
+					}
+
+					// The cache is empty. Refill it so the following allocations don't need to take the lock.
+					std::scoped_lock lock(m_lock);
+					GAIA_FOR(BlockCache::batch_blocks(sizeType) - 1) blocks.push_back(alloc_inter(sizeType));
+					return alloc_inter(sizeType);
+				}
+
+				GAIA_CLANG_WARNING_PUSH()
+				// Memory is aligned so we can silence this warning
+				GAIA_CLANG_WARNING_DISABLE("-Wcast-align")
+
+				/*!
+				Releases memory allocated for pointer
+				*/
+				void free(void* pBlock) {
+					auto* pCache = m_isDone ? nullptr : thread_cache();
+					if (pCache == nullptr) {
+						bool deleteThis = false;
+						{
+							std::scoped_lock lock(m_lock);
+							deleteThis = free_inter(pBlock);
+						}
+						if (deleteThis)
+							delete this;
+						return;
+					}
+
+					if (pCache->m_pAllocator != this)
+						reg_cache(*pCache);
+
+					// The size type never changes after the page is created so it is safe to read it without locking
+					const auto* pPage = page_from_block(pBlock);
+					std::scoped_lock cacheLock(pCache->m_lock);
+					auto& blocks = pCache->m_blocks[pPage->m_sizeType];
+					const auto maxBlocks = BlockCache::max_blocks(pPage->m_sizeType);
+					if (blocks.size() == maxBlocks) {
+						// The cache is full. Return the oldest blocks to their pages.
+						const auto batchBlocks = BlockCache::batch_blocks(pPage->m_sizeType);
+						std::scoped_lock lock(m_lock);
+						GAIA_FOR(batchBlocks) (void)free_inter(blocks[i]);
+						GAIA_FOR(maxBlocks - batchBlocks) blocks[i] = blocks[i + batchBlocks];
+						blocks.resize(maxBlocks - batchBlocks);
+					}
+
+					blocks.push_back(pBlock);
+				}
+
+				GAIA_CLANG_WARNING_POP()
+
+				/*!
+				Returns allocator statistics.
+				Blocks cached by threads are free memory and don't count as used.
+				*/
+				ChunkAllocatorStats stats() const {
+					uint64_t cachedBytes[MemoryBlockSizeTypes]{};
+					std::scoped_lock cachesLock(m_cachesLock);
+					for (auto* pCache: m_caches) {
+						std::scoped_lock cacheLock(pCache->m_lock);
+						GAIA_FOR(MemoryBlockSizeTypes) {
+							cachedBytes[i] += (uint64_t)pCache->m_blocks[i].size() * mem_block_size(i);
+						}
+					}
+
+					std::scoped_lock lock(m_lock);
+
+					ChunkAllocatorStats stats;
+					GAIA_FOR(MemoryBlockSizeTypes) {
+						stats.stats[i] = page_stats(i);
+						stats.stats[i].mem_used -= cachedBytes[i];
+					}
+					stats.mem_trimmed = m_memTrimmed;
+					return stats;
+				}
+
+				//! Returns how much of the page holding \param pBlock is in use, from 0 to 1.
+				//! Blocks cached by threads count as used.
+				float page_usage(const void* pBlock) const {
+					// Pages never move so it is safe to read the page pointer without locking
+					const auto* pPage = page_from_block((void*)pBlock);
+					std::scoped_lock lock(m_lock);
+					return (float)pPage->used_blocks_cnt() / (float)MemoryPage::NBlocks;
+				}
+
+				//! Sets the policy used by trim()
+				void trim_policy(const ChunkAllocatorTrimPolicy& policy) {
+					std::scoped_lock lock(m_lock);
+					m_trimPolicy = policy;
+					m_trimTicks = 0;
+				}
+
+				//! Returns the policy used by trim()
+				ChunkAllocatorTrimPolicy trim_policy() const {
+					std::scoped_lock lock(m_lock);
+					return m_trimPolicy;
+				}
+
+				/*!
+				Performs one trim tick. Blocks cached by all threads are returned to their pages first
+				so they don't keep otherwise empty pages alive. Empty pages are then released according to the trim policy.
+				Meant to be called once per frame. It is thread-safe so it can also run from a low-priority job.
+				\return Number of bytes released
+				*/
+				uint64_t trim() {
+					GAIA_PROF_SCOPE(ChunkAllocator::trim);
+
+					if (drain_caches()) {
+						delete this;
+						return 0;
+					}
+
+					std::scoped_lock lock(m_lock);
+
+					const auto& policy = m_trimPolicy;
+					const auto emptyBytes = empty_pages_bytes();
+					if (emptyBytes <= policy.low_watermark) {
+						m_trimTicks = 0;
+						return 0;
+					}
+
+					// Memory between the watermarks is kept for a while in case it is needed again soon
+					if (emptyBytes <= policy.high_watermark) {
+						if (policy.decay_ticks == 0 || ++m_trimTicks < policy.decay_ticks)
+							return 0;
+					}
+
+					m_trimTicks = 0;
+					const auto released = release_empty_pages(policy.low_watermark);
+					m_memTrimmed += released;
+					return released;
+				}
+
+				/*!
+				Flushes unused memory. Blocks cached by all threads are returned to their pages first.
+				*/
+				void flush() {
+					if (drain_caches()) {
+						delete this;
+						return;
+					}
+
+					std::scoped_lock lock(m_lock);
+					(void)release_empty_pages(0);
+				}
+
+				/*!
+				Performs diagnostics of the memory used.
+				*/
+				void diag() const {
+					auto diagPage = [](const ChunkAllocatorPageStats& memstats) {
+						GAIA_LOG_N("ChunkAllocator stats");
+						GAIA_LOG_N("  Allocated: %" PRIu64 " B", memstats.mem_total);
+						GAIA_LOG_N("  Used: %" PRIu64 " B", memstats.mem_total - memstats.mem_used);
+						GAIA_LOG_N("  Overhead: %" PRIu64 " B", memstats.mem_used);
+						GAIA_LOG_N("  Utilization: %.1f%%", 100.0 * ((double)memstats.mem_used / (double)memstats.mem_total));
+						GAIA_LOG_N("  Pages: %u", memstats.num_pages);
+						GAIA_LOG_N("  Free pages: %u", memstats.num_pages_free);
+					};
+
+					const auto memStats = stats();
+					for (const auto& s: memStats.stats) {
+						if (s.num_pages != 0)
+							diagPage(s);
+					}
+					GAIA_LOG_N("ChunkAllocator trimmed: %" PRIu64 " B", memStats.mem_trimmed);
+				}
+
+			private:
+				//! Returns the block cache of the calling thread or nullptr if the thread is exiting
+				//! and the cache has already been destroyed.
+				static BlockCache* thread_cache() {
+					// Trivially destructible so it can be checked even after the cache is gone
+					thread_local bool s_destroyed = false;
+					if (s_destroyed)
+						return nullptr;
+
+					thread_local BlockCache s_cache(&s_destroyed);
+					return &s_cache;
+				}
+
+				//! Registers the block cache \param cache of the calling thread so other threads can drain it
+				void reg_cache(BlockCache& cache) {
+					GAIA_ASSERT(cache.m_pAllocator == nullptr);
+
+					std::scoped_lock lock(m_cachesLock);
+					cache.m_pAllocator = this;
+					m_caches.push_back(&cache);
+				}
+
+				//! Unregisters the block cache \param cache of a thread that is exiting and returns its blocks
+				//! to their pages
+				void unreg_cache(BlockCache& cache) {
+					bool deleteThis = false;
+					{
+						std::scoped_lock lock(m_cachesLock);
+						const auto idx = core::get_index(m_caches, &cache);
+						GAIA_ASSERT(idx != BadIndex);
+						core::erase_fast(m_caches, idx);
+						deleteThis = drain(cache);
+						cache.m_pAllocator = nullptr;
+					}
+					if (deleteThis)
+						delete this;
+				}
+
+				//! Returns all blocks cached in \param cache to their pages. The caches lock needs to be held.
+				//! \return True if the allocator was asked to destroy itself and there is nothing left in it.
+				bool drain(BlockCache& cache) {
+					bool deleteThis = false;
+					std::scoped_lock cacheLock(cache.m_lock);
+					std::scoped_lock lock(m_lock);
+					for (auto& blocks: cache.m_blocks) {
+						for (auto* pBlock: blocks)
+							deleteThis = free_inter(pBlock);
+						blocks.clear();
+					}
+					return deleteThis;
+				}
+
+				//! Returns blocks cached by all threads to their pages.
+				//! \return True if the allocator was asked to destroy itself and there is nothing left in it.
+				bool drain_caches() {
+					bool deleteThis = false;
+					std::scoped_lock lock(m_cachesLock);
+					for (auto* pCache: m_caches)
+						deleteThis |= drain(*pCache);
+					return deleteThis;
+				}
+
+				GAIA_CLANG_WARNING_PUSH()
+				// Memory is aligned so we can silence this warning
+				GAIA_CLANG_WARNING_DISABLE("-Wcast-align")
+
+				static MemoryPage* page_from_block(void* pBlock) {
+					// Decode the page from the address
+					const auto pageAddr = *(uintptr_t*)((uint8_t*)pBlock - MemoryBlockUsableOffset);
+					return (MemoryPage*)pageAddr;
+				}
+
+				GAIA_CLANG_WARNING_POP()
+
+				//! Returns the amount of memory taken by a page of the size type \param sizeType
+				static constexpr uint64_t page_bytes(uint32_t sizeType) {
+					return (uint64_t)mem_block_size(sizeType) * MemoryPage::NBlocks;
+				}
+
+				//! Returns the amount of memory taken by empty pages. The lock needs to be held.
+				uint64_t empty_pages_bytes() const {
+					uint64_t bytes = 0;
+					GAIA_FOR(MemoryBlockSizeTypes) {
+						for (const auto* pPage: m_pages[i].pagesFree) {
+							if (pPage->empty())
+								bytes += page_bytes(i);
+						}
+					}
+					return bytes;
+				}
+
+				//! Releases empty pages until no more than \param bytesToKeep bytes are taken by them.
+				//! Pages with the biggest blocks go first. The lock needs to be held.
+				//! \return Number of bytes released
+				uint64_t release_empty_pages(uint64_t bytesToKeep) {
+					auto emptyBytes = empty_pages_bytes();
+					uint64_t released = 0;
+
+					for (uint32_t sizeType = MemoryBlockSizeTypes; sizeType-- > 0 && emptyBytes > bytesToKeep;) {
+						auto& container = m_pages[sizeType];
+						for (uint32_t i = 0; i < container.pagesFree.size() && emptyBytes > bytesToKeep;) {
+							auto* pPage = container.pagesFree[i];
+
+							// Skip non-empty pages
+							if (!pPage->empty()) {
+								++i;
+								continue;
+							}
+
+							GAIA_ASSERT(pPage->m_idx == i);
+							container.pagesFree.back()->m_idx = i;
+							core::erase_fast(container.pagesFree, i);
+							free_page(pPage);
+
+							emptyBytes -= page_bytes(sizeType);
+							released += page_bytes(sizeType);
+						}
+					}
+
+					return released;
+				}
+
+				//! Allocates a block of the given size type. The lock needs to be held.
+				void* alloc_inter(uint8_t sizeType) {
 					void* pBlock = nullptr;
 					MemoryPage* pPage = nullptr;
 
-					const auto sizeType = mem_block_size_type(bytesWanted);
 					auto& container = m_pages[sizeType];
 
 					// Find first page with available space
@@ -266,17 +703,10 @@ namespace gaia {
 					return pBlock;
 				}
 
-				GAIA_CLANG_WARNING_PUSH()
-				// Memory is aligned so we can silence this warning
-				GAIA_CLANG_WARNING_DISABLE("-Wcast-align")
-
-				/*!
-				Releases memory allocated for pointer
-				*/
-				void free(void* pBlock) {
-					// Decode the page from the address
-					const auto pageAddr = *(uintptr_t*)((uint8_t*)pBlock - MemoryBlockUsableOffset);
-					auto* pPage = (MemoryPage*)pageAddr;
+				//! Returns \param pBlock to its page. The lock needs to be held.
+				//! \return True if the allocator was asked to destroy itself and there is nothing left in it.
+				bool free_inter(void* pBlock) {
+					auto* pPage = page_from_block(pBlock);
 					const bool wasFull = pPage->full();
 
 					auto& container = m_pages[pPage->m_sizeType];
@@ -310,96 +740,134 @@ namespace gaia {
 					}
 
 					// Special handling for the allocator signaled to destroy itself
-					if (m_isDone) {
-						// Remove the page right away
-						if (pPage->empty()) {
-							GAIA_ASSERT(!container.pagesFree.empty());
-							container.pagesFree.back()->m_idx = pPage->m_idx;
-							core::erase_fast(container.pagesFree, pPage->m_idx);
-						}
-
-						try_delete_this();
+					if (!m_isDone)
+						return false;
+
+					// Remove the page right away
+					if (pPage->empty()) {
+						GAIA_ASSERT(!container.pagesFree.empty());
+						container.pagesFree.back()->m_idx = pPage->m_idx;
+						core::erase_fast(container.pagesFree, pPage->m_idx);
+						free_page(pPage);
 					}
+
+					return can_delete_this();
 				}
 
-				GAIA_CLANG_WARNING_POP()
+				MemoryPage* alloc_page(uint8_t sizeType) {
+	#if GAIA_ECS_CHUNK_ALLOCATOR_HUGE_PAGES
+					auto* pPageData = alloc_huge_page_data(huge_page_slots(sizeType));
+	#else
+					const uint32_t size = mem_block_size(sizeType) * MemoryPage::NBlocks;
+					auto* pPageData = mem::mem_alloc_alig(size, 16U);
+	#endif
+					return new MemoryPage(pPageData, sizeType);
+				}
 
-				/*!
-				Returns allocator statistics
-				*/
-				ChunkAllocatorStats stats() const {
-					ChunkAllocatorStats stats;
-					stats.stats[0] = page_stats(0);
-					stats.stats[1] = page_stats(1);
-					return stats;
+				void free_page(MemoryPage* page) {
+	#if GAIA_ECS_CHUNK_ALLOCATOR_HUGE_PAGES
+					free_huge_page_data(page->m_data, huge_page_slots(page->m_sizeType));
+	#else
+					// The memory allocator might keep the address range around so make sure the system
+					// can reclaim the physical memory right away
+					decommit(page->m_data, page_bytes(page->m_sizeType));
+					mem::mem_free_alig(page->m_data);
+	#endif
+					delete page;
 				}
 
-				/*!
-				Flushes unused memory
-				*/
-				void flush() {
-					auto flushPages = [](MemoryPageContainer& container) {
-						for (uint32_t i = 0; i < container.pagesFree.size();) {
-							auto* pPage = container.pagesFree[i];
+				//! Lets the system reclaim the physical memory backing \param size bytes at \param pData.
+				//! The address range stays valid and reads as zeros once touched again.
+				static void decommit([[maybe_unused]] void* pData, [[maybe_unused]] uint64_t size) {
+	#if GAIA_PLATFORM_LINUX
+					// Only whole system pages can be decommitted
+					static const auto sysPageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+					const auto begin = ((uintptr_t)pData + sysPageSize - 1) & ~(sysPageSize - 1);
+					const auto end = ((uintptr_t)pData + (uintptr_t)size) & ~(sysPageSize - 1);
+					if (begin < end)
+						(void)madvise((void*)begin, end - begin, MADV_DONTNEED);
+	#endif
+				}
 
-							// Skip non-empty pages
-							if (!pPage->empty()) {
-								++i;
+	#if GAIA_ECS_CHUNK_ALLOCATOR_HUGE_PAGES
+				//! Allocates \param slots consecutive slots in one of the huge page regions.
+				//! A new region is allocated if there is no room left in the existing ones.
+				void* alloc_huge_page_data(uint32_t slots) {
+					if (slots >= HugePageRegion::NSlots) {
+						// Too big for a region. Allocate whole huge pages just for this page.
+						const auto size = (size_t)slots * HugePageRegion::SlotSize;
+						auto* pData = mem::mem_alloc_alig(size, HugePageRegion::Size);
+		#if GAIA_PLATFORM_LINUX
+						(void)madvise(pData, size, MADV_HUGEPAGE);
+		#endif
+						return pData;
+					}
+
+					const uint32_t mask = (1U << slots) - 1U;
+
+					for (auto& region: m_regions) {
+						// Slots are aligned to their count so data of a page never crosses into another region
+						for (uint32_t i = 0; i + slots <= HugePageRegion::NSlots; i += slots) {
+							if ((region.m_usedSlots & (mask << i)) != 0)
 								continue;
-							}
 
-							GAIA_ASSERT(pPage->m_idx == i);
-							container.pagesFree.back()->m_idx = i;
-							core::erase_fast(container.pagesFree, i);
-							free_page(pPage);
+							region.m_usedSlots |= mask << i;
+							return (uint8_t*)region.m_data + (size_t)i * HugePageRegion::SlotSize;
 						}
-					};
+					}
 
-					for (auto& c: m_pages)
-						flushPages(c);
+					auto* pData = mem::mem_alloc_alig(HugePageRegion::Size, HugePageRegion::Size);
+		#if GAIA_PLATFORM_LINUX
+					// Only a hint. If transparent huge pages are disabled the memory stays backed by regular pages.
+					(void)madvise(pData, HugePageRegion::Size, MADV_HUGEPAGE);
+		#endif
+					m_regions.push_back({pData, mask});
+					return pData;
 				}
 
-				/*!
-				Performs diagnostics of the memory used.
-				*/
-				void diag() const {
-					auto diagPage = [](const ChunkAllocatorPageStats& memstats) {
-						GAIA_LOG_N("ChunkAllocator stats");
-						GAIA_LOG_N("  Allocated: %" PRIu64 " B", memstats.mem_total);
-						GAIA_LOG_N("  Used: %" PRIu64 " B", memstats.mem_total - memstats.mem_used);
-						GAIA_LOG_N("  Overhead: %" PRIu64 " B", memstats.mem_used);
-						GAIA_LOG_N("  Utilization: %.1f%%", 100.0 * ((double)memstats.mem_used / (double)memstats.mem_total));
-						GAIA_LOG_N("  Pages: %u", memstats.num_pages);
-						GAIA_LOG_N("  Free pages: %u", memstats.num_pages_free);
-					};
+				//! Releases \param slots slots starting at \param pData.
+				//! The region is released once none of its slots are used. Until then its memory stays committed.
+				//! Decommitting single slots would make the system split the huge page backing the region.
+				void free_huge_page_data(void* pData, uint32_t slots) {
+					if (slots >= HugePageRegion::NSlots) {
+						decommit(pData, (uint64_t)slots * HugePageRegion::SlotSize);
+						mem::mem_free_alig(pData);
+						return;
+					}
 
-					diagPage(page_stats(0));
-					diagPage(page_stats(1));
-				}
+					const uint32_t mask = (1U << slots) - 1U;
 
-			private:
-				static MemoryPage* alloc_page(uint8_t sizeType) {
-					const uint32_t size = mem_block_size(sizeType) * MemoryPage::NBlocks;
-					auto* pPageData = mem::mem_alloc_alig(size, 16U);
-					return new MemoryPage(pPageData, sizeType);
-				}
+					const auto cnt = (uint32_t)m_regions.size();
+					GAIA_FOR(cnt) {
+						auto& region = m_regions[i];
+						const auto offset = (uintptr_t)pData - (uintptr_t)region.m_data;
+						if ((uintptr_t)pData < (uintptr_t)region.m_data || offset >= HugePageRegion::Size)
+							continue;
 
-				static void free_page(MemoryPage* page) {
-					mem::mem_free_alig(page->m_data);
-					delete page;
+						const auto slot = (uint32_t)(offset / HugePageRegion::SlotSize);
+						GAIA_ASSERT((region.m_usedSlots & (mask << slot)) == (mask << slot));
+						region.m_usedSlots &= ~(mask << slot);
+						if (region.m_usedSlots == 0) {
+							mem::mem_free_alig(region.m_data);
+							core::erase_fast(m_regions, i);
+						}
+						return;
+					}
+
+					GAIA_ASSERT2(false, "Page data doesn't belong to any huge page region");
 				}
+	#endif
 
 				void done() {
 					m_isDone = true;
 				}
 
-				void try_delete_this() {
-					// When there is nothing left, delete the allocator
+				//! Returns true when there is nothing left in the allocator so it can be deleted
+				bool can_delete_this() const {
 					bool allEmpty = true;
 					for (const auto& c: m_pages)
 						allEmpty = allEmpty && c.empty();
-					if (allEmpty)
-						delete this;
+					return allEmpty;
 				}
 
 				ChunkAllocatorPageStats page_stats(uint32_t sizeType) const {
@@ -410,7 +878,7 @@ namespace gaia {
 					stats.mem_total = stats.num_pages * (size_t)mem_block_size(sizeType) * MemoryPage::NBlocks;
 					stats.mem_used = container.pagesFull.size() * (size_t)mem_block_size(sizeType) * MemoryPage::NBlocks;
 					for (auto* page: container.pagesFree)
-						stats.mem_used += page->used_blocks_cnt() * (size_t)MaxMemoryBlockSize;
+						stats.mem_used += page->used_blocks_cnt() * (size_t)mem_block_size(sizeType);
 					return stats;
 				};
 			};
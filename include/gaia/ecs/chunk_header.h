@@ -1,6 +1,7 @@
 #pragma once
 #include "../config/config.h"
 
+#include <atomic>
 #include <cstdint>
 
 #include "../cnt/bitset.h"
@@ -37,9 +38,17 @@ namespace gaia {
 			const ComponentCacheItem* pDesc;
 		};
 
+		struct ChunkRowChanges;
+
 		struct ChunkRecords {
 			//! Pointer to where component versions are stored
 			ComponentVersion* pVersions{};
+			//! Pointer to component versions of the parent archetype.
+			//! They hold the most recent version of each component among all chunks of the archetype.
+			std::atomic<ComponentVersion>* pArchetypeVersions{};
+			//! Pointer to per-row change tracking data of components, indexed by component index.
+			//! Data of a component is allocated on its first write once a changed() filter refers to it.
+			ChunkRowChanges** pRowChanges{};
 			//! Pointer to where (component) entities are stored
 			Entity* pCompEntities{};
 			//! Pointer to the array of component records
@@ -50,17 +59,17 @@ namespace gaia {
 
 		struct ChunkHeader final {
 			//! Maxiumum number of entities per chunk.
-			//! Defined as sizeof(big_chunk) / sizeof(entity)
-			static constexpr uint16_t MAX_CHUNK_ENTITIES = (mem_block_size(1) - 64) / sizeof(Entity);
+			//! Defined as sizeof(16K chunk) / sizeof(entity). Bigger chunks are meant for archetypes with fat components.
+			static constexpr uint16_t MAX_CHUNK_ENTITIES = (16384 - 64) / sizeof(Entity);
+			static constexpr uint16_t CHUNK_SIZE_TYPE_BITS = (uint16_t)core::count_bits(MemoryBlockSizeTypes - 1);
 			static constexpr uint16_t MAX_CHUNK_ENTITIES_BITS = (uint16_t)core::count_bits(MAX_CHUNK_ENTITIES);
 
 			static constexpr uint16_t CHUNK_LIFESPAN_BITS = 4;
 			//! Number of ticks before empty chunks are removed
 			static constexpr uint16_t MAX_CHUNK_LIFESPAN = (1 << CHUNK_LIFESPAN_BITS) - 1;
 
-			static constexpr uint16_t CHUNK_LOCKS_BITS = 3;
 			//! Number of locks the chunk can aquire
-			static constexpr uint16_t MAX_CHUNK_LOCKS = (1 << CHUNK_LOCKS_BITS) - 1;
+			static constexpr uint16_t MAX_CHUNK_LOCKS = 0xFFFF;
 
 			//! Component cache reference
 			const ComponentCache* cc;
@@ -83,14 +92,14 @@ namespace gaia {
 			uint16_t hasAnyCustomGenDtor : 1;
 			//! True if there's any unique component that requires custom destruction
 			uint16_t hasAnyCustomUniDtor : 1;
-			//! Chunk size type. This tells whether it's 8K or 16K
-			uint16_t sizeType : 1;
+			//! Chunk size type. This tells how big the memory block of the chunk is, see mem_block_size
+			uint16_t sizeType: CHUNK_SIZE_TYPE_BITS;
 			//! When it hits 0 the chunk is scheduled for deletion
 			uint16_t lifespanCountdown: CHUNK_LIFESPAN_BITS;
 			//! True if deleted, false otherwise
 			uint16_t dead : 1;
-			//! Updated when chunks are being iterated. Used to inform of structural changes when they shouldn't happen.
-			uint16_t structuralChangesLocked: CHUNK_LOCKS_BITS;
+			//! True if there's any component that tracks changes per row
+			uint16_t hasAnyRowChanges : 1;
 			//! Empty space for future use
 			uint16_t unused : 8;
 
@@ -98,6 +107,12 @@ namespace gaia {
 			uint8_t genEntities;
 			//! Number of components on the archetype
 			uint8_t componentCount;
+			//! Updated when chunks are being iterated. Used to inform of structural changes when they shouldn't happen.
+			//! Atomic because chunks can be iterated by multiple threads at once.
+			std::atomic<uint16_t> structuralChangesLocked;
+			//! Incremented whenever entities change their rows within the chunk.
+			//! 32 bits so it does not wrap around to a value cached by some query in practice.
+			uint32_t rowVersion;
 			//! Version of the world (stable pointer to parent world's world version)
 			uint32_t& worldVersion;
 
@@ -111,9 +126,10 @@ namespace gaia {
 					index(chunkIndex), count(0), countEnabled(0), capacity(cap),
 					//
 					rowFirstEnabledEntity(0), hasAnyCustomGenCtor(0), hasAnyCustomUniCtor(0), hasAnyCustomGenDtor(0),
-					hasAnyCustomUniDtor(0), sizeType(st), lifespanCountdown(0), dead(0), structuralChangesLocked(0), unused(0),
+					hasAnyCustomUniDtor(0), sizeType(st), lifespanCountdown(0), dead(0), hasAnyRowChanges(0),
+					unused(0),
 					//
-					genEntities(genEntitiesCnt), componentCount(0), worldVersion(version) {
+					genEntities(genEntitiesCnt), componentCount(0), structuralChangesLocked(0), rowVersion(0), worldVersion(version) {
 				// Make sure the alignment is right
 				GAIA_ASSERT(uintptr_t(this) % (sizeof(size_t)) == 0);
 			}
@@ -126,5 +142,15 @@ namespace gaia {
 				return countEnabled > 0;
 			}
 		};
+
+		//! Rows of a component written to since a given version
+		struct ChunkRowChanges {
+			//! Rows written to after the version \ref since
+			cnt::bitset<ChunkHeader::MAX_CHUNK_ENTITIES> rows;
+			//! Last write which is not recorded in \ref rows. All later writes are recorded.
+			ComponentVersion since{};
+			//! True if \ref rows have been read since the last write. The next write starts recording anew.
+			bool consumed{};
+		};
 	} // namespace ecs
 } // namespace gaia
@@ -17,9 +17,11 @@ namespace gaia {
 			class ChunkIterImpl {
 			protected:
 				Chunk& m_chunk;
+				//! Changes made after this version are considered new
+				uint32_t m_changeVersion;
 
 			public:
-				ChunkIterImpl(Chunk& chunk): m_chunk(chunk) {}
+				ChunkIterImpl(Chunk& chunk, uint32_t changeVersion = 0): m_chunk(chunk), m_changeVersion(changeVersion) {}
 
 				//! Returns a read-only entity or component view.
 				//! \warning If \tparam T is a component it is expected it is present. Undefined behavior otherwise.
@@ -70,6 +72,19 @@ namespace gaia {
 					return m_chunk.sview_auto<T>(from(), to());
 				}
 
+				//! Calls \param func for each entity accessible via the iterator whose component \tparam T changed
+				//! since the query was run the last time. The index passed to \param func is the same one views use.
+				//! Components which do not track changes per row report all entities of a changed chunk.
+				//! \warning It is expected the component \tparam T is present. Undefined behavior otherwise.
+				//! \tparam T Component or pair
+				template <typename T, typename Func>
+				void each_changed(Func func) {
+					const auto offset = from();
+					m_chunk.each_changed(m_changeVersion, m_chunk.comp_idx<T>(), offset, to(), [&](uint16_t row) {
+						func((uint32_t)(row - offset));
+					});
+				}
+
 				//! Checks if the entity at the current iterator index is enabled.
 				//! \return True it the entity is enabled. False otherwise.
 				GAIA_NODISCARD bool enabled(uint32_t index) const {
@@ -130,7 +145,8 @@ namespace gaia {
 		//! Disabled entities always preceed enabled ones.
 		class IterAll: public detail::ChunkIterImpl<Constraints::AcceptAll> {
 		public:
-			IterAll(Chunk& chunk): detail::ChunkIterImpl<Constraints::AcceptAll>(chunk) {}
+			IterAll(Chunk& chunk, uint32_t changeVersion = 0):
+					detail::ChunkIterImpl<Constraints::AcceptAll>(chunk, changeVersion) {}
 
 			//! Returns the number of enabled entities accessible via the iterator.
 			GAIA_NODISCARD uint16_t size_enabled() const noexcept {
@@ -143,5 +159,66 @@ namespace gaia {
 				return m_chunk.size_disabled();
 			}
 		};
+
+		//! Iterator for iterating a continuous range of rows in a chunk.
+		//! Used when entities are created in bulk to give access to the newly added rows.
+		class IterRange {
+			Chunk& m_chunk;
+			//! Index of the first row
+			uint16_t m_from;
+			//! Index one past the last row
+			uint16_t m_to;
+
+		public:
+			IterRange(Chunk& chunk, uint16_t from, uint16_t cnt): m_chunk(chunk), m_from(from), m_to((uint16_t)(from + cnt)) {}
+
+			//! Returns a read-only entity or component view.
+			//! \warning If \tparam T is a component it is expected it is present. Undefined behavior otherwise.
+			//! \tparam T Component or Entity
+			//! \return Entity of component view with read-only access
+			template <typename T>
+			GAIA_NODISCARD auto view() const {
+				return m_chunk.view<T>(m_from, m_to);
+			}
+
+			//! Returns a mutable entity or component view.
+			//! \warning If \tparam T is a component it is expected it is present. Undefined behavior otherwise.
+			//! \tparam T Component or Entity
+			//! \return Entity or component view with read-write access
+			template <typename T>
+			GAIA_NODISCARD auto view_mut() {
+				return m_chunk.view_mut<T>(m_from, m_to);
+			}
+
+			//! Returns a mutable component view.
+			//! Doesn't update the world version when the access is aquired.
+			//! \warning It is expected the component \tparam T is present. Undefined behavior otherwise.
+			//! \tparam T Component
+			//! \return Component view with read-write access
+			template <typename T>
+			GAIA_NODISCARD auto sview_mut() {
+				return m_chunk.sview_mut<T>(m_from, m_to);
+			}
+
+			//! Checks if entity \param entity is present in the chunk.
+			//! \param entity Entity
+			//! \return True if the component is present. False otherwise.
+			GAIA_NODISCARD bool has(Entity entity) const {
+				return m_chunk.has(entity);
+			}
+
+			//! Checks if component \tparam T is present in the chunk.
+			//! \tparam T Component
+			//! \return True if the component is present. False otherwise.
+			template <typename T>
+			GAIA_NODISCARD bool has() const {
+				return m_chunk.has<T>();
+			}
+
+			//! Returns the number of entities accessible via the iterator
+			GAIA_NODISCARD uint16_t size() const noexcept {
+				return (uint16_t)(m_to - m_from);
+			}
+		};
 	} // namespace ecs
 } // namespace gaia
\ No newline at end of file
@@ -5,7 +5,9 @@
 #include <type_traits>
 
 #include "../cnt/map.h"
+#include "../cnt/sarray.h"
 #include "../cnt/sarray_ext.h"
+#include "../mt/threadpool.h"
 #include "../ser/serialization.h"
 #include "archetype.h"
 #include "common.h"
@@ -30,10 +32,39 @@ namespace gaia {
 		*/
 		class CommandBuffer final {
 			struct CommandBufferCtx: SerializationBuffer {
+				//! Entity with structural changes gathered but not applied yet
+				struct PendingEntity {
+					//! Entity to change
+					Entity entity;
+					//! Archetype the entity was in when the changes started to be gathered
+					Archetype* pArchetypeOrig;
+					//! Archetype the entity is going to be moved to
+					Archetype* pArchetype;
+					//! Number of component data loads waiting for the entity to be moved
+					uint32_t dataCnt;
+				};
+
+				//! Component data waiting to be loaded once its entity is moved
+				struct PendingData {
+					//! Index of the entity in the list of pending entities. BadIndex if already loaded.
+					uint32_t pendingIdx;
+					//! Component the data belongs to
+					Entity object;
+					//! Position of the data in the buffer
+					uint32_t dataPos;
+				};
+
 				ecs::World& world;
 				uint32_t entities;
 				cnt::map<uint32_t, Entity> entityMap;
 
+				//! Map of entities to their index in the list of pending entities
+				cnt::map<EntityLookupKey, uint32_t> pendingMap;
+				//! List of entities with pending changes, in the order they were first changed
+				cnt::darray<PendingEntity> pending;
+				//! List of component data loads, in the order they were requested
+				cnt::darray<PendingData> pendingData;
+
 				CommandBufferCtx(ecs::World& w): SerializationBuffer(&w.comp_cache()), world(w), entities(0) {}
 
 				using SerializationBuffer::reset;
@@ -41,6 +72,128 @@ namespace gaia {
 					SerializationBuffer::reset();
 					entities = 0;
 					entityMap.clear();
+					pendingMap.clear();
+					pending.clear();
+					pendingData.clear();
+				}
+
+				//! Returns the entity created for \param tempEntity
+				GAIA_NODISCARD Entity temp(TempEntity tempEntity) const {
+					// For delayed entities we have to do a look in our map
+					// of temporaries and find a link there
+					const auto it = entityMap.find(tempEntity.id);
+					// Link has to exist!
+					GAIA_ASSERT(it != entityMap.end());
+					return it->second;
+				}
+
+				//! Returns the index of \param entity in the list of pending entities. Adds it if necessary.
+				GAIA_NODISCARD uint32_t pending_idx(Entity entity) {
+					const auto res = pendingMap.try_emplace(EntityLookupKey(entity), (uint32_t)pending.size());
+					if (res.second) {
+						auto* pArchetype = world.fetch(entity).pArchetype;
+						pending.push_back({entity, pArchetype, pArchetype, 0});
+					}
+					return res.first->second;
+				}
+
+				//! Gathers adding \param object to \param entity. The entity is not moved until flush().
+				void add(Entity entity, Entity object) {
+					const auto idx = pending_idx(entity);
+					// Adding back something removed earlier needs to construct it anew.
+					// Apply the changes gathered so far first.
+					if (pending[idx].pArchetypeOrig->has(object) && !pending[idx].pArchetype->has(object))
+						flush(idx);
+
+					World::EntityBuilder eb(world, entity, pending[idx].pArchetype);
+					eb.add(object);
+					pending[idx].pArchetype = eb.release();
+				}
+
+				//! Gathers removing \param object from \param entity. The entity is not moved until flush().
+				void del(Entity entity, Entity object) {
+					const auto idx = pending_idx(entity);
+					// Removing something added earlier or something with data waiting to be loaded
+					// needs to happen in order. Apply the changes gathered so far first.
+					if (pending[idx].dataCnt != 0 ||
+							(!pending[idx].pArchetypeOrig->has(object) && pending[idx].pArchetype->has(object)))
+						flush(idx);
+
+					World::EntityBuilder eb(world, entity, pending[idx].pArchetype);
+					eb.del(object);
+					pending[idx].pArchetype = eb.release();
+				}
+
+				//! Loads data of \param object for \param entity. If the entity has changes pending,
+				//! the data is loaded once the entity is moved to its final archetype.
+				void set(Entity entity, Entity object) {
+					const auto it = pendingMap.find(EntityLookupKey(entity));
+					if (it == pendingMap.end()) {
+						load_data(entity, object);
+						return;
+					}
+
+					const auto idx = it->second;
+					++pending[idx].dataCnt;
+					pendingData.push_back({idx, object, tell()});
+					skip_comp(object);
+				}
+
+				//! Moves all pending entities to their final archetypes and loads their data.
+				void flush() {
+					if (pending.empty())
+						return;
+
+					for (const auto& p: pending)
+						world.move_entity(p.entity, *p.pArchetype);
+
+					const auto pos = tell();
+					for (const auto& d: pendingData) {
+						if (d.pendingIdx == BadIndex)
+							continue;
+						seek(d.dataPos);
+						load_data(pending[d.pendingIdx].entity, d.object);
+					}
+					seek(pos);
+
+					pendingMap.clear();
+					pending.clear();
+					pendingData.clear();
+				}
+
+			private:
+				//! Moves the pending entity at index \param idx to its final archetype and loads its data.
+				//! The entity stays on the list of pending entities.
+				void flush(uint32_t idx) {
+					auto& p = pending[idx];
+					world.move_entity(p.entity, *p.pArchetype);
+					p.pArchetypeOrig = p.pArchetype;
+
+					if (p.dataCnt == 0)
+						return;
+
+					const auto pos = tell();
+					for (auto& d: pendingData) {
+						if (d.pendingIdx != idx)
+							continue;
+						seek(d.dataPos);
+						load_data(p.entity, d.object);
+						d.pendingIdx = BadIndex;
+					}
+					seek(pos);
+					p.dataCnt = 0;
+				}
+
+				//! Loads data of \param object at the current position in the buffer to \param entity
+				void load_data(Entity entity, Entity object) {
+					const auto& ec = world.fetch(entity);
+					auto* pChunk = ec.pChunk;
+					const auto indexInChunk = object.kind() == EntityKind::EK_Uni ? 0U : ec.row;
+
+					// Component data
+					const auto compIdx = pChunk->comp_idx(object);
+					auto* pComponentData = (void*)pChunk->comp_ptr_mut(compIdx, indexInChunk);
+					load_comp(pComponentData, object);
 				}
 			};
 
@@ -77,6 +230,9 @@ namespace gaia {
 				Entity entity;
 
 				void commit(CommandBufferCtx& ctx) const {
+					// The copy needs to see all changes requested before it
+					ctx.flush();
+
 					[[maybe_unused]] const auto res = ctx.entityMap.try_emplace(ctx.entities++, ctx.world.copy(entity));
 					GAIA_ASSERT(res.second);
 				}
@@ -85,6 +241,10 @@ namespace gaia {
 				Entity entity;
 
 				void commit(CommandBufferCtx& ctx) const {
+					// Deleting an entity can affect other entities via cleanup rules.
+					// Apply all changes requested before it first.
+					ctx.flush();
+
 					ctx.world.del(entity);
 				}
 			};
@@ -93,13 +253,7 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					World::EntityBuilder(ctx.world, entity).add(object);
-
-#if GAIA_ASSERT_ENABLED
-					[[maybe_unused]] uint32_t indexInChunk{};
-					[[maybe_unused]] auto* pChunk = ctx.world.get_chunk(entity, indexInChunk);
-					GAIA_ASSERT(pChunk != nullptr);
-#endif
+					ctx.add(entity, object);
 				}
 			};
 			struct AddComponentWithDataCmd: CommandBufferCmd {
@@ -107,19 +261,8 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					World::EntityBuilder(ctx.world, entity).add(object);
-
-					uint32_t indexInChunk{};
-					auto* pChunk = ctx.world.get_chunk(entity, indexInChunk);
-					GAIA_ASSERT(pChunk != nullptr);
-
-					if (object.kind() == EntityKind::EK_Uni)
-						indexInChunk = 0;
-
-					// Component data
-					const auto compIdx = pChunk->comp_idx(object);
-					auto* pComponentData = (void*)pChunk->comp_ptr_mut(compIdx, indexInChunk);
-					ctx.load_comp(pComponentData, object);
+					ctx.add(entity, object);
+					ctx.set(entity, object);
 				}
 			};
 			struct AddComponentToTempEntityCmd: CommandBufferCmd {
@@ -127,20 +270,7 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					// For delayed entities we have to do a look in our map
-					// of temporaries and find a link there
-					const auto it = ctx.entityMap.find(tempEntity.id);
-					// Link has to exist!
-					GAIA_ASSERT(it != ctx.entityMap.end());
-
-					Entity entity = it->second;
-					World::EntityBuilder(ctx.world, entity).add(object);
-
-#if GAIA_ASSERT_ENABLED
-					[[maybe_unused]] uint32_t indexInChunk{};
-					[[maybe_unused]] auto* pChunk = ctx.world.get_chunk(entity, indexInChunk);
-					GAIA_ASSERT(pChunk != nullptr);
-#endif
+					ctx.add(ctx.temp(tempEntity), object);
 				}
 			};
 			struct AddComponentWithDataToTempEntityCmd: CommandBufferCmd {
@@ -148,26 +278,9 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					// For delayed entities we have to do a look in our map
-					// of temporaries and find a link there
-					const auto it = ctx.entityMap.find(tempEntity.id);
-					// Link has to exist!
-					GAIA_ASSERT(it != ctx.entityMap.end());
-
-					Entity entity = it->second;
-					World::EntityBuilder(ctx.world, entity).add(object);
-
-					uint32_t indexInChunk{};
-					auto* pChunk = ctx.world.get_chunk(entity, indexInChunk);
-					GAIA_ASSERT(pChunk != nullptr);
-
-					if (object.kind() == EntityKind::EK_Uni)
-						indexInChunk = 0;
-
-					// Component data
-					const auto compIdx = pChunk->comp_idx(object);
-					auto* pComponentData = (void*)pChunk->comp_ptr_mut(compIdx, indexInChunk);
-					ctx.load_comp(pComponentData, object);
+					const auto entity = ctx.temp(tempEntity);
+					ctx.add(entity, object);
+					ctx.set(entity, object);
 				}
 			};
 			struct SetComponentCmd: CommandBufferCmd {
@@ -175,14 +288,7 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					const auto& ec = ctx.world.m_recs.entities[entity.id()];
-					auto* pChunk = ec.pChunk;
-					const auto indexInChunk = object.kind() == EntityKind::EK_Uni ? 0U : ec.row;
-
-					// Component data
-					const auto compIdx = pChunk->comp_idx(object);
-					auto* pComponentData = (void*)pChunk->comp_ptr_mut(compIdx, indexInChunk);
-					ctx.load_comp(pComponentData, object);
+					ctx.set(entity, object);
 				}
 			};
 			struct SetComponentOnTempEntityCmd: CommandBufferCmd {
@@ -190,22 +296,7 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					// For delayed entities we have to do a look in our map
-					// of temporaries and find a link there
-					const auto it = ctx.entityMap.find(tempEntity.id);
-					// Link has to exist!
-					GAIA_ASSERT(it != ctx.entityMap.end());
-
-					Entity entity = it->second;
-
-					const auto& ec = ctx.world.m_recs.entities[entity.id()];
-					auto* pChunk = ec.pChunk;
-					const auto indexInChunk = object.kind() == EntityKind::EK_Uni ? 0U : ec.row;
-
-					// Component data
-					const auto compIdx = pChunk->comp_idx(object);
-					auto* pComponentData = (void*)pChunk->comp_ptr_mut(compIdx, indexInChunk);
-					ctx.load_comp(pComponentData, object);
+					ctx.set(ctx.temp(tempEntity), object);
 				}
 			};
 			struct RemoveComponentCmd: CommandBufferCmd {
@@ -213,7 +304,7 @@ namespace gaia {
 				Entity object;
 
 				void commit(CommandBufferCtx& ctx) const {
-					World::EntityBuilder(ctx.world, entity).del(object);
+					ctx.del(entity, object);
 				}
 			};
 
@@ -237,6 +328,20 @@ namespace gaia {
 				return {m_entities++};
 			}
 
+			//! Returns the component cache item of \tparam T. Registers the component if necessary.
+			//! \warning Components can only be registered on the main thread. When recording from worker
+			//!          threads, make sure all components used are registered up front.
+			template <typename T>
+			GAIA_NODISCARD const ComponentCacheItem& reg_comp() {
+				using FT = typename component_type_t<T>::TypeFull;
+				const auto* pItem = m_ctx.world.comp_cache().template find<FT>();
+				if (pItem != nullptr)
+					return *pItem;
+
+				GAIA_ASSERT2(mt::ThreadPool::get().main_thread(), "Components can't be registered from worker threads");
+				return comp_cache_add<T>(m_ctx.world);
+			}
+
 		public:
 			CommandBuffer(World& world): m_ctx(world), m_entities(0) {}
 			~CommandBuffer() = default;
@@ -291,7 +396,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(ADD_COMPONENT);
 
@@ -309,7 +414,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(ADD_COMPONENT_TO_TEMPENTITY);
 
@@ -327,7 +432,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(ADD_COMPONENT_DATA);
 
@@ -346,7 +451,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(ADD_COMPONENT_TO_TEMPENTITY_DATA);
 
@@ -365,7 +470,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(SET_COMPONENT);
 
@@ -385,7 +490,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(SET_COMPONENT_FOR_TEMPENTITY);
 
@@ -404,7 +509,7 @@ namespace gaia {
 				verify_comp<T>();
 
 				// Make sure the component is registered
-				const auto& desc = comp_cache_add<T>(m_ctx.world);
+				const auto& desc = reg_comp<T>();
 
 				m_ctx.save(REMOVE_COMPONENT);
 
@@ -486,6 +591,8 @@ namespace gaia {
 		public:
 			/*!
 			Commits all queued changes.
+			Structural changes are gathered per entity so each entity is moved to its final archetype only once.
+			Requests to copy or delete an entity apply all changes gathered before them first.
 			*/
 			void commit() {
 				if (m_ctx.empty())
@@ -498,10 +605,68 @@ namespace gaia {
 					m_ctx.load(id);
 					CommandBufferRead[id](m_ctx);
 				}
+				m_ctx.flush();
 
 				m_entities = 0;
 				m_ctx.reset();
 			} // namespace ecs
 		};
+
+		/*!
+		Set of command buffers, one for each thread of the thread pool.
+
+		Each thread records into its own CommandBuffer so no locking is necessary when recording from jobs.
+		Buffers are committed in the order of thread indices which makes the result independent of the order
+		in which threads recorded their commands.
+		\warning TempEntity returned by a buffer is only valid within the buffer that created it.
+		\warning Components used by commands recorded on worker threads need to be registered up front.
+		*/
+		class ThreadCommandBuffer final {
+			World& m_world;
+			//! Command buffers indexed by the thread index. Created on first use by the thread owning them.
+			cnt::sarray<CommandBuffer*, mt::ThreadPool::MaxThreads> m_buffers;
+
+		public:
+			ThreadCommandBuffer(World& world): m_world(world) {
+				for (auto*& pBuffer: m_buffers)
+					pBuffer = nullptr;
+			}
+			~ThreadCommandBuffer() {
+				for (auto* pBuffer: m_buffers)
+					delete pBuffer;
+			}
+
+			ThreadCommandBuffer(ThreadCommandBuffer&&) = delete;
+			ThreadCommandBuffer(const ThreadCommandBuffer&) = delete;
+			ThreadCommandBuffer& operator=(ThreadCommandBuffer&&) = delete;
+			ThreadCommandBuffer& operator=(const ThreadCommandBuffer&) = delete;
+
+			//! Returns the command buffer of the calling thread
+			//! \warning Must be called from the main thread or from a worker thread of the thread pool.
+			//!          Threads outside the pool would share the buffer of the main thread.
+			GAIA_NODISCARD CommandBuffer& get() {
+				GAIA_ASSERT(
+						(mt::ThreadPool::worker_thread() || mt::ThreadPool::get().main_thread()) &&
+						"ThreadCommandBuffer can only be used from the main thread and worker threads of the thread pool");
+
+				auto*& pBuffer = m_buffers[mt::ThreadPool::thread_idx()];
+				if GAIA_UNLIKELY (pBuffer == nullptr)
+					pBuffer = new CommandBuffer(m_world);
+				return *pBuffer;
+			}
+
+			/*!
+			Commits all queued changes. Buffers are committed one after another in the order of thread indices.
+			\warning Needs to be called from the main thread once no job records into the buffers anymore.
+			*/
+			void commit() {
+				GAIA_ASSERT(mt::ThreadPool::get().main_thread());
+
+				for (auto* pBuffer: m_buffers) {
+					if (pBuffer != nullptr)
+						pBuffer->commit();
+				}
+			}
+		};
 	} // namespace ecs
 } // namespace gaia
@@ -22,5 +22,51 @@ namespace gaia {
 			if GAIA_UNLIKELY (version == 0U)
 				++version;
 		}
+
+		namespace detail {
+			//! World version assigned to the system running on the calling thread
+			struct SystemVersion {
+				//! Version of the world the system belongs to. nullptr if no system runs on the thread.
+				const uint32_t* pWorldVersion;
+				//! Version all changes of the system are stamped with
+				uint32_t version;
+			};
+
+			inline thread_local SystemVersion t_systemVersion{};
+
+			//! Makes the calling thread use \param version instead of \param worldVersion while in scope
+			class SystemVersionScope {
+				SystemVersion m_prev;
+
+			public:
+				SystemVersionScope(const uint32_t& worldVersion, uint32_t version): m_prev(t_systemVersion) {
+					t_systemVersion = {&worldVersion, version};
+				}
+				~SystemVersionScope() {
+					t_systemVersion = m_prev;
+				}
+
+				SystemVersionScope(const SystemVersionScope&) = delete;
+				SystemVersionScope(SystemVersionScope&&) = delete;
+				SystemVersionScope& operator=(const SystemVersionScope&) = delete;
+				SystemVersionScope& operator=(SystemVersionScope&&) = delete;
+			};
+		} // namespace detail
+
+		//! Returns the version changes to the world with the version \param worldVersion are stamped with.
+		//! Systems running in parallel use the version they were given when dispatched.
+		GAIA_NODISCARD inline uint32_t curr_world_version(const uint32_t& worldVersion) {
+			const auto& sv = detail::t_systemVersion;
+			return sv.pWorldVersion == &worldVersion ? sv.version : worldVersion;
+		}
+
+		//! Moves the world version \param worldVersion forward.
+		//! Systems running in parallel keep using the version they were given when dispatched
+		//! so the world version is never modified from multiple threads.
+		inline void bump_world_version(uint32_t& worldVersion) {
+			if (detail::t_systemVersion.pWorldVersion == &worldVersion)
+				return;
+			update_version(worldVersion);
+		}
 	} // namespace ecs
 } // namespace gaia
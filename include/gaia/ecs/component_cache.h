@@ -224,6 +224,18 @@ namespace gaia {
 				return get(compDescId);
 			}
 
+			//! Returns the number of registered components
+			GAIA_NODISCARD uint32_t size() const noexcept {
+				return (uint32_t)m_compByEntity.size();
+			}
+
+			//! Calls \param func for each registered component item
+			template <typename Func>
+			void each(Func func) const {
+				for (auto [entity, pDesc]: m_compByEntity)
+					func(*pDesc);
+			}
+
 			void diag() const {
 				const auto registeredTypes = m_descIdArr.size();
 				GAIA_LOG_N("Registered components: %u", registeredTypes);
@@ -1,6 +1,7 @@
 #pragma once
 #include "../config/config.h"
 
+#include <atomic>
 #include <cstdint>
 #include <type_traits>
 
@@ -24,6 +25,8 @@ namespace gaia {
 			using FuncMove = void(void*, void*);
 			using FuncSwap = void(void*, void*);
 			using FuncCmp = bool(const void*, const void*);
+			using FuncSave = void(SerializationBuffer&, const void*, uint32_t);
+			using FuncLoad = void(SerializationBuffer&, void*, uint32_t);
 
 			//! Component entity
 			Entity entity;
@@ -52,6 +55,17 @@ namespace gaia {
 			FuncSwap* func_swap{};
 			//! Function to call when comparing two components of the same type
 			FuncCmp* func_cmp{};
+			//! Function to call when a non-trivial component needs to be written to a snapshot
+			FuncSave* func_save{};
+			//! Function to call when a non-trivial component needs to be read from a snapshot
+			FuncLoad* func_load{};
+			//! If true, the component can be copied around as raw memory
+			bool trivial{};
+			//! If true, chunks track which rows of the component were written to
+			bool trackRowChanges{};
+			//! If true, a changed() filter of some query refers to the component.
+			//! Chunks only allocate row change tracking data once this is set.
+			mutable std::atomic_bool rowChangesFiltered{};
 
 		private:
 			ComponentCacheItem() = default;
@@ -184,6 +198,10 @@ namespace gaia {
 				cci->func_move = detail::ComponentDesc<T>::func_move();
 				cci->func_swap = detail::ComponentDesc<T>::func_swap();
 				cci->func_cmp = detail::ComponentDesc<T>::func_cmp();
+				cci->func_save = detail::ComponentDesc<T>::func_save();
+				cci->func_load = detail::ComponentDesc<T>::func_load();
+				cci->trivial = detail::ComponentDesc<T>::trivial();
+				cci->trackRowChanges = detail::ComponentDesc<T>::track_row_changes();
 				return cci;
 			}
 
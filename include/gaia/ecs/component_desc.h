@@ -12,13 +12,22 @@
 #include "../mem/mem_utils.h"
 #include "../meta/reflection.h"
 #include "../meta/type_info.h"
+#include "../ser/serialization.h"
 #include "component.h"
 
 namespace gaia {
 	namespace ecs {
+		class SerializationBuffer;
+
 		namespace detail {
 			using ComponentDescId = uint32_t;
 
+			template <typename, typename = void>
+			struct has_track_row_changes: std::false_type {};
+			template <typename T>
+			struct has_track_row_changes<T, std::void_t<decltype(T::TrackRowChanges)>>:
+					std::bool_constant<T::TrackRowChanges> {};
+
 			template <typename T>
 			struct ComponentDesc final {
 				using CT = component_type_t<T>;
@@ -31,6 +40,8 @@ namespace gaia {
 				using FuncMove = void(void*, void*);
 				using FuncSwap = void(void*, void*);
 				using FuncCmp = bool(const void*, const void*);
+				using FuncSave = void(SerializationBuffer&, const void*, uint32_t);
+				using FuncLoad = void(SerializationBuffer&, void*, uint32_t);
 
 				static ComponentDescId id() {
 					return meta::type_info::id<DescU>();
@@ -77,6 +88,17 @@ namespace gaia {
 					}
 				}
 
+				//! Returns true if writes to the component are tracked per row.
+				//! Components opt in by defining "static constexpr bool TrackRowChanges = true".
+				static constexpr bool track_row_changes() {
+					return has_track_row_changes<U>::value;
+				}
+
+				//! Returns true if the component can be copied around as raw memory.
+				static constexpr bool trivial() {
+					return std::is_trivially_copyable_v<U>;
+				}
+
 				static constexpr auto func_ctor() {
 					if constexpr (!mem::is_soa_layout_v<U> && !std::is_trivially_constructible_v<U>) {
 						return [](void* ptr, uint32_t cnt) {
@@ -223,6 +245,32 @@ namespace gaia {
 						}
 					}
 				}
+
+				static constexpr auto func_save() {
+					if constexpr (mem::is_soa_layout_v<U> || std::is_trivially_copyable_v<U>) {
+						return nullptr;
+					} else if constexpr (ser::detail::has_save<U, SerializationBuffer&>::value) {
+						return [](SerializationBuffer& s, const void* pSrc, uint32_t cnt) {
+							const auto* p = (const U*)pSrc;
+							GAIA_FOR(cnt) ser::save(s, p[i]);
+						};
+					} else {
+						return nullptr;
+					}
+				}
+
+				static constexpr auto func_load() {
+					if constexpr (mem::is_soa_layout_v<U> || std::is_trivially_copyable_v<U>) {
+						return nullptr;
+					} else if constexpr (ser::detail::has_load<U, SerializationBuffer&>::value) {
+						return [](SerializationBuffer& s, void* pDst, uint32_t cnt) {
+							auto* p = (U*)pDst;
+							GAIA_FOR(cnt) ser::load(s, p[i]);
+						};
+					} else {
+						return nullptr;
+					}
+				}
 			};
 		} // namespace detail
 	} // namespace ecs
@@ -19,6 +19,10 @@ namespace gaia {
 			DataContainer m_data;
 			//! Current position in the buffer
 			uint32_t m_dataPos = 0;
+			//! External read-only memory the buffer reads from instead of m_data (e.g. a memory-mapped file)
+			const uint8_t* m_pExtData = nullptr;
+			//! Size of the external memory in bytes
+			uint32_t m_extSize = 0;
 
 		public:
 			SerializationBuffer() = default;
@@ -33,20 +37,50 @@ namespace gaia {
 			void reset() {
 				m_dataPos = 0;
 				m_data.clear();
+				m_pExtData = nullptr;
+				m_extSize = 0;
+			}
+
+			//! Makes the buffer read \param size bytes starting at \param pData instead of its own storage.
+			//! Nothing is copied so the memory (e.g. a memory-mapped snapshot file) needs to outlive the buffer
+			//! or the next reset/attach. An attached buffer can only be loaded from.
+			void attach(const void* pData, uint32_t size) {
+				GAIA_ASSERT(pData != nullptr || size == 0);
+
+				m_data.clear();
+				m_pExtData = (const uint8_t*)pData;
+				m_extSize = size;
+				m_dataPos = 0;
+			}
+
+			//! Returns true if the buffer reads from external memory
+			GAIA_NODISCARD bool attached() const {
+				return m_pExtData != nullptr;
+			}
+
+			//! Returns the pointer to the first byte of the buffer
+			GAIA_NODISCARD const uint8_t* data() const {
+				if (m_pExtData != nullptr)
+					return m_pExtData;
+				return m_data.empty() ? nullptr : &std::as_const(m_data)[0];
 			}
 
 			//! Returns the number of bytes written in the buffer
 			GAIA_NODISCARD uint32_t bytes() const {
+				if (m_pExtData != nullptr)
+					return m_extSize;
 				return (uint32_t)m_data.size();
 			}
 
 			//! Returns true if there is no data written in the buffer
 			GAIA_NODISCARD bool empty() const {
-				return m_data.empty();
+				return bytes() == 0;
 			}
 
 			//! Makes sure there is enough capacity in our data container to hold another \param size bytes of data
 			void reserve(uint32_t size) {
+				GAIA_ASSERT(!attached() && "Attached buffers are read-only");
+
 				const auto nextSize = m_dataPos + size;
 				if (nextSize <= bytes())
 					return;
@@ -81,6 +115,9 @@ namespace gaia {
 
 			//! Writes \param size bytes of data starting at the address \param pSrc to the buffer
 			void save(const void* pSrc, uint32_t size) {
+				if (size == 0)
+					return;
+
 				reserve(size);
 
 				// Copy "size" bytes of raw data starting at pSrc
@@ -118,24 +155,28 @@ namespace gaia {
 			void load(T& value) {
 				GAIA_ASSERT(m_dataPos + sizeof(T) <= bytes());
 
-				const auto& cdata = std::as_const(m_data);
-				value = mem::unaligned_ref<T>((void*)&cdata[m_dataPos]);
+				value = mem::unaligned_ref<T>((void*)(data() + m_dataPos));
 
 				m_dataPos += sizeof(T);
 			}
 
 			//! Loads \param size bytes of data from the buffer and writes them to the address \param pDst
 			void load(void* pDst, uint32_t size) {
+				if (size == 0)
+					return;
+
 				GAIA_ASSERT(m_dataPos + size <= bytes());
 
-				const auto& cdata = std::as_const(m_data);
-				memmove(pDst, (const void*)&cdata[m_dataPos], size);
+				memmove(pDst, (const void*)(data() + m_dataPos), size);
 
 				m_dataPos += size;
 			}
 
 			//! Loads \param value from the buffer
 			void load_comp(void* pDst, Entity entity) {
+				// Component data is moved out of the buffer so it can't be read-only
+				GAIA_ASSERT(!attached());
+
 				bool isManualDestroyNeeded = false;
 				load(isManualDestroyNeeded);
 
@@ -149,6 +190,16 @@ namespace gaia {
 
 				m_dataPos += desc.comp.size();
 			}
+
+			//! Moves past the component data of \param entity written by save_comp without loading it
+			void skip_comp(Entity entity) {
+				bool isManualDestroyNeeded = false;
+				load(isManualDestroyNeeded);
+
+				const auto& desc = m_cc->get(entity);
+				GAIA_ASSERT(m_dataPos + desc.comp.size() <= bytes());
+				m_dataPos += desc.comp.size();
+			}
 		};
 	} // namespace ecs
 } // namespace gaia
\ No newline at end of file
@@ -60,6 +60,9 @@ namespace gaia {
 			uint16_t row;
 			//! Flags
 			uint16_t flags = 0;
+			//! World version at which the entity last changed its chunk, enabled state or name,
+			//! or at which it was deleted. Used by delta snapshots.
+			uint32_t ver;
 
 			//! Archetype
 			Archetype* pArchetype;
@@ -2,6 +2,7 @@
 #include "../config/config.h"
 
 #include <cstdarg>
+#include <cstring>
 #include <type_traits>
 
 #include "../cnt/darray.h"
@@ -10,6 +11,7 @@
 #include "../config/profiler.h"
 #include "../core/hashing_policy.h"
 #include "../core/utility.h"
+#include "../mt/threadpool.h"
 #include "../ser/serialization.h"
 #include "archetype.h"
 #include "archetype_common.h"
@@ -59,7 +61,7 @@ namespace gaia {
 
 			private:
 				//! Command buffer command type
-				enum CommandBufferCmdType : uint8_t { ADD_ITEM, ADD_FILTER };
+				enum CommandBufferCmdType : uint8_t { ADD_ITEM, ADD_FILTER, ORDER_BY, GROUP_BY };
 
 				struct Command_AddItem {
 					static constexpr CommandBufferCmdType Id = CommandBufferCmdType::ADD_ITEM;
@@ -159,6 +161,13 @@ namespace gaia {
 						// NoneList makes no sense because we skip those in query processing anyway.
 						if (pair[compIdx].op != QueryOp::Not) {
 							withChanged.push_back(comp);
+
+							// Let chunks know they need to start tracking rows of the component
+							if (!comp.pair()) {
+								const auto* pItem = ctx.cc->find(comp);
+								if (pItem != nullptr && pItem->trackRowChanges)
+									pItem->rowChangesFiltered.store(true, std::memory_order_relaxed);
+							}
 							return;
 						}
 
@@ -170,6 +179,37 @@ namespace gaia {
 					}
 				};
 
+				struct Command_OrderBy {
+					static constexpr CommandBufferCmdType Id = CommandBufferCmdType::ORDER_BY;
+
+					Entity comp;
+					QueryOrderByFunc func;
+
+					void exec(QueryCtx& ctx) const {
+						auto& data = ctx.data;
+
+						GAIA_ASSERT(!comp.pair() && comp.kind() == EntityKind::EK_Gen);
+						GAIA_ASSERT(func != nullptr);
+
+						data.orderBy = comp;
+						data.orderByFunc = func;
+					}
+				};
+
+				struct Command_GroupBy {
+					static constexpr CommandBufferCmdType Id = CommandBufferCmdType::GROUP_BY;
+
+					Entity rel;
+
+					void exec(QueryCtx& ctx) const {
+						auto& data = ctx.data;
+
+						GAIA_ASSERT(!rel.pair());
+
+						data.groupBy = rel;
+					}
+				};
+
 				static constexpr CmdBufferCmdFunc CommandBufferRead[] = {
 						// Add component
 						[](SerializationBuffer& buffer, QueryCtx& ctx) {
@@ -182,6 +222,18 @@ namespace gaia {
 							Command_Filter cmd;
 							ser::load(buffer, cmd);
 							cmd.exec(ctx);
+						},
+						// Order by
+						[](SerializationBuffer& buffer, QueryCtx& ctx) {
+							Command_OrderBy cmd;
+							ser::load(buffer, cmd);
+							cmd.exec(ctx);
+						},
+						// Group by
+						[](SerializationBuffer& buffer, QueryCtx& ctx) {
+							Command_GroupBy cmd;
+							ser::load(buffer, cmd);
+							cmd.exec(ctx);
 						}};
 
 				World* m_world{};
@@ -199,6 +251,12 @@ namespace gaia {
 				const EntityToArchetypeMap* m_entityToArchetypeMap{};
 				//! All world archetypes
 				const ArchetypeList* m_allArchetypes{};
+				//! If true, chunks are iterated via QueryInfo::chunk_cache
+				bool m_cacheChunks = false;
+				//! Group of archetypes to iterate. GroupIdBad to iterate all of them.
+				GroupId m_groupIdSet = GroupIdBad;
+				//! Chunks gathered by each_par before they are handed over to jobs
+				cnt::darray<Chunk*> m_parChunks;
 
 				//--------------------------------------------------------------------------------
 			public:
@@ -215,17 +273,24 @@ namespace gaia {
 						// Because caching is used, we expect this to be the common case.
 						if GAIA_LIKELY (m_storage.m_queryId != QueryIdBad) {
 							auto& queryInfo = m_storage.m_queryCache->get(m_storage.m_queryId);
-							queryInfo.match(*m_entityToArchetypeMap, *m_allArchetypes, last_archetype_id());
+							// Cached queries are shared. They can only be matched on the main thread.
+							// Systems running in parallel need to register their queries via BaseSystem::access
+							// so they are matched before the systems are dispatched.
+							GAIA_ASSERT(
+									(!mt::ThreadPool::worker_thread() || queryInfo.matched(*m_nextArchetypeId)) &&
+									"Cached queries can't be matched on worker threads");
+							queryInfo.match(*m_entityToArchetypeMap, *m_allArchetypes, *m_nextArchetypeId);
 							return queryInfo;
 						}
 
 						// No queryId is set which means QueryInfo needs to be created
+						GAIA_ASSERT(!mt::ThreadPool::worker_thread() && "Cached queries can't be created on worker threads");
 						QueryCtx ctx;
 						ctx.init(m_world);
 						commit(ctx);
 						auto& queryInfo = m_storage.m_queryCache->add(GAIA_MOV(ctx));
 						m_storage.m_queryId = queryInfo.id();
-						queryInfo.match(*m_entityToArchetypeMap, *m_allArchetypes, last_archetype_id());
+						queryInfo.match(*m_entityToArchetypeMap, *m_allArchetypes, *m_nextArchetypeId);
 						return queryInfo;
 					} else {
 						if GAIA_UNLIKELY (m_storage.m_queryInfo.id() == QueryIdBad) {
@@ -234,17 +299,13 @@ namespace gaia {
 							commit(ctx);
 							m_storage.m_queryInfo = QueryInfo::create(QueryId{}, GAIA_MOV(ctx));
 						}
-						m_storage.m_queryInfo.match(*m_entityToArchetypeMap, *m_allArchetypes, last_archetype_id());
+						m_storage.m_queryInfo.match(*m_entityToArchetypeMap, *m_allArchetypes, *m_nextArchetypeId);
 						return m_storage.m_queryInfo;
 					}
 				}
 
 				//--------------------------------------------------------------------------------
 			private:
-				ArchetypeId last_archetype_id() const {
-					return *m_nextArchetypeId - 1;
-				}
-
 				void add_inter(QueryItem item) {
 					// Adding new query items invalidates the query
 					invalidate();
@@ -352,17 +413,36 @@ namespace gaia {
 
 				//--------------------------------------------------------------------------------
 
-				GAIA_NODISCARD static bool match_filters(const Chunk& chunk, const QueryInfo& queryInfo) {
+				//! Returns true if any filtered component changed in any chunk of \param archetype.
+				//! \param filterIdx Indices of filtered components in the archetype
+				GAIA_NODISCARD static bool match_filters(
+						const Archetype& archetype, const QueryInfo& queryInfo,
+						const QueryInfo::FilterCompIdxArray& filterIdx) {
+					const auto queryVersion = queryInfo.world_version();
+
+					for (auto compIdx: filterIdx) {
+						if (compIdx == QueryInfo::FilterCompIdxBad)
+							continue;
+						if (archetype.changed(queryVersion, compIdx))
+							return true;
+					}
+
+					// Skip unchanged archetypes.
+					return false;
+				}
+
+				//! Returns true if any filtered component changed in \param chunk.
+				//! \param filterIdx Indices of filtered components in the chunk's archetype
+				GAIA_NODISCARD static bool
+				match_filters(const Chunk& chunk, const QueryInfo& queryInfo, const QueryInfo::FilterCompIdxArray& filterIdx) {
 					GAIA_ASSERT(!chunk.empty() && "match_filters called on an empty chunk");
 
 					const auto queryVersion = queryInfo.world_version();
 
 					// See if any component has changed
-					const auto& filtered = queryInfo.filters();
-					for (const auto comp: filtered) {
-						// TODO: Components are sorted. Therefore, we don't need to search from 0
-						//       all the time. We can search from the last found index.
-						const auto compIdx = chunk.comp_idx(comp);
+					for (auto compIdx: filterIdx) {
+						if (compIdx == QueryInfo::FilterCompIdxBad)
+							continue;
 						if (chunk.changed(queryVersion, compIdx))
 							return true;
 					}
@@ -429,12 +509,48 @@ namespace gaia {
 					return !archetype.is_req_del();
 				}
 
+				//! Returns true if chunks of \param queryInfo are to be iterated via its chunk cache.
+				//! Filters are evaluated per archetype and per chunk so filtered queries do not use it.
+				GAIA_NODISCARD bool use_chunk_cache(const QueryInfo& queryInfo) const {
+					// The chunk cache covers all groups
+					return m_cacheChunks && !queryInfo.has_filters() && m_groupIdSet == GroupIdBad;
+				}
+
+				template <typename Iter, typename Func>
+				void run_query_cached(QueryInfo& queryInfo, Func func) {
+					GAIA_PROF_SCOPE(query::run_query_cached);
+
+					const auto& items = queryInfo.chunk_cache();
+					const auto itemCnt = items.size();
+					GAIA_FOR(itemCnt) {
+						// Give the CPU a hint we are going to need the next chunk soon, see run_func_batched
+						if (i + 1 < itemCnt)
+							gaia::prefetch(items[i + 1].pChunk, PrefetchHint::PREFETCH_HINT_T2);
+
+						auto& chunk = *items[i].pChunk;
+						Iter iter(chunk);
+						if (iter.size() == 0)
+							continue;
+
+						chunk.lock(true);
+						func(items[i]);
+						chunk.lock(false);
+					}
+				}
+
 				template <bool HasFilters, typename Iter, typename Func>
 				void run_query(const QueryInfo& queryInfo, Func func, ChunkBatchedList& chunkBatch) {
-					for (auto* pArchetype: queryInfo) {
+					const auto range = queryInfo.group_range(m_groupIdSet);
+					for (uint32_t a = range.from; a < range.to; ++a) {
+						auto* pArchetype = queryInfo.archetype(a);
 						if GAIA_UNLIKELY (!can_process_archetype(*pArchetype))
 							continue;
 
+						if constexpr (HasFilters) {
+							if (!match_filters(*pArchetype, queryInfo, queryInfo.filter_comp_idx(a)))
+								continue;
+						}
+
 						GAIA_PROF_SCOPE(query::run_query); // batch preparation + chunk processing
 
 						const auto& chunks = pArchetype->chunks();
@@ -452,7 +568,7 @@ namespace gaia {
 									continue;
 
 								if constexpr (HasFilters) {
-									if (!match_filters(*pChunk, queryInfo))
+									if (!match_filters(*pChunk, queryInfo, queryInfo.filter_comp_idx(a)))
 										continue;
 								}
 
@@ -471,26 +587,126 @@ namespace gaia {
 				template <typename Iter, typename Func>
 				void run_query_on_chunks(QueryInfo& queryInfo, Func func) {
 					// Update the world version
-					update_version(*m_worldVersion);
+					bump_world_version(*m_worldVersion);
 
-					ChunkBatchedList chunkBatch;
+					if (use_chunk_cache(queryInfo)) {
+						run_query_cached<Iter>(queryInfo, [&](const QueryInfo::ChunkCacheItem& item) {
+							func(*item.pChunk);
+						});
+					} else {
+						ChunkBatchedList chunkBatch;
 
-					const bool hasFilters = queryInfo.has_filters();
-					if (hasFilters)
-						run_query<true, Iter>(queryInfo, func, chunkBatch);
-					else
-						run_query<false, Iter>(queryInfo, func, chunkBatch);
+						const bool hasFilters = queryInfo.has_filters();
+						if (hasFilters)
+							run_query<true, Iter>(queryInfo, func, chunkBatch);
+						else
+							run_query<false, Iter>(queryInfo, func, chunkBatch);
 
-					// Take care of any leftovers not processed during run_query
-					if (!chunkBatch.empty())
-						run_func_batched(func, chunkBatch);
+						// Take care of any leftovers not processed during run_query
+						if (!chunkBatch.empty())
+							run_func_batched(func, chunkBatch);
+					}
 
 					// Update the query version with the current world's version
-					queryInfo.set_world_version(*m_worldVersion);
+					queryInfo.set_world_version(curr_world_version(*m_worldVersion));
+				}
+
+				template <bool HasFilters, typename Iter>
+				void gather_chunks(const QueryInfo& queryInfo, cnt::darray<Chunk*>& outChunks) const {
+					const auto range = queryInfo.group_range(m_groupIdSet);
+					for (uint32_t a = range.from; a < range.to; ++a) {
+						auto* pArchetype = queryInfo.archetype(a);
+						if GAIA_UNLIKELY (!can_process_archetype(*pArchetype))
+							continue;
+
+						if constexpr (HasFilters) {
+							if (!match_filters(*pArchetype, queryInfo, queryInfo.filter_comp_idx(a)))
+								continue;
+						}
+
+						GAIA_PROF_SCOPE(query::gather_chunks);
+
+						const auto& chunks = pArchetype->chunks();
+						for (auto* pChunk: chunks) {
+							Iter iter(*pChunk);
+							if (iter.size() == 0)
+								continue;
+
+							if constexpr (HasFilters) {
+								if (!match_filters(*pChunk, queryInfo, queryInfo.filter_comp_idx(a)))
+									continue;
+							}
+
+							outChunks.push_back(pChunk);
+						}
+					}
+				}
+
+				template <typename Iter, typename Func>
+				mt::JobHandle
+				run_query_on_chunks_par(QueryInfo& queryInfo, Func func, uint32_t groupSize, mt::JobPriority priority) {
+					// Update the world version
+					bump_world_version(*m_worldVersion);
+
+					// Chunks are gathered up-front so filters are evaluated on the calling thread
+					// and workers only ever receive a flat range of chunk indices.
+					auto& chunks = m_parChunks;
+					chunks.clear();
+					if (use_chunk_cache(queryInfo)) {
+						for (const auto& item: queryInfo.chunk_cache()) {
+							Iter iter(*item.pChunk);
+							if (iter.size() != 0)
+								chunks.push_back(item.pChunk);
+						}
+					} else if (queryInfo.has_filters())
+						gather_chunks<true, Iter>(queryInfo, chunks);
+					else
+						gather_chunks<false, Iter>(queryInfo, chunks);
+
+					// Update the query version with the current world's version.
+					// The world version can not change until the jobs finish so it is safe to do it now.
+					queryInfo.set_world_version(curr_world_version(*m_worldVersion));
+
+					if (chunks.empty())
+						return mt::JobNull;
+
+					// Lock all chunks before any job starts. Each chunk belongs to exactly one job
+					// which unlocks it once it is done with it. Locks are counted so chunks shared
+					// with jobs of other each_par calls stay locked until all of them are done.
+					for (auto* pChunk: chunks)
+						pChunk->lock(true);
+
+					// The chunk list and the functor are copied to memory owned by the thread pool.
+					// It stays valid until the jobs finish so each_par can be called again before that.
+					// Jobs only capture a pointer to it so the size of the functor is not limited by GAIA_JOB_FUNC_SIZE.
+					struct JobData {
+						Chunk** ppChunks;
+						Func func;
+					};
+
+					auto& tp = mt::ThreadPool::get();
+					const auto chunkCnt = chunks.size();
+					auto* ppChunks = tp.alloc_job_data_n<Chunk*>(chunkCnt);
+					memcpy((void*)ppChunks, (const void*)chunks.data(), sizeof(Chunk*) * chunkCnt);
+					const auto* pData = tp.alloc_job_data<JobData>(JobData{ppChunks, GAIA_MOV(func)});
+
+					mt::JobParallel job;
+					job.priority = priority;
+					job.func = [pData](const mt::JobArgs& args) {
+						GAIA_PROF_SCOPE(query::run_query_on_chunks_par);
+
+						for (uint32_t i = args.idxStart; i < args.idxEnd; ++i) {
+							auto& chunk = *pData->ppChunks[i];
+							pData->func(chunk);
+							chunk.lock(false);
+						}
+					};
+
+					return tp.sched_par(job, chunkCnt, groupSize);
 				}
 
 				template <typename Iter, typename Func, typename... T>
-				GAIA_FORCEINLINE void
+				GAIA_FORCEINLINE static void
 				run_query_on_chunk(Chunk& chunk, Func func, [[maybe_unused]] core::func_type_list<T...> types) {
 					if constexpr (sizeof...(T) > 0) {
 						Iter iter(chunk);
@@ -514,6 +730,103 @@ namespace gaia {
 					}
 				}
 
+				//! Runs \param func for each enabled entity of \param chunk in the order given by \param queryInfo
+				template <typename Func, typename... T>
+				GAIA_FORCEINLINE static void run_query_on_chunk_ordered(
+						QueryInfo& queryInfo, Chunk& chunk, Func func, [[maybe_unused]] core::func_type_list<T...> types) {
+					const auto rows = queryInfo.sorted_rows(chunk);
+					const auto from = chunk.size_disabled();
+
+					if constexpr (sizeof...(T) > 0) {
+						auto dataPointerTuple = std::make_tuple(chunk.template view_auto<T>(from, chunk.size())...);
+						for (auto row: rows)
+							func(std::get<decltype(chunk.template view_auto<T>())>(dataPointerTuple)[row - from]...);
+					} else {
+						// No functor parameters. Do an empty loop.
+						for (uint32_t i = 0; i < (uint32_t)rows.size(); ++i)
+							func();
+					}
+				}
+
+				//! Returns a view of \tparam T in \param chunk using the data of the query item at the index \param idx
+				//! stored in the chunk cache \param item. Unlike Chunk::view_auto no component lookup is needed.
+				template <typename T>
+				GAIA_FORCEINLINE static decltype(auto)
+				view_cached(const QueryInfo::ChunkCacheItem& item, uint32_t idx, uint16_t from, uint16_t to) {
+					auto& chunk = *item.pChunk;
+					if constexpr (std::is_same_v<core::raw_t<T>, Entity> || is_pair<T>::value) {
+						return chunk.view_auto<T>(from, to);
+					} else {
+						using UOriginal = typename actual_type_t<T>::TypeOriginal;
+						using U = typename actual_type_t<T>::Type;
+						static_assert(!std::is_empty_v<U>, "Attempting to get value of an empty component");
+
+						const uint32_t compIdx = item.compIdx[idx];
+						GAIA_ASSERT(compIdx != QueryInfo::ChunkCacheCompIdxBad);
+
+						uint8_t* pData = item.pData[idx];
+						uint32_t cnt = 1;
+						if constexpr (entity_kind_v<T> == EntityKind::EK_Gen) {
+							pData += (uintptr_t)chunk.comp_rec_view()[compIdx].comp.size() * from;
+							cnt = to - from;
+						}
+
+						if constexpr (core::is_mut_v<UOriginal>) {
+							chunk.update_world_version(compIdx, from, to);
+							return mem::auto_view_policy_set<U>{std::span<uint8_t>{pData, cnt}};
+						} else {
+							return mem::auto_view_policy_get<U>{std::span<const uint8_t>{pData, cnt}};
+						}
+					}
+				}
+
+				//! Runs \param func for each enabled entity of the chunk in the chunk cache \param item.
+				//! \param argIdx Indices of query items matching the functor arguments
+				template <typename Func, typename... T, size_t... I>
+				GAIA_FORCEINLINE static void run_query_on_cached_chunk(
+						const QueryInfo::ChunkCacheItem& item, const uint8_t* argIdx, Func func,
+						[[maybe_unused]] core::func_type_list<T...> types, std::index_sequence<I...> /*no_name*/) {
+					const auto& chunk = *item.pChunk;
+					const auto from = chunk.size_disabled();
+					const auto to = chunk.size();
+
+					if constexpr (sizeof...(T) > 0) {
+						auto dataPointerTuple = std::make_tuple(view_cached<T>(item, argIdx[I], from, to)...);
+						for (uint32_t i = 0, cnt = to - from; i < cnt; ++i)
+							func(std::get<I>(dataPointerTuple)[i]...);
+					} else {
+						for (uint32_t i = 0, cnt = to - from; i < cnt; ++i)
+							func();
+					}
+				}
+
+				//! Returns the index of the query item matching the functor argument \tparam T.
+				//! Entity arguments do not need any.
+				template <typename T>
+				GAIA_NODISCARD uint8_t arg_idx(const QueryInfo& queryInfo) const {
+					using TT = core::raw_t<T>;
+					if constexpr (std::is_same_v<TT, Entity> || is_pair<TT>::value) {
+						return 0;
+					} else {
+						const auto entity = comp_cache(*m_world).template get<TT>().entity;
+						const auto idx = core::get_index(queryInfo.ids(), entity);
+						GAIA_ASSERT(idx != BadIndex);
+						return (uint8_t)idx;
+					}
+				}
+
+				template <typename Func, typename... T>
+				void each_cached(QueryInfo& queryInfo, Func func, [[maybe_unused]] core::func_type_list<T...> types) {
+					// Query items matching the functor arguments are looked up once rather than for each chunk
+					const uint8_t argIdx[sizeof...(T) + 1] = {arg_idx<T>(queryInfo)..., 0};
+
+					bump_world_version(*m_worldVersion);
+					run_query_cached<Iter>(queryInfo, [&](const QueryInfo::ChunkCacheItem& item) {
+						run_query_on_cached_chunk(item, argIdx, func, types, std::index_sequence_for<T...>{});
+					});
+					queryInfo.set_world_version(curr_world_version(*m_worldVersion));
+				}
+
 				void invalidate() {
 					if constexpr (UseCaching)
 						m_storage.m_queryId = QueryIdBad;
@@ -521,17 +834,24 @@ namespace gaia {
 
 				template <bool UseFilters, typename Iter>
 				GAIA_NODISCARD bool empty_inter(const QueryInfo& queryInfo) const {
-					for (const auto* pArchetype: queryInfo) {
+					const auto range = queryInfo.group_range(m_groupIdSet);
+					for (uint32_t a = range.from; a < range.to; ++a) {
+						const auto* pArchetype = queryInfo.archetype(a);
 						if GAIA_UNLIKELY (!can_process_archetype(*pArchetype))
 							continue;
 
+						if constexpr (UseFilters) {
+							if (!match_filters(*pArchetype, queryInfo, queryInfo.filter_comp_idx(a)))
+								continue;
+						}
+
 						GAIA_PROF_SCOPE(query::empty);
 
 						const auto& chunks = pArchetype->chunks();
 						const bool isNotEmpty = core::has_if(chunks, [&](Chunk* pChunk) {
 							Iter iter(*pChunk);
 							if constexpr (UseFilters)
-								return iter.size() > 0 && match_filters(*pChunk, queryInfo);
+								return iter.size() > 0 && match_filters(*pChunk, queryInfo, queryInfo.filter_comp_idx(a));
 							else
 								return iter.size() > 0;
 						});
@@ -547,10 +867,17 @@ namespace gaia {
 				GAIA_NODISCARD uint32_t count_inter(const QueryInfo& queryInfo) const {
 					uint32_t cnt = 0;
 
-					for (const auto* pArchetype: queryInfo) {
+					const auto range = queryInfo.group_range(m_groupIdSet);
+					for (uint32_t a = range.from; a < range.to; ++a) {
+						const auto* pArchetype = queryInfo.archetype(a);
 						if GAIA_UNLIKELY (!can_process_archetype(*pArchetype))
 							continue;
 
+						if constexpr (UseFilters) {
+							if (!match_filters(*pArchetype, queryInfo, queryInfo.filter_comp_idx(a)))
+								continue;
+						}
+
 						GAIA_PROF_SCOPE(query::count);
 
 						const auto& chunks = pArchetype->chunks();
@@ -562,7 +889,7 @@ namespace gaia {
 
 							// Filters
 							if constexpr (UseFilters) {
-								if (!match_filters(*pChunk, queryInfo))
+								if (!match_filters(*pChunk, queryInfo, queryInfo.filter_comp_idx(a)))
 									continue;
 							}
 
@@ -578,10 +905,17 @@ namespace gaia {
 				void arr_inter(QueryInfo& queryInfo, ContainerOut& outArray) {
 					using ContainerItemType = typename ContainerOut::value_type;
 
-					for (auto* pArchetype: queryInfo) {
+					const auto range = queryInfo.group_range(m_groupIdSet);
+					for (uint32_t a = range.from; a < range.to; ++a) {
+						auto* pArchetype = queryInfo.archetype(a);
 						if GAIA_UNLIKELY (!can_process_archetype(*pArchetype))
 							continue;
 
+						if constexpr (UseFilters) {
+							if (!match_filters(*pArchetype, queryInfo, queryInfo.filter_comp_idx(a)))
+								continue;
+						}
+
 						GAIA_PROF_SCOPE(query::arr);
 
 						const auto& chunks = pArchetype->chunks();
@@ -592,7 +926,7 @@ namespace gaia {
 
 							// Filters
 							if constexpr (UseFilters) {
-								if (!match_filters(*pChunk, queryInfo))
+								if (!match_filters(*pChunk, queryInfo, queryInfo.filter_comp_idx(a)))
 									continue;
 							}
 
@@ -843,6 +1177,68 @@ namespace gaia {
 					return *this;
 				}
 
+				//! Orders entities visited by each() using \param func called with the data of the component \param comp.
+				//! Entities are ordered within each chunk. Orderings are cached and only refreshed when the component
+				//! changes or entities of the chunk move. Query the component as read-only to keep them cached.
+				//! \warning Only each() with typed arguments visits entities in this order.
+				QueryImpl& order_by(Entity comp, QueryOrderByFunc func) {
+					// Changing the ordering invalidates the query
+					invalidate();
+
+					Command_OrderBy cmd{comp, func};
+					ser::save(m_serBuffer, Command_OrderBy::Id);
+					ser::save(m_serBuffer, cmd);
+					return *this;
+				}
+
+				template <typename T>
+				QueryImpl& order_by(QueryOrderByFunc func) {
+					// Make sure the component is always registered
+					const auto& desc = comp_cache_add<T>(*m_world);
+					return order_by(desc.entity, func);
+				}
+
+				//! Groups archetypes by the target of the relationship \param rel. Archetypes are iterated in the order
+				//! of their group ids followed by those without the relationship. The order is kept as archetypes
+				//! get matched so it does not need to be recalculated. See group_id.
+				QueryImpl& group_by(Entity rel) {
+					// Changing the grouping invalidates the query
+					invalidate();
+
+					Command_GroupBy cmd{rel};
+					ser::save(m_serBuffer, Command_GroupBy::Id);
+					ser::save(m_serBuffer, cmd);
+					return *this;
+				}
+
+				template <typename Rel>
+				QueryImpl& group_by() {
+					// Make sure the component is always registered
+					const auto& desc = comp_cache_add<Rel>(*m_world);
+					return group_by(desc.entity);
+				}
+
+				//! Limits iteration of a query grouped by group_by to archetypes of the group \param groupId.
+				//! GroupIdBad iterates all groups.
+				QueryImpl& group_id(GroupId groupId) {
+					m_groupIdSet = groupId;
+					return *this;
+				}
+
+				//! Limits iteration of a query grouped by group_by to archetypes whose relationship targets \param tgt
+				QueryImpl& group_id(Entity tgt) {
+					return group_id(tgt.id());
+				}
+
+				//! Makes the query iterate a flat list of matched chunks with precomputed component data pointers
+				//! rather than walking archetypes and looking up components for each chunk.
+				//! The list is rebuilt only when chunks of matched archetypes are added or removed.
+				//! Queries with filters keep walking archetypes.
+				QueryImpl& cache_chunks(bool enable = true) {
+					m_cacheChunks = enable;
+					return *this;
+				}
+
 				template <typename Func>
 				void each(QueryInfo& queryInfo, Func func) {
 					using InputArgs = decltype(core::func_args(&Func::operator()));
@@ -865,6 +1261,19 @@ namespace gaia {
 					GAIA_ASSERT(unpack_args_into_query_has_all(queryInfo, InputArgs{}));
 #endif
 
+					if (queryInfo.has_order_by()) {
+						queryInfo.sync_sorted_rows();
+						run_query_on_chunks<Iter>(queryInfo, [&](Chunk& chunk) {
+							run_query_on_chunk_ordered(queryInfo, chunk, func, InputArgs{});
+						});
+						return;
+					}
+
+					if (use_chunk_cache(queryInfo)) {
+						each_cached(queryInfo, func, InputArgs{});
+						return;
+					}
+
 					run_query_on_chunks<Iter>(queryInfo, [&](Chunk& chunk) {
 						run_query_on_chunk<Iter>(chunk, func, InputArgs{});
 					});
@@ -873,23 +1282,82 @@ namespace gaia {
 				template <typename Func>
 				void each(Func func) {
 					auto& queryInfo = fetch();
+					// Iterators report changes made since the query was run the last time
+					const auto changeVersion = queryInfo.world_version();
 
 					if constexpr (std::is_invocable_v<Func, IterAll>)
 						run_query_on_chunks<IterAll>(queryInfo, [&](Chunk& chunk) {
-							func(IterAll(chunk));
+							func(IterAll(chunk, changeVersion));
 						});
 					else if constexpr (std::is_invocable_v<Func, Iter>)
 						run_query_on_chunks<Iter>(queryInfo, [&](Chunk& chunk) {
-							func(Iter(chunk));
+							func(Iter(chunk, changeVersion));
 						});
 					else if constexpr (std::is_invocable_v<Func, IterDisabled>)
 						run_query_on_chunks<IterDisabled>(queryInfo, [&](Chunk& chunk) {
-							func(IterDisabled(chunk));
+							func(IterDisabled(chunk, changeVersion));
 						});
 					else
 						each(queryInfo, func);
 				}
 
+				//! Iterates the query on worker threads. Matched chunks are split into groups of \param groupSize
+				//! chunks and each group is processed by one job. The function accepts the same kinds of functors
+				//! as each().
+				//! \param func Functor invoked for each entity or chunk iterator
+				//! \param groupSize Number of chunks processed per job. If zero the job system decides the group size.
+				//! \param priority Priority of the scheduled jobs
+				//! \return Handle of the scheduled batch of jobs. Use mt::ThreadPool::wait to wait for it to finish.
+				//!         JobNull if there was nothing to process.
+				//! \warning Must be used from the main thread.
+				//! \warning Matched chunks stay locked until processed by their job. No structural changes can
+				//!          be done to the world until the returned job finishes.
+				//! \warning \param func is copied into memory shared by the jobs. Its size is limited by the size of
+				//!          a memory block of mt::JobArena (16 KiB) rather than GAIA_JOB_FUNC_SIZE.
+				template <typename Func>
+				mt::JobHandle each_par(Func func, uint32_t groupSize = 0, mt::JobPriority priority = mt::JobPriority::High) {
+					auto& queryInfo = fetch();
+					// Iterators report changes made since the query was run the last time
+					const auto changeVersion = queryInfo.world_version();
+
+					if constexpr (std::is_invocable_v<Func, IterAll>)
+						return run_query_on_chunks_par<IterAll>(
+								queryInfo,
+								[func, changeVersion](Chunk& chunk) {
+									func(IterAll(chunk, changeVersion));
+								},
+								groupSize, priority);
+					else if constexpr (std::is_invocable_v<Func, Iter>)
+						return run_query_on_chunks_par<Iter>(
+								queryInfo,
+								[func, changeVersion](Chunk& chunk) {
+									func(Iter(chunk, changeVersion));
+								},
+								groupSize, priority);
+					else if constexpr (std::is_invocable_v<Func, IterDisabled>)
+						return run_query_on_chunks_par<IterDisabled>(
+								queryInfo,
+								[func, changeVersion](Chunk& chunk) {
+									func(IterDisabled(chunk, changeVersion));
+								},
+								groupSize, priority);
+					else {
+						using InputArgs = decltype(core::func_args(&Func::operator()));
+
+#if GAIA_DEBUG
+						// Make sure we only use components specified in the query
+						GAIA_ASSERT(unpack_args_into_query_has_all(queryInfo, InputArgs{}));
+#endif
+
+						return run_query_on_chunks_par<Iter>(
+								queryInfo,
+								[func](Chunk& chunk) {
+									run_query_on_chunk<Iter>(chunk, func, InputArgs{});
+								},
+								groupSize, priority);
+					}
+				}
+
 				template <typename Func, bool FuncEnabled = UseCaching, typename std::enable_if<FuncEnabled>::type* = nullptr>
 				void each(QueryId queryId, Func func) {
 					// Make sure the query was created by World.query()
@@ -1013,11 +1481,71 @@ namespace gaia {
 					}
 				}
 
+				//! Appends all chunks with entities matching the query to the output array.
+				//! \param outChunks Container storing chunks
+				//! \param constraints QueryImpl constraints
+				//! \warning The chunks are only valid until the next structural change of the world.
+				void chunks(cnt::darray<Chunk*>& outChunks, Constraints constraints = Constraints::EnabledOnly) {
+					auto& queryInfo = fetch();
+
+					// Update the world version
+					bump_world_version(*m_worldVersion);
+
+					const bool hasFilters = queryInfo.has_filters();
+					if (hasFilters) {
+						switch (constraints) {
+							case Constraints::EnabledOnly:
+								gather_chunks<true, Iter>(queryInfo, outChunks);
+								break;
+							case Constraints::DisabledOnly:
+								gather_chunks<true, IterDisabled>(queryInfo, outChunks);
+								break;
+							case Constraints::AcceptAll:
+								gather_chunks<true, IterAll>(queryInfo, outChunks);
+								break;
+						}
+					} else {
+						switch (constraints) {
+							case Constraints::EnabledOnly:
+								gather_chunks<false, Iter>(queryInfo, outChunks);
+								break;
+							case Constraints::DisabledOnly:
+								gather_chunks<false, IterDisabled>(queryInfo, outChunks);
+								break;
+							case Constraints::AcceptAll:
+								gather_chunks<false, IterAll>(queryInfo, outChunks);
+								break;
+						}
+					}
+
+					// Update the query version with the current world's version
+					queryInfo.set_world_version(curr_world_version(*m_worldVersion));
+				}
+
 				//!
 				void diag() {
 					// Make sure matching happened
 					auto& info = fetch();
 					GAIA_LOG_N("DIAG Query %u [%c]", id(), UseCaching ? 'C' : 'U');
+
+					const auto& plan = info.plan();
+					GAIA_LOG_N("plan:%s, candidates:%u", plan.intersect ? "intersect" : "scan", plan.candidates);
+					for (const auto& item: plan.items) {
+						static constexpr const char* OpNames[] = {"all", "any", "not"};
+						const auto* opName = OpNames[(uint32_t)item.op];
+						// Cost of items whose archetypes can not be looked up is not known
+						const int cost = item.cost == BadIndex ? -1 : (int)item.cost;
+						if (item.id.pair()) {
+							GAIA_LOG_N(
+									"  %s pair [%u:%u] %s -> %s, cost:%d", opName, item.id.id(), item.id.gen(),
+									entity_name(*m_world, item.id.id()), entity_name(*m_world, item.id.gen()), cost);
+						} else {
+							GAIA_LOG_N(
+									"  %s ent [%u:%u] %s, cost:%d", opName, item.id.id(), item.id.gen(),
+									entity_name(*m_world, item.id), cost);
+						}
+					}
+
 					for (const auto* pArchetype: info)
 						Archetype::diag_basic_info(*m_world, *pArchetype);
 					GAIA_LOG_N("END DIAG Query");
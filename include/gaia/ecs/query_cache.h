@@ -71,6 +71,11 @@ namespace gaia {
 				return m_queryArr[queryId];
 			};
 
+			//! Returns the number of registered queries
+			GAIA_NODISCARD uint32_t size() const {
+				return m_queryArr.size();
+			}
+
 			//! Registers the provided query lookup context \param ctx. If it already exists it is returned.
 			//! \return Query id
 			QueryInfo& add(QueryCtx&& ctx) {
@@ -87,6 +92,22 @@ namespace gaia {
 				return get(queryId);
 			};
 
+			//! Notifies all cached queries that \param pArchetype is about to be deleted.
+			//! Newly created archetypes need no notification. Queries pick them up incrementally
+			//! from the world's archetype list the next time they are matched.
+			//! \param pArchetype Archetype being deleted. Used only for comparison, never dereferenced.
+			void del_archetype(Archetype* pArchetype) {
+				for (auto& info: m_queryArr)
+					info.remove(pArchetype);
+			}
+
+			//! Makes all cached queries forget the archetypes they matched.
+			//! Used when all archetypes of the world are replaced at once.
+			void reset() {
+				for (auto& info: m_queryArr)
+					info.reset();
+			}
+
 			cnt::darray<QueryInfo>::iterator begin() {
 				return m_queryArr.begin();
 			}
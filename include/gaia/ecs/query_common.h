@@ -36,11 +36,20 @@ namespace gaia {
 		using QueryId = uint32_t;
 		using QueryLookupHash = core::direct_hash_key<uint64_t>;
 		using QueryEntityArray = cnt::sarray_ext<Entity, MAX_ITEMS_IN_QUERY>;
-		using QueryArchetypeCacheIndexMap = cnt::map<EntityLookupKey, uint32_t>;
 		using QueryOpArray = cnt::sarray_ext<QueryOp, MAX_ITEMS_IN_QUERY>;
 
 		static constexpr QueryId QueryIdBad = (QueryId)-1;
 
+		//! Function ordering entities of a query by the data of a component.
+		//! Returns a negative number if \param pData0 goes before \param pData1, a positive number if it goes after
+		//! and zero if their order does not matter.
+		using QueryOrderByFunc = int (*)(const void* pData0, const void* pData1);
+
+		//! Group of archetypes of a query. Id of the target of the relationship the query groups by.
+		using GroupId = uint32_t;
+		//! Group of archetypes without the relationship the query groups by
+		static constexpr GroupId GroupIdBad = (GroupId)-1;
+
 		struct QueryItem {
 			//! Entity/Component/Pair to query
 			Entity id;
@@ -91,13 +100,16 @@ namespace gaia {
 				QueryEntityArray ids;
 				//! List of [op,id] pairs
 				QueryEntityOpPairArray pairs;
-				//! Index of the last checked archetype in the component-to-archetype map
-				QueryArchetypeCacheIndexMap lastMatchedArchetypeIdx_All;
-				QueryArchetypeCacheIndexMap lastMatchedArchetypeIdx_Any;
 				//! Mapping of the original indices to the new ones after sorting
 				QueryRemappingArray remapping;
 				//! List of filtered components
 				QueryEntityArray withChanged;
+				//! Component entities are ordered by. EntityBad if not ordered.
+				Entity orderBy;
+				//! Function used to order entities
+				QueryOrderByFunc orderByFunc;
+				//! Relationship archetypes are grouped by. EntityBad if not grouped.
+				Entity groupBy;
 				//! Mask for items with Is relationship pair.
 				//! If the id is a pair, the first part (id) is written here.
 				uint32_t as_mask;
@@ -150,6 +162,12 @@ namespace gaia {
 				if (left.withChanged != right.withChanged)
 					return false;
 
+				// Ordering and grouping need to be the same
+				if (left.orderBy != right.orderBy || left.orderByFunc != right.orderByFunc)
+					return false;
+				if (left.groupBy != right.groupBy)
+					return false;
+
 				return true;
 			}
 
@@ -234,6 +252,17 @@ namespace gaia {
 				hashLookup = core::hash_combine(hashLookup, hash);
 			}
 
+			// Ordering & grouping
+			{
+				QueryLookupHash::Type hash = 0;
+
+				hash = core::hash_combine(hash, (QueryLookupHash::Type)data.orderBy.value());
+				hash = core::hash_combine(hash, (QueryLookupHash::Type)(uintptr_t)data.orderByFunc);
+				hash = core::hash_combine(hash, (QueryLookupHash::Type)data.groupBy.value());
+
+				hashLookup = core::hash_combine(hashLookup, hash);
+			}
+
 			ctx.hashLookup = {core::calculate_hash64(hashLookup)};
 		}
 
@@ -1,6 +1,8 @@
 #pragma once
 #include "../config/config.h"
 
+#include <cstring>
+
 #include "../cnt/darray.h"
 #include "../cnt/sarray_ext.h"
 #include "../cnt/set.h"
@@ -29,20 +31,107 @@ namespace gaia {
 		template <typename Func>
 		bool as_relations_trav_if(const World& world, Entity target, Func func);
 
+		//! Query item as evaluated by the query plan
+		struct QueryPlanItem {
+			//! Queried id
+			Entity id;
+			//! Operation of the item
+			QueryOp op;
+			//! Estimated number of archetypes the item can match, including those reachable via Is relationships.
+			//! BadIndex if the number can not be estimated.
+			uint32_t cost;
+		};
+
+		//! Plan used when the query was matched against archetypes the last time
+		struct QueryPlan {
+			//! Query items in the order of evaluation. The first ALL item with a known cost drives the matching.
+			cnt::sarr_ext<QueryPlanItem, MAX_ITEMS_IN_QUERY> items;
+			//! Number of archetypes fully evaluated by the query
+			uint32_t candidates;
+			//! True if the candidates were found by intersecting archetype lists of the query items.
+			//! False if all new archetypes had to be evaluated.
+			bool intersect;
+		};
+
 		class QueryInfo {
 		public:
 			//! Query matching result
 			enum class MatchArchetypeQueryRet : uint8_t { Fail, Ok, Skip };
 
+			//! Index of a filtered component which is not present in the archetype
+			static constexpr uint8_t FilterCompIdxBad = (uint8_t)-1;
+			//! Indices of filtered components in an archetype
+			using FilterCompIdxArray = cnt::sarray_ext<uint8_t, MAX_ITEMS_IN_QUERY>;
+
+			//! Index of a queried id which has no data in the chunk
+			static constexpr uint8_t ChunkCacheCompIdxBad = (uint8_t)-1;
+			//! Chunk of a matched archetype along with the data of queried ids
+			struct ChunkCacheItem {
+				Chunk* pChunk;
+				//! Data of each queried id in the order of ids(). Nullptr if the id has no data in the chunk.
+				uint8_t* pData[MAX_ITEMS_IN_QUERY];
+				//! Index of each queried id among the components of the chunk in the order of ids().
+				//! ChunkCacheCompIdxBad if the id has no data in the chunk.
+				uint8_t compIdx[MAX_ITEMS_IN_QUERY];
+			};
+
+			//! Range [from, to) of indices of cached archetypes
+			struct ArchetypeCacheRange {
+				uint32_t from;
+				uint32_t to;
+			};
+
 		private:
+			//! Rows of enabled entities of a chunk in the order given by the query
+			struct SortedRows {
+				cnt::darray<uint16_t> rows;
+				//! Version of the sorted component at the time the rows were sorted
+				ComponentVersion version{};
+				//! Row version of the chunk at the time the rows were sorted
+				uint32_t rowVersion{};
+				//! Range of enabled rows at the time the rows were sorted
+				uint16_t from{};
+				uint16_t to{};
+			};
+
 			//! Lookup context
 			QueryCtx m_lookupCtx;
 			//! List of archetypes matching the query
 			ArchetypeList m_archetypeCache;
-			//! Id of the last archetype in the world we checked
-			ArchetypeId m_lastArchetypeId{};
+			//! Indices of filtered components for each archetype in m_archetypeCache.
+			//! Only used when the query has filters.
+			cnt::darray<FilterCompIdxArray> m_archetypeFilterIdx;
+			//! Id of the first archetype in the world not checked yet
+			ArchetypeId m_nextArchetypeId{};
 			//! Version of the world for which the query has been called most recently
 			uint32_t m_worldVersion{};
+			//! Plan used by the most recent matching
+			QueryPlan m_plan{};
+			//! Signature of ALL items. Archetypes whose signature does not contain it do not match.
+			ArchetypeSignature m_sigAll;
+			//! Signature of ANY items. Archetypes whose signature does not intersect it do not match.
+			//! Empty if some ANY item can not be checked via signatures.
+			ArchetypeSignature m_sigAny;
+			//! Signature of NOT items. Archetypes whose signature does not intersect it pass the NOT items.
+			ArchetypeSignature m_sigNot;
+			//! False if some NOT item can not be checked via signatures
+			bool m_sigNotOk = true;
+			//! Chunks of all matched archetypes
+			cnt::darray<ChunkCacheItem> m_chunkCache;
+			//! Sum of chunk list versions of matched archetypes at the time m_chunkCache was built
+			uint32_t m_chunkCacheVersion = 0;
+			//! True if m_chunkCache needs to be rebuilt regardless of the chunk list versions
+			bool m_chunkCacheDirty = true;
+			//! Group of each archetype in m_archetypeCache. Only used when the query groups archetypes.
+			cnt::darray<GroupId> m_archetypeGroupIds;
+			//! Ordered rows of chunks of matched archetypes. Only used when the query orders entities.
+			cnt::map<const Chunk*, SortedRows> m_sortedRows;
+			//! Sum of chunk list versions of matched archetypes at the time m_sortedRows were validated
+			uint32_t m_sortedRowsVersion = 0;
+			//! True if m_sortedRows need to be dropped regardless of the chunk list versions
+			bool m_sortedRowsDirty = true;
+			//! Temporary buffer used when sorting rows
+			cnt::darray<uint16_t> m_sortTmp;
 
 			enum QueryCmdType : uint8_t { ALL, ANY, NOT };
 
@@ -318,9 +407,15 @@ namespace gaia {
 				QueryInfo info;
 				info.m_lookupCtx = GAIA_MOV(ctx);
 				info.m_lookupCtx.queryId = id;
+				info.init_signatures();
 				return info;
 			}
 
+			//! Returns true if the query has been matched against all archetypes with ids below \param nextArchetypeId
+			GAIA_NODISCARD bool matched(ArchetypeId nextArchetypeId) const {
+				return m_nextArchetypeId == nextArchetypeId;
+			}
+
 			void set_world_version(uint32_t version) {
 				m_worldVersion = version;
 			}
@@ -337,489 +432,538 @@ namespace gaia {
 				return !operator==(other);
 			}
 
-			void match_archetype_all(
-					const EntityToArchetypeMap& entityToArchetypeMap, cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr,
-					Entity ent, EntitySpan idsToMatch) {
-				// For ALL we need all the archetypes to match. We start by checking
-				// if the first one is registered in the world at all.
-				const auto it = entityToArchetypeMap.find(EntityLookupKey(ent));
-				if (it == entityToArchetypeMap.end() || it->second.empty())
-					return;
-
-				auto& data = m_lookupCtx.data;
-
-				const auto& archetypes = it->second;
-				const auto cache_it = data.lastMatchedArchetypeIdx_All.find(EntityLookupKey(ent));
-				uint32_t lastMatchedIdx = 0;
-				if (cache_it == data.lastMatchedArchetypeIdx_All.end())
-					data.lastMatchedArchetypeIdx_All.emplace(EntityLookupKey(ent), archetypes.size());
-				else {
-					lastMatchedIdx = cache_it->second;
-					cache_it->second = archetypes.size();
-				}
-
-				// For simple cases it is enough to add archetypes to cache right away
-				if (idsToMatch.size() == 1) {
-					for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-						auto* pArchetype = archetypes[a];
-						matchesArr.emplace_back(pArchetype);
-					}
-				} else {
-					for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-						auto* pArchetype = archetypes[a];
+		private:
+			//! Returns true if any archetype matching \param id contains the id or its wildcard form so it can
+			//! be checked via archetype signatures. With Is relationships involved, (Is, X) and (*, X) pairs
+			//! can also match archetypes with entities inheriting from X.
+			GAIA_NODISCARD static bool sig_matchable(Entity id, bool isAs) {
+				if (!isAs || !id.pair())
+					return true;
 
-						if (matchesSet.contains(pArchetype))
-							continue;
-						if (!match_all(*pArchetype, idsToMatch))
-							continue;
+				return id.id() != Is.id() && (id.id() != All.id() || is_wildcard(id.gen()));
+			}
 
-						matchesSet.emplace(pArchetype);
-						matchesArr.emplace_back(pArchetype);
+			//! Calculates signatures of query items
+			void init_signatures() {
+				const auto& data = m_lookupCtx.data;
+				const bool isAs = data.as_mask + data.as_mask_2 != 0U;
+				// NOT items take relationships into account only when there is nothing else to match
+				const bool isAsNot = isAs && data.firstNot == 0;
+
+				bool anyOk = true;
+				for (const auto& p: data.pairs) {
+					if (p.op == QueryOp::All) {
+						// Items with a fixed source are not matched against archetypes
+						if (p.src == EntityBad && sig_matchable(p.id, isAs))
+							m_sigAll.add(p.id);
+					} else if (p.op == QueryOp::Any) {
+						if (sig_matchable(p.id, isAs))
+							m_sigAny.add(p.id);
+						else
+							anyOk = false;
+					} else if (p.src == EntityBad) {
+						if (sig_matchable(p.id, isAsNot))
+							m_sigNot.add(p.id);
+						else
+							m_sigNotOk = false;
 					}
 				}
-			}
 
-			void match_archetype_all_as(
-					const EntityToArchetypeMap& entityToArchetypeMap, const ArchetypeList& allArchetypes,
-					cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr, Entity ent, EntitySpan idsToMatch) {
-				// For ALL we need all the archetypes to match. We start by checking
-				// if the first one is registered in the world at all.
-
-				const ArchetypeList* pSrcArchetypes = nullptr;
+				if (!anyOk)
+					m_sigAny = {};
+			}
 
-				if (ent.id() == Is.id()) {
-					ent = EntityBad;
-					pSrcArchetypes = &allArchetypes;
-				} else {
-					const auto it = entityToArchetypeMap.find(EntityLookupKey(ent));
-					if (it == entityToArchetypeMap.end() || it->second.empty())
-						return;
-					pSrcArchetypes = &it->second;
+			bool do_match_one(const Archetype& archetype, EntitySpan idsToMatch, uint32_t as_mask_0, uint32_t as_mask_1) const {
+				// First viable item is not related to an Is relationship
+				if (as_mask_0 + as_mask_1 == 0U) {
+					return match_one(archetype, idsToMatch);
 				}
-
-				auto& data = m_lookupCtx.data;
-
-				const auto& archetypes = *pSrcArchetypes;
-				const auto cache_it = data.lastMatchedArchetypeIdx_All.find(EntityLookupKey(ent));
-				uint32_t lastMatchedIdx = 0;
-				if (cache_it == data.lastMatchedArchetypeIdx_All.end())
-					data.lastMatchedArchetypeIdx_All.emplace(EntityLookupKey(ent), archetypes.size());
+				// First viable item is related to an Is relationship.
+				// In this case we need to gather all related archetypes.
 				else {
-					lastMatchedIdx = cache_it->second;
-					cache_it->second = archetypes.size();
-				}
-
-				// For simple cases it is enough to add archetypes to cache right away
-				// if (idsToMatch.size() == 1) {
-				// 	for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-				// 		auto* pArchetype = archetypes[a];
-
-				// 		auto res = matchesSet.emplace(pArchetype);
-				// 		if (res.second)
-				// 			matchesArr.emplace_back(pArchetype);
-				// 	}
-				// } else {
-				for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-					auto* pArchetype = archetypes[a];
-
-					if (matchesSet.contains(pArchetype))
-						continue;
-					if (!match_all_backtrack(*pArchetype, idsToMatch))
-						continue;
-
-					matchesSet.emplace(pArchetype);
-					matchesArr.emplace_back(pArchetype);
+					return match_one_backtrack(archetype, idsToMatch);
 				}
-				//}
 			}
 
-			void match_archetype_one(
-					const EntityToArchetypeMap& entityToArchetypeMap, cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr,
-					Entity ent, EntitySpan idsToMatch) {
-				// For ANY we need at least one archetypes to match.
-				// However, because any of them can match, we need to check them all.
-				// Iterating all of them is caller's responsibility.
-				const auto it = entityToArchetypeMap.find(EntityLookupKey(ent));
-				if (it == entityToArchetypeMap.end() || it->second.empty())
-					return;
+			//! Ids the query is evaluated with, split by operation
+			struct MatchIds {
+				cnt::sarr_ext<Entity, MAX_ITEMS_IN_QUERY> all;
+				cnt::sarr_ext<Entity, MAX_ITEMS_IN_QUERY> any;
+				cnt::sarr_ext<Entity, MAX_ITEMS_IN_QUERY> none;
+				//! True if there are any ALL items
+				bool hasAllOps;
+				//! True if there are any ANY items
+				bool hasAnyOps;
+			};
 
+			//! Prepares ids used for matching archetypes.
+			//! \return False if no archetype can match the query at this moment. True otherwise.
+			GAIA_NODISCARD bool prepare_match_ids(const EntityToArchetypeMap& entityToArchetypeMap, MatchIds& ids) {
 				auto& data = m_lookupCtx.data;
+				auto& pairs = data.pairs;
+				if (pairs.empty())
+					return false;
 
-				const auto& archetypes = it->second;
-				const auto cache_it = data.lastMatchedArchetypeIdx_Any.find(EntityLookupKey(ent));
-				uint32_t lastMatchedIdx = 0;
-				if (cache_it == data.lastMatchedArchetypeIdx_Any.end())
-					data.lastMatchedArchetypeIdx_Any.emplace(EntityLookupKey(ent), archetypes.size());
-				else {
-					lastMatchedIdx = cache_it->second;
-					cache_it->second = archetypes.size();
-				}
+				QueryEntityOpPairSpan ops_ids{pairs.data(), pairs.size()};
+				QueryEntityOpPairSpan ops_ids_all = ops_ids.subspan(0, data.firstAny);
+				QueryEntityOpPairSpan ops_ids_any = ops_ids.subspan(data.firstAny, data.firstNot - data.firstAny);
+				QueryEntityOpPairSpan ops_ids_not = ops_ids.subspan(data.firstNot);
 
-				// For simple cases it is enough to add archetypes to cache right away
-				if (idsToMatch.size() == 1) {
-					for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-						auto* pArchetype = archetypes[a];
+				ids.hasAllOps = !ops_ids_all.empty();
+				ids.hasAnyOps = !ops_ids_any.empty();
 
-						auto res = matchesSet.emplace(pArchetype);
-						if (res.second)
-							matchesArr.emplace_back(pArchetype);
+				for (auto& p: ops_ids_all) {
+					if (p.src == EntityBad) {
+						ids.all.push_back(p.id);
+						continue;
 					}
-				} else {
-					for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-						auto* pArchetype = archetypes[a];
-
-						if (matchesSet.contains(pArchetype))
-							continue;
-						if (!match_one(*pArchetype, idsToMatch))
-							continue;
 
-						matchesSet.emplace(pArchetype);
-						matchesArr.emplace_back(pArchetype);
-					}
+					// Archetype of a static fixed source needs to exist.
+					// If it does not we have nothing to do here.
+					if (p.srcArchetype == nullptr)
+						p.srcArchetype = archetype_from_entity(*m_lookupCtx.w, p.src);
+					if (p.srcArchetype == nullptr)
+						return false;
 				}
-			}
 
-			void match_archetype_one_as(
-					const EntityToArchetypeMap& entityToArchetypeMap, const ArchetypeList& allArchetypes,
-					cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr, Entity ent, EntitySpan idsToMatch) {
-				// For ANY we need at least one archetypes to match.
-				// However, because any of them can match, we need to check them all.
-				// Iterating all of them is caller's responsibility.
+				// Only fixed sources among ALL items. These are not matched against archetypes.
+				if (ids.hasAllOps && ids.all.empty())
+					return false;
 
-				const ArchetypeList* pSrcArchetypes = nullptr;
+				for (auto& p: ops_ids_any) {
+					if (p.src != EntityBad) {
+						if (p.srcArchetype == nullptr)
+							p.srcArchetype = archetype_from_entity(*m_lookupCtx.w, p.src);
+						if (p.srcArchetype == nullptr)
+							continue;
+					}
 
-				if (ent.id() == Is.id()) {
-					ent = EntityBad;
-					pSrcArchetypes = &allArchetypes;
-				} else {
-					const auto it = entityToArchetypeMap.find(EntityLookupKey(ent));
+					// Check if any archetype is associated with the entity id.
+					// All ids must be registered in the world.
+					const auto it = entityToArchetypeMap.find(EntityLookupKey(p.id));
 					if (it == entityToArchetypeMap.end() || it->second.empty())
-						return;
-					pSrcArchetypes = &it->second;
+						continue;
+
+					ids.any.push_back(p.id);
 				}
 
-				auto& data = m_lookupCtx.data;
+				// No archetypes with "any" entities exist. We can quit right away.
+				if (ids.hasAnyOps && ids.any.empty())
+					return false;
 
-				const auto& archetypes = *pSrcArchetypes;
-				const auto cache_it = data.lastMatchedArchetypeIdx_Any.find(EntityLookupKey(ent));
-				uint32_t lastMatchedIdx = 0;
-				if (cache_it == data.lastMatchedArchetypeIdx_Any.end())
-					data.lastMatchedArchetypeIdx_Any.emplace(EntityLookupKey(ent), archetypes.size());
-				else {
-					lastMatchedIdx = cache_it->second;
-					cache_it->second = archetypes.size();
+				for (const auto& p: ops_ids_not) {
+					if (p.src == EntityBad)
+						ids.none.push_back(p.id);
 				}
 
-				// For simple cases it is enough to add archetypes to cache right away
-				// if (idsToMatch.size() == 1) {
-				// 	for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-				// 		auto* pArchetype = archetypes[a];
+				return true;
+			}
 
-				// 		auto res = matchesSet.emplace(pArchetype);
-				// 		if (res.second)
-				// 			matchesArr.emplace_back(pArchetype);
-				// 	}
-				// } else {
-				for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-					auto* pArchetype = archetypes[a];
+			//! Checks if \param archetype matches the query.
+			GAIA_NODISCARD bool match_archetype(const Archetype& archetype, const MatchIds& ids) const {
+				const auto& data = m_lookupCtx.data;
+				const bool isAs = data.as_mask + data.as_mask_2 != 0U;
+
+				// Most archetypes are rejected by their signature before their ids are compared
+				const auto& sig = archetype.signature();
+				if (!sig.contains(m_sigAll))
+					return false;
+				if (!ids.any.empty() && !m_sigAny.empty() && !sig.intersects(m_sigAny))
+					return false;
+
+				if (!ids.all.empty()) {
+					const EntitySpan all{ids.all.data(), ids.all.size()};
+					if (isAs ? !match_all_backtrack(archetype, all) : !match_all(archetype, all))
+						return false;
+				}
 
-					if (matchesSet.contains(pArchetype))
-						continue;
-					if (!match_one_backtrack(*pArchetype, idsToMatch))
-						continue;
+				if (!ids.any.empty()) {
+					if (!do_match_one(archetype, {ids.any.data(), ids.any.size()}, data.as_mask, data.as_mask_2))
+						return false;
+				}
 
-					matchesSet.emplace(pArchetype);
-					matchesArr.emplace_back(pArchetype);
+				// None of the NOT items is present if the signatures have nothing in common
+				if (!ids.none.empty() && (!m_sigNotOk || sig.intersects(m_sigNot))) {
+					const EntitySpan none{ids.none.data(), ids.none.size()};
+					// Relationships are only taken into account when there is nothing else to match
+					if (!ids.hasAllOps && !ids.hasAnyOps) {
+						if (do_match_one(archetype, none, data.as_mask, data.as_mask_2))
+							return false;
+					} else if (match_one(archetype, none))
+						return false;
 				}
-				//}
+
+				return true;
 			}
 
-			void match_archetype_no(
-					const ArchetypeList& archetypes, cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr,
-					EntitySpan idsToMatch) {
-				// For NO we need to search among all archetypes.
-				const EntityLookupKey key(EntityBad);
-				auto& data = m_lookupCtx.data;
+			//! Returns the group of \param archetype. That is the target of the first pair of the relationship
+			//! the query groups by. GroupIdBad if the archetype has no such pair.
+			GAIA_NODISCARD GroupId calc_group_id(const Archetype& archetype) const {
+				const auto rel = m_lookupCtx.data.groupBy;
+				for (auto id: archetype.ids()) {
+					if (id.pair() && id.id() == rel.id())
+						return id.gen();
+				}
+				return GroupIdBad;
+			}
 
-				const auto cache_it = data.lastMatchedArchetypeIdx_All.find(key);
-				uint32_t lastMatchedIdx = 0;
-				if (cache_it == data.lastMatchedArchetypeIdx_All.end())
-					data.lastMatchedArchetypeIdx_All.emplace(key, 0U);
-				else
-					lastMatchedIdx = cache_it->second;
-				cache_it->second = archetypes.size();
-
-				for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-					auto* pArchetype = archetypes[a];
-					if (matchesSet.contains(pArchetype))
-						continue;
-					if (match_one(*pArchetype, idsToMatch))
-						continue;
+			//! Adds \param pArchetype to the cache of matching archetypes
+			void add_archetype(Archetype* pArchetype) {
+				m_archetypeCache.push_back(pArchetype);
+				m_chunkCacheDirty = true;
+				m_sortedRowsDirty = true;
+
+				if (has_filters()) {
+					// Component indices are the same in all chunks of the archetype. Calculate them up-front
+					// so we do not have to look them up for each chunk when evaluating filters.
+					FilterCompIdxArray filterIdx;
+					for (auto comp: filters()) {
+						const auto compIdx = core::get_index(pArchetype->ids(), comp);
+						filterIdx.push_back(compIdx == BadIndex ? FilterCompIdxBad : (uint8_t)compIdx);
+					}
+					m_archetypeFilterIdx.push_back(filterIdx);
+				}
 
-					matchesSet.emplace(pArchetype);
-					matchesArr.emplace_back(pArchetype);
+				if (has_group_by()) {
+					// Keep archetypes sorted by their group. Archetypes of the same group stay in the order
+					// in which they were matched.
+					const auto groupId = calc_group_id(*pArchetype);
+					m_archetypeGroupIds.push_back(groupId);
+
+					auto idx = m_archetypeCache.size() - 1;
+					while (idx > 0 && m_archetypeGroupIds[idx - 1] > groupId) {
+						core::swap(m_archetypeCache[idx - 1], m_archetypeCache[idx]);
+						core::swap(m_archetypeGroupIds[idx - 1], m_archetypeGroupIds[idx]);
+						if (has_filters())
+							core::swap(m_archetypeFilterIdx[idx - 1], m_archetypeFilterIdx[idx]);
+						--idx;
+					}
 				}
 			}
 
-			void match_archetype_no_as(
-					const ArchetypeList& archetypes, cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr,
-					EntitySpan idsToMatch) {
-				// For NO we need to search among all archetypes.
-				const EntityLookupKey key(EntityBad);
-				auto& data = m_lookupCtx.data;
-
-				const auto cache_it = data.lastMatchedArchetypeIdx_All.find(key);
-				uint32_t lastMatchedIdx = 0;
-				if (cache_it == data.lastMatchedArchetypeIdx_All.end())
-					data.lastMatchedArchetypeIdx_All.emplace(key, 0U);
-				else
-					lastMatchedIdx = cache_it->second;
-				cache_it->second = archetypes.size();
+			//! Sorts \param rows given the comparison function \param func.
+			//! Natural merge sort is used so rows which are already mostly sorted are sorted in close to linear time.
+			//! Rows which compare equal keep their relative order.
+			template <typename Func>
+			static void sort_rows(cnt::darray<uint16_t>& rows, cnt::darray<uint16_t>& tmp, Func func) {
+				const auto cnt = rows.size();
+				if (cnt < 2)
+					return;
 
-				for (uint32_t a = lastMatchedIdx; a < archetypes.size(); ++a) {
-					auto* pArchetype = archetypes[a];
+				tmp.resize(cnt);
+				uint16_t* pSrc = rows.data();
+				uint16_t* pDst = tmp.data();
+
+				while (true) {
+					// Merge pairs of neighboring sorted runs from pSrc into pDst
+					uint32_t runs = 0;
+					uint32_t i = 0;
+					while (i < cnt) {
+						uint32_t mid = i + 1;
+						while (mid < cnt && !func(pSrc[mid], pSrc[mid - 1]))
+							++mid;
+						uint32_t end = mid;
+						if (end < cnt) {
+							++end;
+							while (end < cnt && !func(pSrc[end], pSrc[end - 1]))
+								++end;
+						}
 
-					if (matchesSet.contains(pArchetype))
-						continue;
-					if (match_one_backtrack(*pArchetype, idsToMatch))
-						continue;
+						uint32_t l = i;
+						uint32_t r = mid;
+						uint32_t o = i;
+						while (l < mid && r < end)
+							pDst[o++] = func(pSrc[r], pSrc[l]) ? pSrc[r++] : pSrc[l++];
+						while (l < mid)
+							pDst[o++] = pSrc[l++];
+						while (r < end)
+							pDst[o++] = pSrc[r++];
+
+						++runs;
+						i = end;
+					}
 
-					matchesSet.emplace(pArchetype);
-					matchesArr.emplace_back(pArchetype);
+					core::swap(pSrc, pDst);
+					if (runs == 1)
+						break;
 				}
-			}
 
-			void do_match_all(
-					const EntityToArchetypeMap& entityToArchetypeMap, const ArchetypeList& allArchetypes,
-					cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr, Entity ent, EntitySpanMut idsToMatch,
-					uint32_t as_mask_0, uint32_t as_mask_1) {
-				// First viable item is not related to an Is relationship
-				if (as_mask_0 + as_mask_1 == 0U) {
-					match_archetype_all(entityToArchetypeMap, matchesSet, matchesArr, ent, idsToMatch);
-				} else
-				// First viable item is related to an Is relationship.
-				// In this case we need to gather all related archetypes and evaluate one-by-one (backtracking).
-				{
-					match_archetype_all_as(entityToArchetypeMap, allArchetypes, matchesSet, matchesArr, ent, idsToMatch);
-				}
+				if (pSrc != rows.data())
+					memcpy(rows.data(), pSrc, cnt * sizeof(uint16_t));
 			}
 
-			void do_match_one(
-					const EntityToArchetypeMap& entityToArchetypeMap, const ArchetypeList& allArchetypes,
-					cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr, Entity ent, EntitySpanMut idsToMatch,
-					uint32_t as_mask_0, uint32_t as_mask_1) {
-				// First viable item is not related to an Is relationship
-				if (as_mask_0 + as_mask_1 == 0U) {
-					match_archetype_one(entityToArchetypeMap, matchesSet, matchesArr, ent, idsToMatch);
-				}
-				// First viable item is related to an Is relationship.
-				// In this case we need to gather all related archetypes.
-				else {
-					match_archetype_one_as(entityToArchetypeMap, allArchetypes, matchesSet, matchesArr, ent, idsToMatch);
-				}
+			//! Returns the sum of chunk list versions of matched archetypes.
+			//! Chunk list versions only ever grow so the sum changes whenever any of them does.
+			GAIA_NODISCARD uint32_t chunks_version() const {
+				uint32_t version = 0;
+				for (const auto* pArchetype: m_archetypeCache)
+					version += pArchetype->chunks_version();
+				return version;
 			}
 
-			bool do_match_one(const Archetype& archetype, EntitySpanMut idsToMatch, uint32_t as_mask_0, uint32_t as_mask_1) {
-				// First viable item is not related to an Is relationship
-				if (as_mask_0 + as_mask_1 == 0U) {
-					return match_one(archetype, idsToMatch);
-				}
-				// First viable item is related to an Is relationship.
-				// In this case we need to gather all related archetypes.
-				else {
-					return match_one_backtrack(archetype, idsToMatch);
-				}
-			}
+			//! Maximum number of archetype lists a query item can be looked up in
+			static constexpr uint32_t MaxMatchTermLists = 16;
 
-			void do_match_no(
-					const ArchetypeList& allArchetypes, cnt::set<Archetype*>& matchesSet, ArchetypeList& matchesArr,
-					EntitySpanMut idsToMatch, uint32_t as_mask_0, uint32_t as_mask_1) {
-				matchesSet.clear();
+			//! Archetype lists which together contain every archetype a query item can match.
+			//! Each list is sorted by archetype id.
+			struct MatchTerm {
+				cnt::sarr_ext<const ArchetypeList*, MaxMatchTermLists> lists;
+				//! Total number of archetypes in the lists. BadIndex if the lists could not be determined.
+				uint32_t cost;
+			};
 
-				if (as_mask_0 + as_mask_1 == 0U)
-					match_archetype_no(allArchetypes, matchesSet, matchesArr, idsToMatch);
-				else
-					match_archetype_no_as(allArchetypes, matchesSet, matchesArr, idsToMatch);
-			}
+			//! Query items of MatchIds turned into archetype lists
+			struct MatchPlan {
+				//! ALL items sorted by their cost
+				cnt::sarr_ext<MatchTerm, MAX_ITEMS_IN_QUERY> all;
+				//! Union of all ANY items
+				MatchTerm any;
+				//! Lists of NOT items which can be used to reject archetypes without evaluating them
+				cnt::sarr_ext<const ArchetypeList*, MAX_ITEMS_IN_QUERY> none;
+			};
 
-			//! Tries to match the query against archetypes in \param entityToArchetypeMap.
-			//! This is necessary so we do not iterate all chunks over and over again when running queries.
-			void match(
-					// entity -> archetypes mapping
-					const EntityToArchetypeMap& entityToArchetypeMap,
-					// all archetypes in the world
-					const ArchetypeList& allArchetypes,
-					// last matched archetype id
-					ArchetypeId archetypeLastId) {
-				static cnt::set<Archetype*> s_tmpArchetypeMatches;
-				static ArchetypeList s_tmpArchetypeMatchesArr;
-
-				struct CleanUpTmpArchetypeMatches {
-					~CleanUpTmpArchetypeMatches() {
-						s_tmpArchetypeMatches.clear();
-						s_tmpArchetypeMatchesArr.clear();
+			//! Collects the archetype lists of \param id into \param term.
+			//! Besides the archetypes containing the id directly, (Is, X) and (*, X) pairs can match archetypes
+			//! containing entities which inherit from X. Lists of these are added as well.
+			//! \return False if there are too many lists and the archetypes of the id can not be determined.
+			GAIA_NODISCARD bool
+			match_term(const EntityToArchetypeMap& entityToArchetypeMap, Entity id, bool isAs, MatchTerm& term) const {
+				bool ok = true;
+				auto addList = [&](Entity entity) {
+					const auto it = entityToArchetypeMap.find(EntityLookupKey(entity));
+					if (it == entityToArchetypeMap.end() || it->second.empty())
+						return;
+					if (term.lists.size() == MaxMatchTermLists) {
+						ok = false;
+						return;
 					}
-				} autoCleanup;
-
-				// Skip if no new archetype appeared
-				GAIA_ASSERT(archetypeLastId >= m_lastArchetypeId);
-				if (m_lastArchetypeId == archetypeLastId)
-					return;
-				m_lastArchetypeId = archetypeLastId;
-
-				GAIA_PROF_SCOPE(queryinfo::match);
-
-				auto& data = m_lookupCtx.data;
-				const auto& pairs = data.pairs;
-				if (pairs.empty())
-					return;
+					term.lists.push_back(&it->second);
+					term.cost += it->second.size();
+				};
 
-				// Array of archetypes containing the given entity/component/pair
-				cnt::sarr_ext<const ArchetypeList*, MAX_ITEMS_IN_QUERY> archetypesWithId;
-				cnt::sarr_ext<Entity, MAX_ITEMS_IN_QUERY> ids_all;
-				cnt::sarr_ext<Entity, MAX_ITEMS_IN_QUERY> ids_any;
-				cnt::sarr_ext<Entity, MAX_ITEMS_IN_QUERY> ids_none;
+				addList(id);
 
-				QueryEntityOpPairSpan ops_ids{pairs.data(), pairs.size()};
-				QueryEntityOpPairSpan ops_ids_all = ops_ids.subspan(0, data.firstAny);
-				QueryEntityOpPairSpan ops_ids_any = ops_ids.subspan(data.firstAny, data.firstNot - data.firstAny);
-				QueryEntityOpPairSpan ops_ids_not = ops_ids.subspan(data.firstNot);
+				if (!isAs || !id.pair() || is_wildcard(id.gen()))
+					return true;
 
-				if (!ops_ids_all.empty()) {
-					// Match static fixed sources
-					GAIA_EACH(ops_ids_all) {
-						auto& p = ops_ids_all[i];
-						if (p.src == EntityBad) {
-							ids_all.push_back(p.id);
-							continue;
-						}
+				const bool isIs = id.id() == Is.id();
+				if (!isIs && id.id() != All.id())
+					return true;
 
-						if (p.srcArchetype == nullptr) {
-							p.srcArchetype = archetype_from_entity(*m_lookupCtx.w, p.src);
+				const auto target = entity_from_id(*m_lookupCtx.w, id.gen());
+				as_relations_trav(*m_lookupCtx.w, target, [&](Entity relation) {
+					addList(relation);
+					if (isIs)
+						addList(Pair(Is, relation));
+				});
+				return ok;
+			}
 
-							// Archetype needs to exist. If it does not we have nothing to do here.
-							if (p.srcArchetype == nullptr)
-								return;
-						}
+			//! Turns \param ids into archetype lists and orders them by their cost.
+			//! The plan is stored in m_plan so it can be inspected later.
+			void make_plan(const EntityToArchetypeMap& entityToArchetypeMap, const MatchIds& ids, MatchPlan& plan) {
+				const auto& data = m_lookupCtx.data;
+				const bool isAs = data.as_mask + data.as_mask_2 != 0U;
+
+				m_plan.items.clear();
+
+				for (auto id: ids.all) {
+					MatchTerm term{};
+					if (!match_term(entityToArchetypeMap, id, isAs, term))
+						term.cost = BadIndex;
+
+					// Insertion sort, there are at most MAX_ITEMS_IN_QUERY items
+					uint32_t idx = plan.all.size();
+					plan.all.push_back(term);
+					m_plan.items.push_back({id, QueryOp::All, term.cost});
+					for (; idx > 0 && plan.all[idx - 1].cost > term.cost; --idx) {
+						core::swap(plan.all[idx - 1], plan.all[idx]);
+						core::swap(m_plan.items[idx - 1], m_plan.items[idx]);
 					}
+				}
 
-					// Match variable fixed sources
-					GAIA_EACH(ops_ids_all) {
-						const auto& p = ops_ids_all[i];
-						if (p.src != EntityBad)
-							continue;
+				plan.any = {};
+				for (auto id: ids.any) {
+					MatchTerm term{};
+					if (!match_term(entityToArchetypeMap, id, isAs, term))
+						term.cost = BadIndex;
+					m_plan.items.push_back({id, QueryOp::Any, term.cost});
 
-						// Pick the entity that we use to evalute archetypes.
-						// TODO: Ideally we would pick the entity associated with the least amount of archetypes
-						//       so we do not unnecessarily check too many of them.
-						//       However, we would need to take into account all the possible permutations
-						//       of "base" -> "descendant".
-						//       In order to do this efficiently the query would have to be notified by the world
-						//       that a new Is relationship exists / component was added. We definitelly evaluate
-						//       such a thing every time a query runs.
-						const auto e = ops_ids_all[i].id;
-
-						do_match_all(
-								entityToArchetypeMap, allArchetypes, s_tmpArchetypeMatches, s_tmpArchetypeMatchesArr,
-								//
-								e, ids_all, data.as_mask, data.as_mask_2);
-						break;
+					if (plan.any.cost == BadIndex)
+						continue;
+					if (term.cost == BadIndex || plan.any.lists.size() + term.lists.size() > MaxMatchTermLists) {
+						plan.any.cost = BadIndex;
+						continue;
 					}
-
-					// No ALL matches were found. We can quit right away.
-					if (s_tmpArchetypeMatchesArr.empty())
-						return;
+					for (const auto* pList: term.lists)
+						plan.any.lists.push_back(pList);
+					plan.any.cost += term.cost;
 				}
 
-				if (!ops_ids_any.empty()) {
-					archetypesWithId.clear();
+				// NOT items reject archetypes only when something else is matched as well. Wildcards and Is
+				// relationships are left for the full evaluation.
+				const bool useNone = !isAs && (ids.hasAllOps || ids.hasAnyOps);
+				for (auto id: ids.none) {
+					const auto it = entityToArchetypeMap.find(EntityLookupKey(id));
+					const uint32_t cost = it == entityToArchetypeMap.end() ? 0 : it->second.size();
+					m_plan.items.push_back({id, QueryOp::Not, cost});
 
-					// Match static fixed sources
-					GAIA_EACH(ops_ids_any) {
-						auto& p = ops_ids_any[i];
-						if (p.src != EntityBad) {
-							if (p.srcArchetype == nullptr)
-								p.srcArchetype = archetype_from_entity(*m_lookupCtx.w, p.src);
-							if (p.srcArchetype == nullptr)
-								continue;
-						}
+					if (useNone && cost > 0 && !is_wildcard(id))
+						plan.none.push_back(&it->second);
+				}
+			}
 
-						// Check if any archetype is associated with the entity id.
-						// All ids must be registered in the world.
-						const auto it = entityToArchetypeMap.find(EntityLookupKey(ops_ids_any[i].id));
-						if (it == entityToArchetypeMap.end() || it->second.empty())
-							continue;
+			//! Returns the cheapest term candidates can be gathered from. Nullptr if there is none.
+			GAIA_NODISCARD static const MatchTerm* plan_driver(const MatchPlan& plan) {
+				const MatchTerm* pDriver = nullptr;
+				if (!plan.all.empty() && plan.all[0].cost != BadIndex)
+					pDriver = &plan.all[0];
+				if (plan.any.cost != BadIndex && !plan.any.lists.empty()) {
+					if (pDriver == nullptr || plan.any.cost < pDriver->cost)
+						pDriver = &plan.any;
+				}
+				return pDriver;
+			}
 
-						archetypesWithId.push_back(&it->second);
-						ids_any.push_back(p.id);
+			//! Merges archetypes with an id not smaller than \param firstArchetypeId from lists of \param term
+			//! into \param out. The result is sorted by archetype id and contains no duplicates.
+			static void gather_term(const MatchTerm& term, ArchetypeId firstArchetypeId, ArchetypeList& out) {
+				cnt::sarr_ext<uint32_t, MaxMatchTermLists> cursors;
+				for (const auto* pList: term.lists)
+					cursors.push_back(archetype_lower_bound(*pList, firstArchetypeId));
+
+				while (true) {
+					Archetype* pMin = nullptr;
+					GAIA_EACH(term.lists) {
+						const auto& list = *term.lists[i];
+						if (cursors[i] < list.size() && (pMin == nullptr || list[cursors[i]]->id() < pMin->id()))
+							pMin = list[cursors[i]];
 					}
+					if (pMin == nullptr)
+						break;
 
-					// No archetypes with "any" entities exist. We can quit right away.
-					if (archetypesWithId.empty())
-						return;
+					out.push_back(pMin);
+
+					// Skip the archetype in all lists
+					GAIA_EACH(term.lists) {
+						const auto& list = *term.lists[i];
+						if (cursors[i] < list.size() && list[cursors[i]] == pMin)
+							++cursors[i];
+					}
 				}
+			}
 
-				if (!ids_any.empty()) {
-					if (ops_ids_all.empty()) {
-						// We didn't try to match any ALL items.
-						// We need to search among all archetypes.
+			//! Checks if \param pArchetype is present in \param list
+			GAIA_NODISCARD static bool list_has(const ArchetypeList& list, const Archetype* pArchetype) {
+				const auto idx = archetype_lower_bound(list, pArchetype->id());
+				return idx < list.size() && list[idx] == pArchetype;
+			}
 
-						// Try find matches with optional components.
-						GAIA_EACH(ids_any) {
-							do_match_one(
-									entityToArchetypeMap, allArchetypes, s_tmpArchetypeMatches, s_tmpArchetypeMatchesArr, ids_any[i],
-									ids_any, data.as_mask, data.as_mask_2);
-						}
-					} else {
-						// We tried to match ALL items. Only search among those we already found.
-						// No last matched idx update is necessary because all ids were already checked
-						// during the ALL pass.
-						for (uint32_t i = 0; i < s_tmpArchetypeMatchesArr.size();) {
-							auto* pArchetype = s_tmpArchetypeMatchesArr[i];
-
-							for (auto _: ids_any) {
-								if (do_match_one(*pArchetype, ids_any, data.as_mask, data.as_mask_2))
-									goto checkNextArchetype;
-							}
+			//! Checks if \param pArchetype is present in any list of \param term
+			GAIA_NODISCARD static bool term_has(const MatchTerm& term, const Archetype* pArchetype) {
+				for (const auto* pList: term.lists) {
+					if (list_has(*pList, pArchetype))
+						return true;
+				}
+				return false;
+			}
 
-							// No match found among ANY. Remove the archetype from the matching ones
-							core::erase_fast(s_tmpArchetypeMatchesArr, i);
+			//! Keeps only the archetypes in \param candidates which pass all terms of \param plan
+			//! except for \param pDriver which they were gathered from.
+			static void filter_candidates(const MatchPlan& plan, const MatchTerm* pDriver, ArchetypeList& candidates) {
+				uint32_t cnt = 0;
+				for (auto* pArchetype: candidates) {
+					bool ok = true;
+					for (const auto& term: plan.all) {
+						if (&term == pDriver || term.cost == BadIndex)
 							continue;
+						if (!term_has(term, pArchetype)) {
+							ok = false;
+							break;
+						}
+					}
+					if (!ok)
+						continue;
+
+					if (&plan.any != pDriver && plan.any.cost != BadIndex && !plan.any.lists.empty() &&
+							!term_has(plan.any, pArchetype))
+						continue;
 
-						checkNextArchetype:
-							++i;
+					for (const auto* pList: plan.none) {
+						if (list_has(*pList, pArchetype)) {
+							ok = false;
+							break;
 						}
 					}
+					if (!ok)
+						continue;
+
+					candidates[cnt++] = pArchetype;
 				}
+				candidates.resize(cnt);
+			}
 
-				// Make sure there is no match with NOT items.
-				if (!ops_ids_not.empty()) {
-					GAIA_EACH(ops_ids_not) {
-						const auto& p = ops_ids_not[i];
-						if (p.src == EntityBad)
-							ids_none.push_back(p.id);
-					}
+		public:
+			//! Matches the query against archetypes created since the last call.
+			//! The first call matches against all existing archetypes.
+			//! Matching is re-entrant. Scratch data lives on the caller's stack, only the state of this query
+			//! is modified and the world is only read. Different queries can therefore be matched on different
+			//! threads at the same time as long as the world does not change meanwhile.
+			//! \param entityToArchetypeMap Map of entities to archetypes containing them
+			//! \param archetypes Archetypes of the world in the order of their creation
+			//! \param nextArchetypeId Id the next created archetype is going to get
+			void match(
+					const EntityToArchetypeMap& entityToArchetypeMap, const ArchetypeList& archetypes,
+					ArchetypeId nextArchetypeId) {
+				// Skip if no new archetype appeared
+				GAIA_ASSERT(nextArchetypeId >= m_nextArchetypeId);
+				if (m_nextArchetypeId == nextArchetypeId)
+					return;
 
-					// We searched for nothing more than NO matches
-					if (ops_ids_all.empty() && ops_ids_any.empty()) {
-						do_match_no(
-								allArchetypes, s_tmpArchetypeMatches, m_archetypeCache,
-								//
-								ids_none, data.as_mask, data.as_mask_2);
-					} else {
-						// Write the temporary matches to cache if no match with NO is found
-						for (auto* pArchetype: s_tmpArchetypeMatchesArr) {
-							if (match_one(*pArchetype, ids_none))
-								continue;
+				const auto firstArchetypeId = m_nextArchetypeId;
+				m_nextArchetypeId = nextArchetypeId;
 
-							m_archetypeCache.push_back(pArchetype);
-						}
+				GAIA_PROF_SCOPE(queryinfo::match);
+
+				MatchIds ids;
+				if (!prepare_match_ids(entityToArchetypeMap, ids))
+					return;
+
+				MatchPlan plan;
+				make_plan(entityToArchetypeMap, ids, plan);
+
+				// Candidates come from the cheapest archetype list. Lists are sorted by archetype id
+				// so only archetypes created since the last time are gathered. Lists of the remaining
+				// items then filter the candidates so only a few of them need to be evaluated fully.
+				if (const auto* pDriver = plan_driver(plan)) {
+					ArchetypeList candidates;
+					gather_term(*pDriver, firstArchetypeId, candidates);
+					filter_candidates(plan, pDriver, candidates);
+
+					m_plan.candidates = candidates.size();
+					m_plan.intersect = true;
+					for (auto* pArchetype: candidates) {
+						if (match_archetype(*pArchetype, ids))
+							add_archetype(pArchetype);
 					}
-				} else {
-					// Write the temporary matches to cache
-					for (auto* pArchetype: s_tmpArchetypeMatchesArr)
-						m_archetypeCache.push_back(pArchetype);
+					return;
 				}
+
+				// Archetypes are stored in the order of their creation so only the tail of the list
+				// needs to be evaluated.
+				const auto firstIdx = archetype_lower_bound(archetypes, firstArchetypeId);
+				m_plan.candidates = archetypes.size() - firstIdx;
+				m_plan.intersect = false;
+				for (uint32_t i = firstIdx; i < archetypes.size(); ++i) {
+					auto* pArchetype = archetypes[i];
+					if (match_archetype(*pArchetype, ids))
+						add_archetype(pArchetype);
+				}
+			}
+
+			//! Returns the plan used when the query was matched against archetypes the last time
+			GAIA_NODISCARD const QueryPlan& plan() const {
+				return m_plan;
 			}
 
 			GAIA_NODISCARD QueryId id() const {
@@ -865,19 +1009,182 @@ namespace gaia {
 				const auto idx = core::get_index(m_archetypeCache, pArchetype);
 				if (idx == BadIndex)
 					return;
-				core::erase_fast(m_archetypeCache, idx);
-
-				// An archetype was removed from the world so the last matching archetype index needs to be
-				// lowered by one for every component context.
-				auto clearMatches = [](QueryArchetypeCacheIndexMap& matches) {
-					for (auto& pair: matches) {
-						auto& lastMatchedArchetypeIdx = pair.second;
-						if (lastMatchedArchetypeIdx > 0)
-							--lastMatchedArchetypeIdx;
+				if (has_group_by()) {
+					// Grouped archetypes need to stay sorted
+					m_archetypeCache.erase(m_archetypeCache.begin() + idx);
+					m_archetypeGroupIds.erase(m_archetypeGroupIds.begin() + idx);
+					if (has_filters())
+						m_archetypeFilterIdx.erase(m_archetypeFilterIdx.begin() + idx);
+				} else {
+					core::erase_fast(m_archetypeCache, idx);
+					if (has_filters())
+						core::erase_fast(m_archetypeFilterIdx, idx);
+				}
+				m_chunkCacheDirty = true;
+				m_sortedRowsDirty = true;
+			}
+
+			//! Forgets all matched archetypes. The next match starts from the first archetype of the world.
+			void reset() {
+				m_archetypeCache.clear();
+				m_archetypeFilterIdx.clear();
+				m_nextArchetypeId = 0;
+				m_worldVersion = 0;
+				m_plan = {};
+				m_chunkCache = {};
+				m_chunkCacheDirty = true;
+				m_archetypeGroupIds.clear();
+				m_sortedRows = {};
+				m_sortedRowsDirty = true;
+			}
+
+			//! Returns chunks of all matched archetypes which are not requested to be deleted.
+			//! The list is only rebuilt when chunks are added to or removed from any of these archetypes
+			//! or when the set of matched archetypes changes. Otherwise it is returned as it is.
+			//! Chunks in the list are not guaranteed to contain any entities.
+			GAIA_NODISCARD const cnt::darray<ChunkCacheItem>& chunk_cache() {
+				const auto version = chunks_version();
+				if (m_chunkCacheDirty || version != m_chunkCacheVersion) {
+					GAIA_PROF_SCOPE(queryinfo::chunk_cache);
+
+					m_chunkCache.clear();
+					const auto& queryIds = ids();
+					for (auto* pArchetype: m_archetypeCache) {
+						if (pArchetype->is_req_del())
+							continue;
+
+						// Component indices are the same in all chunks of the archetype
+						ChunkCacheItem item{};
+						GAIA_EACH(queryIds) {
+							const auto compIdx = core::get_index(pArchetype->ids(), queryIds[i]);
+							item.compIdx[i] = compIdx == BadIndex ? ChunkCacheCompIdxBad : (uint8_t)compIdx;
+						}
+
+						for (auto* pChunk: pArchetype->chunks()) {
+							item.pChunk = pChunk;
+							GAIA_EACH(queryIds) {
+								const auto compIdx = item.compIdx[i];
+								item.pData[i] = compIdx == ChunkCacheCompIdxBad ? nullptr : pChunk->comp_ptr_mut(compIdx);
+							}
+							m_chunkCache.push_back(item);
+						}
 					}
-				};
-				clearMatches(m_lookupCtx.data.lastMatchedArchetypeIdx_All);
-				clearMatches(m_lookupCtx.data.lastMatchedArchetypeIdx_Any);
+
+					m_chunkCacheVersion = version;
+					m_chunkCacheDirty = false;
+				}
+
+				return m_chunkCache;
+			}
+
+			//! Returns true if the query orders entities, see sorted_rows
+			GAIA_NODISCARD bool has_order_by() const {
+				return m_lookupCtx.data.orderBy != EntityBad;
+			}
+
+			//! Returns true if the query groups archetypes, see group_range
+			GAIA_NODISCARD bool has_group_by() const {
+				return m_lookupCtx.data.groupBy != EntityBad;
+			}
+
+			//! Drops ordered rows of all chunks if chunks of matched archetypes or the set of matched archetypes
+			//! changed since the last call. Needs to be called before sorted_rows are requested.
+			void sync_sorted_rows() {
+				const auto version = chunks_version();
+				if (m_sortedRowsDirty || version != m_sortedRowsVersion) {
+					// Chunks might have been released and their memory reused. Forget about all of them.
+					m_sortedRows.clear();
+					m_sortedRowsVersion = version;
+					m_sortedRowsDirty = false;
+				}
+			}
+
+			//! Returns rows of enabled entities of \param chunk in the order given by the query.
+			//! Rows are only sorted again when the sorted component changes or entities of the chunk move.
+			//! Rows of chunks without the sorted component are returned in their storage order.
+			//! \warning sync_sorted_rows needs to be called before the first call of each iteration.
+			GAIA_NODISCARD std::span<const uint16_t> sorted_rows(const Chunk& chunk) {
+				GAIA_ASSERT(has_order_by());
+				GAIA_PROF_SCOPE(queryinfo::sorted_rows);
+
+				const auto& data = m_lookupCtx.data;
+				const auto compIdx = core::get_index(chunk.ents_id_view(), data.orderBy);
+				const auto version = compIdx == BadIndex ? ComponentVersion{} : chunk.comp_version(compIdx);
+				const auto rowVersion = chunk.row_version();
+				const auto from = chunk.size_disabled();
+				const auto to = chunk.size();
+
+				auto& entry = m_sortedRows[&chunk];
+				const bool moved = entry.rowVersion != rowVersion || entry.from != from || entry.to != to;
+				if (!moved && entry.version == version)
+					return {entry.rows.data(), entry.rows.size()};
+
+				if (moved) {
+					// Entities moved around. Start with rows in their storage order.
+					entry.rows.resize(to - from);
+					GAIA_FOR2(from, to) entry.rows[i - from] = (uint16_t)i;
+				}
+
+				// Values of the previous sort are likely to be mostly sorted still
+				if (compIdx != BadIndex) {
+					const auto func = data.orderByFunc;
+					sort_rows(entry.rows, m_sortTmp, [&](uint16_t left, uint16_t right) {
+						return func(chunk.comp_ptr(compIdx, left), chunk.comp_ptr(compIdx, right)) < 0;
+					});
+				}
+
+				entry.version = version;
+				entry.rowVersion = rowVersion;
+				entry.from = from;
+				entry.to = to;
+				return {entry.rows.data(), entry.rows.size()};
+			}
+
+			//! Returns the group of the cached archetype at the index \param archetypeIdx
+			//! \warning Only valid for queries which group archetypes.
+			GAIA_NODISCARD GroupId group_id(uint32_t archetypeIdx) const {
+				GAIA_ASSERT(has_group_by());
+				return m_archetypeGroupIds[archetypeIdx];
+			}
+
+			//! Returns the range of cached archetypes which belong to the group \param groupId.
+			//! All cached archetypes are returned if \param groupId is GroupIdBad or the query does not group archetypes.
+			GAIA_NODISCARD ArchetypeCacheRange group_range(GroupId groupId) const {
+				const auto cnt = m_archetypeCache.size();
+				if (groupId == GroupIdBad || !has_group_by())
+					return {0, cnt};
+
+				// Groups are sorted so a binary search is enough
+				uint32_t lo = 0;
+				uint32_t hi = cnt;
+				while (lo < hi) {
+					const auto mid = (lo + hi) / 2;
+					if (m_archetypeGroupIds[mid] < groupId)
+						lo = mid + 1;
+					else
+						hi = mid;
+				}
+				uint32_t to = lo;
+				while (to < cnt && m_archetypeGroupIds[to] == groupId)
+					++to;
+				return {lo, to};
+			}
+
+			//! Returns the number of archetypes matching the query
+			GAIA_NODISCARD uint32_t cache_size() const {
+				return m_archetypeCache.size();
+			}
+
+			//! Returns the cached archetype at the index \param archetypeIdx
+			GAIA_NODISCARD Archetype* archetype(uint32_t archetypeIdx) const {
+				return m_archetypeCache[archetypeIdx];
+			}
+
+			//! Returns indices of filtered components in the cached archetype at the index \param archetypeIdx.
+			//! \warning Only valid for queries with filters.
+			GAIA_NODISCARD const FilterCompIdxArray& filter_comp_idx(uint32_t archetypeIdx) const {
+				GAIA_ASSERT(has_filters());
+				return m_archetypeFilterIdx[archetypeIdx];
 			}
 
 			GAIA_NODISCARD ArchetypeList::iterator begin() {
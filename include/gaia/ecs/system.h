@@ -10,6 +10,30 @@ namespace gaia {
 		class System: public BaseSystem {
 			friend class World;
 			friend struct ExecutionContextBase;
+
+			//! Per-thread command buffers of the system
+			ThreadCommandBuffer* m_pCmdBuffer = nullptr;
+
+		protected:
+			~System() override {
+				delete m_pCmdBuffer;
+			}
+
+			//! Returns the command buffer of the calling thread. Can be used from jobs spawned by the system.
+			//! Recorded commands are committed once all systems finished updating. Systems are committed in
+			//! the order they are sorted in. Commands of a single system are committed in the order of threads.
+			GAIA_NODISCARD CommandBuffer& cmd_buffer() {
+				return m_pCmdBuffer->get();
+			}
+
+		private:
+			void init() override {
+				m_pCmdBuffer = new ThreadCommandBuffer(world());
+			}
+
+			void commit() override {
+				m_pCmdBuffer->commit();
+			}
 		};
 
 		class SystemManager final: public BaseSystemManager {
@@ -18,7 +42,7 @@ namespace gaia {
 
 		public:
 			SystemManager(World& world):
-					BaseSystemManager(world), m_beforeUpdateCmdBuffer(world), m_afterUpdateCmdBuffer(world) {}
+					BaseSystemManager(world, world.world_version()), m_beforeUpdateCmdBuffer(world), m_afterUpdateCmdBuffer(world) {}
 
 			CommandBuffer& BeforeUpdateCmdBufer() {
 				return m_beforeUpdateCmdBuffer;
@@ -9,10 +9,16 @@
 	#include "../config/logging.h"
 #endif
 #include "../cnt/darray.h"
+#include "../cnt/darray_ext.h"
+#include "../cnt/dbitset.h"
 #include "../cnt/map.h"
 #include "../core/hashing_policy.h"
 #include "../core/utility.h"
 #include "../meta/type_info.h"
+#include "../mt/threadpool.h"
+#include "common.h"
+#include "id.h"
+#include "query_common.h"
 
 namespace gaia {
 	namespace ecs {
@@ -38,6 +44,23 @@ namespace gaia {
 			bool m_enabled = true;
 			//! If true, the system is to be destroyed
 			bool m_destroy = false;
+			//! If true, the system declared which components it accesses
+			bool m_hasAccess = false;
+			//! If true, the declared access changed since the last time system dependencies were built
+			bool m_accessChanged = false;
+			//! Components the system reads
+			cnt::darray<Entity> m_reads;
+			//! Components the system writes
+			cnt::darray<Entity> m_writes;
+
+			struct QueryRef {
+				//! Query registered via access()
+				void* pQuery;
+				//! Makes sure the query is matched against the latest archetypes
+				void (*prepare)(void* pQuery);
+			};
+			//! Queries the system declared access with
+			cnt::darray<QueryRef> m_queries;
 
 		protected:
 			BaseSystem() = default;
@@ -104,7 +127,102 @@ namespace gaia {
 				return false;
 			}
 
+			//! Registers read or write access to \param entity.
+			//! \param entity Component or entity accessed by the system
+			//! \param isReadWrite True if the system writes to \param entity. False if it only reads it.
+			void access(Entity entity, bool isReadWrite) {
+				m_hasAccess = true;
+
+				if (isReadWrite) {
+					if (core::has(m_writes, entity))
+						return;
+
+					const auto idx = core::get_index(m_reads, entity);
+					if (idx != BadIndex)
+						core::erase_fast(m_reads, idx);
+					m_writes.push_back(entity);
+				} else {
+					if (core::has(m_writes, entity) || core::has(m_reads, entity))
+						return;
+
+					m_reads.push_back(entity);
+				}
+
+				m_accessChanged = true;
+			}
+
+			//! Registers all items of \param query with the system. Excluded items are ignored.
+			//! Systems which declare their access can run in parallel with systems they do not conflict with.
+			//! Systems which never declare any access are considered to conflict with every other system.
+			//! Registered queries are matched on the main thread before the system is dispatched.
+			//! \warning The query needs to stay alive for as long as the system exists.
+			//! \warning When systems run in parallel, every cached query a system runs needs to be registered.
+			//!          Cached queries can't be created or matched on worker threads.
+			template <typename TQuery>
+			void access(TQuery& query) {
+				m_hasAccess = true;
+
+				const bool isRegistered = core::has_if(m_queries, [&](const QueryRef& ref) {
+					return ref.pQuery == (void*)&query;
+				});
+				if (!isRegistered) {
+					QueryRef ref;
+					ref.pQuery = (void*)&query;
+					ref.prepare = [](void* pQuery) {
+						(void)((TQuery*)pQuery)->fetch();
+					};
+					m_queries.push_back(ref);
+				}
+
+				const auto& data = query.fetch().data();
+				GAIA_EACH(data.pairs) {
+					if (data.pairs[i].op == QueryOp::Not)
+						continue;
+
+					const bool isReadWrite = (data.readWriteMask & (1U << i)) != 0U;
+					access(data.ids[i], isReadWrite);
+				}
+			}
+
 		private:
+			//! Checks if \param other accesses data in a way that prevents it from running in parallel with this system.
+			//! \return True if the systems conflict. False otherwise.
+			GAIA_NODISCARD bool conflicts(const BaseSystem& other) const {
+				if (!m_hasAccess || !other.m_hasAccess)
+					return true;
+
+				for (auto e: m_writes) {
+					if (core::has(other.m_writes, e) || core::has(other.m_reads, e))
+						return true;
+				}
+				for (auto e: other.m_writes) {
+					if (core::has(m_reads, e))
+						return true;
+				}
+
+				return false;
+			}
+
+			//! Matches registered queries on the calling thread so no archetype matching is necessary
+			//! once the system runs on a worker thread.
+			void prepare_queries() {
+				for (auto& ref: m_queries)
+					ref.prepare(ref.pQuery);
+			}
+
+			//! Called once the system is registered with a system manager and bound to a world
+			virtual void init() {}
+			//! Called on the main thread once all systems finished updating.
+			//! Commits changes the system deferred during its update.
+			virtual void commit() {}
+
+			void run() {
+				GAIA_PROF_SCOPE2(&m_name[0]);
+				BeforeOnUpdate();
+				OnUpdate();
+				AfterOnUpdate();
+			}
+
 			void set_destroyed(bool destroy) {
 				m_destroy = destroy;
 			}
@@ -118,6 +236,8 @@ namespace gaia {
 			using SystemHash = core::direct_hash_key<uint64_t>;
 
 			World& m_world;
+			//! Version of the world
+			uint32_t& m_worldVersion;
 			//! Map of all systems - used for look-ups only
 			cnt::map<SystemHash, BaseSystem*> m_systemsMap;
 			//! List of systems - used for iteration
@@ -126,9 +246,17 @@ namespace gaia {
 			cnt::darray<BaseSystem*> m_systemsToCreate;
 			//! List of systems which need to be deleted
 			cnt::darray<BaseSystem*> m_systemsToDelete;
+			//! For each system in m_systems, indices of preceding systems it has to wait for
+			cnt::darray<cnt::darray<uint32_t>> m_systemDeps;
+			//! Job handles of systems scheduled in the current frame
+			cnt::darray<mt::JobHandle> m_systemJobs;
+			//! If true, systems with no conflicting access are run in parallel
+			bool m_parallel = false;
+			//! If true, system dependencies need to be rebuilt
+			bool m_depsDirty = true;
 
 		public:
-			BaseSystemManager(World& world): m_world(world) {}
+			BaseSystemManager(World& world, uint32_t& worldVersion): m_world(world), m_worldVersion(worldVersion) {}
 			virtual ~BaseSystemManager() {
 				clear();
 			}
@@ -153,6 +281,9 @@ namespace gaia {
 
 				m_systemsToCreate.clear();
 				m_systemsToDelete.clear();
+
+				m_systemDeps.clear();
+				m_depsDirty = true;
 			}
 
 			void cleanup() {
@@ -175,9 +306,13 @@ namespace gaia {
 				}
 				for (auto* pSystem: m_systemsToDelete)
 					delete pSystem;
+				if GAIA_UNLIKELY (!m_systemsToDelete.empty())
+					m_depsDirty = true;
 				m_systemsToDelete.clear();
 
 				if GAIA_UNLIKELY (!m_systemsToCreate.empty()) {
+					m_depsDirty = true;
+
 					// Sort systems if necessary
 					sort();
 
@@ -192,21 +327,41 @@ namespace gaia {
 
 				OnBeforeUpdate();
 
-				for (auto* pSystem: m_systems) {
-					if (!pSystem->enabled())
-						continue;
+				if (m_parallel)
+					update_par();
+				else {
+					for (auto* pSystem: m_systems) {
+						if (!pSystem->enabled())
+							continue;
 
-					{
-						GAIA_PROF_SCOPE2(&pSystem->m_name[0]);
-						pSystem->BeforeOnUpdate();
-						pSystem->OnUpdate();
-						pSystem->AfterOnUpdate();
+						pSystem->run();
 					}
 				}
 
+				// Commit changes deferred by systems. Systems are committed in the order they are sorted in
+				// so the result does not depend on whether or how they were run in parallel.
+				for (auto* pSystem: m_systems)
+					pSystem->commit();
+
 				OnAfterUpdate();
 			}
 
+			//! Enables or disables parallel execution of systems.
+			//! When enabled, systems which do not conflict in their component access are scheduled as jobs and
+			//! run concurrently. Conflicting systems run in the same order they would run serially.
+			//! \warning Systems running in parallel must not make structural changes to the world directly.
+			//!          Use command buffers instead.
+			//! \warning Systems running in parallel run on worker threads. They can't use Query::each_par
+			//!          or schedule jobs and every cached query they run needs to be registered via BaseSystem::access.
+			void parallel(bool enable) {
+				m_parallel = enable;
+			}
+
+			//! Returns true if systems are run in parallel
+			GAIA_NODISCARD bool parallel() const {
+				return m_parallel;
+			}
+
 			template <typename T>
 			T* add([[maybe_unused]] const char* name = nullptr) {
 				GAIA_SAFE_CONSTEXPR auto hash = meta::type_info::hash<std::decay_t<T>>();
@@ -217,6 +372,7 @@ namespace gaia {
 
 				BaseSystem* pSystem = new T();
 				pSystem->m_world = &m_world;
+				pSystem->init();
 
 #if GAIA_PROFILER_CPU
 				if (name == nullptr) {
@@ -266,6 +422,115 @@ namespace gaia {
 			virtual void OnAfterUpdate() {}
 
 		private:
+			//! Builds the list of dependencies for each system.
+			//! System B depends on system A if A precedes B in the sorted list of systems and both their access
+			//! conflicts or one of them explicitly depends on the other. Dependencies which are already implied
+			//! by some other dependency are not stored.
+			void build_deps() {
+				GAIA_PROF_SCOPE(BaseSystemManager::build_deps);
+
+				const auto cnt = m_systems.size();
+				m_systemDeps.resize(cnt);
+
+				// Set of systems each system transitively depends on
+				cnt::darray<cnt::dbitset> reach;
+				reach.resize(cnt);
+
+				GAIA_FOR_(cnt, j) {
+					auto* pSystem = m_systems[j];
+					pSystem->m_accessChanged = false;
+
+					auto& deps = m_systemDeps[j];
+					deps.clear();
+
+					auto& reachJ = reach[j];
+					reachJ.resize(cnt);
+
+					for (uint32_t i = j; i-- > 0;) {
+						// Already waiting for this system through some other dependency
+						if (reachJ.test(i))
+							continue;
+
+						const auto* pOther = m_systems[i];
+						if (!pSystem->conflicts(*pOther) && !pSystem->DependsOn(pOther) && !pOther->DependsOn(pSystem))
+							continue;
+
+						deps.push_back(i);
+						reachJ.set(i);
+						GAIA_FOR_(i, k) {
+							if (reach[i].test(k))
+								reachJ.set(k);
+						}
+					}
+				}
+
+				m_depsDirty = false;
+			}
+
+			//! Runs systems as jobs respecting their dependencies and waits for all of them to finish.
+			void update_par() {
+				GAIA_PROF_SCOPE(BaseSystemManager::update_par);
+
+				bool accessChanged = false;
+				for (auto* pSystem: m_systems)
+					accessChanged |= pSystem->m_accessChanged;
+				if (m_depsDirty || accessChanged)
+					build_deps();
+
+				auto& tp = mt::ThreadPool::get();
+
+				// Register a job for each system. Disabled systems get an empty job so
+				// dependencies passing through them remain valid.
+				const auto cnt = m_systems.size();
+				m_systemJobs.resize(cnt);
+				GAIA_FOR(cnt) {
+					auto* pSystem = m_systems[i];
+					mt::Job job;
+					if (pSystem->enabled()) {
+						pSystem->prepare_queries();
+
+						// The world version is moved forward here rather than by the system's queries so it is
+						// never modified from multiple threads. Every system gets a version of its own. Systems
+						// are sorted so that any system a system depends on runs with an older version. Therefore,
+						// changed() filters see changes made by systems which ran after them the last time.
+						update_version(m_worldVersion);
+						const auto version = m_worldVersion;
+						auto* pWorldVersion = &m_worldVersion;
+						job.func = [pSystem, pWorldVersion, version]() {
+							detail::SystemVersionScope scope(*pWorldVersion, version);
+							pSystem->run();
+						};
+					}
+					m_systemJobs[i] = tp.add(job);
+				}
+
+				// Set up dependencies
+				cnt::darray_ext<mt::JobHandle, 32> depHandles;
+				GAIA_FOR(cnt) {
+					const auto& deps = m_systemDeps[i];
+					if (deps.empty())
+						continue;
+
+					depHandles.clear();
+					for (auto idx: deps)
+						depHandles.push_back(m_systemJobs[idx]);
+					tp.dep(m_systemJobs[i], {depHandles.data(), depHandles.size()});
+				}
+
+				// The frame job depends on all system jobs. Waiting for it releases all of them.
+				// Waiting for system jobs one by one is not possible because a finished job could
+				// be released while a job depending on it did not run yet.
+				mt::Job frameJob;
+				auto frameJobHandle = tp.add(frameJob);
+				tp.dep(frameJobHandle, {m_systemJobs.data(), m_systemJobs.size()});
+
+				// Submit all jobs and wait for them to finish
+				for (auto jobHandle: m_systemJobs)
+					tp.submit(jobHandle);
+				tp.submit(frameJobHandle);
+				tp.wait(frameJobHandle);
+			}
+
 			void sort() {
 				GAIA_FOR_(m_systems.size() - 1, l) {
 					auto min = l;
@@ -1,6 +1,7 @@
 #pragma once
 #include "../config/config.h"
 
+#include <chrono>
 #include <cstdint>
 #include <type_traits>
 
@@ -30,6 +31,7 @@
 #include "component_getter.h"
 #include "component_setter.h"
 #include "component_utils.h"
+#include "data_buffer.h"
 #include "entity_container.h"
 #include "id.h"
 #include "query.h"
@@ -45,6 +47,7 @@ namespace gaia {
 			friend class CommandBuffer;
 			friend void* AllocateChunkMemory(World& world);
 			friend void ReleaseChunkMemory(World& world, void* mem);
+			friend Entity entity_from_rec(const World& world, EntityId id);
 
 			using EntityNameLookupKey = core::StringLookupKey<256>;
 			using PairMap = cnt::map<EntityLookupKey, cnt::set<EntityLookupKey>>;
@@ -78,7 +81,8 @@ namespace gaia {
 			//! Map of target -> relations
 			PairMap m_targetsToRelations;
 
-			//! List of all archetypes
+			//! List of all archetypes ordered by their creation (and therefore by their id).
+			//! Cached queries keep a cursor into it and only ever test archetypes past the cursor.
 			ArchetypeList m_archetypes;
 			//! Map of archetypes identified by their component hash code
 			cnt::map<ArchetypeLookupKey, Archetype*> m_archetypesByHash;
@@ -112,12 +116,24 @@ namespace gaia {
 			//! ID of the last defragmented archetype
 			uint32_t m_defragLastArchetypeID = 0;
 			ArchetypeIdLookupKey::LookupHash m_defragLastArchetypeIDHash = {0};
-			//! Maximum number of entities to defragment per world tick
+			//! Maximum number of entities to defragment per world tick.
+			//! With a time budget set it is the number of entities moved between checks of the time spent.
 			uint32_t m_defragEntitesPerTick = 100;
+			//! Time budget for defragmentation per world tick in microseconds. Zero means no time budget.
+			uint32_t m_defragBudgetUs = 0;
+			//! Statistics of the last defragmentation
+			DefragStats m_defragStats{};
 
 			//! With every structural change world version changes
 			uint32_t m_worldVersion = 0;
 
+			//! Identifies the beginning of a world snapshot
+			static constexpr uint32_t SnapshotMagic = 0x41494147; // "GAIA"
+			//! Identifies the beginning of a delta snapshot
+			static constexpr uint32_t SnapshotDeltaMagic = 0x44494147; // "GAID"
+			//! Version of the world snapshot format
+			static constexpr uint32_t SnapshotVersion = 2;
+
 		public:
 			EntityContainer& fetch(Entity entity) {
 				// Valid entity
@@ -156,6 +172,11 @@ namespace gaia {
 					m_pArchetype = ec.pArchetype;
 				}
 
+				//! Continues building from \param pArchetype rather than from the entity's current archetype.
+				//! Used when changes to the entity were gathered earlier without moving it.
+				EntityBuilder(World& world, Entity entity, Archetype* pArchetype):
+						m_world(world), m_entity(entity), m_pArchetype(pArchetype) {}
+
 				EntityBuilder(const EntityBuilder&) = default;
 				EntityBuilder(EntityBuilder&&) = delete;
 				EntityBuilder& operator=(const EntityBuilder&) = delete;
@@ -178,6 +199,14 @@ namespace gaia {
 					m_pArchetype = nullptr;
 				}
 
+				//! Returns the archetype gathered changes would move the entity to without moving it.
+				//! \warning Once called, the object is returned to its default state (as if no add/remove was ever called).
+				GAIA_NODISCARD Archetype* release() {
+					auto* pArchetype = m_pArchetype;
+					m_pArchetype = nullptr;
+					return pArchetype;
+				}
+
 				//! Prepares an archetype movement by following the "add" edge of the current archetype.
 				//! \param entity Added entity
 				EntityBuilder& add(Entity entity) {
@@ -393,6 +422,14 @@ namespace gaia {
 					if (m_pArchetype->has(entity))
 						return;
 
+					handle_add_records(entity);
+
+					m_pArchetype = m_world.foc_archetype_add(m_pArchetype, entity);
+				}
+
+				//! Updates the flags of m_entity and the relationship maps as if \param entity was added to it.
+				//! Used directly when entities are placed into an archetype containing \param entity already.
+				void handle_add_records(Entity entity) {
 					try_set_flags(entity, true);
 
 					// Update the Is relationship base counter if necessary
@@ -410,8 +447,6 @@ namespace gaia {
 						// auto& ec = m_world.fetch(tgt);
 						// m_world.add_entity_archetype_pair(m_entity, ec.pArchetype);
 					}
-
-					m_pArchetype = m_world.foc_archetype_add(m_pArchetype, entity);
 				}
 
 				void handle_del(Entity entity) {
@@ -478,6 +513,244 @@ namespace gaia {
 				}
 			};
 
+			//! Adds or removes entities to/from all entities matched by a query at once.
+			//! Archetype movements are resolved once per source archetype and entities are
+			//! then moved a chunk range at a time rather than one by one.
+			struct BulkBuilder final {
+				friend class World;
+
+				struct Op {
+					//! Added or removed entity
+					Entity entity;
+					//! True if the entity is added, false if it is removed
+					bool add;
+				};
+
+				World& m_world;
+				//! Chunks matched by the query
+				cnt::darray<Chunk*> m_chunks;
+				//! List of add/del operations in the order they were requested
+				cnt::sarr_ext<Op, Chunk::MAX_COMPONENTS> m_ops;
+				//! Decides which entities of the matched chunks are affected
+				Constraints m_constraints;
+				//! True if there are any pairs among the operations
+				bool m_hasPairs = false;
+
+				template <bool UseCaching>
+				BulkBuilder(World& world, detail::QueryImpl<UseCaching>& query, Constraints constraints):
+						m_world(world), m_constraints(constraints) {
+					query.chunks(m_chunks, constraints);
+				}
+
+				BulkBuilder(const BulkBuilder&) = delete;
+				BulkBuilder(BulkBuilder&&) = delete;
+				BulkBuilder& operator=(const BulkBuilder&) = delete;
+				BulkBuilder& operator=(BulkBuilder&&) = delete;
+
+				~BulkBuilder() {
+					commit();
+				}
+
+				//! Commits all gathered changes and performs archetype movements.
+				//! \warning Once called, the object is returned to its default state (as if no add/remove was ever called).
+				void commit() {
+					GAIA_PROF_SCOPE(BulkBuilder::commit);
+
+					if (!m_ops.empty()) {
+						// Pairs need per-entity bookkeeping (Is relationship, entity flags) so handle them
+						// the slow way. Generic entities and components are moved a chunk at a time.
+						if (m_hasPairs)
+							commit_per_entity();
+						else
+							commit_per_chunk();
+					}
+
+					m_chunks.clear();
+					m_ops.clear();
+					m_hasPairs = false;
+				}
+
+				//! Prepares addition of \param entity to all matched entities.
+				BulkBuilder& add(Entity entity) {
+					GAIA_ASSERT(m_world.valid(entity));
+					GAIA_ASSERT(!is_wildcard(entity));
+
+					m_ops.push_back({entity, true});
+					m_hasPairs |= entity.pair();
+					return *this;
+				}
+
+				//! Prepares addition of \param pair to all matched entities.
+				BulkBuilder& add(Pair pair) {
+					GAIA_ASSERT(m_world.valid(pair.first()));
+					GAIA_ASSERT(m_world.valid(pair.second()));
+
+					return add((Entity)pair);
+				}
+
+				template <typename... T>
+				BulkBuilder& add() {
+					(verify_comp<T>(), ...);
+					(add(register_component<T>()), ...);
+					return *this;
+				}
+
+				//! Prepares removal of \param entity from all matched entities.
+				//! Entities which don't contain \param entity are left untouched.
+				BulkBuilder& del(Entity entity) {
+					GAIA_ASSERT(m_world.valid(entity));
+					GAIA_ASSERT(!is_wildcard(entity));
+
+					m_ops.push_back({entity, false});
+					m_hasPairs |= entity.pair();
+					return *this;
+				}
+
+				//! Prepares removal of \param pair from all matched entities.
+				BulkBuilder& del(Pair pair) {
+					GAIA_ASSERT(m_world.valid(pair.first()));
+					GAIA_ASSERT(m_world.valid(pair.second()));
+
+					return del((Entity)pair);
+				}
+
+				template <typename... T>
+				BulkBuilder& del() {
+					(verify_comp<T>(), ...);
+					(del(register_component<T>()), ...);
+					return *this;
+				}
+
+			private:
+				//! Takes care of registering the component \tparam T
+				template <typename T>
+				Entity register_component() {
+					if constexpr (is_pair<T>::value) {
+						const auto rel = m_world.add<typename T::rel>().entity;
+						const auto tgt = m_world.add<typename T::tgt>().entity;
+						return Pair(rel, tgt);
+					} else {
+						return m_world.add<T>().entity;
+					}
+				}
+
+				//! Applies all operations to \param eb
+				void apply(EntityBuilder& eb) const {
+					for (const auto& op: m_ops) {
+						// Matched archetypes don't need to contain everything that is removed
+						if (!op.add && !eb.m_pArchetype->has(op.entity))
+							continue;
+
+						if (op.entity.pair()) {
+							const Pair pair(m_world.get(op.entity.id()), m_world.get(op.entity.gen()));
+							if (op.add)
+								eb.add(pair);
+							else
+								eb.del(pair);
+						} else {
+							if (op.add)
+								eb.add(op.entity);
+							else
+								eb.del(op.entity);
+						}
+					}
+				}
+
+				//! Returns the row of the entity used to resolve the target archetype of \param chunk.
+				//! \return Row of the entity or BadIndex if no entity matches the constraints.
+				GAIA_NODISCARD uint32_t probe_row(const Chunk& chunk) const {
+					switch (m_constraints) {
+						case Constraints::EnabledOnly:
+							return chunk.size_enabled() > 0 ? (uint32_t)chunk.size() - 1 : BadIndex;
+						case Constraints::DisabledOnly:
+							return chunk.size_disabled() > 0 ? (uint32_t)chunk.size_disabled() - 1 : BadIndex;
+						case Constraints::AcceptAll:
+							return !chunk.empty() ? (uint32_t)chunk.size() - 1 : BadIndex;
+					}
+					return BadIndex;
+				}
+
+				//! Returns the range of rows of \param chunk affected by the operations
+				GAIA_NODISCARD std::pair<uint32_t, uint32_t> row_range(const Chunk& chunk) const {
+					switch (m_constraints) {
+						case Constraints::EnabledOnly:
+							return {(uint32_t)chunk.size_disabled(), (uint32_t)chunk.size()};
+						case Constraints::DisabledOnly:
+							return {0U, (uint32_t)chunk.size_disabled()};
+						case Constraints::AcceptAll:
+							break;
+					}
+					return {0U, (uint32_t)chunk.size()};
+				}
+
+				void commit_per_entity() {
+					cnt::darray<Entity> entities;
+					for (auto* pChunk: m_chunks) {
+						const auto range = row_range(*pChunk);
+						auto ents = pChunk->entity_view();
+						for (uint32_t i = range.first; i < range.second; ++i)
+							entities.push_back(ents[i]);
+					}
+
+					for (auto entity: entities) {
+						EntityBuilder eb(m_world, entity);
+						apply(eb);
+					}
+				}
+
+				void commit_per_chunk() {
+					Archetype* pSrcArchetype = nullptr;
+					Archetype* pDstArchetype = nullptr;
+
+					for (auto* pChunk: m_chunks) {
+						const auto probeRow = probe_row(*pChunk);
+						if (probeRow == BadIndex)
+							continue;
+
+						const auto probe = pChunk->entity_view()[probeRow];
+						auto* pArchetype = m_world.fetch(probe).pArchetype;
+
+						// Chunks of the same archetype follow each other so the target archetype
+						// only needs to be resolved once per archetype. Resolving is done by running
+						// the operations on a single entity which moves it to the target archetype.
+						if (pArchetype != pSrcArchetype) {
+							pSrcArchetype = pArchetype;
+							{
+								EntityBuilder eb(m_world, probe);
+								apply(eb);
+							}
+							pDstArchetype = m_world.fetch(probe).pArchetype;
+						}
+
+						// Nothing to do if the operations don't change the archetype
+						if (pDstArchetype == pSrcArchetype)
+							continue;
+
+						// Keep the singleton flag in sync with the new archetype
+						const auto range = row_range(*pChunk);
+						auto ents = pChunk->entity_view();
+						for (uint32_t i = range.first; i < range.second; ++i) {
+							const auto entity = ents[i];
+							auto& ec = m_world.fetch(entity);
+							if ((ec.flags & EntityContainerFlags::IsSingleton) == 0 && !is_op(entity))
+								continue;
+
+							EntityBuilder::updateFlag(ec.flags, EntityContainerFlags::IsSingleton, pDstArchetype->has(entity));
+						}
+
+						m_world.move_entities(*pSrcArchetype, *pChunk, *pDstArchetype, m_constraints);
+					}
+				}
+
+				GAIA_NODISCARD bool is_op(Entity entity) const {
+					for (const auto& op: m_ops) {
+						if (op.entity == entity)
+							return true;
+					}
+					return false;
+				}
+			};
+
 		private:
 			GAIA_NODISCARD bool valid(const EntityContainer& ec, Entity entityExpected) const {
 				if (is_req_del(ec))
@@ -535,6 +808,11 @@ namespace gaia {
 					return false;
 
 				const auto& ec = m_recs.entities[entity.id()];
+				// Deleted entities leave their record behind with a bumped generation.
+				// Such records no longer point to live data so they must not be inspected.
+				if (ec.gen != entity.gen())
+					return false;
+
 				return valid(ec, entity);
 			}
 
@@ -683,13 +961,8 @@ namespace gaia {
 				// Note, all archetype pointers in the tmp array are invalid at this point and can
 				// be used only for comparison. They can't be dereferenced.
 				if (!tmp.empty()) {
-					// TODO: How to speed this up? If there are 1k cached queries is it still going to
-					//       be fast enough or do we get spikes? Probably a linked list for query cache
-					//       would be a way to go.
-					for (auto& info: m_queryCache) {
-						for (auto* pArchetype: tmp)
-							info.remove(pArchetype);
-					}
+					for (auto* pArchetype: tmp)
+						m_queryCache.del_archetype(pArchetype);
 				}
 			}
 
@@ -708,10 +981,20 @@ namespace gaia {
 			}
 
 			//! Defragments chunks.
-			//! \param maxEntites Maximum number of entities moved per call
-			void defrag_chunks(uint32_t maxEntities) {
+			//! Without a time budget, at most m_defragEntitesPerTick entities are moved.
+			//! With a time budget, entities are moved in batches of m_defragEntitesPerTick until the budget
+			//! is used up or there is nothing left to defragment.
+			void defrag_chunks() {
 				GAIA_PROF_SCOPE(World::defrag_chunks);
 
+				using clock = std::chrono::steady_clock;
+				const auto timeStart = clock::now();
+				auto elapsed_us = [timeStart]() {
+					return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - timeStart).count();
+				};
+
+				m_defragStats = {};
+
 				const auto maxIters = (uint32_t)m_archetypesById.size();
 				// There has to be at least the root archetype present
 				GAIA_ASSERT(maxIters > 0);
@@ -721,24 +1004,37 @@ namespace gaia {
 				// Therefore, it should always be valid.
 				GAIA_ASSERT(it != m_archetypesById.end());
 
-				GAIA_FOR(maxIters) {
-					auto* pArchetype =
-							m_archetypesById[ArchetypeIdLookupKey(m_defragLastArchetypeID, m_defragLastArchetypeIDHash)];
-					pArchetype->defrag(maxEntities, m_chunksToDel, m_recs);
-					if (maxEntities == 0)
-						return;
+				uint32_t maxEntities = m_defragEntitesPerTick;
+				// Number of archetypes visited since the last time a batch of entities was used up.
+				// Once all archetypes are visited without using a batch up there is nothing left to do.
+				uint32_t iters = 0;
+				while (iters < maxIters) {
+					auto* pArchetype = it->second;
+					pArchetype->defrag(maxEntities, m_chunksToDel, m_recs, m_defragStats);
+					if (maxEntities == 0) {
+						// The archetype might have more work left so we stay with it
+						if (m_defragBudgetUs == 0 || elapsed_us() >= m_defragBudgetUs)
+							break;
 
-					++it;
-					if (it == m_archetypesById.end()) {
-						auto* pArch = m_archetypesById.begin()->second;
-						m_defragLastArchetypeID = pArch->id();
-						m_defragLastArchetypeIDHash = pArch->id_hash();
-					} else {
-						auto* pArch = it->second;
-						m_defragLastArchetypeID = pArch->id();
-						m_defragLastArchetypeIDHash = pArch->id_hash();
+						maxEntities = m_defragEntitesPerTick;
+						iters = 0;
+						continue;
 					}
+
+					++iters;
+					++it;
+					if (it == m_archetypesById.end())
+						it = m_archetypesById.begin();
+
+					auto* pArch = it->second;
+					m_defragLastArchetypeID = pArch->id();
+					m_defragLastArchetypeIDHash = pArch->id_hash();
+
+					if (m_defragBudgetUs != 0 && elapsed_us() >= m_defragBudgetUs)
+						break;
 				}
+
+				m_defragStats.time_us = elapsed_us();
 			}
 
 			//! Searches for archetype with a given set of components
@@ -758,15 +1054,52 @@ namespace gaia {
 				return pArchetype;
 			}
 
-			//! Adds the archetype to <entity, archetype> map for quick lookups of archetypes by comp/tag/pair
+			//! Adds the archetype to <entity, archetype> map for quick lookups of archetypes by comp/tag/pair.
+			//! Archetypes in the map are kept sorted by their id so queries can intersect the lists.
 			//! \param entity Entity getting added
 			//! \param pArchetype Linked archetype
 			void add_entity_archetype_pair(Entity entity, Archetype* pArchetype) {
 				const auto it = m_entityToArchetypeMap.find(EntityLookupKey(entity));
-				if (it == m_entityToArchetypeMap.end())
+				if (it == m_entityToArchetypeMap.end()) {
 					m_entityToArchetypeMap.try_emplace(EntityLookupKey(entity), ArchetypeList{pArchetype});
-				else if (!core::has(it->second, pArchetype))
-					it->second.push_back(pArchetype);
+					return;
+				}
+
+				// Archetypes are linked right after they are created so the newest one is always the last.
+				// Wildcard pairs can link the same archetype multiple times.
+				auto& archetypes = it->second;
+				if (!archetypes.empty() && archetypes.back() == pArchetype)
+					return;
+
+				GAIA_ASSERT(archetypes.empty() || archetypes.back()->id() < pArchetype->id());
+				archetypes.push_back(pArchetype);
+			}
+
+			//! Removes the archetype from the <entity, archetype> map
+			//! \param pArchetype Archetype getting deleted
+			void del_archetype_entity_pairs(Archetype* pArchetype) {
+				auto delPair = [&](Entity entity) {
+					const auto it = m_entityToArchetypeMap.find(EntityLookupKey(entity));
+					if (it == m_entityToArchetypeMap.end())
+						return;
+
+					auto& archetypes = it->second;
+					const auto idx = archetype_lower_bound(archetypes, pArchetype->id());
+					if (idx < archetypes.size() && archetypes[idx] == pArchetype)
+						archetypes.erase(archetypes.begin() + idx);
+				};
+
+				for (auto entity: pArchetype->ids()) {
+					delPair(entity);
+
+					if (entity.pair()) {
+						const auto first = Entity(entity.id(), 0, false, false, EntityKind::EK_Gen);
+						const auto second = Entity(entity.gen(), 0, false, false, EntityKind::EK_Gen);
+						delPair(Pair(All, second));
+						delPair(Pair(first, All));
+						delPair(Pair(All, All));
+					}
+				}
 			}
 
 			//! Deletes an archetype to <entity, archetype> record
@@ -779,7 +1112,8 @@ namespace gaia {
 					if (pArchetype->has(entity))
 						continue;
 
-					core::erase_fast_unsafe(archetypes, i);
+					// Keep the list sorted
+					archetypes.erase(archetypes.begin() + i);
 				}
 			}
 
@@ -870,12 +1204,14 @@ namespace gaia {
 				ArchetypeLookupKey key(pArchetype->lookup_hash(), &tmpArchetype);
 				m_archetypesByHash.erase(key);
 				m_archetypesById.erase(ArchetypeIdLookupKey(pArchetype->id(), pArchetype->id_hash()));
-
-				// TODO: This can be thousands or archetypes. We need a better way.
-				//       E.g., hash maps could contain indices to this array or something else.
-				//       Ideally this needs to be O(1).
-				const auto idx = core::get_index(m_archetypes, pArchetype);
-				core::erase_fast(m_archetypes, idx);
+				del_archetype_entity_pairs(pArchetype);
+				pArchetype->del_column_maps();
+
+				// Archetypes are stored in the order of creation so cached queries can match only the new ones.
+				// Their ids grow monotonically so we can binary search instead of a linear lookup.
+				const auto idx = archetype_lower_bound(m_archetypes, pArchetype->id());
+				GAIA_ASSERT(idx < m_archetypes.size() && m_archetypes[idx] == pArchetype);
+				m_archetypes.erase(m_archetypes.begin() + idx);
 			}
 
 #if GAIA_DEBUG
@@ -1037,7 +1373,9 @@ namespace gaia {
 				if (entity.pair())
 					return;
 
-				auto& ec = fetch(entity);
+				// Called from del_entity so the entity's archetype might already be requested for deletion
+				auto& ec = m_recs[entity];
+				GAIA_ASSERT(ec.gen == entity.gen());
 				auto& entityDesc = ec.pChunk->sview_mut<EntityDesc>()[ec.row];
 				if (entityDesc.name == nullptr)
 					return;
@@ -1055,6 +1393,7 @@ namespace gaia {
 					m_nameToEntity.erase(it);
 				}
 				entityDesc.name = nullptr;
+				touch(ec);
 			}
 
 			//! Deletes an entity along with all data associated with it.
@@ -1063,7 +1402,9 @@ namespace gaia {
 				if (entity.pair() || entity == EntityBad)
 					return;
 
-				const auto& ec = fetch(entity);
+				// The entity's archetype might already be requested for deletion so we can't use fetch() here
+				const auto& ec = m_recs[entity];
+				GAIA_ASSERT(ec.gen == entity.gen());
 				GAIA_ASSERT(entity.id() > GAIA_ID(LastCoreComponent).id());
 
 				// if (!is_req_del(ec))
@@ -1094,15 +1435,22 @@ namespace gaia {
 			//! deleted so the chunk can be removed.
 			void del_entities(Archetype& archetype) {
 				for (auto* pChunk: archetype.chunks()) {
-					auto ids = pChunk->entity_view();
-					for (auto e: ids) {
-						if (!valid(e))
+					// Entities are removed back-to-front so no entity is moved around by the removal.
+					// Their archetype is requested for deletion so valid() would report all of them as
+					// invalid already. Every entity still present in the chunk is alive, though.
+					while (!pChunk->empty()) {
+						const auto row = (uint16_t)(pChunk->size() - 1);
+						const auto e = pChunk->entity_view()[row];
+
+						// Pairs only ever live in the entity archetype which is never deleted
+						GAIA_ASSERT(!e.pair());
+						if (e.pair()) {
+							remove_entity(pChunk, row);
 							continue;
-
-						const auto& ec = fetch(e);
+						}
 
 						// We should never end up trying to delete a forbidden-to-delete entity
-						GAIA_ASSERT((ec.flags & EntityContainerFlags::OnDeleteTarget_Error) == 0);
+						GAIA_ASSERT((m_recs[e].flags & EntityContainerFlags::OnDeleteTarget_Error) == 0);
 
 						del_entity(e);
 					}
@@ -1162,34 +1510,75 @@ namespace gaia {
 				return false;
 			}
 
+			//! Moves entities of \param srcChunk to \param dstArchetype.
+			//! Enabled entities are moved in batches, as many as fit into the destination chunk at once,
+			//! with component data transferred column by column. Disabled entities are moved one by one.
+			//! \param srcArchetype Archetype of \param srcChunk
+			//! \param constraints Decides which entities of the chunk are moved
+			void move_entities(
+					Archetype& srcArchetype, Chunk& srcChunk, Archetype& dstArchetype, Constraints constraints) {
+				GAIA_PROF_SCOPE(World::move_entities);
+
+				GAIA_ASSERT(
+						!srcChunk.locked() && "Entities can't be moved while their chunk is being iterated "
+																	"(structural changes are forbidden during this time!)");
+
+				if (constraints != Constraints::DisabledOnly) {
+					while (srcChunk.size_enabled() > 0) {
+						auto* pDstChunk = dstArchetype.foc_free_chunk();
+						GAIA_ASSERT(pDstChunk != &srcChunk);
+
+						// Enabled entities are always stored at the end of the chunk
+						const auto freeCnt = (uint32_t)(pDstChunk->capacity() - pDstChunk->size());
+						const auto entCnt = core::get_min((uint32_t)srcChunk.size_enabled(), freeCnt);
+						const auto srcRow = (uint32_t)srcChunk.size() - entCnt;
+						const auto dstRow = (uint32_t)pDstChunk->size();
+
+						auto srcEnts = srcChunk.entity_view();
+						GAIA_FOR(entCnt) {
+							const auto entity = srcEnts[srcRow + i];
+							auto& ec = fetch(entity);
+							ec.pArchetype = &dstArchetype;
+							ec.pChunk = pDstChunk;
+							ec.row = pDstChunk->add_entity(entity);
+							ec.ver = m_worldVersion;
+						}
+
+						const auto& map = srcArchetype.column_map(dstArchetype, srcChunk, *pDstChunk);
+						Chunk::move_foreign_entities_data(&srcChunk, srcRow, pDstChunk, dstRow, entCnt, map);
+
+						srcChunk.remove_last_entities(entCnt, m_chunksToDel);
+						srcChunk.update_versions();
+
+						validate_chunk(pDstChunk);
+					}
+				}
+
+				if (constraints != Constraints::EnabledOnly) {
+					while (srcChunk.size_disabled() > 0) {
+						const auto entity = srcChunk.entity_view()[srcChunk.size_disabled() - 1];
+						move_entity(entity, dstArchetype, *dstArchetype.foc_free_chunk());
+					}
+				}
+
+				validate_chunk(&srcChunk);
+				validate_entities();
+			}
+
 			//! Updates all chunks and entities of archetype \param srcArchetype so they are a part of \param dstArchetype
 			void move_to_archetype(Archetype& srcArchetype, Archetype& dstArchetype) {
 				GAIA_ASSERT(&srcArchetype != &dstArchetype);
 
 				for (auto* pSrcChunk: srcArchetype.chunks()) {
-					auto srcEnts = pSrcChunk->entity_view();
-					if (srcEnts.empty())
+					if (pSrcChunk->empty())
 						continue;
 
-					// Copy entities back-to-front to avoid unnecessary data movements.
-					// TODO: Handle disabled entities efficiently.
-					//       If there are disabled entites, we still do data movements if there already
-					//       are enabled entities in the chunk.
 					// TODO: If the header was of some fixed size, e.g. if we always acted as if we had
 					//       Chunk::MAX_COMPONENTS, certain data movements could be done pretty much instantly.
 					//       E.g. when removing tags or pairs, we would simply replace the chunk pointer
 					//       with a pointer to another one. The some goes for archetypes. Component data
 					//       would not have to move at all internal chunk header pointers would remain unchanged.
-
-					auto* pDstChunk = dstArchetype.foc_free_chunk();
-					int i = (int)(srcEnts.size() - 1);
-					while (i >= 0) {
-						if (pDstChunk->full())
-							pDstChunk = dstArchetype.foc_free_chunk();
-						move_entity(srcEnts[(uint32_t)i], dstArchetype, *pDstChunk);
-
-						--i;
-					}
+					move_entities(srcArchetype, *pSrcChunk, dstArchetype, Constraints::AcceptAll);
 				}
 			}
 
@@ -1584,6 +1973,7 @@ namespace gaia {
 					ec.pArchetype = nullptr;
 					ec.pChunk = nullptr;
 					EntityBuilder::updateFlag(ec.flags, EntityContainerFlags::DeleteRequested, false);
+					touch(ec);
 
 					// Update pairs
 					delPair(m_relationsToTargets, All, entity);
@@ -1617,6 +2007,14 @@ namespace gaia {
 				ec.row = pChunk->add_entity(entity);
 				GAIA_ASSERT(entity.pair() || ec.gen == entity.gen());
 				ec.dis = 0;
+				// Adding the entity to the chunk moved the world version forward already
+				ec.ver = m_worldVersion;
+			}
+
+			//! Marks the entity record \param ec as changed at the current world version
+			void touch(EntityContainer& ec) {
+				bump_world_version(m_worldVersion);
+				ec.ver = curr_world_version(m_worldVersion);
 			}
 
 			//! Moves an entity along with all its generic components from its current chunk to another one.
@@ -1646,8 +2044,10 @@ namespace gaia {
 				// Move data from the old chunk to the new one
 				if (newArchetype.id() == oldArchetype.id())
 					pNewChunk->move_entity_data(entity, newRow, m_recs);
-				else
-					pNewChunk->move_foreign_entity_data(entity, newRow, m_recs);
+				else {
+					const auto& map = oldArchetype.column_map(newArchetype, *pOldChunk, *pNewChunk);
+					Chunk::move_foreign_entity_data(pOldChunk, oldRow, pNewChunk, newRow, map);
+				}
 
 				// Remove the entity record from the old chunk
 				remove_entity(pOldChunk, oldRow);
@@ -1656,6 +2056,7 @@ namespace gaia {
 				ec.pArchetype = &newArchetype;
 				ec.pChunk = pNewChunk;
 				ec.row = (uint16_t)newRow;
+				ec.ver = m_worldVersion;
 
 				// Make the enabled state in the new chunk match the original state
 				newArchetype.enable_entity(pNewChunk, newRow, wasEnabled, m_recs);
@@ -1766,6 +2167,8 @@ namespace gaia {
 					// Update the entity string pointer
 					sset<EntityDesc>(entity, {name, key.len()});
 				}
+
+				touch(fetch(entity));
 			}
 
 			//! If \tparam CheckIn is true, checks if \param entity inherits from \param entityBase.
@@ -2008,6 +2411,122 @@ namespace gaia {
 #endif
 			}
 
+			//! Releases all entities, archetypes and entity names.
+			//! Registered components and cached queries are kept.
+			void cleanup_entities() {
+				// Clear entities
+				m_recs.entities = {};
+				m_recs.pairs = {};
+
+				// Clear archetypes
+				{
+					// Delete all allocated chunks and their parent archetypes
+					for (auto& pair: m_archetypesById) {
+						auto* pArchetype = pair.second;
+						delete pArchetype;
+					}
+
+					m_entityToAsRelations.clear();
+					m_entityToAsTargets.clear();
+					m_targetsToRelations.clear();
+					m_relationsToTargets.clear();
+
+					m_archetypes = {};
+					m_archetypesById = {};
+					m_archetypesByHash = {};
+					m_pRootArchetype = nullptr;
+					m_pEntityArchetype = nullptr;
+					m_pCompArchetype = nullptr;
+					m_nextArchetypeId = 0;
+					m_defragLastArchetypeID = 0;
+					m_defragLastArchetypeIDHash = {0};
+
+					m_reqArchetypesToDel = {};
+					m_reqEntitiesToDel = {};
+
+					m_entitiesToDel = {};
+					m_chunksToDel = {};
+					m_archetypesToDel = {};
+				}
+
+				// Clear caches
+				m_entityToArchetypeMap = {};
+
+				// Clear entity names
+				{
+					for (auto& pair: m_nameToEntity) {
+						if (!pair.first.owned())
+							continue;
+						// Release any memory allocated for owned names
+						mem::mem_free((void*)pair.first.str());
+					}
+					m_nameToEntity = {};
+				}
+			}
+
+			static void save_pair_map(SerializationBuffer& s, const PairMap& map) {
+				s.save((uint32_t)map.size());
+				for (const auto& pair: map) {
+					s.save(pair.first.entity());
+					s.save((uint32_t)pair.second.size());
+					for (auto key: pair.second)
+						s.save(key.entity());
+				}
+			}
+
+			static void load_pair_map(SerializationBuffer& s, PairMap& map) {
+				uint32_t cnt = 0;
+				s.load(cnt);
+				GAIA_FOR(cnt) {
+					Entity entity;
+					s.load(entity);
+					auto& set = map[EntityLookupKey(entity)];
+
+					uint32_t setCnt = 0;
+					s.load(setCnt);
+					GAIA_FOR_(setCnt, j) {
+						Entity other;
+						s.load(other);
+						set.insert(EntityLookupKey(other));
+					}
+				}
+			}
+
+			//! Writes the component registry to \param s so snapshots can be checked for compatibility
+			void save_registry(SerializationBuffer& s) const {
+				s.save(m_compCache.size());
+				m_compCache.each([&s](const ComponentCacheItem& item) {
+					s.save(item.entity);
+					s.save(item.hashLookup);
+					s.save((uint32_t)item.comp.size());
+				});
+			}
+
+			//! Reads the component registry written by save_registry from \param s.
+			//! \return True if the registry matches the component registry of the world. False otherwise.
+			bool load_registry(SerializationBuffer& s) const {
+				uint32_t compCnt = 0;
+				s.load(compCnt);
+				if (compCnt != m_compCache.size())
+					return false;
+
+				GAIA_FOR(compCnt) {
+					Entity entity;
+					ComponentLookupHash hashLookup{};
+					uint32_t size = 0;
+					s.load(entity);
+					s.load(hashLookup);
+					s.load(size);
+
+					const auto* pItem = m_compCache.find(entity);
+					if (pItem == nullptr || pItem->entity != entity || pItem->hashLookup != hashLookup ||
+							pItem->comp.size() != size)
+						return false;
+				}
+
+				return true;
+			}
+
 			//! Creates a new entity of a given archetype
 			//! \param archetype Archetype the entity should inherit
 			//! \param isEntity True if entity, false otherwise
@@ -2021,6 +2540,82 @@ namespace gaia {
 				return entity;
 			}
 
+			//! Creates \param count new entities of a given archetype.
+			//! Entity records are reserved up-front and chunks are filled one at a time.
+			//! \param archetype Archetype the entities should inherit
+			//! \param count Number of entities to create
+			//! \param ctx Entity container context
+			//! \param func Function called for each chunk with IterRange covering the new entities,
+			//!              or for each new entity if it accepts Entity.
+			template <typename Func>
+			void add_entity_n(Archetype& archetype, uint32_t count, EntityContainerCtx ctx, Func func) {
+				GAIA_PROF_SCOPE(World::add_entity_n);
+
+				m_recs.entities.reserve_more(count);
+
+				// Entities are stored into the archetype directly. Flags and relationship maps which EntityBuilder
+				// maintains when adding pairs need to be updated for each of them the same way.
+				cnt::sarray_ext<Entity, Chunk::MAX_COMPONENTS> pairs;
+				for (auto id: archetype.ids()) {
+					if (id.pair())
+						pairs.push_back(id);
+				}
+
+				uint32_t left = count;
+				while (left > 0) {
+					auto* pChunk = archetype.foc_free_chunk();
+					const uint32_t rowFirst = pChunk->size();
+					const uint32_t toCreate = core::get_min(left, (uint32_t)pChunk->capacity() - rowFirst);
+
+					GAIA_FOR(toCreate) {
+						const auto entity = m_recs.entities.alloc(&ctx);
+						store_entity(m_recs.entities[entity.id()], entity, &archetype, pChunk);
+
+						if (!pairs.empty()) {
+							EntityBuilder eb(*this, entity, nullptr);
+							for (auto pair: pairs)
+								eb.handle_add_records(pair);
+						}
+					}
+
+					// Call constructors for the generic components on the newly added entities if necessary
+					if (pChunk->has_custom_gen_ctor())
+						pChunk->call_gen_ctors(rowFirst, toCreate);
+
+					// No structural changes are allowed while the callback runs
+					pChunk->lock(true);
+					if constexpr (std::is_invocable_v<Func, IterRange&>) {
+						IterRange it(*pChunk, (uint16_t)rowFirst, (uint16_t)toCreate);
+						func(it);
+					} else {
+						const auto ents = pChunk->entity_view();
+						GAIA_FOR2(rowFirst, rowFirst + toCreate) func(ents[i]);
+					}
+					pChunk->lock(false);
+
+					left -= toCreate;
+				}
+
+				validate_entities();
+			}
+
+			//! Creates \param count new entities of a given archetype. Used by add_n.
+			//! \param func Function to call for the new entities. nullptr if no function is to be called.
+			template <typename Func>
+			void add_n_inter(Archetype& archetype, uint32_t count, EntityContainerCtx ctx, Func func) {
+				if (count == 0)
+					return;
+
+				if constexpr (std::is_same_v<Func, std::nullptr_t>)
+					add_entity_n(archetype, count, ctx, [](IterRange&) {});
+				else {
+					static_assert(
+							std::is_invocable_v<Func, IterRange&> || std::is_invocable_v<Func, Entity>,
+							"add_n expects a function accepting either IterRange& or Entity");
+					add_entity_n(archetype, count, ctx, func);
+				}
+			}
+
 			//! Assigns an entity to a given archetype
 			//! \param archetype Archetype the entity should inherit
 			//! \param entity Entity
@@ -2078,7 +2673,7 @@ namespace gaia {
 				GAIA_PROF_SCOPE(World::gc);
 
 				del_empty_chunks();
-				defrag_chunks(m_defragEntitesPerTick);
+				defrag_chunks();
 				del_empty_archetypes();
 			}
 
@@ -2136,6 +2731,17 @@ namespace gaia {
 				return EntityBuilder(*this, entity);
 			}
 
+			//! Starts a bulk add/remove operation on all entities matched by \param query.
+			//! \param query Query
+			//! \param constraints Decides which entities of the matched chunks are affected
+			//! \return BulkBuilder
+			//! \warning No structural changes can happen while the BulkBuilder is alive.
+			//!          Changes are applied when commit() is called or when the builder goes out of scope.
+			template <bool UseCaching>
+			BulkBuilder bulk(detail::QueryImpl<UseCaching>& query, Constraints constraints = Constraints::EnabledOnly) {
+				return BulkBuilder(*this, query, constraints);
+			}
+
 			//! Creates a new empty entity
 			//! \param kind Entity kind
 			//! \return New entity
@@ -2143,6 +2749,33 @@ namespace gaia {
 				return add(*m_pEntityArchetype, true, false, kind);
 			}
 
+			//! Creates \param count new empty entities.
+			//! \param count Number of entities to create
+			//! \param func Function called for each chunk with IterRange covering the new entities,
+			//!              or for each new entity if it accepts Entity.
+			template <typename Func = std::nullptr_t>
+			void add_n(uint32_t count, Func func = nullptr) {
+				add_n_inter(*m_pEntityArchetype, count, {true, false, EntityKind::EK_Gen}, func);
+			}
+
+			//! Creates \param count new entities with the same components as \param entity.
+			//! Components of the new entities are default-constructed, no data is copied from \param entity.
+			//! \param entity Entity to use as a template
+			//! \param count Number of entities to create
+			//! \param func Function called for each chunk with IterRange covering the new entities,
+			//!              or for each new entity if it accepts Entity.
+			//! \warning It is expected \param entity is valid. Undefined behavior otherwise.
+			template <typename Func = std::nullptr_t>
+			void add_n(Entity entity, uint32_t count, Func func = nullptr) {
+				GAIA_ASSERT(!entity.pair());
+				GAIA_ASSERT(valid(entity));
+
+				auto& ec = m_recs.entities[entity.id()];
+				GAIA_ASSERT(ec.pArchetype != nullptr);
+
+				add_n_inter(*ec.pArchetype, count, {entity.entity(), false, entity.kind()}, func);
+			}
+
 			//! Creates a new component if not found already.
 			//! \param kind Component kind
 			//! \return Component cache item of the component
@@ -2940,6 +3573,27 @@ namespace gaia {
 
 			//----------------------------------------------------------------------
 
+			//! Matches all cached queries against archetypes created since they were last matched.
+			//! The work is spread across the worker threads of the thread pool. Use it to warm up the query cache,
+			//! e.g. after loading a level, so queries don't have to match archetypes the next time they run.
+			//! \warning Must be called from the main thread. The world must not change until the call returns.
+			void match_queries() {
+				GAIA_PROF_SCOPE(World::match_queries);
+
+				const auto queryCnt = m_queryCache.size();
+				if (queryCnt == 0)
+					return;
+
+				mt::JobParallel job;
+				job.func = [this](const mt::JobArgs& args) {
+					for (uint32_t i = args.idxStart; i < args.idxEnd; ++i)
+						m_queryCache.get(i).match(m_entityToArchetypeMap, m_archetypes, m_nextArchetypeId);
+				};
+
+				auto& tp = mt::ThreadPool::get();
+				tp.wait(tp.sched_par(job, queryCnt, 1));
+			}
+
 			//! Provides a query set up to work with the parent world.
 			//! \tparam UseCache If true, results of the query are cached
 			//! \return Valid query object
@@ -2978,8 +3632,12 @@ namespace gaia {
 						"Entities can't be enabled/disabled while their chunk is being iterated "
 						"(structural changes are forbidden during this time!)");
 
+				if (enable != (bool)ec.dis)
+					return;
+
 				auto& archetype = *ec.pArchetype;
 				archetype.enable_entity(ec.pChunk, ec.row, enable, m_recs);
+				touch(ec);
 			}
 
 			//! Checks if an entity is enabled.
@@ -3041,59 +3699,578 @@ namespace gaia {
 				// Run garbage collector
 				gc();
 
+#if GAIA_ECS_CHUNK_ALLOCATOR
+				// Give memory no longer needed by chunks back to the system
+				auto& allocator = ChunkAllocator::get();
+				if (allocator.trim_policy().auto_trim)
+					(void)allocator.trim();
+#endif
+
 				// Signal the end of the frame
 				GAIA_PROF_FRAME();
 			}
 
 			//! Clears the world so that all its entities and components are released
 			void cleanup() {
-				// Clear entities
-				m_recs.entities = {};
-				m_recs.pairs = {};
+				cleanup_entities();
 
-				// Clear archetypes
+				// Clear query cache
+				m_queryCache.clear();
+
+				// Clear component cache
+				m_compCache.clear();
+			}
+
+			//! Writes a snapshot of the world to \param s.
+			//! The component registry and the archetype table go first. After that, the component data
+			//! of each chunk is streamed as contiguous blocks of raw memory. Only non-trivial components
+			//! are written one by one using their save function.
+			//! \param s Serialization buffer
+			//! \warning Call after update() so there are no pending deletions.
+			void save(SerializationBuffer& s) const {
+				GAIA_PROF_SCOPE(World::save);
+
+				s.save(SnapshotMagic);
+				s.save(SnapshotVersion);
+				s.save(m_worldVersion);
+				save_registry(s);
+
+				// Entity records
 				{
-					// Delete all allocated chunks and their parent archetypes
-					for (auto& pair: m_archetypesById) {
-						auto* pArchetype = pair.second;
-						delete pArchetype;
+					const auto& ents = m_recs.entities;
+					s.save((uint32_t)ents.size());
+					s.save(ents.m_nextFreeIdx);
+					s.save(ents.m_freeItems);
+					s.save((const void*)ents.data(), ents.size() * (uint32_t)sizeof(EntityContainer));
+
+					s.save((uint32_t)m_recs.pairs.size());
+					for (const auto& pair: m_recs.pairs) {
+						s.save(pair.first.entity());
+						s.save(pair.second);
 					}
+				}
 
-					m_entityToAsRelations.clear();
-					m_entityToAsTargets.clear();
-					m_targetsToRelations.clear();
-					m_relationsToTargets.clear();
+				// Relationships
+				save_pair_map(s, m_entityToAsTargets);
+				save_pair_map(s, m_entityToAsRelations);
+				save_pair_map(s, m_relationsToTargets);
+				save_pair_map(s, m_targetsToRelations);
+
+				// Archetypes and their chunks
+				s.save((uint32_t)m_archetypes.size());
+				s.save((uint32_t)core::get_index(m_archetypes, m_pRootArchetype));
+				s.save((uint32_t)core::get_index(m_archetypes, m_pEntityArchetype));
+				s.save((uint32_t)core::get_index(m_archetypes, m_pCompArchetype));
+				for (const auto* pArchetype: m_archetypes) {
+					const auto& ids = pArchetype->ids();
+					s.save((uint32_t)ids.size());
+					s.save((const void*)ids.data(), (uint32_t)ids.size() * (uint32_t)sizeof(Entity));
+
+					uint32_t chunkCnt = 0;
+					for (const auto* pChunk: pArchetype->chunks())
+						chunkCnt += (uint32_t)!pChunk->empty();
+					s.save(chunkCnt);
+
+					for (const auto* pChunk: pArchetype->chunks()) {
+						if (pChunk->empty())
+							continue;
 
-					m_archetypesById = {};
-					m_archetypesByHash = {};
+						const auto ents = pChunk->entity_view();
+						s.save(pChunk->size_type());
+						s.save(pChunk->size());
+						s.save(pChunk->size_disabled());
+						s.save((const void*)ents.data(), (uint32_t)ents.size() * (uint32_t)sizeof(Entity));
+						pChunk->save(s);
+					}
+				}
 
-					m_reqArchetypesToDel = {};
-					m_reqEntitiesToDel = {};
+				// Entity names
+				s.save((uint32_t)m_nameToEntity.size());
+				for (const auto& pair: m_nameToEntity) {
+					s.save(pair.second);
+					s.save((uint32_t)pair.first.len());
+					s.save((const void*)pair.first.str(), pair.first.len());
+				}
+			}
 
-					m_entitiesToDel = {};
-					m_chunksToDel = {};
-					m_archetypesToDel = {};
+			//! Replaces the contents of the world with a snapshot created by save.
+			//! The snapshot can only be loaded by a world with the same component registry. This is the case
+			//! when components are registered in the same order as they were in the world that saved the snapshot.
+			//! \param s Serialization buffer positioned at the beginning of the snapshot
+			//! \return True if the snapshot was loaded. False if it is incompatible with the world, in which case
+			//!         the world is left untouched.
+			//! \warning Cached queries keep working. Uncached queries need to be created anew.
+			bool load(SerializationBuffer& s) {
+				GAIA_PROF_SCOPE(World::load);
+
+				uint32_t magic = 0;
+				uint32_t version = 0;
+				s.load(magic);
+				s.load(version);
+				if (magic != SnapshotMagic || version != SnapshotVersion)
+					return false;
+
+				uint32_t worldVersion = 0;
+				s.load(worldVersion);
+				if (!load_registry(s))
+					return false;
+
+				cleanup_entities();
+				m_queryCache.reset();
+				m_worldVersion = worldVersion;
+
+				// Entity records. Their chunks are assigned once the chunks are restored.
+				{
+					auto& ents = m_recs.entities;
+					uint32_t entCnt = 0;
+					s.load(entCnt);
+					s.load(ents.m_nextFreeIdx);
+					s.load(ents.m_freeItems);
+					ents.m_items.resize(entCnt);
+					s.load((void*)ents.data(), entCnt * (uint32_t)sizeof(EntityContainer));
+					for (auto& ec: ents) {
+						ec.pArchetype = nullptr;
+						ec.pChunk = nullptr;
+						ec.dis = 0;
+					}
+
+					uint32_t pairCnt = 0;
+					s.load(pairCnt);
+					GAIA_FOR(pairCnt) {
+						Entity pair;
+						EntityContainer ec;
+						s.load(pair);
+						s.load(ec);
+						ec.pArchetype = nullptr;
+						ec.pChunk = nullptr;
+						ec.dis = 0;
+						m_recs.pairs.emplace(EntityLookupKey(pair), GAIA_MOV(ec));
+					}
 				}
 
-				// Clear caches
+				// Relationships
+				load_pair_map(s, m_entityToAsTargets);
+				load_pair_map(s, m_entityToAsRelations);
+				load_pair_map(s, m_relationsToTargets);
+				load_pair_map(s, m_targetsToRelations);
+
+				// Archetypes and their chunks
 				{
-					m_entityToArchetypeMap = {};
-					m_queryCache.clear();
+					uint32_t archetypeCnt = 0;
+					uint32_t rootIdx = 0;
+					uint32_t entityIdx = 0;
+					uint32_t compIdx = 0;
+					s.load(archetypeCnt);
+					s.load(rootIdx);
+					s.load(entityIdx);
+					s.load(compIdx);
+
+					GAIA_FOR(archetypeCnt) {
+						Entity ids[Chunk::MAX_COMPONENTS];
+						uint32_t idsCnt = 0;
+						s.load(idsCnt);
+						GAIA_ASSERT(idsCnt <= Chunk::MAX_COMPONENTS);
+						s.load((void*)ids, idsCnt * (uint32_t)sizeof(Entity));
+
+						const EntitySpan idsSpan{ids, idsCnt};
+						auto* pArchetype = create_archetype(idsSpan);
+						pArchetype->set_hashes({calc_lookup_hash(idsSpan).hash});
+						reg_archetype(pArchetype);
+
+						uint32_t chunkCnt = 0;
+						s.load(chunkCnt);
+						GAIA_FOR_(chunkCnt, j) {
+							uint8_t sizeType = 0;
+							uint16_t entCnt = 0;
+							uint16_t disabledCnt = 0;
+							s.load(sizeType);
+							s.load(entCnt);
+							s.load(disabledCnt);
+
+							auto* pChunk = pArchetype->add_chunk(sizeType);
+							GAIA_ASSERT(entCnt <= pChunk->capacity());
+							GAIA_FOR_(entCnt, k) {
+								Entity entity;
+								s.load(entity);
+
+								auto& ec = m_recs[entity];
+								ec.pArchetype = pArchetype;
+								ec.pChunk = pChunk;
+								ec.row = pChunk->add_entity(entity);
+							}
+							pChunk->set_disabled(disabledCnt, m_recs);
+							pChunk->load(s);
+						}
+					}
+
+					m_pRootArchetype = m_archetypes[rootIdx];
+					m_pEntityArchetype = m_archetypes[entityIdx];
+					m_pCompArchetype = m_archetypes[compIdx];
 				}
 
-				// Clear entity names
+				// Pointers stored in EntityDesc are not valid anymore. Clear them before names are restored.
+				for (auto* pArchetype: m_archetypes) {
+					for (auto* pChunk: pArchetype->chunks()) {
+						if (!pChunk->has<EntityDesc>())
+							continue;
+						auto descs = pChunk->sview_mut<EntityDesc>();
+						GAIA_EACH(descs) descs[i] = {};
+					}
+				}
+
+				// Component entities point to the component cache of this world
+				m_compCache.each([&](const ComponentCacheItem& item) {
+					if (has<EntityDesc>(item.entity))
+						sset<EntityDesc>(item.entity, {item.name.str(), item.name.len()});
+					if (has<Component>(item.entity))
+						sset<Component>(item.entity, item.comp);
+				});
+
+				// Entity names
 				{
-					for (auto& pair: m_nameToEntity) {
-						if (!pair.first.owned())
+					cnt::darray<char> str;
+					uint32_t nameCnt = 0;
+					s.load(nameCnt);
+					GAIA_FOR(nameCnt) {
+						Entity entity;
+						uint32_t len = 0;
+						s.load(entity);
+						s.load(len);
+						str.resize(len + 1);
+						s.load((void*)str.data(), len);
+						str[len] = 0;
+
+						// Component names keep pointing to the component cache. Other names are copied.
+						// Naming the entity is not a change so the version of its record is kept.
+						const auto ver = m_recs.entities[entity.id()].ver;
+						const auto* pItem = m_compCache.find(entity);
+						if (pItem != nullptr && pItem->name.len() == len && memcmp(pItem->name.str(), str.data(), len) == 0)
+							name_raw(entity, pItem->name.str(), len);
+						else
+							name(entity, str.data(), len);
+						m_recs.entities[entity.id()].ver = ver;
+					}
+				}
+
+				// Restoring the world moved its version forward. Everything is as old as the snapshot.
+				m_worldVersion = worldVersion;
+				for (auto* pArchetype: m_archetypes) {
+					for (auto* pChunk: pArchetype->chunks())
+						pChunk->update_world_version();
+				}
+
+				validate_entities();
+				return true;
+			}
+
+			//! Writes changes made to the world after \param version to \param s.
+			//! Entity records which were created, deleted, moved to a different archetype, enabled, disabled
+			//! or renamed are written in full. Component data is only written for chunks and components whose
+			//! version moved past \param version.
+			//! \param s Serialization buffer
+			//! \param version World version the delta is relative to. Use world_version() at the time
+			//!                the previous snapshot or delta was written.
+			//! \warning Call after update() so there are no pending deletions.
+			//! \warning SoA components and non-trivial components without save and load functions are not written.
+			void save_delta(SerializationBuffer& s, uint32_t version) const {
+				GAIA_PROF_SCOPE(World::save_delta);
+
+				s.save(SnapshotDeltaMagic);
+				s.save(SnapshotVersion);
+				s.save(version);
+				s.save(m_worldVersion);
+				save_registry(s);
+
+				// Changed entity records
+				{
+					const auto& ents = m_recs.entities;
+					const auto entCnt = (uint32_t)ents.size();
+					s.save(entCnt);
+					s.save(ents.m_nextFreeIdx);
+					s.save(ents.m_freeItems);
+
+					uint32_t recCnt = 0;
+					GAIA_FOR(entCnt) {
+						if (version_changed(ents[i].ver, version))
+							++recCnt;
+					}
+					s.save(recCnt);
+
+					GAIA_FOR(entCnt) {
+						const auto& ec = ents[i];
+						if (!version_changed(ec.ver, version))
 							continue;
-						// Release any memory allocated for owned names
-						mem::mem_free((void*)pair.first.str());
+
+						s.save(i);
+						s.save(ec);
+						// Deleted entities are done here
+						if (ec.pChunk == nullptr)
+							continue;
+
+						const auto& ids = ec.pArchetype->ids();
+						s.save((uint32_t)ids.size());
+						s.save((const void*)ids.data(), (uint32_t)ids.size() * (uint32_t)sizeof(Entity));
+
+						const EntityDesc* pDesc = nullptr;
+						if (ec.pChunk->has<EntityDesc>())
+							pDesc = &ec.pChunk->view<EntityDesc>()[ec.row];
+						const uint32_t len = pDesc != nullptr && pDesc->name != nullptr ? pDesc->len : 0U;
+						s.save(len);
+						if (len != 0)
+							s.save((const void*)pDesc->name, len);
 					}
-					m_nameToEntity = {};
 				}
 
-				// Clear component cache
-				m_compCache.clear();
+				// Changed component data
+				{
+					uint32_t chunkCnt = 0;
+					for (const auto* pArchetype: m_archetypes) {
+						for (const auto* pChunk: pArchetype->chunks())
+							chunkCnt += (uint32_t)(!pChunk->empty() && pChunk->changed(version));
+					}
+					s.save(chunkCnt);
+
+					for (const auto* pArchetype: m_archetypes) {
+						for (const auto* pChunk: pArchetype->chunks()) {
+							if (pChunk->empty() || !pChunk->changed(version))
+								continue;
+
+							const auto ents = pChunk->entity_view();
+							s.save(pChunk->size());
+							s.save((const void*)ents.data(), (uint32_t)ents.size() * (uint32_t)sizeof(Entity));
+							pChunk->save_delta(s, version);
+						}
+					}
+				}
+			}
+
+			//! Applies changes written by save_delta to the world.
+			//! The world needs to be in the state the delta is relative to. That is, it loaded the snapshot or applied
+			//! the delta written at the version the delta is relative to, and nothing changed in it since then.
+			//! \param s Serialization buffer positioned at the beginning of the delta
+			//! \return True if the delta was applied. False if it is incompatible with the world or relative to a different
+			//!         version of it, in which case the world is left untouched.
+			bool load_delta(SerializationBuffer& s) {
+				GAIA_PROF_SCOPE(World::load_delta);
+
+				uint32_t magic = 0;
+				uint32_t version = 0;
+				s.load(magic);
+				s.load(version);
+				if (magic != SnapshotDeltaMagic || version != SnapshotVersion)
+					return false;
+
+				uint32_t baseVersion = 0;
+				uint32_t worldVersion = 0;
+				s.load(baseVersion);
+				s.load(worldVersion);
+				if (baseVersion != m_worldVersion || !load_registry(s))
+					return false;
+
+				auto& ents = m_recs.entities;
+				uint32_t entCnt = 0;
+				auto nextFreeIdx = ents.m_nextFreeIdx;
+				auto freeItems = ents.m_freeItems;
+				s.load(entCnt);
+				s.load(nextFreeIdx);
+				s.load(freeItems);
+				// Entity records are never released so the list can only grow
+				if (entCnt < (uint32_t)ents.size())
+					return false;
+
+				struct DeltaRecord {
+					//! Index of the record
+					uint32_t idx;
+					//! Record as it was written
+					EntityContainer ec;
+					//! Range of the archetype ids in the ids array
+					uint32_t idsFirst;
+					uint32_t idsCnt;
+					//! Range of the name in the names array
+					uint32_t nameFirst;
+					uint32_t nameLen;
+				};
+				cnt::darray<DeltaRecord> recs;
+				cnt::darray<Entity> recIds;
+				cnt::darray<char> recNames;
+				{
+					uint32_t recCnt = 0;
+					s.load(recCnt);
+					recs.resize(recCnt);
+					for (auto& rec: recs) {
+						s.load(rec.idx);
+						s.load(rec.ec);
+						rec.idsFirst = (uint32_t)recIds.size();
+						rec.idsCnt = 0;
+						rec.nameFirst = (uint32_t)recNames.size();
+						rec.nameLen = 0;
+						if (rec.ec.pChunk == nullptr)
+							continue;
+
+						s.load(rec.idsCnt);
+						recIds.resize(rec.idsFirst + rec.idsCnt);
+						s.load((void*)&recIds[rec.idsFirst], rec.idsCnt * (uint32_t)sizeof(Entity));
+
+						s.load(rec.nameLen);
+						recNames.resize(rec.nameFirst + rec.nameLen + 1);
+						s.load((void*)&recNames[rec.nameFirst], rec.nameLen);
+						recNames[rec.nameFirst + rec.nameLen] = 0;
+					}
+				}
+
+				auto ids_of = [&](const DeltaRecord& rec) {
+					return EntitySpan{recIds.data() + rec.idsFirst, rec.idsCnt};
+				};
+				auto is_alive = [&](const DeltaRecord& rec) {
+					return rec.ec.pChunk != nullptr;
+				};
+				auto is_kept = [&](const DeltaRecord& rec) {
+					if (!is_alive(rec) || rec.idx >= (uint32_t)ents.size())
+						return false;
+					const auto& ec = ents[rec.idx];
+					return ec.pChunk != nullptr && ec.gen == rec.ec.gen;
+				};
+
+				// Remove whatever the entities which stay around lost first. Some of it might be about to be deleted.
+				for (const auto& rec: recs) {
+					if (!is_kept(rec))
+						continue;
+
+					const auto& ec = ents[rec.idx];
+					EntityBuilder eb(*this, EntityContainer::create(ec));
+					for (auto id: ec.pArchetype->ids()) {
+						if (!core::has(ids_of(rec), id))
+							eb.del_inter(id);
+					}
+				}
+
+				// Delete entities which are gone or whose record got reused
+				for (const auto& rec: recs) {
+					if (rec.idx >= (uint32_t)ents.size() || is_kept(rec))
+						continue;
+
+					const auto& ec = ents[rec.idx];
+					if (ec.pChunk != nullptr)
+						del_entity(EntityContainer::create(ec));
+				}
+
+				// Bring the records up-to-date and create the new entities
+				{
+					const auto oldCnt = (uint32_t)ents.size();
+					ents.m_items.resize(entCnt);
+					for (uint32_t i = oldCnt; i < entCnt; ++i)
+						ents.m_items[i] = {};
+					ents.m_nextFreeIdx = nextFreeIdx;
+					ents.m_freeItems = freeItems;
+
+					for (const auto& rec: recs) {
+						auto& ec = ents[rec.idx];
+						if (ec.pChunk != nullptr)
+							continue;
+
+						ec = rec.ec;
+						ec.pArchetype = nullptr;
+						ec.pChunk = nullptr;
+						ec.dis = 0;
+						if (is_alive(rec))
+							assign(EntityContainer::create(ec), *m_pEntityArchetype);
+					}
+				}
+
+				// Move the entities to their archetypes
+				for (const auto& rec: recs) {
+					if (!is_alive(rec))
+						continue;
+
+					const auto& ec = ents[rec.idx];
+					EntityBuilder eb(*this, EntityContainer::create(ec));
+					for (auto id: ec.pArchetype->ids()) {
+						if (!core::has(ids_of(rec), id))
+							eb.del_inter(id);
+					}
+					for (auto id: ids_of(rec))
+						eb.add_inter(id);
+				}
+
+				// Enabled state, names and flags
+				for (const auto& rec: recs) {
+					auto& ec = ents[rec.idx];
+					if (is_alive(rec)) {
+						const auto entity = EntityContainer::create(ec);
+						enable(entity, rec.ec.dis == 0);
+
+						if (ec.pChunk->has<EntityDesc>()) {
+							const auto& desc = ec.pChunk->view<EntityDesc>()[ec.row];
+							const char* pName = &recNames[rec.nameFirst];
+							const uint32_t len = desc.name != nullptr ? desc.len : 0U;
+							if (len != rec.nameLen || (len != 0 && memcmp(desc.name, pName, len) != 0)) {
+								del_name(entity);
+								if (rec.nameLen != 0) {
+									// Component names keep pointing to the component cache. Other names are copied.
+									const auto* pItem = m_compCache.find(entity);
+									if (pItem != nullptr && pItem->name.len() == rec.nameLen &&
+											memcmp(pItem->name.str(), pName, rec.nameLen) == 0)
+										name_raw(entity, pItem->name.str(), rec.nameLen);
+									else
+										name(entity, pName, rec.nameLen);
+								}
+							}
+						}
+
+						constexpr auto DelFlag = (EntityContainerFlagsType)EntityContainerFlags::DeleteRequested;
+						ec.flags = (EntityContainerFlagsType)((rec.ec.flags & ~DelFlag) | (ec.flags & DelFlag));
+					}
+					ec.ver = rec.ec.ver;
+				}
+
+				// Component data. Changes are marked with the version of the world the delta comes from.
+				m_worldVersion = worldVersion;
+				{
+					cnt::darray<Entity> chunkEnts;
+					uint32_t chunkCnt = 0;
+					s.load(chunkCnt);
+					GAIA_FOR(chunkCnt) {
+						uint16_t chunkEntCnt = 0;
+						s.load(chunkEntCnt);
+						chunkEnts.resize(chunkEntCnt);
+						s.load((void*)chunkEnts.data(), chunkEntCnt * (uint32_t)sizeof(Entity));
+
+						uint32_t compCnt = 0;
+						s.load(compCnt);
+						GAIA_FOR_(compCnt, j) {
+							Entity comp;
+							s.load(comp);
+
+							if (comp.kind() == EntityKind::EK_Gen) {
+								for (auto entity: chunkEnts) {
+									const auto& ec = fetch(entity);
+									ec.pChunk->load_delta(s, ec.pChunk->comp_idx(comp), ec.row);
+								}
+								continue;
+							}
+
+							// Unique components are written once per chunk. The entities might be spread
+							// across more chunks in this world so the value is read for each of them.
+							const auto pos = s.tell();
+							auto posEnd = pos;
+							const Chunk* pPrevChunk = nullptr;
+							for (auto entity: chunkEnts) {
+								const auto& ec = fetch(entity);
+								if (ec.pChunk == pPrevChunk)
+									continue;
+
+								pPrevChunk = ec.pChunk;
+								s.seek(pos);
+								ec.pChunk->load_delta(s, ec.pChunk->comp_idx(comp), 0);
+								posEnd = s.tell();
+							}
+							s.seek(posEnd);
+						}
+					}
+				}
+
+				validate_entities();
+				return true;
 			}
 
 			//! Sets the maximum number of entites defragmented per world tick
@@ -3102,6 +4279,18 @@ namespace gaia {
 				m_defragEntitesPerTick = value;
 			}
 
+			//! Sets the time budget for defragmentation per world tick.
+			//! Entities are then moved in batches of defrag_entities_per_tick() until the budget is used up.
+			//! \param microseconds Time budget in microseconds. Zero turns the time budget off.
+			void defrag_budget(uint32_t microseconds) {
+				m_defragBudgetUs = microseconds;
+			}
+
+			//! Returns statistics of the defragmentation done during the last world tick
+			GAIA_NODISCARD const DefragStats& defrag_stats() const {
+				return m_defragStats;
+			}
+
 			//--------------------------------------------------------------------------------
 
 			//! Performs diagnostics on archetypes. Prints basic info about them and the chunks they contain.
@@ -3166,6 +4355,12 @@ namespace gaia {
 			return world.get(id);
 		}
 
+		GAIA_NODISCARD inline Entity entity_from_rec(const World& world, EntityId id) {
+			GAIA_ASSERT(id < world.m_recs.entities.size());
+			const auto& ec = world.m_recs.entities[id];
+			return EntityContainer::create(ec);
+		}
+
 		GAIA_NODISCARD inline bool is(const World& world, Entity entity, Entity baseEntity) {
 			return world.is(entity, baseEntity);
 		}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "../config/config.h"
+
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+#include "../cnt/darray.h"
+#include "../mem/mem_alloc.h"
+
+namespace gaia {
+	namespace mt {
+		//! Linear allocator for data that lives as long as the jobs using it.
+		//! Memory blocks are never released on reset, only rewound, so once the arena
+		//! has grown to the size needed by a frame no more allocations happen.
+		//! \warning Not thread-safe. Must be used from the main thread.
+		class JobArena {
+			//! Size of a single memory block in bytes
+			static constexpr uint32_t BlockSize = 16 * 1024;
+			//! Alignment of memory blocks
+			static constexpr uint32_t BlockAlignment = 64;
+
+			struct DtorItem {
+				void* pData;
+				void (*dtor)(void*);
+			};
+
+			//! List of allocated memory blocks
+			cnt::darray<uint8_t*> m_blocks;
+			//! Objects that need their destructor called on reset
+			cnt::darray<DtorItem> m_dtors;
+			//! Allocations too big to fit into a memory block. Released on reset.
+			cnt::darray<void*> m_bigAllocs;
+			//! Index of the memory block used for the next allocation
+			uint32_t m_blockIdx = 0;
+			//! Offset in the current memory block
+			uint32_t m_offset = 0;
+
+			void* alloc_raw(uint32_t size, uint32_t alignment) {
+				GAIA_ASSERT(size <= BlockSize);
+
+				if (m_blockIdx < m_blocks.size()) {
+					const auto offset = (uint32_t)mem::align(m_offset, alignment);
+					if (offset + size <= BlockSize) {
+						m_offset = offset + size;
+						return m_blocks[m_blockIdx] + offset;
+					}
+
+					// Not enough space in the current block. Move to the next one.
+					++m_blockIdx;
+				}
+
+				if (m_blockIdx == m_blocks.size())
+					m_blocks.push_back((uint8_t*)mem::mem_alloc_alig(BlockSize, BlockAlignment));
+
+				m_offset = size;
+				return m_blocks[m_blockIdx];
+			}
+
+		public:
+			JobArena() = default;
+			~JobArena() {
+				reset();
+				for (auto* pBlock: m_blocks)
+					mem::mem_free_alig(pBlock);
+			}
+
+			JobArena(JobArena&&) = delete;
+			JobArena(const JobArena&) = delete;
+			JobArena& operator=(JobArena&&) = delete;
+			JobArena& operator=(const JobArena&) = delete;
+
+			//! Constructs an object of type \tparam T inside the arena.
+			//! The object is destroyed when the arena is reset.
+			template <typename T, typename... Args>
+			GAIA_NODISCARD T* alloc(Args&&... args) {
+				static_assert(sizeof(T) <= BlockSize);
+				static_assert(alignof(T) <= BlockAlignment);
+
+				auto* pData = alloc_raw((uint32_t)sizeof(T), (uint32_t)alignof(T));
+				auto* pObj = new (pData) T(GAIA_FWD(args)...);
+				if constexpr (!std::is_trivially_destructible_v<T>) {
+					m_dtors.push_back({pObj, [](void* p) {
+															 ((T*)p)->~T();
+														 }});
+				}
+				return pObj;
+			}
+
+			//! Allocates an uninitialized array of \param cnt items of type \tparam T inside the arena.
+			//! Arrays bigger than a memory block get memory of their own which is released on reset.
+			template <typename T>
+			GAIA_NODISCARD T* alloc_n(uint32_t cnt) {
+				static_assert(std::is_trivially_destructible_v<T>);
+				static_assert(alignof(T) <= BlockAlignment);
+
+				const auto size = (uint32_t)sizeof(T) * cnt;
+				if (size > BlockSize) {
+					auto* pData = mem::mem_alloc_alig(size, BlockAlignment);
+					m_bigAllocs.push_back(pData);
+					return (T*)pData;
+				}
+
+				return (T*)alloc_raw(size, (uint32_t)alignof(T));
+			}
+
+			//! Destroys all objects and rewinds the arena. Memory blocks are kept around for reuse.
+			//! \warning No job using the arena's data can be running at this point.
+			void reset() {
+				for (uint32_t i = m_dtors.size(); i > 0; --i) {
+					const auto& item = m_dtors[i - 1];
+					item.dtor(item.pData);
+				}
+				m_dtors.clear();
+				for (auto* pData: m_bigAllocs)
+					mem::mem_free_alig(pData);
+				m_bigAllocs.clear();
+				m_blockIdx = 0;
+				m_offset = 0;
+			}
+
+			//! Returns the number of memory blocks owned by the arena
+			GAIA_NODISCARD uint32_t blocks() const {
+				return m_blocks.size();
+			}
+		};
+	} // namespace mt
+} // namespace gaia
@@ -1,7 +1,11 @@
 #pragma once
 
-#include <functional>
+#include "../config/config.h"
+
+#include <cstddef>
 #include <inttypes.h>
+#include <new>
+#include <type_traits>
 
 namespace gaia {
 	namespace mt {
@@ -18,8 +22,133 @@ namespace gaia {
 			JobPriority priority;
 		};
 
+		template <typename Sig>
+		class JobFunc;
+
+		//! Type-erased callable with a fixed-capacity inline storage.
+		//! Unlike std::function it never allocates memory. Callables bigger than GAIA_JOB_FUNC_SIZE bytes
+		//! are rejected at compile-time.
+		template <typename R, typename... Args>
+		class JobFunc<R(Args...)> {
+		public:
+			//! The maximum size of the callable in bytes
+			static constexpr uint32_t StorageSize = GAIA_JOB_FUNC_SIZE;
+
+		private:
+			enum class Op { Copy, Move, Destroy };
+
+			using InvokeFunc = R (*)(void*, Args...);
+			using ManageFunc = void (*)(Op, void*, void*);
+
+			alignas(std::max_align_t) uint8_t m_storage[StorageSize];
+			//! Invokes the stored callable. nullptr when empty.
+			InvokeFunc m_pInvoke = nullptr;
+			//! Copies, moves or destroys the stored callable. nullptr when empty.
+			ManageFunc m_pManage = nullptr;
+
+			template <typename F>
+			static R invoke(void* pStorage, Args... args) {
+				return (*(F*)pStorage)(GAIA_FWD(args)...);
+			}
+
+			template <typename F>
+			static void manage(Op op, void* pDst, void* pSrc) {
+				switch (op) {
+					case Op::Copy:
+						(void)new (pDst) F(*(const F*)pSrc);
+						break;
+					case Op::Move:
+						(void)new (pDst) F(GAIA_MOV(*(F*)pSrc));
+						break;
+					case Op::Destroy:
+						((F*)pDst)->~F();
+						break;
+				}
+			}
+
+			void copy_from(const JobFunc& other) {
+				if (other.m_pManage == nullptr)
+					return;
+				other.m_pManage(Op::Copy, m_storage, (void*)other.m_storage);
+				m_pInvoke = other.m_pInvoke;
+				m_pManage = other.m_pManage;
+			}
+
+			void move_from(JobFunc& other) {
+				if (other.m_pManage == nullptr)
+					return;
+				other.m_pManage(Op::Move, m_storage, other.m_storage);
+				m_pInvoke = other.m_pInvoke;
+				m_pManage = other.m_pManage;
+				other.reset();
+			}
+
+		public:
+			JobFunc() noexcept = default;
+			JobFunc(std::nullptr_t) noexcept {}
+
+			template <
+					typename F, typename FD = std::decay_t<F>,
+					typename = std::enable_if_t<!std::is_same_v<FD, JobFunc> && std::is_invocable_r_v<R, FD&, Args...>>>
+			JobFunc(F&& func) {
+				static_assert(
+						sizeof(FD) <= StorageSize, "Job function is too big. Capture less data or increase GAIA_JOB_FUNC_SIZE");
+				static_assert(alignof(FD) <= alignof(std::max_align_t), "Job function is over-aligned");
+
+				(void)new (m_storage) FD(GAIA_FWD(func));
+				m_pInvoke = &invoke<FD>;
+				m_pManage = &manage<FD>;
+			}
+
+			~JobFunc() {
+				reset();
+			}
+
+			JobFunc(const JobFunc& other) {
+				copy_from(other);
+			}
+
+			JobFunc(JobFunc&& other) noexcept {
+				move_from(other);
+			}
+
+			JobFunc& operator=(const JobFunc& other) {
+				if (this != &other) {
+					reset();
+					copy_from(other);
+				}
+				return *this;
+			}
+
+			JobFunc& operator=(JobFunc&& other) noexcept {
+				if (this != &other) {
+					reset();
+					move_from(other);
+				}
+				return *this;
+			}
+
+			//! Destroys the stored callable
+			void reset() {
+				if (m_pManage == nullptr)
+					return;
+				m_pManage(Op::Destroy, m_storage, nullptr);
+				m_pInvoke = nullptr;
+				m_pManage = nullptr;
+			}
+
+			GAIA_NODISCARD explicit operator bool() const noexcept {
+				return m_pInvoke != nullptr;
+			}
+
+			R operator()(Args... args) const {
+				GAIA_ASSERT(m_pInvoke != nullptr);
+				return m_pInvoke((void*)m_storage, GAIA_FWD(args)...);
+			}
+		};
+
 		struct Job {
-			std::function<void()> func;
+			JobFunc<void()> func;
 			JobPriority priority = JobPriority::High;
 		};
 
@@ -29,8 +158,8 @@ namespace gaia {
 		};
 
 		struct JobParallel {
-			std::function<void(const JobArgs&)> func;
+			JobFunc<void(const JobArgs&)> func;
 			JobPriority priority = JobPriority::High;
 		};
 	} // namespace mt
-} // namespace gaia
\ No newline at end of file
+} // namespace gaia
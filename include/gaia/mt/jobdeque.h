@@ -0,0 +1,130 @@
+#pragma once
+
+#include "../config/config.h"
+
+#include <atomic>
+#include <cstdint>
+
+#include "../config/profiler.h"
+
+#include "jobhandle.h"
+
+namespace gaia {
+	namespace mt {
+		//! Bounded lock-free work-stealing deque (Chase-Lev).
+		//! Only the owning thread is allowed to push and pop jobs. Pushing and popping
+		//! happens at the bottom of the deque (LIFO). Any other thread can steal jobs
+		//! from the top of the deque (FIFO).
+		class JobDeque {
+		public:
+			//! The maximum number of jobs fitting in the deque at the same time
+			static constexpr uint32_t N = 1 << 12;
+
+		private:
+			static constexpr uint32_t MASK = N - 1;
+
+			//! Index of the oldest job. Modified by thieves (and the owner when taking the last job).
+			alignas(64) std::atomic_uint32_t m_top{};
+			//! Index one past the newest job. Modified only by the owner.
+			alignas(64) std::atomic_uint32_t m_bottom{};
+			//! Ring buffer of jobs
+			alignas(64) std::atomic<JobHandle> m_buffer[N];
+
+		public:
+			JobDeque() = default;
+			~JobDeque() = default;
+
+			JobDeque(JobDeque&&) = delete;
+			JobDeque(const JobDeque&) = delete;
+			JobDeque& operator=(JobDeque&&) = delete;
+			JobDeque& operator=(const JobDeque&) = delete;
+
+			//! Returns an estimate of the number of jobs in the deque.
+			//! \warning Other threads might be modifying the deque at the same time so the value
+			//!          is only guaranteed to be exact when called by the owner with no thieves around.
+			GAIA_NODISCARD uint32_t size() const {
+				const uint32_t b = m_bottom.load(std::memory_order_relaxed);
+				const uint32_t t = m_top.load(std::memory_order_relaxed);
+				const auto diff = (int32_t)(b - t);
+				return diff > 0 ? (uint32_t)diff : 0U;
+			}
+
+			//! Checks if the deque is empty. Same rules as for size() apply.
+			GAIA_NODISCARD bool empty() const {
+				return size() == 0;
+			}
+
+			//! Tries adding a job to the bottom of the deque.
+			//! \warning Must be called by the owner thread.
+			//! \return True if the job was added. False otherwise (e.g. maximum capacity has been reached).
+			GAIA_NODISCARD bool try_push(JobHandle jobHandle) {
+				GAIA_PROF_SCOPE(JobDeque::try_push);
+
+				const uint32_t b = m_bottom.load(std::memory_order_relaxed);
+				const uint32_t t = m_top.load(std::memory_order_acquire);
+				if (b - t >= N)
+					return false;
+
+				m_buffer[b & MASK].store(jobHandle, std::memory_order_relaxed);
+
+				// Make sure the handle is written before the new bottom becomes visible
+				std::atomic_thread_fence(std::memory_order_release);
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+				return true;
+			}
+
+			//! Tries retrieving a job from the bottom of the deque. LIFO.
+			//! \warning Must be called by the owner thread.
+			//! \return True if the job was retrieved. False otherwise (e.g. there are no jobs).
+			GAIA_NODISCARD bool try_pop(JobHandle& jobHandle) {
+				GAIA_PROF_SCOPE(JobDeque::try_pop);
+
+				const uint32_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+				m_bottom.store(b, std::memory_order_relaxed);
+				// Reserve the bottom slot before reading the top so thieves can see it
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				uint32_t t = m_top.load(std::memory_order_relaxed);
+
+				// Deque already empty
+				if ((int32_t)(b - t) < 0) {
+					m_bottom.store(b + 1, std::memory_order_relaxed);
+					return false;
+				}
+
+				jobHandle = m_buffer[b & MASK].load(std::memory_order_relaxed);
+
+				// More than one job left, no need to race with thieves
+				if (b != t)
+					return true;
+
+				// The last job in the deque. Should multiple threads fight for it
+				// the atomic CAS ensures it is extracted only once.
+				const bool ret =
+						m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+				return ret;
+			}
+
+			//! Tries stealing a job from the top of the deque. FIFO.
+			//! Can be called from any thread.
+			//! \return True if the job was stolen. False otherwise (e.g. there are no jobs or
+			//!         a concurrent pop/steal took the job first).
+			GAIA_NODISCARD bool try_steal(JobHandle& jobHandle) {
+				GAIA_PROF_SCOPE(JobDeque::try_steal);
+
+				uint32_t t = m_top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				const uint32_t b = m_bottom.load(std::memory_order_acquire);
+
+				// Return false when empty
+				if ((int32_t)(b - t) <= 0)
+					return false;
+
+				jobHandle = m_buffer[t & MASK].load(std::memory_order_relaxed);
+
+				// We fail if a concurrent pop/steal operation changed the current top
+				return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			}
+		};
+	} // namespace mt
+} // namespace gaia
@@ -2,7 +2,6 @@
 
 #include "../config/config.h"
 
-#include <functional>
 #include <inttypes.h>
 #include <mutex>
 
@@ -36,7 +35,7 @@ namespace gaia {
 			uint32_t dependencyIdx;
 			JobPriority priority : 1;
 			JobInternalState state : 31;
-			std::function<void()> func;
+			JobFunc<void()> func;
 
 			JobContainer() = default;
 
@@ -173,7 +172,7 @@ namespace gaia {
 			}
 
 			void run(JobHandle jobHandle) {
-				std::function<void()> func;
+				JobFunc<void()> func;
 
 				{
 					std::scoped_lock<std::mutex> lock(m_jobsLock);
@@ -181,7 +180,7 @@ namespace gaia {
 					job.state = JobInternalState::Running;
 					func = job.func;
 				}
-				if (func.operator bool())
+				if (func)
 					func();
 				{
 					std::scoped_lock<std::mutex> lock(m_jobsLock);
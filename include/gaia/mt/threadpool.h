@@ -26,7 +26,9 @@
 #include "../core/span.h"
 #include "../core/utility.h"
 
+#include "jobarena.h"
 #include "jobcommon.h"
+#include "jobdeque.h"
 #include "jobhandle.h"
 #include "jobmanager.h"
 #include "jobqueue.h"
@@ -34,7 +36,17 @@
 namespace gaia {
 	namespace mt {
 		class ThreadPool final {
+		public:
 			static constexpr uint32_t MaxWorkers = 31;
+			//! The maximum number of threads executing jobs. All workers plus the main thread.
+			static constexpr uint32_t MaxThreads = MaxWorkers + 1;
+
+		private:
+			//! The maximum number of jobs moved to the thief's deque in one stealing attempt
+			static constexpr uint32_t MaxStealBatch = 32;
+
+			//! Index of the calling thread. 0 for the main thread and threads outside the pool, workerIdx+1 for workers
+			static inline thread_local uint32_t s_threadIdx = 0;
 
 			//! ID of the main thread
 			std::thread::id m_mainThreadId;
@@ -47,6 +59,11 @@ namespace gaia {
 
 			//! Manager for internal jobs
 			JobManager m_jobManager;
+			//! Storage for data shared by jobs created via sched_par.
+			//! Reset once no jobs are pending.
+			JobArena m_arena;
+			//! True if data was allocated in the arena for jobs which are not scheduled yet
+			bool m_arenaPending = false;
 
 			//! How many jobs are currently being processed
 			std::atomic_uint32_t m_jobsPending[JobPriority::Cnt]{};
@@ -54,8 +71,13 @@ namespace gaia {
 			std::mutex m_cvLock[JobPriority::Cnt];
 			//! Signals for given workers to wake up
 			std::condition_variable m_cv[JobPriority::Cnt];
-			//! List of pending user jobs
-			JobQueue m_jobQueue[JobPriority::Cnt];
+			//! Deques of jobs submitted by the main thread. Only the main thread pushes and pops,
+			//! workers steal from them.
+			JobDeque m_mainDeque[JobPriority::Cnt];
+			//! Per-worker deques. Each worker pushes and pops its own deque, idle workers steal from it.
+			JobDeque m_workerDeque[MaxWorkers];
+			//! List of jobs whose dependencies were not met yet when they were picked up
+			JobQueue m_jobQueueDeferred[JobPriority::Cnt];
 
 		private:
 			ThreadPool() {
@@ -164,6 +186,30 @@ namespace gaia {
 				m_jobManager.dep(jobHandle, dependsOnSpan);
 			}
 
+			//! Constructs an object of type \tparam T in memory shared by jobs.
+			//! The object stays alive until the jobs scheduled next by sched_par finish.
+			//! \warning Must be used from the main thread.
+			template <typename T, typename... Args>
+			GAIA_NODISCARD T* alloc_job_data(Args&&... args) {
+				GAIA_ASSERT(main_thread());
+
+				reset_arena_if_idle();
+				m_arenaPending = true;
+				return m_arena.alloc<T>(GAIA_FWD(args)...);
+			}
+
+			//! Allocates an uninitialized array of \param cnt items of type \tparam T in memory shared by jobs.
+			//! The array stays valid until the jobs scheduled next by sched_par finish.
+			//! \warning Must be used from the main thread.
+			template <typename T>
+			GAIA_NODISCARD T* alloc_job_data_n(uint32_t cnt) {
+				GAIA_ASSERT(main_thread());
+
+				reset_arena_if_idle();
+				m_arenaPending = true;
+				return m_arena.alloc_n<T>(cnt);
+			}
+
 			//! Creates a job system job from \param job.
 			//! \warning Must be used from the main thread.
 			//! \return Job handle of the scheduled job.
@@ -185,22 +231,26 @@ namespace gaia {
 			//! If there are more jobs than the queue can handle it puts the calling
 			//! thread to sleep until workers consume enough jobs.
 			//! \warning Once submited, dependencies can't be modified for this job.
+			//! \warning Must be used from the main thread.
 			void submit(JobHandle jobHandle) {
+				GAIA_ASSERT(main_thread());
+
 				m_jobManager.submit(jobHandle);
 
 				const auto prio = (JobPriority)jobHandle.prio();
-				auto& jobQueue = m_jobQueue[(uint32_t)prio];
+				auto& deque = m_mainDeque[(uint32_t)prio];
 				auto& cv = m_cv[(uint32_t)prio];
 
 				if GAIA_UNLIKELY (m_workers.empty()) {
-					jobQueue.try_push(jobHandle);
+					while (!deque.try_push(jobHandle))
+						main_thread_tick(prio);
 					main_thread_tick(prio);
 					return;
 				}
 
 				// Try pushing a new job until we succeed.
 				// The thread is put to sleep if pushing the jobs fails.
-				while (!jobQueue.try_push(jobHandle))
+				while (!deque.try_push(jobHandle))
 					poll(prio);
 
 				// Wake some worker thread
@@ -208,8 +258,10 @@ namespace gaia {
 			}
 
 		private:
-			//! Resubmits \param jobHandle into the internal queue so worker threads
-			//! can pick it up and execute it.
+			//! Resubmits \param jobHandle into the internal queue of deferred jobs so worker
+			//! threads can pick it up and execute it once its dependencies are met.
+			//! Deferred jobs are not returned to the deques because the owner would pop
+			//! the same job again right away.
 			//! If there are more jobs than the queue can handle it puts the calling
 			//! thread to sleep until workers consume enough jobs.
 			//! \warning Internal usage only. Only worker theads can decide to resubmit.
@@ -217,7 +269,7 @@ namespace gaia {
 				m_jobManager.resubmit(jobHandle);
 
 				const auto prio = (JobPriority)jobHandle.prio();
-				auto& jobQueue = m_jobQueue[(uint32_t)prio];
+				auto& jobQueue = m_jobQueueDeferred[(uint32_t)prio];
 				auto& cv = m_cv[(uint32_t)prio];
 
 				if GAIA_UNLIKELY (m_workers.empty()) {
@@ -304,14 +356,22 @@ namespace gaia {
 					groupSize = (itemsToProcess + workerCount - 1) / workerCount;
 
 				const auto jobs = (itemsToProcess + groupSize - 1) / groupSize;
+
+				reset_arena_if_idle();
+				m_arenaPending = false;
+
 				// Internal jobs + 1 for the groupHandle
 				m_jobsPending[(uint32_t)prio] += (jobs + 1U);
 
+				// The job is shared by all groups. Store it in the arena so each group job
+				// only needs to capture a pointer to it.
+				const auto* pJob = m_arena.alloc<JobParallel>(job);
+
 				JobHandle groupHandle = m_jobManager.alloc_job({{}, prio});
 
 				GAIA_FOR_(jobs, jobIndex) {
 					// Create one job per group
-					auto groupJobFunc = [job, itemsToProcess, groupSize, jobIndex]() {
+					auto groupJobFunc = [pJob, itemsToProcess, groupSize, jobIndex]() {
 						const uint32_t groupJobIdxStart = jobIndex * groupSize;
 						const uint32_t groupJobIdxStartPlusGroupSize = groupJobIdxStart + groupSize;
 						const uint32_t groupJobIdxEnd =
@@ -320,7 +380,7 @@ namespace gaia {
 						JobArgs args;
 						args.idxStart = groupJobIdxStart;
 						args.idxEnd = groupJobIdxEnd;
-						job.func(args);
+						pJob->func(args);
 					};
 
 					JobHandle jobHandle = m_jobManager.alloc_job({groupJobFunc, prio});
@@ -333,13 +393,17 @@ namespace gaia {
 			}
 
 			//! Waits for the job to finish.
-			//! \param jobHandle Job handle
+			//! \param jobHandle Job handle. JobNull is accepted and ignored.
 			//! \warning Must be used from the main thread.
 			void wait(JobHandle jobHandle) {
+				if (jobHandle == JobNull)
+					return;
+
 				// When no workers are available, execute all we have.
 				if GAIA_UNLIKELY (m_workers.empty()) {
 					update();
 					m_jobManager.reset();
+					m_arena.reset();
 					return;
 				}
 
@@ -359,6 +423,7 @@ namespace gaia {
 				if GAIA_UNLIKELY (m_workers.empty()) {
 					update();
 					m_jobManager.reset();
+					m_arena.reset();
 					return;
 				}
 
@@ -374,6 +439,7 @@ namespace gaia {
 #endif
 
 				m_jobManager.reset();
+				m_arena.reset();
 			}
 
 			//! Uses the main thread to help with jobs processing.
@@ -400,6 +466,24 @@ namespace gaia {
 				return hwThreads;
 			}
 
+			//! Checks if the calling thread is considered the main thread
+			//! \return True if the calling thread is the main thread. False otherwise.
+			GAIA_NODISCARD bool main_thread() const {
+				return std::this_thread::get_id() == m_mainThreadId;
+			}
+
+			//! Returns the index of the calling thread in range [0, MaxThreads).
+			//! The main thread and threads not owned by the pool have index 0. Worker threads have index workerIdx+1.
+			GAIA_NODISCARD static uint32_t thread_idx() {
+				return s_threadIdx;
+			}
+
+			//! Checks if the calling thread is one of the worker threads of the pool
+			//! \return True if the calling thread is a worker thread. False otherwise.
+			GAIA_NODISCARD static bool worker_thread() {
+				return s_threadIdx != 0;
+			}
+
 		private:
 			struct ThreadFuncCtx {
 				ThreadPool* tp;
@@ -419,7 +503,7 @@ namespace gaia {
 				ctx.tp->set_thread_priority(ctx.workerIdx, ctx.prio);
 
 				// Process jobs
-				ctx.tp->worker_loop(ctx.prio);
+				ctx.tp->worker_loop(ctx.workerIdx, ctx.prio);
 
 #if !GAIA_PLATFORM_WINDOWS
 				// Other platforms allocate the context dynamically
@@ -657,22 +741,16 @@ namespace gaia {
 #endif
 			}
 
-			//! Checks if the calling thread is considered the main thread
-			//! \return True if the calling thread is the main thread. False otherwise.
-			GAIA_NODISCARD bool main_thread() const {
-				return std::this_thread::get_id() == m_mainThreadId;
-			}
-
 			//! Loop run by main thread. Pops jobs from the given queue
 			//! and executes it.
 			//! \param prio Target worker queue defined by job priority
 			//! \return True if a job was resubmitted or executed. False otherwise.
 			bool main_thread_tick(JobPriority prio) {
-				auto& jobQueue = m_jobQueue[(uint32_t)prio];
+				GAIA_ASSERT(main_thread());
 
 				JobHandle jobHandle;
 
-				if (!jobQueue.try_pop(jobHandle))
+				if (!try_get_job(m_mainDeque[(uint32_t)prio], (uint32_t)-1, prio, jobHandle))
 					return false;
 
 				GAIA_ASSERT(busy(prio));
@@ -690,18 +768,21 @@ namespace gaia {
 				return true;
 			}
 
-			//! Loop run by worker threads. Pops jobs from the given queue
-			//! and executes it.
+			//! Loop run by worker threads. Pops jobs from the worker's deque, steals them
+			//! from other deques when it runs dry and executes them.
+			//! \param workerIdx Worker index
 			//! \param prio Target worker queue defined by job priority
-			void worker_loop(JobPriority prio) {
-				auto& jobQueue = m_jobQueue[(uint32_t)prio];
+			void worker_loop(uint32_t workerIdx, JobPriority prio) {
+				auto& deque = m_workerDeque[workerIdx];
 				auto& cv = m_cv[(uint32_t)prio];
 				auto& cvLock = m_cvLock[(uint32_t)prio];
 
+				s_threadIdx = workerIdx + 1;
+
 				while (!m_stop) {
 					JobHandle jobHandle;
 
-					if (!jobQueue.try_pop(jobHandle)) {
+					if (!try_get_job(deque, workerIdx, prio, jobHandle)) {
 						std::unique_lock<std::mutex> lock(cvLock);
 						cv.wait(lock);
 						continue;
@@ -722,6 +803,85 @@ namespace gaia {
 				}
 			}
 
+			//! Returns the range of workers processing jobs of priority \param prio.
+			//! \param[out] from Index of the first worker
+			//! \param[out] to Index one past the last worker
+			void worker_range(JobPriority prio, uint32_t& from, uint32_t& to) const {
+				const uint32_t workerCnt = m_workers.size();
+				from = prio == JobPriority::High ? 0 : core::get_min(m_workerCnt[0], workerCnt);
+				to = prio == JobPriority::High ? core::get_min(m_workerCnt[0], workerCnt) : workerCnt;
+			}
+
+			//! Tries stealing a job from deques of other threads processing jobs of priority \param prio.
+			//! Workers are visited first starting with the one following the thief. The main thread's
+			//! deque is visited last. When stealing from the main thread's deque, up to MaxStealBatch
+			//! additional jobs are moved to the thief's deque so other idle workers can steal them from
+			//! the thief rather than all of them contending on the main thread's deque.
+			//! \param deque Deque owned by the thief
+			//! \param thiefIdx Index of the worker stealing. (uint32_t)-1 for the main thread.
+			//! \param prio Job priority
+			//! \param[out] jobHandle Stolen job
+			//! \return True if a job was stolen. False otherwise.
+			bool try_steal(JobDeque& deque, uint32_t thiefIdx, JobPriority prio, JobHandle& jobHandle) {
+				uint32_t from{};
+				uint32_t to{};
+				worker_range(prio, from, to);
+
+				const uint32_t cnt = to - from;
+				if (cnt > 0) {
+					const uint32_t start = thiefIdx >= from && thiefIdx < to ? thiefIdx - from + 1 : 0;
+					GAIA_FOR(cnt) {
+						const uint32_t victimIdx = from + ((start + i) % cnt);
+						if (victimIdx == thiefIdx)
+							continue;
+						if (m_workerDeque[victimIdx].try_steal(jobHandle))
+							return true;
+					}
+				}
+
+				auto& mainDeque = m_mainDeque[(uint32_t)prio];
+				if (&mainDeque == &deque || !mainDeque.try_steal(jobHandle))
+					return false;
+
+				// Move a part of the remaining jobs over to the thief's deque.
+				// Never move more than the thief's deque can hold. Only thieves take jobs from it while we are
+				// at it, so its free space can only grow and pushing can't fail.
+				const uint32_t freeCnt = JobDeque::N - deque.size();
+				const uint32_t stealCnt = core::get_min(mainDeque.size() / (cnt + 1), MaxStealBatch);
+				const uint32_t batchSize = core::get_min(stealCnt, freeCnt);
+				uint32_t movedCnt = 0;
+				GAIA_FOR(batchSize) {
+					JobHandle stolenHandle;
+					if (!mainDeque.try_steal(stolenHandle))
+						break;
+
+					[[maybe_unused]] const bool pushed = deque.try_push(stolenHandle);
+					GAIA_ASSERT(pushed);
+					++movedCnt;
+				}
+
+				// Wake idle workers so they can steal the moved jobs from the thief
+				if (movedCnt > 0)
+					m_cv[(uint32_t)prio].notify_all();
+
+				return true;
+			}
+
+			//! Tries retrieving a job for the thread owning \param deque. Jobs are popped from the owned deque
+			//! first, then stolen from other threads. Deferred jobs are picked up when there is nothing else to do.
+			//! \param deque Deque owned by the calling thread
+			//! \param threadIdx Index of the calling worker. (uint32_t)-1 for the main thread.
+			//! \param prio Job priority
+			//! \param[out] jobHandle Retrieved job
+			//! \return True if a job was retrieved. False otherwise.
+			bool try_get_job(JobDeque& deque, uint32_t threadIdx, JobPriority prio, JobHandle& jobHandle) {
+				if (deque.try_pop(jobHandle))
+					return true;
+				if (try_steal(deque, threadIdx, prio, jobHandle))
+					return true;
+				return m_jobQueueDeferred[(uint32_t)prio].try_pop(jobHandle);
+			}
+
 			//! Finishes all jobs and stops all worker threads
 			void reset() {
 				// Request stopping
@@ -747,6 +907,12 @@ namespace gaia {
 				return m_jobsPending[(uint32_t)prio] > 0;
 			}
 
+			//! Rewinds the arena if no jobs are pending and nothing was allocated for jobs about to be scheduled
+			void reset_arena_if_idle() {
+				if (!m_arenaPending && !busy(JobPriority::High) && !busy(JobPriority::Low))
+					m_arena.reset();
+			}
+
 			//! Wakes up some worker thread and reschedules the current one.
 			void poll(JobPriority prio) {
 				// Wake some worker thread
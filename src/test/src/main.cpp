@@ -78,6 +78,10 @@ struct RotationSoA16 {
 struct Scale {
 	float x, y, z;
 };
+struct PositionTracked {
+	float x, y, z;
+	static constexpr bool TrackRowChanges = true;
+};
 struct Something {
 	bool value;
 };
@@ -1576,6 +1580,89 @@ TEST_CASE("Entity copy") {
 	REQUIRE(wld.has(e3, e2));
 }
 
+TEST_CASE("Add - n") {
+	const uint32_t N = 1'500;
+
+	TestWorld twld;
+
+	SECTION("No components") {
+		cnt::darr<ecs::Entity> ents;
+		wld.add_n(N, [&](ecs::Entity e) {
+			ents.push_back(e);
+		});
+		REQUIRE(ents.size() == N);
+		for (auto e: ents)
+			REQUIRE(wld.valid(e));
+
+		auto q = wld.query().all<ecs::EntityDesc>().no<ecs::Component>();
+		REQUIRE(q.count() - 3 == N); // 3 for core component
+	}
+	SECTION("Entity template") {
+		auto e = wld.add();
+		wld.add<Position>(e, {1, 2, 3});
+		wld.add<PositionNonTrivial>(e, {4, 5, 6});
+		wld.add<StringComponent2>(e);
+
+		uint32_t chunks = 0;
+		uint32_t cnt = 0;
+		wld.add_n(e, N, [&](ecs::IterRange& it) {
+			++chunks;
+			auto pos = it.view_mut<Position>();
+			auto ents = it.view<ecs::Entity>();
+			GAIA_EACH(it) {
+				pos[i] = {(float)cnt, 0, 0};
+				REQUIRE(wld.valid(ents[i]));
+				++cnt;
+			}
+		});
+		REQUIRE(cnt == N);
+		REQUIRE(chunks > 1);
+
+		// The template entity is not modified
+		REQUIRE(wld.get<Position>(e).x == 1.f);
+
+		uint32_t idx = 0;
+		auto q = wld.query().all<Position>().all<PositionNonTrivial>().all<StringComponent2>();
+		REQUIRE(q.count() == N + 1);
+		q.each([&](ecs::Entity entity, const Position& p, const PositionNonTrivial& pnt, const StringComponent2& str) {
+			if (entity == e)
+				return;
+			// Components of new entities are default-constructed
+			REQUIRE(pnt.x == 1.f);
+			REQUIRE(pnt.y == 2.f);
+			REQUIRE(pnt.z == 3.f);
+			REQUIRE(str.value == StringComponent2DefaultValue);
+			REQUIRE(p.x == (float)idx);
+			++idx;
+		});
+		REQUIRE(idx == N);
+	}
+	SECTION("Entity template with pairs") {
+		auto animal = wld.add();
+		auto e = wld.add();
+		wld.as(e, animal);
+		wld.add(e, ecs::Pair(ecs::OnDelete, ecs::Delete));
+
+		cnt::darr<ecs::Entity> ents;
+		wld.add_n(e, N, [&](ecs::Entity entity) {
+			ents.push_back(entity);
+		});
+		REQUIRE(ents.size() == N);
+
+		// New entities take part in the Is relationship the same way the template does
+		for (auto entity: ents)
+			REQUIRE(wld.is(entity, animal));
+
+		// Cleanup rules of the template apply to new entities as well
+		auto user = wld.add();
+		wld.add(user, ents[0]);
+		wld.del(ents[0]);
+		wld.update();
+		REQUIRE_FALSE(wld.valid(user));
+		REQUIRE(wld.valid(ents[1]));
+	}
+}
+
 TEST_CASE("Add - no components") {
 	const uint32_t N = 1'500;
 
@@ -1795,6 +1882,303 @@ TEST_CASE("Add - many components, bulk") {
 	GAIA_FOR(N) create();
 }
 
+TEST_CASE("Add - query, bulk") {
+	TestWorld twld;
+
+	// Enough entities to span multiple chunks
+	const uint32_t N = 5'000;
+	cnt::darr<ecs::Entity> ents;
+	ents.reserve(N);
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, (float)i, (float)i});
+		wld.add<StringComponent2>(e);
+		ents.push_back(e);
+	}
+	// Entities not matching the query must be left untouched
+	auto eOther = wld.add();
+	wld.add<Rotation>(eOther, {1, 2, 3, 4});
+	// Disabled entities are ignored by default
+	wld.enable(ents[0], false);
+	wld.enable(ents[1], false);
+
+	auto verify = [&](uint32_t i) {
+		const auto e = ents[i];
+		auto pos = wld.get<Position>(e);
+		REQUIRE(pos.x == (float)i);
+		REQUIRE(pos.y == (float)i);
+		REQUIRE(pos.z == (float)i);
+		REQUIRE(wld.get<StringComponent2>(e).value == StringComponent2DefaultValue);
+	};
+
+	auto q = wld.query().all<Position>();
+	wld.bulk(q).add<PositionNonTrivial>().add<Empty>();
+
+	REQUIRE_FALSE(wld.has<PositionNonTrivial>(ents[0]));
+	REQUIRE_FALSE(wld.has<PositionNonTrivial>(ents[1]));
+	REQUIRE_FALSE(wld.enabled(ents[0]));
+	for (uint32_t i = 2; i < N; ++i) {
+		const auto e = ents[i];
+		REQUIRE(wld.has<PositionNonTrivial>(e));
+		REQUIRE(wld.has<Empty>(e));
+		REQUIRE(wld.enabled(e));
+		auto pnt = wld.get<PositionNonTrivial>(e);
+		REQUIRE(pnt.x == 1.f);
+		REQUIRE(pnt.y == 2.f);
+		REQUIRE(pnt.z == 3.f);
+		verify(i);
+	}
+	REQUIRE_FALSE(wld.has<PositionNonTrivial>(eOther));
+	REQUIRE(wld.get<Rotation>(eOther).w == 4.f);
+
+	// Include the disabled entities now
+	wld.bulk(q, ecs::Constraints::AcceptAll).del<StringComponent2>().del<Empty>();
+	GAIA_FOR(N) {
+		const auto e = ents[i];
+		REQUIRE_FALSE(wld.has<StringComponent2>(e));
+		REQUIRE_FALSE(wld.has<Empty>(e));
+		REQUIRE(wld.has<Position>(e));
+		REQUIRE(wld.has<PositionNonTrivial>(e) == (i >= 2));
+		REQUIRE(wld.enabled(e) == (i >= 2));
+		REQUIRE(wld.get<Position>(e).x == (float)i);
+	}
+
+	// Nothing changes when the archetype stays the same
+	wld.bulk(q).add<Position>().del<Scale>();
+	GAIA_FOR(N) REQUIRE(wld.get<Position>(ents[i]).x == (float)i);
+	REQUIRE(q.count() == N - 2);
+}
+
+TEST_CASE("Chunk - column map") {
+	TestWorld twld;
+
+	auto e0 = wld.add();
+	wld.add<Position>(e0, {1, 2, 3});
+	wld.add<StringComponent2>(e0);
+	auto* pSrcArchetype = wld.fetch(e0).pArchetype;
+	auto* pSrcChunk = wld.fetch(e0).pChunk;
+
+	auto e1 = wld.copy(e0);
+	wld.add<PositionNonTrivial>(e1);
+	wld.del<StringComponent2>(e1);
+	auto* pDstArchetype = wld.fetch(e1).pArchetype;
+	auto* pDstChunk = wld.fetch(e1).pChunk;
+
+	ecs::Chunk::ColumnMap map;
+	ecs::Chunk::build_column_map(*pSrcChunk, *pDstChunk, map);
+	// EntityDesc and Position are relocated, PositionNonTrivial is constructed, StringComponent2 is destroyed
+	REQUIRE(map.items.size() == 3);
+	uint32_t relocCnt = 0;
+	uint32_t ctorCnt = 0;
+	for (const auto& item: map.items) {
+		relocCnt += item.op == ecs::Chunk::ColumnMap::Op::Relocate;
+		ctorCnt += item.op == ecs::Chunk::ColumnMap::Op::Ctor;
+	}
+	REQUIRE(relocCnt == 2);
+	REQUIRE(ctorCnt == 1);
+	REQUIRE(map.dtors.size() == 1);
+
+	// The mapping is cached on the source archetype
+	const auto& map0 = pSrcArchetype->column_map(*pDstArchetype, *pSrcChunk, *pDstChunk);
+	const auto& map1 = pSrcArchetype->column_map(*pDstArchetype, *pSrcChunk, *pDstChunk);
+	REQUIRE(&map0 == &map1);
+
+	// Move entities back and forth and make sure data survives
+	const uint32_t N = 1'000;
+	cnt::darr<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, 0, 0});
+		wld.add<StringComponent2>(e);
+		ents.push_back(e);
+	}
+	for (auto e: ents) {
+		wld.add<PositionNonTrivial>(e);
+		wld.del<StringComponent2>(e);
+	}
+	for (auto e: ents) {
+		wld.del<PositionNonTrivial>(e);
+		wld.add<StringComponent2>(e);
+	}
+	GAIA_FOR(N) {
+		const auto e = ents[i];
+		REQUIRE(wld.get<Position>(e).x == (float)i);
+		REQUIRE(wld.get<StringComponent2>(e).value == StringComponent2DefaultValue);
+		REQUIRE_FALSE(wld.has<PositionNonTrivial>(e));
+	}
+}
+
+TEST_CASE("Chunk - column map cleanup") {
+	TestWorld twld;
+
+	const uint32_t N = 100;
+	cnt::darr<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, 0, 0});
+		ents.push_back(e);
+	}
+	auto q = wld.query().all<Position>();
+	const auto* pArchetype = wld.fetch(ents[0]).pArchetype;
+	const auto mapCnt = pArchetype->column_map_cnt();
+
+	// Bulk moves lead to archetypes that are not graph neighbours of the source archetype
+	const uint32_t Runs = 10;
+	GAIA_FOR(Runs) {
+		auto tag = wld.add();
+		wld.bulk(q).add<Rotation>().add(tag);
+		REQUIRE(pArchetype->column_map_cnt() > mapCnt);
+
+		// Deleting the tag moves the entities back and deletes the archetypes holding it
+		wld.bulk(q).del<Rotation>().del(tag);
+		wld.del(tag);
+		// Give the empty archetypes time to die
+		GAIA_FOR_(200, j) wld.update();
+		REQUIRE(pArchetype->column_map_cnt() == mapCnt);
+	}
+
+	GAIA_FOR(N) {
+		REQUIRE(wld.fetch(ents[i]).pArchetype == pArchetype);
+		REQUIRE(wld.get<Position>(ents[i]).x == (float)i);
+	}
+}
+
+template <uint32_t I>
+struct FatComponent {
+	uint8_t data[250];
+};
+
+TEST_CASE("Chunk - size classes") {
+	TestWorld twld;
+
+	SECTION("Chunks grow with the archetype") {
+		constexpr uint32_t N = 5'000;
+		cnt::darr<ecs::Entity> ents;
+		GAIA_FOR(N) {
+			auto e = wld.add();
+			wld.add<Position>(e, {(float)i, 0, 0});
+			ents.push_back(e);
+		}
+
+		const auto* pArchetype = wld.fetch(ents[0]).pArchetype;
+		const auto& props = pArchetype->props();
+		REQUIRE(props.minSizeType < props.maxSizeType);
+
+		// Sparse archetypes start with small chunks and bigger ones follow as the population grows
+		const auto& chunks = pArchetype->chunks();
+		REQUIRE(chunks.front()->size_type() == props.minSizeType);
+		REQUIRE(chunks.back()->size_type() == props.maxSizeType);
+		for (uint32_t i = 1; i < chunks.size(); ++i)
+			REQUIRE(chunks[i - 1]->size_type() <= chunks[i]->size_type());
+		for (const auto* pChunk: chunks)
+			REQUIRE(pChunk->capacity() == pArchetype->chunk_layout(pChunk->size_type()).capacity);
+
+		GAIA_FOR(N) REQUIRE(wld.get<Position>(ents[i]).x == (float)i);
+
+		// Entities moved between chunks of different sizes by defragmentation keep their data
+		for (uint32_t i = 0; i < N; i += 2)
+			wld.del(ents[i]);
+		GAIA_FOR(100) wld.update();
+		for (uint32_t i = 1; i < N; i += 2)
+			REQUIRE(wld.get<Position>(ents[i]).x == (float)i);
+	}
+	SECTION("Fat archetypes use chunks bigger than 16K") {
+		using F0 = FatComponent<0>;
+		using F1 = FatComponent<1>;
+		using F2 = FatComponent<2>;
+		using F3 = FatComponent<3>;
+		using F4 = FatComponent<4>;
+		using F5 = FatComponent<5>;
+		using F6 = FatComponent<6>;
+		using F7 = FatComponent<7>;
+
+		constexpr uint32_t N = 200;
+		cnt::darr<ecs::Entity> ents;
+		GAIA_FOR(N) {
+			auto e = wld.add();
+			wld.bulk(e).add<F0>().add<F1>().add<F2>().add<F3>().add<F4>().add<F5>().add<F6>().add<F7>();
+			F0 f0{};
+			f0.data[0] = (uint8_t)i;
+			F7 f7{};
+			f7.data[249] = (uint8_t)(i + 1);
+			wld.set(e).set<F0>(GAIA_MOV(f0)).set<F7>(GAIA_MOV(f7));
+			ents.push_back(e);
+		}
+
+		const auto* pArchetype = wld.fetch(ents[0]).pArchetype;
+		const auto& props = pArchetype->props();
+		REQUIRE(ecs::mem_block_size(props.maxSizeType) > 16384);
+		REQUIRE(props.capacity > 16384 / (8 * sizeof(F0)));
+
+		GAIA_FOR(N) {
+			REQUIRE(wld.get<F0>(ents[i]).data[0] == (uint8_t)i);
+			REQUIRE(wld.get<F7>(ents[i]).data[249] == (uint8_t)(i + 1));
+		}
+	}
+}
+
+TEST_CASE("Chunk - defragmentation") {
+	TestWorld twld;
+
+	constexpr uint32_t N = 5'000;
+	cnt::darr<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, 0, 0});
+		ents.push_back(e);
+	}
+	// Leave every chunk sparsely populated
+	GAIA_FOR(N) {
+		if (i % 10 != 0)
+			wld.del(ents[i]);
+		else if (i % 30 == 0)
+			wld.enable(ents[i], false);
+	}
+
+	const auto* pArchetype = wld.fetch(ents[0]).pArchetype;
+	auto semiChunks = [&]() {
+		uint32_t cnt = 0;
+		for (const auto* pChunk: pArchetype->chunks())
+			cnt += (uint32_t)(!pChunk->empty() && !pChunk->full());
+		return cnt;
+	};
+	auto checkEntities = [&]() {
+		for (uint32_t i = 0; i < N; i += 10) {
+			REQUIRE(wld.get<Position>(ents[i]).x == (float)i);
+			REQUIRE(wld.enabled(ents[i]) == (i % 30 != 0));
+		}
+	};
+	REQUIRE(semiChunks() > 2);
+
+	SECTION("Entity budget") {
+		wld.defrag_entities_per_tick(10);
+		wld.update();
+
+		const auto& stats = wld.defrag_stats();
+		REQUIRE(stats.entities_moved == 10);
+		checkEntities();
+	}
+
+	SECTION("Time budget") {
+		// A generous time budget and small batches. Everything is defragmented within one tick.
+		wld.defrag_entities_per_tick(16);
+		wld.defrag_budget(10'000'000);
+		wld.update();
+
+		const auto& stats = wld.defrag_stats();
+		REQUIRE(stats.entities_moved > 16);
+		REQUIRE(stats.chunks_emptied > 0);
+		REQUIRE(stats.mem_reclaimed >= stats.chunks_emptied * ecs::MinMemoryBlockSize);
+		REQUIRE(semiChunks() <= 1);
+		checkEntities();
+
+		// Nothing left to do
+		wld.update();
+		REQUIRE(wld.defrag_stats().entities_moved == 0);
+		checkEntities();
+	}
+}
+
 TEST_CASE("Pair") {
 	{
 		TestWorld twld;
@@ -2884,133 +3268,618 @@ TEST_CASE("Query - equality") {
 	}
 }
 
-TEST_CASE("Enable") {
-	// 1,500 picked so we create enough entites that they overflow into another chunk
-	const uint32_t N = 1'500;
-
+TEST_CASE("Query - incremental matching") {
 	TestWorld twld;
-	cnt::darr<ecs::Entity> arr;
-	arr.reserve(N);
 
-	auto create = [&]() {
-		auto e = wld.add();
-		wld.add<Position>(e);
-		arr.push_back(e);
-	};
+	auto e0 = wld.add();
+	wld.add<Position>(e0);
 
-	GAIA_FOR(N) create();
+	ecs::Query qAll = wld.query().all<Position>();
+	ecs::Query qAny = wld.query().any<Scale, Rotation>();
+	ecs::Query qNo = wld.query().all<Position>().no<Rotation>();
+	REQUIRE(qAll.count() == 1);
+	REQUIRE(qAny.count() == 0);
+	REQUIRE(qNo.count() == 1);
 
-	SECTION("State validity") {
-		wld.enable(arr[0], false);
-		REQUIRE_FALSE(wld.enabled(arr[0]));
+	// New archetypes are picked up by queries that were already matched
+	auto e1 = wld.add();
+	wld.add<Position>(e1);
+	wld.add<Scale>(e1);
+	REQUIRE(qAll.count() == 2);
+	REQUIRE(qAny.count() == 1);
+	REQUIRE(qNo.count() == 2);
 
-		wld.enable(arr[0], true);
-		REQUIRE(wld.enabled(arr[0]));
+	auto e2 = wld.add();
+	wld.add<Position>(e2);
+	wld.add<Rotation>(e2);
+	REQUIRE(qAll.count() == 3);
+	REQUIRE(qAny.count() == 2);
+	REQUIRE(qNo.count() == 2);
 
-		wld.enable(arr[1], false);
-		REQUIRE(wld.enabled(arr[0]));
-		REQUIRE_FALSE(wld.enabled(arr[1]));
+	// Archetypes unrelated to the queries do not change anything
+	auto e3 = wld.add();
+	wld.add<Acceleration>(e3);
+	REQUIRE(qAll.count() == 3);
+	REQUIRE(qAny.count() == 2);
+	REQUIRE(qNo.count() == 2);
 
-		wld.enable(arr[1], true);
-		REQUIRE(wld.enabled(arr[0]));
-		REQUIRE(wld.enabled(arr[1]));
-	}
+	// Deleted archetypes are removed from the cached queries
+	wld.del(e1);
+	wld.del(e3);
+	GAIA_FOR(100) wld.update();
+	REQUIRE(qAll.count() == 2);
+	REQUIRE(qAny.count() == 1);
+	REQUIRE(qNo.count() == 1);
+
+	// Archetypes created after some were deleted are still matched
+	auto e4 = wld.add();
+	wld.add<Position>(e4);
+	wld.add<Scale>(e4);
+	REQUIRE(qAll.count() == 3);
+	REQUIRE(qAny.count() == 2);
+	REQUIRE(qNo.count() == 2);
+
+	// A new query sees all the current archetypes
+	ecs::Query qNew = wld.query().all<Position>().all<Scale>();
+	REQUIRE(qNew.count() == 1);
+}
 
-	SECTION("State persistance") {
-		wld.enable(arr[0], false);
-		REQUIRE_FALSE(wld.enabled(arr[0]));
-		auto e = arr[0];
-		wld.del<Position>(e);
-		REQUIRE_FALSE(wld.enabled(e));
+TEST_CASE("Query - plan") {
+	constexpr uint32_t N = 32;
+	TestWorld twld;
 
-		wld.enable(arr[0], true);
-		wld.add<Position>(arr[0]);
-		REQUIRE(wld.enabled(arr[0]));
+	// Many archetypes with Position, only a few with the rare tag
+	auto rare = wld.add();
+	GAIA_FOR(N) {
+		auto tag = wld.add();
+		auto e = wld.add();
+		wld.add<Position>(e);
+		wld.add(e, tag);
+	}
+	{
+		auto e = wld.add();
+		wld.add<Position>(e);
+		wld.add(e, rare);
+	}
+	{
+		auto e = wld.add();
+		wld.add<Scale>(e);
+		wld.add(e, rare);
 	}
 
-	ecs::Query q = wld.query().all<Position>();
+	auto positionEntity = wld.add<Position>().entity;
+	REQUIRE(wld.query().all<Position>().count() == N + 1);
 
-	auto checkQuery = [&q](uint32_t expectedCountAll, uint32_t expectedCountEnabled, uint32_t expectedCountDisabled) {
-		{
-			uint32_t cnt = 0;
-			q.each([&]([[maybe_unused]] ecs::IterAll iter) {
-				const uint32_t cExpected = iter.size();
-				uint32_t c = 0;
-				GAIA_EACH(iter)++ c;
-				REQUIRE(c == cExpected);
-				cnt += c;
-			});
-			REQUIRE(cnt == expectedCountAll);
+	ecs::Query q = wld.query().all<Position>().all(rare);
+	REQUIRE(q.count() == 1);
+	{
+		const auto& plan = q.fetch().plan();
+		REQUIRE(plan.intersect);
+		// Only archetypes with both the rare tag and Position are evaluated
+		REQUIRE(plan.candidates == 1);
+		// The rare tag drives the matching
+		REQUIRE(plan.items.size() >= 2);
+		REQUIRE(plan.items[0].id == rare);
+		REQUIRE(plan.items[0].op == ecs::QueryOp::All);
+		REQUIRE(plan.items[1].id == positionEntity);
+		REQUIRE(plan.items[0].cost < plan.items[1].cost);
+	}
 
-			cnt = q.count(ecs::Constraints::AcceptAll);
-			REQUIRE(cnt == expectedCountAll);
-		}
-		{
-			uint32_t cnt = 0;
-			q.each([&]([[maybe_unused]] ecs::Iter iter) {
-				const uint32_t cExpected = iter.size();
-				uint32_t c = 0;
-				GAIA_EACH(iter) {
-					REQUIRE(iter.enabled(i));
-					++c;
-				}
-				REQUIRE(c == cExpected);
-				cnt += c;
-			});
-			REQUIRE(cnt == expectedCountEnabled);
+	ecs::Query qNo = wld.query().all<Position>().no(rare);
+	REQUIRE(qNo.count() == N);
 
-			cnt = q.count();
-			REQUIRE(cnt == expectedCountEnabled);
-		}
-		{
-			uint32_t cnt = 0;
-			q.each([&]([[maybe_unused]] ecs::IterDisabled iter) {
-				const uint32_t cExpected = iter.size();
-				uint32_t c = 0;
-				GAIA_EACH(iter) {
-					REQUIRE(!iter.enabled(i));
-					++c;
-				}
-				REQUIRE(c == cExpected);
-				cnt += c;
-			});
-			REQUIRE(cnt == expectedCountDisabled);
+	ecs::Query qAny = wld.query().any<Scale>().any(rare);
+	REQUIRE(qAny.count() == 2);
+	REQUIRE(qAny.fetch().plan().intersect);
 
-			cnt = q.count(ecs::Constraints::DisabledOnly);
-			REQUIRE(cnt == expectedCountDisabled);
-		}
-	};
+	// Only archetypes created since the last match are evaluated
+	{
+		auto e = wld.add();
+		wld.add<Position>(e);
+		wld.add(e, rare);
+		wld.add<Rotation>(e);
+	}
+	REQUIRE(q.count() == 2);
+	REQUIRE(q.fetch().plan().candidates == 1);
+	REQUIRE(qNo.count() == N);
+	REQUIRE(qAny.count() == 3);
+
+	// Deleting the tag moves its entities to other archetypes. Archetypes which are deleted as a result
+	// are no longer considered.
+	wld.del(rare);
+	GAIA_FOR(100) wld.update();
+	ecs::Query qNew = wld.query().all<Position>();
+	REQUIRE(qNew.count() == N + 2);
+}
 
-	checkQuery(N, N, 0);
+TEST_CASE("Query - signatures") {
+	SECTION("Signature") {
+		ecs::ArchetypeSignature sig;
+		REQUIRE(sig.empty());
+
+		const auto rel = ecs::Entity(100, 0, false, false, ecs::EntityKind::EK_Gen);
+		const auto tgt = ecs::Entity(101, 0, false, false, ecs::EntityKind::EK_Gen);
+		const auto pair = (ecs::Entity)ecs::Pair(rel, tgt);
+		sig.add(pair);
+		sig.add_wildcards(pair);
+		REQUIRE_FALSE(sig.empty());
+
+		// Added ids are always found
+		auto contains = [&](ecs::Entity entity) {
+			ecs::ArchetypeSignature other;
+			other.add(entity);
+			return sig.contains(other) && sig.intersects(other);
+		};
+		REQUIRE(contains(pair));
+		REQUIRE(contains(ecs::Pair(ecs::All, tgt)));
+		REQUIRE(contains(ecs::Pair(rel, ecs::All)));
+		REQUIRE(contains(ecs::Pair(ecs::All, ecs::All)));
 
-	SECTION("Disable vs query") {
-		wld.enable(arr[1000], false);
-		checkQuery(N, N - 1, 1);
+		// The empty signature is contained in any other
+		REQUIRE(sig.contains({}));
+		REQUIRE_FALSE(sig.intersects({}));
 	}
 
-	SECTION("Enable vs query") {
-		wld.enable(arr[1000], true);
-		checkQuery(N, N, 0);
-	}
+	SECTION("Queries") {
+		constexpr uint32_t N = 64;
+		TestWorld twld;
 
-	SECTION("Disable vs query") {
-		wld.enable(arr[1], false);
-		wld.enable(arr[100], false);
-		wld.enable(arr[999], false);
-		wld.enable(arr[1400], false);
-		checkQuery(N, N - 4, 4);
-	}
+		auto rel = wld.add();
+		cnt::darr<ecs::Entity> tags;
+		GAIA_FOR(N) {
+			auto tag = wld.add();
+			tags.push_back(tag);
 
-	SECTION("Enable vs query") {
-		wld.enable(arr[1], true);
-		wld.enable(arr[100], true);
-		wld.enable(arr[999], true);
-		wld.enable(arr[1400], true);
-		checkQuery(N, N, 0);
+			auto e = wld.add();
+			wld.add<Position>(e);
+			wld.add(e, tag);
+			if (i % 2 == 0)
+				wld.add(e, ecs::Pair(rel, tag));
+		}
+
+		REQUIRE(wld.query().all<Position>().count() == N);
+		REQUIRE(wld.query().all(ecs::Pair(rel, ecs::All)).count() == N / 2);
+		REQUIRE(wld.query().all(ecs::Pair(ecs::All, tags[2])).count() == 1);
+		REQUIRE(wld.query().all(ecs::Pair(ecs::All, tags[3])).count() == 0);
+		REQUIRE(wld.query().all<Position>().no(ecs::Pair(rel, ecs::All)).count() == N / 2);
+		REQUIRE(wld.query().any(tags[0]).any(tags[1]).count() == 2);
+		REQUIRE(wld.query().all<Position>().no(tags[0]).no(tags[1]).count() == N - 2);
 	}
 }
 
-TEST_CASE("Add - generic") {
+TEST_CASE("Query - chunk cache") {
+	// Enough entities to span multiple chunks
+	constexpr uint32_t N = 5000;
+	TestWorld twld;
+
+	cnt::darr<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, 0, 0});
+		if (i % 2 == 0)
+			wld.add<Acceleration>(e, {1, 1, 1});
+		ents.push_back(e);
+	}
+
+	auto q = wld.query().all<Position&>().cache_chunks();
+	auto qu = wld.query().all<Position>();
+
+	auto sum = [](ecs::Query& query) {
+		float s = 0;
+		query.each([&](const Position& p) {
+			s += p.x;
+		});
+		return s;
+	};
+	auto sum_mut = [](ecs::Query& query) {
+		float s = 0;
+		query.each([&](Position& p) {
+			s += p.x;
+		});
+		return s;
+	};
+
+	SECTION("Same results as an uncached query") {
+		REQUIRE(q.count() == N);
+		REQUIRE(sum_mut(q) == sum(qu));
+
+		uint32_t cnt = 0;
+		q.each([&](ecs::Iter it) {
+			cnt += it.size();
+		});
+		REQUIRE(cnt == N);
+
+		wld.enable(ents[0], false);
+		wld.enable(ents[1], false);
+		REQUIRE(q.count() == N - 2);
+		REQUIRE(sum_mut(q) == sum(qu));
+
+		const auto& items = q.fetch().chunk_cache();
+		uint32_t ents2 = 0;
+		for (const auto& item: items)
+			ents2 += item.pChunk->size();
+		REQUIRE(ents2 == N);
+	}
+
+	SECTION("Rebuilt when chunks change") {
+		REQUIRE(sum_mut(q) == sum(qu));
+		const auto chunkCnt = q.fetch().chunk_cache().size();
+
+		// New chunks in matched archetypes
+		GAIA_FOR(N) {
+			auto e = wld.add();
+			wld.add<Position>(e, {1, 0, 0});
+		}
+		REQUIRE(q.count() == N * 2);
+		REQUIRE(sum_mut(q) == sum(qu));
+		REQUIRE(q.fetch().chunk_cache().size() > chunkCnt);
+
+		// New matched archetype
+		auto e = wld.add();
+		wld.add<Position>(e, {1, 0, 0});
+		wld.add<Rotation>(e);
+		REQUIRE(q.count() == N * 2 + 1);
+		REQUIRE(sum_mut(q) == sum(qu));
+
+		// Removed chunks
+		for (auto ent: ents)
+			wld.del(ent);
+		wld.update();
+		REQUIRE(q.count() == N + 1);
+		REQUIRE(sum_mut(q) == sum(qu));
+	}
+
+	SECTION("Writes") {
+		q.each([](Position& p) {
+			p.y = 1.f;
+		});
+
+		uint32_t cnt = 0;
+		qu.each([&](const Position& p) {
+			if (p.y == 1.f)
+				++cnt;
+		});
+		REQUIRE(cnt == N);
+
+		// Writes through the cache are visible to change filters
+		auto qc = wld.query().all<Position>().changed<Position>();
+		qc.each([](const Position&) {});
+		q.each([](ecs::Iter it) {
+			auto p = it.view_mut<Position>();
+			GAIA_EACH(it) p[i].z = 2.f;
+		});
+		cnt = 0;
+		qc.each([&](const Position& p) {
+			REQUIRE(p.z == 2.f);
+			++cnt;
+		});
+		REQUIRE(cnt == N);
+
+		cnt = 0;
+		q.each([&](Position& p) {
+			p.z = 3.f;
+		});
+		qc.each([&](const Position& p) {
+			REQUIRE(p.z == 3.f);
+			++cnt;
+		});
+		REQUIRE(cnt == N);
+	}
+}
+
+TEST_CASE("Query - order_by") {
+	static uint32_t s_cmpCnt = 0;
+	auto cmp = [](const void* pData0, const void* pData1) {
+		++s_cmpCnt;
+		const auto& p0 = *(const Position*)pData0;
+		const auto& p1 = *(const Position*)pData1;
+		return (int)(p0.x - p1.x);
+	};
+
+	SECTION("Cached orderings") {
+		constexpr uint32_t N = 100;
+		TestWorld twld;
+
+		cnt::darr<ecs::Entity> ents;
+		GAIA_FOR(N) {
+			auto e = wld.add();
+			wld.add<Position>(e, {(float)((i * 7919) % N), 0, 0});
+			ents.push_back(e);
+		}
+
+		auto q = wld.query().all<const Position>().order_by<Position>(cmp);
+
+		// Entities are ordered within each chunk. Remembers if \p first and \p last were visited first and last in their chunk.
+		ecs::Entity firstInChunk = ecs::EntityBad;
+		ecs::Entity lastInChunk = ecs::EntityBad;
+		auto check = [&](uint32_t expectedCnt, ecs::Entity first, ecs::Entity last) {
+			uint32_t cnt = 0;
+			const ecs::Chunk* pChunk = nullptr;
+			float lastVal = 0.f;
+			ecs::Entity prev = ecs::EntityBad;
+			q.each([&](ecs::Entity e, const Position& p) {
+				const auto* pEntChunk = wld.fetch(e).pChunk;
+				if (pEntChunk != pChunk) {
+					if (prev == last)
+						lastInChunk = prev;
+					pChunk = pEntChunk;
+					if (e == first)
+						firstInChunk = e;
+				} else
+					REQUIRE(p.x >= lastVal);
+				lastVal = p.x;
+				prev = e;
+				++cnt;
+			});
+			if (prev == last)
+				lastInChunk = prev;
+			REQUIRE(cnt == expectedCnt);
+		};
+		check(N, ecs::EntityBad, ecs::EntityBad);
+		// Cached orderings are not sorted again
+		const auto cmpCnt = s_cmpCnt;
+		REQUIRE(cmpCnt > 0);
+		check(N, ecs::EntityBad, ecs::EntityBad);
+		REQUIRE(s_cmpCnt == cmpCnt);
+
+		// Changed values
+		wld.set<Position>(ents[0], {1000.f, 0, 0});
+		wld.set<Position>(ents[N - 1], {-10.f, 0, 0});
+		check(N, ents[N - 1], ents[0]);
+		REQUIRE(firstInChunk == ents[N - 1]);
+		REQUIRE(lastInChunk == ents[0]);
+
+		// Entities moved around
+		wld.enable(ents[10], false);
+		wld.enable(ents[20], false);
+		check(N - 2, ecs::EntityBad, ecs::EntityBad);
+		wld.enable(ents[10], true);
+		check(N - 1, ecs::EntityBad, ecs::EntityBad);
+
+		// New entities
+		GAIA_FOR(10) {
+			auto e = wld.add();
+			wld.add<Position>(e, {(float)(N - i), 0, 0});
+		}
+		check(N + 9, ecs::EntityBad, ecs::EntityBad);
+
+		// Deleted entities
+		wld.del(ents[5]);
+		wld.del(ents[50]);
+		check(N + 7, ecs::EntityBad, ecs::EntityBad);
+
+		// Entities without the ordering component are not ordered but still visited
+		auto q2 = wld.query().any<const Position>().order_by<Position>(cmp);
+		REQUIRE(q2.count() == N + 7);
+	}
+
+	SECTION("Many chunks") {
+		constexpr uint32_t N = 5000;
+		TestWorld twld;
+
+		GAIA_FOR(N) {
+			auto e = wld.add();
+			wld.add<Position>(e, {(float)((i * 7919) % N), 0, 0});
+		}
+
+		auto q = wld.query().all<Position&>().order_by<Position>(cmp);
+		cnt::darr<ecs::Chunk*> chunks;
+		q.chunks(chunks);
+		REQUIRE(chunks.size() > 1);
+
+		// Entities are ordered within chunks
+		uint32_t cnt = 0;
+		uint32_t descents = 0;
+		float last = -1.f;
+		q.each([&](Position& p) {
+			if (p.x < last)
+				++descents;
+			last = p.x;
+			p.y = 1.f;
+			++cnt;
+		});
+		REQUIRE(cnt == N);
+		REQUIRE(descents < chunks.size());
+
+		uint32_t written = 0;
+		wld.query().all<const Position>().each([&](const Position& p) {
+			if (p.y == 1.f)
+				++written;
+		});
+		REQUIRE(written == N);
+	}
+}
+
+TEST_CASE("Query - group_by") {
+	TestWorld twld;
+
+	auto rel = wld.add();
+	auto g0 = wld.add();
+	auto g1 = wld.add();
+	auto g2 = wld.add();
+	auto tag = wld.add();
+
+	// Create archetypes out of the group order
+	cnt::darr<ecs::Entity> ents;
+	for (auto g: {g2, g0, g1}) {
+		GAIA_FOR(10) {
+			auto e = wld.add();
+			wld.add<Position>(e);
+			wld.add(e, ecs::Pair(rel, g));
+			if (i % 2 == 0)
+				wld.add(e, tag);
+			ents.push_back(e);
+		}
+	}
+	GAIA_FOR(5) {
+		auto e = wld.add();
+		wld.add<Position>(e);
+	}
+
+	auto q = wld.query().all<Position>().group_by(rel);
+
+	auto check = [&](uint32_t expectedCnt) {
+		uint32_t cnt = 0;
+		ecs::GroupId last = 0;
+		q.each([&](ecs::Entity e) {
+			const auto tgt = wld.target(e, rel);
+			const auto groupId = tgt == ecs::EntityBad ? ecs::GroupIdBad : tgt.id();
+			REQUIRE(groupId >= last);
+			last = groupId;
+			++cnt;
+		});
+		REQUIRE(cnt == expectedCnt);
+	};
+	check(35);
+
+	// Newly matched archetypes keep the order
+	auto g3 = wld.add();
+	wld.del(ents[0], ecs::Pair(rel, g2));
+	wld.del(ents[1], ecs::Pair(rel, g2));
+	wld.add(ents[1], ecs::Pair(rel, g3));
+	wld.add(ents[15], wld.add());
+	check(35);
+
+	// Single group
+	REQUIRE(q.group_id(g0).count() == 10);
+	q.each([&](ecs::Entity e) {
+		REQUIRE(wld.target(e, rel) == g0);
+	});
+	REQUIRE(q.group_id(g3).count() == 1);
+	REQUIRE(q.group_id(ecs::GroupIdBad).count() == 35);
+
+	// Grouping is a part of the query identity
+	REQUIRE(wld.query().all<Position>().count() == 35);
+	REQUIRE(wld.query().all<Position>().group_by(tag).group_id(g0).count() == 0);
+}
+
+TEST_CASE("Enable") {
+	// 1,500 picked so we create enough entites that they overflow into another chunk
+	const uint32_t N = 1'500;
+
+	TestWorld twld;
+	cnt::darr<ecs::Entity> arr;
+	arr.reserve(N);
+
+	auto create = [&]() {
+		auto e = wld.add();
+		wld.add<Position>(e);
+		arr.push_back(e);
+	};
+
+	GAIA_FOR(N) create();
+
+	SECTION("State validity") {
+		wld.enable(arr[0], false);
+		REQUIRE_FALSE(wld.enabled(arr[0]));
+
+		wld.enable(arr[0], true);
+		REQUIRE(wld.enabled(arr[0]));
+
+		wld.enable(arr[1], false);
+		REQUIRE(wld.enabled(arr[0]));
+		REQUIRE_FALSE(wld.enabled(arr[1]));
+
+		wld.enable(arr[1], true);
+		REQUIRE(wld.enabled(arr[0]));
+		REQUIRE(wld.enabled(arr[1]));
+	}
+
+	SECTION("State persistance") {
+		wld.enable(arr[0], false);
+		REQUIRE_FALSE(wld.enabled(arr[0]));
+		auto e = arr[0];
+		wld.del<Position>(e);
+		REQUIRE_FALSE(wld.enabled(e));
+
+		wld.enable(arr[0], true);
+		wld.add<Position>(arr[0]);
+		REQUIRE(wld.enabled(arr[0]));
+	}
+
+	ecs::Query q = wld.query().all<Position>();
+
+	auto checkQuery = [&q](uint32_t expectedCountAll, uint32_t expectedCountEnabled, uint32_t expectedCountDisabled) {
+		{
+			uint32_t cnt = 0;
+			q.each([&]([[maybe_unused]] ecs::IterAll iter) {
+				const uint32_t cExpected = iter.size();
+				uint32_t c = 0;
+				GAIA_EACH(iter)++ c;
+				REQUIRE(c == cExpected);
+				cnt += c;
+			});
+			REQUIRE(cnt == expectedCountAll);
+
+			cnt = q.count(ecs::Constraints::AcceptAll);
+			REQUIRE(cnt == expectedCountAll);
+		}
+		{
+			uint32_t cnt = 0;
+			q.each([&]([[maybe_unused]] ecs::Iter iter) {
+				const uint32_t cExpected = iter.size();
+				uint32_t c = 0;
+				GAIA_EACH(iter) {
+					REQUIRE(iter.enabled(i));
+					++c;
+				}
+				REQUIRE(c == cExpected);
+				cnt += c;
+			});
+			REQUIRE(cnt == expectedCountEnabled);
+
+			cnt = q.count();
+			REQUIRE(cnt == expectedCountEnabled);
+		}
+		{
+			uint32_t cnt = 0;
+			q.each([&]([[maybe_unused]] ecs::IterDisabled iter) {
+				const uint32_t cExpected = iter.size();
+				uint32_t c = 0;
+				GAIA_EACH(iter) {
+					REQUIRE(!iter.enabled(i));
+					++c;
+				}
+				REQUIRE(c == cExpected);
+				cnt += c;
+			});
+			REQUIRE(cnt == expectedCountDisabled);
+
+			cnt = q.count(ecs::Constraints::DisabledOnly);
+			REQUIRE(cnt == expectedCountDisabled);
+		}
+	};
+
+	checkQuery(N, N, 0);
+
+	SECTION("Disable vs query") {
+		wld.enable(arr[1000], false);
+		checkQuery(N, N - 1, 1);
+	}
+
+	SECTION("Enable vs query") {
+		wld.enable(arr[1000], true);
+		checkQuery(N, N, 0);
+	}
+
+	SECTION("Disable vs query") {
+		wld.enable(arr[1], false);
+		wld.enable(arr[100], false);
+		wld.enable(arr[999], false);
+		wld.enable(arr[1400], false);
+		checkQuery(N, N - 4, 4);
+	}
+
+	SECTION("Enable vs query") {
+		wld.enable(arr[1], true);
+		wld.enable(arr[100], true);
+		wld.enable(arr[999], true);
+		wld.enable(arr[1400], true);
+		checkQuery(N, N, 0);
+	}
+}
+
+TEST_CASE("Add - generic") {
 	{
 		TestWorld twld;
 		auto e = wld.add();
@@ -3123,6 +3992,8 @@ TEST_CASE("Add - generic") {
 // }
 
 TEST_CASE("Add - unique") {
+	// Whenever "e" moves to a new archetype, its unique components there start uninitialized
+	// until set. Their values can match the old ones if chunk memory is reused, so they are not checked.
 	{
 		TestWorld twld;
 		auto e = wld.add();
@@ -3172,14 +4043,6 @@ TEST_CASE("Add - unique") {
 			REQUIRE(a.y == 5.f);
 			REQUIRE(a.z == 6.f);
 		}
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto p = wld.get<ecs::uni<Position>>(e);
-			REQUIRE_FALSE(p.x == 1.f);
-			REQUIRE_FALSE(p.y == 2.f);
-			REQUIRE_FALSE(p.z == 3.f);
-		}
 	}
 
 	{
@@ -3209,14 +4072,6 @@ TEST_CASE("Add - unique") {
 			REQUIRE(a.y == 5.f);
 			REQUIRE(a.z == 6.f);
 		}
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto p = wld.get<ecs::uni<Position>>(e);
-			REQUIRE_FALSE(p.x == 1.f);
-			REQUIRE_FALSE(p.y == 2.f);
-			REQUIRE_FALSE(p.z == 3.f);
-		}
 
 		// Add a generic entity. Archetype changes.
 		auto f = wld.add();
@@ -3233,14 +4088,6 @@ TEST_CASE("Add - unique") {
 			REQUIRE_FALSE(a.y == 5.f);
 			REQUIRE_FALSE(a.z == 6.f);
 		}
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto p = wld.get<ecs::uni<Position>>(e);
-			REQUIRE_FALSE(p.x == 1.f);
-			REQUIRE_FALSE(p.y == 2.f);
-			REQUIRE_FALSE(p.z == 3.f);
-		}
 	}
 
 	{
@@ -3270,14 +4117,6 @@ TEST_CASE("Add - unique") {
 			REQUIRE(a.y == 5.f);
 			REQUIRE(a.z == 6.f);
 		}
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto p = wld.get<ecs::uni<Position>>(e);
-			REQUIRE_FALSE(p.x == 1.f);
-			REQUIRE_FALSE(p.y == 2.f);
-			REQUIRE_FALSE(p.z == 3.f);
-		}
 
 		// Add a unique entity. Archetype changes.
 		auto f = wld.add(ecs::EntityKind::EK_Uni);
@@ -3288,26 +4127,12 @@ TEST_CASE("Add - unique") {
 		REQUIRE(wld.has<ecs::uni<Acceleration>>(e));
 		REQUIRE_FALSE(wld.has<Position>(e));
 		REQUIRE_FALSE(wld.has<Acceleration>(e));
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto a = wld.get<ecs::uni<Acceleration>>(e);
-			REQUIRE_FALSE(a.x == 4.f);
-			REQUIRE_FALSE(a.y == 5.f);
-			REQUIRE_FALSE(a.z == 6.f);
-		}
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto p = wld.get<ecs::uni<Position>>(e);
-			REQUIRE_FALSE(p.x == 1.f);
-			REQUIRE_FALSE(p.y == 2.f);
-			REQUIRE_FALSE(p.z == 3.f);
-		}
 	}
 }
 
 TEST_CASE("Add - mixed") {
+	// Whenever "e" moves to a new archetype, its unique components there start uninitialized
+	// until set. Their values can match the old ones if chunk memory is reused, so they are not checked.
 	{
 		TestWorld twld;
 		auto e = wld.add();
@@ -3369,14 +4194,6 @@ TEST_CASE("Add - mixed") {
 			REQUIRE(p.y == 20.f);
 			REQUIRE(p.z == 30.f);
 		}
-		{
-			// Because "e" was moved to a new archetype nobody ever set the value.
-			// Therefore, it is garbage and won't match the original chunk.
-			auto p = wld.get<ecs::uni<Position>>(e);
-			REQUIRE_FALSE(p.x == 1.f);
-			REQUIRE_FALSE(p.y == 2.f);
-			REQUIRE_FALSE(p.z == 3.f);
-		}
 		wld.set<ecs::uni<Position>>(e, {100.0f, 200.0f, 300.0f});
 		{
 			auto p = wld.get<Position>(e);
@@ -4749,6 +5566,73 @@ TEST_CASE("CommandBuffer") {
 		auto s2 = wld.get<StringComponent2>(e);
 		REQUIRE(s2.value == StringComponent2DefaultValue);
 	}
+
+	SECTION("Coalesced changes") {
+		TestWorld twld;
+		ecs::CommandBuffer cb(wld);
+
+		constexpr uint32_t N = 100;
+		cnt::darr<ecs::Entity> ents;
+		GAIA_FOR(N) {
+			auto e = wld.add();
+			wld.add<Position>(e, {(float)i, 0, 0});
+			ents.push_back(e);
+		}
+
+		// Each entity receives several changes. Moving one entity changes rows of others
+		// so data needs to end up at the right place once all entities are moved.
+		GAIA_FOR(N) {
+			auto e = ents[i];
+			cb.add<Acceleration>(e, {1, 1, 1});
+			cb.add<Rotation>(e, {(float)i, 0, 0, 0});
+			cb.set<Position>(e, {(float)i, 1, 0});
+			// Removing and adding back again needs to use the latest data
+			cb.del<Acceleration>(e);
+			cb.add<Acceleration>(e, {(float)i, 2, 0});
+			// Adding and removing again leaves nothing behind
+			cb.add<Scale>(e);
+			cb.del<Scale>(e);
+		}
+
+		auto tmp = cb.add();
+		cb.add<Position>(tmp, {1, 2, 3});
+		cb.add<Acceleration>(tmp);
+		cb.set<Acceleration>(tmp, {4, 5, 6});
+
+		// Deleted entities stay deleted no matter the changes requested before
+		auto eDel = wld.add();
+		cb.add<Position>(eDel, {});
+		cb.del(eDel);
+
+		cb.commit();
+
+		REQUIRE_FALSE(wld.valid(eDel));
+
+		GAIA_FOR(N) {
+			auto e = ents[i];
+			REQUIRE_FALSE(wld.has<Scale>(e));
+
+			auto p = wld.get<Position>(e);
+			REQUIRE(p.x == (float)i);
+			REQUIRE(p.y == 1.f);
+			auto a = wld.get<Acceleration>(e);
+			REQUIRE(a.x == (float)i);
+			REQUIRE(a.y == 2.f);
+			auto r = wld.get<Rotation>(e);
+			REQUIRE(r.x == (float)i);
+		}
+
+		uint32_t cnt = 0;
+		wld.query().all<Position>().all<Acceleration>().no<Rotation>().each(
+				[&](const Position& p, const Acceleration& a) {
+					REQUIRE(p.x == 1.f);
+					REQUIRE(p.z == 3.f);
+					REQUIRE(a.x == 4.f);
+					REQUIRE(a.z == 6.f);
+					++cnt;
+				});
+		REQUIRE(cnt == 1);
+	}
 }
 
 TEST_CASE("Query Filter - no systems") {
@@ -4810,6 +5694,131 @@ TEST_CASE("Query Filter - no systems") {
 	}
 }
 
+TEST_CASE("Query Filter - archetypes") {
+	TestWorld twld;
+
+	auto e0 = wld.add();
+	wld.add<Position>(e0);
+	auto e1 = wld.add();
+	wld.add<Position>(e1);
+	wld.add<Scale>(e1);
+	auto e2 = wld.add();
+	wld.add<Position>(e2);
+	wld.add<Rotation>(e2);
+
+	ecs::Query q = wld.query().all<Position>().changed<Position>();
+	ecs::Query qAny = wld.query().any<Scale, Rotation>().changed<Rotation>();
+
+	auto run = [](ecs::Query& query) {
+		uint32_t cnt = 0;
+		query.each([&](ecs::Iter it) {
+			cnt += it.size();
+		});
+		return cnt;
+	};
+
+	REQUIRE(run(q) == 3); // first run always happens
+	REQUIRE(run(q) == 0);
+	// Only entities in archetypes with a changed filtered component are processed
+	wld.set<Position>(e1, {});
+	REQUIRE(run(q) == 1);
+	REQUIRE(run(q) == 0);
+	// Changes to components which are not filtered do not count
+	wld.set<Scale>(e1, {});
+	REQUIRE(run(q) == 0);
+
+	// Archetypes without the filtered component are never considered changed
+	REQUIRE(run(qAny) == 1);
+	REQUIRE(run(qAny) == 0);
+	wld.set<Scale>(e1, {});
+	REQUIRE(run(qAny) == 0);
+	wld.set<Rotation>(e2, {});
+	REQUIRE(run(qAny) == 1);
+}
+
+TEST_CASE("Query Filter - changed rows") {
+	TestWorld twld;
+
+	constexpr uint32_t N = 100;
+	cnt::darr<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {});
+		wld.add<PositionTracked>(e, {});
+		ents.push_back(e);
+	}
+
+	// Nothing is tracked per row until a changed() filter refers to the component
+	wld.set<PositionTracked>(ents[0], {});
+	{
+		uint32_t cnt = 0;
+		wld.query().all<PositionTracked>().each([&](ecs::Iter it) {
+			it.each_changed<PositionTracked>([&](uint32_t) {
+				++cnt;
+			});
+		});
+		REQUIRE(cnt == N);
+	}
+
+	ecs::Query qTracked = wld.query().all<Position, PositionTracked>().changed<PositionTracked>();
+	ecs::Query qUntracked = wld.query().all<Position, PositionTracked>().changed<Position>();
+
+	cnt::darr<ecs::Entity> changed;
+	auto run = [&](auto tmp) {
+		using T = decltype(tmp);
+		auto& q = std::is_same_v<T, PositionTracked> ? qTracked : qUntracked;
+		changed.clear();
+		q.each([&](ecs::Iter it) {
+			auto entityView = it.view<ecs::Entity>();
+			it.each_changed<T>([&](uint32_t i) {
+				changed.push_back(entityView[i]);
+			});
+		});
+		return changed.size();
+	};
+
+	REQUIRE(run(PositionTracked{}) == N); // first run always happens
+	REQUIRE(run(PositionTracked{}) == 0);
+
+	// Only the rows that were set are reported
+	wld.set<PositionTracked>(ents[5], {});
+	wld.set<PositionTracked>(ents[42], {});
+	REQUIRE(run(PositionTracked{}) == 2);
+	REQUIRE(core::has(changed, ents[5]));
+	REQUIRE(core::has(changed, ents[42]));
+	REQUIRE(run(PositionTracked{}) == 0);
+
+	// Writes through views mark their whole range
+	ecs::Query qWrite = wld.query().all<PositionTracked&>();
+	qWrite.each([&](ecs::Iter it) {
+		auto posView = it.view_mut<PositionTracked>();
+		(void)posView;
+	});
+	REQUIRE(run(PositionTracked{}) == N);
+	REQUIRE(run(PositionTracked{}) == 0);
+
+	// Components that do not track row changes report the whole chunk
+	REQUIRE(run(Position{}) == N); // first run always happens
+	REQUIRE(run(Position{}) == 0);
+	wld.set<Position>(ents[7], {});
+	REQUIRE(run(Position{}) == wld.fetch(ents[7]).pChunk->size());
+
+	// Structural changes mark all rows of the chunk
+	auto e = wld.add();
+	wld.add<Position>(e, {});
+	wld.add<PositionTracked>(e, {});
+	REQUIRE(run(PositionTracked{}) == wld.fetch(e).pChunk->size());
+	REQUIRE(run(PositionTracked{}) == 0);
+
+	// Multiple writes between runs accumulate
+	wld.set<PositionTracked>(ents[1], {});
+	wld.set<PositionTracked>(ents[2], {});
+	REQUIRE(run(PositionTracked{}) == 2);
+	wld.set<PositionTracked>(ents[3], {});
+	REQUIRE(run(PositionTracked{}) == 1);
+	REQUIRE(changed[0] == ents[3]);
+}
+
 TEST_CASE("Query Filter - systems") {
 	TestWorld twld;
 
@@ -4889,6 +5898,311 @@ TEST_CASE("Query Filter - systems") {
 	sm.update();
 }
 
+TEST_CASE("System - parallel") {
+	auto& tp = mt::ThreadPool::get();
+
+	TestWorld twld;
+
+	constexpr uint32_t N = 1'000;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {});
+		wld.add<Acceleration>(e, {});
+	}
+
+	class PositionWriterSystem final: public ecs::System {
+		ecs::Query m_q;
+
+	public:
+		void OnCreated() override {
+			m_q = world().query().all<Position&>();
+			access(m_q);
+		}
+		void OnUpdate() override {
+			m_q.each([](Position& p) {
+				p.x += 1.f;
+			});
+		}
+	};
+	class PositionReaderSystem final: public ecs::System {
+		ecs::Query m_q;
+
+	public:
+		float m_expected = 0.f;
+		uint32_t m_mismatches = 0;
+
+		void OnCreated() override {
+			m_q = world().query().all<Position>();
+			access(m_q);
+		}
+		void OnUpdate() override {
+			m_q.each([&](const Position& p) {
+				if (p.x != m_expected)
+					++m_mismatches;
+			});
+		}
+	};
+	class AccelerationWriterSystem final: public ecs::System {
+		ecs::Query m_q;
+
+	public:
+		void OnCreated() override {
+			m_q = world().query().all<Acceleration&>();
+			access(m_q);
+		}
+		void OnUpdate() override {
+			m_q.each([](Acceleration& a) {
+				a.x += 1.f;
+			});
+		}
+	};
+	class ExclusiveSystem final: public ecs::System {
+	public:
+		uint32_t m_runs = 0;
+
+		void OnUpdate() override {
+			++m_runs;
+		}
+	};
+
+	auto work = [&]() {
+		ecs::SystemManager sm(wld);
+		sm.parallel(true);
+		sm.add<PositionWriterSystem>();
+		auto* rs = sm.add<PositionReaderSystem>();
+		auto* as = sm.add<AccelerationWriterSystem>();
+		auto* es = sm.add<ExclusiveSystem>();
+
+		GAIA_FOR(10) {
+			// The reader needs to see the data written by the writer in the same frame
+			rs->m_expected += 1.f;
+			sm.update();
+		}
+		REQUIRE(rs->m_mismatches == 0);
+		REQUIRE(es->m_runs == 10);
+
+		// Disabled systems must not run but must not break the ordering of the others either
+		as->enable(false);
+		GAIA_FOR(5) {
+			rs->m_expected += 1.f;
+			sm.update();
+		}
+		REQUIRE(rs->m_mismatches == 0);
+		REQUIRE(es->m_runs == 15);
+
+		uint32_t cnt = 0;
+		wld.query().all<Acceleration>().each([&](const Acceleration& a) {
+			if (a.x == 10.f)
+				++cnt;
+		});
+		REQUIRE(cnt == N);
+
+		tp.wait_all();
+	};
+
+	SECTION("Max workers") {
+		const auto threads = tp.hw_thread_cnt();
+		tp.set_max_workers(threads, threads);
+
+		work();
+	}
+	SECTION("0 workers") {
+		tp.set_max_workers(0, 0);
+
+		work();
+	}
+}
+
+// Readers do not conflict with each other so they run in parallel over the same chunks
+template <uint32_t I>
+class ParallelReaderSystem final: public ecs::System {
+	ecs::Query m_q;
+
+public:
+	uint32_t m_cnt = 0;
+
+	void OnCreated() override {
+		m_q = world().query().all<Position>().all<Acceleration>();
+		access(m_q);
+	}
+	void OnUpdate() override {
+		m_cnt = 0;
+		m_q.each([&](const Position&, const Acceleration&) {
+			++m_cnt;
+		});
+	}
+};
+
+TEST_CASE("System - parallel versions") {
+	auto& tp = mt::ThreadPool::get();
+
+	TestWorld twld;
+
+	constexpr uint32_t N = 1'000;
+	cnt::darr<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {});
+		wld.add<Acceleration>(e, {});
+		ents.push_back(e);
+	}
+
+	class ChangedReaderSystem final: public ecs::System {
+		ecs::Query m_q;
+
+	public:
+		uint32_t m_cnt = 0;
+
+		void OnCreated() override {
+			m_q = world().query().all<Position>().changed<Position>();
+			access(m_q);
+		}
+		void OnUpdate() override {
+			m_cnt = 0;
+			m_q.each([&]() {
+				++m_cnt;
+			});
+		}
+	};
+	class PositionWriterSystem final: public ecs::System {
+		ecs::Query m_q;
+
+	public:
+		void OnCreated() override {
+			m_q = world().query().all<Position&>();
+			access(m_q);
+		}
+		void OnUpdate() override {
+			m_q.each([](Position& p) {
+				p.x += 1.f;
+			});
+		}
+	};
+
+	auto work = [&]() {
+		ecs::SystemManager sm(wld);
+		sm.parallel(true);
+		auto* cs = sm.add<ChangedReaderSystem>();
+		auto* rs0 = sm.add<ParallelReaderSystem<0>>();
+		auto* rs1 = sm.add<ParallelReaderSystem<1>>();
+		auto* rs2 = sm.add<ParallelReaderSystem<2>>();
+		auto* ws = sm.add<PositionWriterSystem>();
+
+		// The reader runs before the writer. It needs to see what the writer wrote in the previous frame.
+		GAIA_FOR(10) {
+			sm.update();
+			REQUIRE(cs->m_cnt == N);
+			REQUIRE(rs0->m_cnt == N);
+			REQUIRE(rs1->m_cnt == N);
+			REQUIRE(rs2->m_cnt == N);
+		}
+
+		ws->enable(false);
+		sm.update();
+		REQUIRE(cs->m_cnt == N);
+		sm.update();
+		REQUIRE(cs->m_cnt == 0);
+
+		// No chunk is left locked so structural changes are possible again
+		for (auto e: ents)
+			REQUIRE_FALSE(wld.fetch(e).pChunk->locked());
+		wld.add<Rotation>(ents[0], {});
+		REQUIRE(wld.has<Rotation>(ents[0]));
+		wld.del<Rotation>(ents[0]);
+
+		tp.wait_all();
+	};
+
+	SECTION("Max workers") {
+		const auto threads = tp.hw_thread_cnt();
+		tp.set_max_workers(threads, threads);
+
+		work();
+	}
+	SECTION("0 workers") {
+		tp.set_max_workers(0, 0);
+
+		work();
+	}
+}
+
+TEST_CASE("System - command buffers") {
+	auto& tp = mt::ThreadPool::get();
+
+	TestWorld twld;
+
+	// Components used by command buffers on worker threads need to be registered up front
+	const auto rotEntity = wld.add<Rotation>().entity;
+
+	constexpr uint32_t N = 100;
+
+	class SpawnerSystemA final: public ecs::System {
+	public:
+		ecs::Entity m_access;
+
+		void OnCreated() override {
+			access(m_access, false);
+		}
+		void OnUpdate() override {
+			auto& cb = cmd_buffer();
+			GAIA_FOR(N) {
+				auto e = cb.add();
+				cb.add<Rotation>(e, {1.f, (float)i, 0, 0});
+			}
+		}
+	};
+	class SpawnerSystemB final: public ecs::System {
+	public:
+		ecs::Entity m_access;
+
+		void OnCreated() override {
+			access(m_access, false);
+		}
+		void OnUpdate() override {
+			auto& cb = cmd_buffer();
+			GAIA_FOR(N) {
+				auto e = cb.add();
+				cb.add<Rotation>(e, {2.f, (float)i, 0, 0});
+			}
+		}
+	};
+
+	auto work = [&]() {
+		ecs::SystemManager sm(wld);
+		sm.parallel(true);
+		sm.add<SpawnerSystemA>()->m_access = rotEntity;
+		sm.add<SpawnerSystemB>()->m_access = rotEntity;
+		sm.update();
+
+		// Entities spawned by systems are committed in the order of systems no matter how they were scheduled
+		cnt::darr<Rotation> rots;
+		wld.query().all<Rotation>().each([&](const Rotation& r) {
+			rots.push_back(r);
+		});
+		REQUIRE(rots.size() == N * 2);
+		GAIA_FOR(N) {
+			REQUIRE(rots[i].x == 1.f);
+			REQUIRE(rots[i].y == (float)i);
+			REQUIRE(rots[N + i].x == 2.f);
+			REQUIRE(rots[N + i].y == (float)i);
+		}
+
+		tp.wait_all();
+	};
+
+	SECTION("Max workers") {
+		const auto threads = tp.hw_thread_cnt();
+		tp.set_max_workers(threads, threads);
+
+		work();
+	}
+	SECTION("0 workers") {
+		tp.set_max_workers(0, 0);
+
+		work();
+	}
+}
+
 template <typename T>
 void TestDataLayoutSoA_ECS() {
 	const uint32_t N = 1'500;
@@ -5441,6 +6755,356 @@ TEST_CASE("Serialization - arrays") {
 	}
 }
 
+struct SnapshotStr {
+	std::string str;
+
+	template <typename Serializer>
+	void save(Serializer& s) const {
+		const auto len = (uint32_t)str.size();
+		s.save(len);
+		s.save((const void*)str.data(), len);
+	}
+
+	template <typename Serializer>
+	void load(Serializer& s) {
+		uint32_t len = 0;
+		s.load(len);
+		str.resize(len);
+		s.load((void*)str.data(), len);
+	}
+};
+
+TEST_CASE("Serialization - world") {
+	auto reg = [](ecs::World& w) {
+		(void)w.add<Position>();
+		(void)w.add<PositionSoA>();
+		(void)w.add<ecs::uni<Scale>>();
+		(void)w.add<SnapshotStr>();
+	};
+
+	constexpr uint32_t N = 1500;
+	constexpr uint32_t NSoA = 100;
+	ecs::SerializationBuffer s;
+	cnt::darray<ecs::Entity> ents;
+	ecs::Entity parent, child;
+
+	{
+		ecs::World w1;
+		reg(w1);
+
+		GAIA_FOR(N) {
+			auto e = w1.add();
+			w1.add<Position>(e, {(float)i, (float)i * 2.f, 0.f});
+			if (i % 4 == 0)
+				w1.add<SnapshotStr>(e, {std::to_string(i)});
+			if (i % 100 == 0)
+				w1.add<ecs::uni<Scale>>(e, {1.f, 2.f, 3.f});
+			ents.push_back(e);
+		}
+		w1.enable(ents[1], false);
+		w1.name(ents[3], "named");
+		w1.del(ents[2]);
+		w1.update();
+
+		parent = w1.add();
+		child = w1.add();
+		w1.child(child, parent);
+
+		GAIA_FOR(NSoA) {
+			auto e = w1.add();
+			w1.add<PositionSoA>(e);
+		}
+		uint32_t j = 0;
+		w1.query().all<PositionSoA&>().each([&](ecs::Iter it) {
+			auto ps = it.view_mut<PositionSoA>();
+			auto px = ps.template set<0>();
+			auto pz = ps.template set<2>();
+			GAIA_EACH(it) {
+				px[i] = (float)j;
+				pz[i] = (float)j * 3.f;
+				++j;
+			}
+		});
+
+		w1.save(s);
+	}
+
+	SECTION("Incompatible registry") {
+		ecs::World w2;
+		(void)w2.add<Scale>();
+		reg(w2);
+		auto e = w2.add();
+
+		s.seek(0);
+		REQUIRE_FALSE(w2.load(s));
+		REQUIRE(w2.valid(e));
+	}
+
+	SECTION("Load") {
+		ecs::World w2;
+		reg(w2);
+		auto q = w2.query().all<Position>();
+		{
+			auto e = w2.add();
+			w2.add<Position>(e, {-1.f, -1.f, -1.f});
+			REQUIRE(q.count() == 1);
+		}
+
+		s.seek(0);
+		REQUIRE(w2.load(s));
+
+		REQUIRE(q.count() == N - 2);
+		REQUIRE(q.count(ecs::Constraints::AcceptAll) == N - 1);
+		REQUIRE(w2.query().all<SnapshotStr>().count(ecs::Constraints::AcceptAll) == N / 4);
+
+		REQUIRE_FALSE(w2.enabled(ents[1]));
+		REQUIRE(w2.enabled(ents[0]));
+		REQUIRE(w2.get("named") == ents[3]);
+		REQUIRE(strcmp(w2.name(ents[3]), "named") == 0);
+		REQUIRE(w2.has(child, ecs::Pair(ecs::ChildOf, parent)));
+
+		GAIA_FOR(N) {
+			if (i == 2)
+				continue;
+			const auto e = ents[i];
+			const auto p = w2.get<Position>(e);
+			REQUIRE(p.x == (float)i);
+			REQUIRE(p.y == (float)i * 2.f);
+			if (i % 4 == 0)
+				REQUIRE(w2.get<SnapshotStr>(e).str == std::to_string(i));
+			if (i % 100 == 0) {
+				const auto sc = w2.get<ecs::uni<Scale>>(e);
+				REQUIRE(sc.y == 2.f);
+			}
+		}
+
+		uint32_t cnt = 0;
+		float sumX = 0.f;
+		float sumZ = 0.f;
+		w2.query().all<PositionSoA>().each([&](ecs::Iter it) {
+			auto ps = it.view<PositionSoA>();
+			auto px = ps.template get<0>();
+			auto pz = ps.template get<2>();
+			GAIA_EACH(it) {
+				sumX += px[i];
+				sumZ += pz[i];
+				++cnt;
+			}
+		});
+		REQUIRE(cnt == NSoA);
+		REQUIRE(sumX == (float)(NSoA * (NSoA - 1) / 2));
+		REQUIRE(sumZ == sumX * 3.f);
+
+		// The loaded world keeps working as usual
+		auto e = w2.add();
+		w2.add<Position>(e, {5.f, 5.f, 5.f});
+		REQUIRE(e != ents[2]);
+		REQUIRE(q.count() == N - 1);
+		w2.del(parent);
+		w2.update();
+		REQUIRE_FALSE(w2.valid(child));
+	}
+
+	SECTION("Load from external memory") {
+		// Stands in for a memory-mapped snapshot file
+		cnt::darray<uint8_t> file(s.bytes());
+		memcpy(file.data(), s.data(), s.bytes());
+
+		ecs::SerializationBuffer s2;
+		s2.attach(file.data(), (uint32_t)file.size());
+		REQUIRE(s2.attached());
+		REQUIRE(s2.bytes() == s.bytes());
+
+		ecs::World w2;
+		reg(w2);
+		REQUIRE(w2.load(s2));
+		REQUIRE(s2.tell() == s2.bytes());
+
+		REQUIRE(w2.query().all<Position>().count() == N - 2);
+		REQUIRE(w2.get<SnapshotStr>(ents[4]).str == "4");
+		REQUIRE(w2.get<Position>(ents[N - 1]).y == (float)(N - 1) * 2.f);
+	}
+}
+
+TEST_CASE("Serialization - world delta") {
+	auto reg = [](ecs::World& w) {
+		(void)w.add<Position>();
+		(void)w.add<Rotation>();
+		(void)w.add<ecs::uni<Scale>>();
+		(void)w.add<SnapshotStr>();
+	};
+
+	constexpr uint32_t N = 1000;
+	ecs::World w1;
+	reg(w1);
+
+	cnt::darray<ecs::Entity> ents;
+	GAIA_FOR(N) {
+		auto e = w1.add();
+		w1.add<Position>(e, {(float)i, 0.f, 0.f});
+		if (i % 4 == 0)
+			w1.add<SnapshotStr>(e, {std::to_string(i)});
+		if (i % 100 == 0)
+			w1.add<ecs::uni<Scale>>(e, {1.f, 1.f, 1.f});
+		ents.push_back(e);
+	}
+	auto parent = w1.add();
+
+	ecs::SerializationBuffer s;
+	w1.save(s);
+	auto version = w1.world_version();
+
+	ecs::World w2;
+	reg(w2);
+	s.seek(0);
+	REQUIRE(w2.load(s));
+
+	// Changes made after the snapshot
+	w1.set(ents[10]).set<Position>({100.f, 1.f, 1.f});
+	w1.set(ents[12]).set<SnapshotStr>({"changed"});
+	w1.set<ecs::uni<Scale>>(ents[0], {5.f, 5.f, 5.f});
+	w1.add<Rotation>(ents[20], {1.f, 2.f, 3.f, 4.f});
+	w1.enable(ents[30], false);
+	w1.name(ents[40], "renamed");
+	w1.child(ents[50], parent);
+	w1.del(ents[60]);
+	w1.del(ents[70]);
+	w1.update();
+	// Reuses one of the deleted records
+	auto created = w1.add();
+	w1.add<Position>(created, {-1.f, -1.f, -1.f});
+	w1.name(created, "created");
+
+	ecs::SerializationBuffer d;
+	w1.save_delta(d, version);
+	REQUIRE(d.bytes() < s.bytes() / 4);
+
+	// The delta is relative to a different version of the world
+	{
+		ecs::World w3;
+		reg(w3);
+		d.seek(0);
+		REQUIRE_FALSE(w3.load_delta(d));
+	}
+
+	d.seek(0);
+	REQUIRE(w2.load_delta(d));
+	REQUIRE(d.tell() == d.bytes());
+	REQUIRE(w2.world_version() == w1.world_version());
+
+	auto q = w2.query().all<Position>();
+	REQUIRE(q.count() == N - 2);
+	REQUIRE(q.count(ecs::Constraints::AcceptAll) == N - 1);
+	REQUIRE(w2.get<Position>(ents[10]).x == 100.f);
+	REQUIRE(w2.get<Position>(ents[11]).x == 11.f);
+	REQUIRE(w2.get<SnapshotStr>(ents[12]).str == "changed");
+	REQUIRE(w2.get<SnapshotStr>(ents[16]).str == "16");
+	// Unique components are shared by the whole chunk
+	REQUIRE(w2.get<ecs::uni<Scale>>(ents[0]).x == 5.f);
+	REQUIRE(w2.get<ecs::uni<Scale>>(ents[300]).x == 5.f);
+	REQUIRE(w2.has<Rotation>(ents[20]));
+	REQUIRE(w2.get<Rotation>(ents[20]).w == 4.f);
+	REQUIRE(w2.get<Position>(ents[20]).x == 20.f);
+	REQUIRE_FALSE(w2.enabled(ents[30]));
+	REQUIRE(w2.get("renamed") == ents[40]);
+	REQUIRE(w2.has(ents[50], ecs::Pair(ecs::ChildOf, parent)));
+	REQUIRE(w2.valid(created));
+	REQUIRE(w2.get("created") == created);
+	REQUIRE(w2.get<Position>(created).x == -1.f);
+	const auto deleted = created.id() == ents[60].id() ? ents[70] : ents[60];
+	REQUIRE_FALSE(w2.valid(deleted));
+
+	// Deltas chain
+	version = w1.world_version();
+	w1.set(ents[11]).set<Position>({111.f, 0.f, 0.f});
+	w1.del(ents[50]);
+	w1.update();
+
+	d.reset();
+	w1.save_delta(d, version);
+	d.seek(0);
+	REQUIRE(w2.load_delta(d));
+	REQUIRE(w2.get<Position>(ents[11]).x == 111.f);
+	REQUIRE_FALSE(w2.valid(ents[50]));
+	REQUIRE(q.count(ecs::Constraints::AcceptAll) == N - 2);
+
+	// Applying the same delta twice is refused
+	d.seek(0);
+	REQUIRE_FALSE(w2.load_delta(d));
+
+	SECTION("Bulk and cleanup moves") {
+		auto regMoves = [&](ecs::World& w) {
+			reg(w);
+			(void)w.add<Empty>();
+		};
+
+		ecs::World wa;
+		regMoves(wa);
+		auto tag = wa.add();
+		wa.add(tag, ecs::Pair(ecs::OnDelete, ecs::Remove));
+		cnt::darray<ecs::Entity> moved;
+		GAIA_FOR(100) {
+			auto e = wa.add();
+			wa.add<Position>(e, {(float)i, 0.f, 0.f});
+			if (i % 2 == 0)
+				wa.add(e, tag);
+			moved.push_back(e);
+		}
+
+		ecs::SerializationBuffer sa;
+		wa.save(sa);
+		auto ver = wa.world_version();
+
+		ecs::World wb;
+		regMoves(wb);
+		sa.seek(0);
+		REQUIRE(wb.load(sa));
+
+		// Bulk add
+		auto qa = wa.query().all<Position>();
+		wa.bulk(qa).add<Empty>();
+		wa.update();
+
+		ecs::SerializationBuffer da;
+		wa.save_delta(da, ver);
+		da.seek(0);
+		REQUIRE(wb.load_delta(da));
+		for (auto e: moved) {
+			REQUIRE(wb.has<Empty>(e));
+			REQUIRE(wb.has(e, tag) == wa.has(e, tag));
+		}
+
+		// Bulk delete
+		ver = wa.world_version();
+		wa.bulk(qa).del<Empty>();
+		wa.update();
+
+		da.reset();
+		wa.save_delta(da, ver);
+		da.seek(0);
+		REQUIRE(wb.load_delta(da));
+		for (auto e: moved)
+			REQUIRE_FALSE(wb.has<Empty>(e));
+
+		// Cleanup rules move entities out of the archetypes of the deleted entity
+		ver = wa.world_version();
+		wa.del(tag);
+		wa.update();
+
+		da.reset();
+		wa.save_delta(da, ver);
+		da.seek(0);
+		REQUIRE(wb.load_delta(da));
+		auto qb = wb.query().all<Position>();
+		REQUIRE(qb.count() == 100);
+		for (auto e: moved) {
+			REQUIRE_FALSE(wb.has(e, tag));
+			REQUIRE(wb.has<Position>(e));
+			REQUIRE(wb.get<Position>(e).x == wa.get<Position>(e).x);
+		}
+	}
+}
+
 //------------------------------------------------------------------------------
 // Mutlithreading
 //------------------------------------------------------------------------------
@@ -5471,6 +7135,315 @@ void Run_Schedule_Simple(const uint32_t* pArr, uint32_t* pRes, uint32_t Jobs, ui
 	GAIA_FOR(Jobs) REQUIRE(pRes[i] == ItemsPerJob);
 }
 
+struct JobFuncCounter {
+	uint32_t* pCtorCnt;
+	uint32_t* pDtorCnt;
+
+	JobFuncCounter(uint32_t* ctorCnt, uint32_t* dtorCnt): pCtorCnt(ctorCnt), pDtorCnt(dtorCnt) {
+		++*pCtorCnt;
+	}
+	JobFuncCounter(const JobFuncCounter& other): pCtorCnt(other.pCtorCnt), pDtorCnt(other.pDtorCnt) {
+		++*pCtorCnt;
+	}
+	~JobFuncCounter() {
+		++*pDtorCnt;
+	}
+};
+
+TEST_CASE("Multithreading - JobFunc") {
+	SECTION("Invoke") {
+		mt::JobFunc<uint32_t(uint32_t)> f;
+		REQUIRE_FALSE(f);
+
+		const uint32_t add = 10;
+		f = [add](uint32_t value) {
+			return value + add;
+		};
+		REQUIRE(f);
+		REQUIRE(f(5) == 15);
+
+		auto f2 = f;
+		REQUIRE(f2(1) == 11);
+
+		auto f3 = GAIA_MOV(f2);
+		REQUIRE_FALSE(f2);
+		REQUIRE(f3(2) == 12);
+
+		f3 = nullptr;
+		REQUIRE_FALSE(f3);
+	}
+	SECTION("Lifetime") {
+		uint32_t ctorCnt = 0;
+		uint32_t dtorCnt = 0;
+		{
+			JobFuncCounter counter(&ctorCnt, &dtorCnt);
+			mt::JobFunc<void()> f = [counter]() {};
+			mt::JobFunc<void()> f2 = f;
+			const auto dtorCntBefore = dtorCnt;
+			f2.reset();
+			REQUIRE(dtorCnt == dtorCntBefore + 1);
+		}
+		REQUIRE(ctorCnt == dtorCnt);
+	}
+	SECTION("Arena") {
+		uint32_t ctorCnt = 0;
+		uint32_t dtorCnt = 0;
+
+		mt::JobArena arena;
+		GAIA_FOR(1000)(void) arena.alloc<JobFuncCounter>(&ctorCnt, &dtorCnt);
+		const auto blocks = arena.blocks();
+		REQUIRE(blocks > 0);
+
+		arena.reset();
+		REQUIRE(ctorCnt == 1000);
+		REQUIRE(dtorCnt == 1000);
+
+		// Memory blocks are reused after reset
+		GAIA_FOR(1000)(void) arena.alloc<JobFuncCounter>(&ctorCnt, &dtorCnt);
+		REQUIRE(arena.blocks() == blocks);
+	}
+}
+
+TEST_CASE("Multithreading - JobDeque") {
+	mt::JobDeque deque;
+
+	SECTION("Owner LIFO, thief FIFO") {
+		GAIA_FOR(4) REQUIRE(deque.try_push(mt::JobHandle(i, 0, 0)));
+		REQUIRE(deque.size() == 4);
+
+		mt::JobHandle jobHandle;
+		REQUIRE(deque.try_pop(jobHandle));
+		REQUIRE(jobHandle.id() == 3);
+		REQUIRE(deque.try_steal(jobHandle));
+		REQUIRE(jobHandle.id() == 0);
+		REQUIRE(deque.try_pop(jobHandle));
+		REQUIRE(jobHandle.id() == 2);
+		REQUIRE(deque.try_steal(jobHandle));
+		REQUIRE(jobHandle.id() == 1);
+
+		REQUIRE(deque.empty());
+		REQUIRE_FALSE(deque.try_pop(jobHandle));
+		REQUIRE_FALSE(deque.try_steal(jobHandle));
+	}
+	SECTION("Capacity") {
+		GAIA_FOR(mt::JobDeque::N) REQUIRE(deque.try_push(mt::JobHandle(i, 0, 0)));
+		REQUIRE_FALSE(deque.try_push(mt::JobHandle(0, 0, 0)));
+
+		mt::JobHandle jobHandle;
+		REQUIRE(deque.try_steal(jobHandle));
+		REQUIRE(deque.try_push(jobHandle));
+	}
+	SECTION("Concurrent stealing") {
+		constexpr uint32_t Jobs = 100000;
+		constexpr uint32_t Thieves = 3;
+
+		auto pTaken = std::make_unique<std::atomic_uint32_t[]>(Jobs);
+		auto* taken = pTaken.get();
+		GAIA_FOR(Jobs) taken[i] = 0;
+		std::atomic_bool done = false;
+
+		cnt::sarr<std::thread, Thieves> thieves;
+		GAIA_FOR(Thieves) {
+			thieves[i] = std::thread([&]() {
+				mt::JobHandle jobHandle;
+				while (!done) {
+					if (deque.try_steal(jobHandle))
+						++taken[jobHandle.id()];
+				}
+			});
+		}
+
+		mt::JobHandle jobHandle;
+		GAIA_FOR(Jobs) {
+			while (!deque.try_push(mt::JobHandle(i, 0, 0))) {
+				if (deque.try_pop(jobHandle))
+					++taken[jobHandle.id()];
+			}
+			// Pop once in a while so the owner competes with the thieves
+			if ((i % 3) == 0 && deque.try_pop(jobHandle))
+				++taken[jobHandle.id()];
+		}
+		while (deque.try_pop(jobHandle))
+			++taken[jobHandle.id()];
+
+		done = true;
+		GAIA_FOR(Thieves) thieves[i].join();
+
+		// Every job needs to be taken exactly once
+		uint32_t errors = 0;
+		GAIA_FOR(Jobs) errors += taken[i] != 1;
+		REQUIRE(errors == 0);
+	}
+}
+
+#if GAIA_ECS_CHUNK_ALLOCATOR
+TEST_CASE("Multithreading - ChunkAllocator") {
+	auto& allocator = ecs::ChunkAllocator::get();
+	allocator.flush();
+	const auto statsBefore = allocator.stats();
+
+	constexpr uint32_t Threads = 4;
+	constexpr uint32_t Iterations = 20;
+	constexpr uint32_t Blocks = 300;
+
+	std::atomic_uint32_t errors = 0;
+	cnt::sarr<std::thread, Threads> threads;
+	GAIA_FOR(Threads) {
+		threads[i] = std::thread([&, t = i]() {
+			cnt::darr<uint32_t*> blocks;
+			GAIA_FOR_(Iterations, j) {
+				// Mix both block sizes and tag each block with its owner
+				GAIA_FOR_(Blocks, k) {
+					const uint32_t size = (k % 3) == 0 ? ecs::MaxMemoryBlockSize : ecs::MaxMemoryBlockSize / 2;
+					auto* pBlock = (uint32_t*)allocator.alloc(size - ecs::MemoryBlockUsableOffset);
+					pBlock[0] = t;
+					pBlock[1] = k;
+					blocks.push_back(pBlock);
+				}
+				// Release every other block first so the blocks get recycled out of order
+				for (uint32_t k = 0; k < Blocks; k += 2) {
+					errors += blocks[k][0] != t || blocks[k][1] != k;
+					allocator.free(blocks[k]);
+				}
+				for (uint32_t k = 1; k < Blocks; k += 2) {
+					errors += blocks[k][0] != t || blocks[k][1] != k;
+					allocator.free(blocks[k]);
+				}
+				blocks.clear();
+			}
+		});
+	}
+	GAIA_FOR(Threads) threads[i].join();
+	REQUIRE(errors == 0);
+
+	// Blocks cached by the threads are returned when they exit so all new pages can be released
+	allocator.flush();
+	const auto statsAfter = allocator.stats();
+	GAIA_FOR(ecs::MemoryBlockSizeTypes) {
+		REQUIRE(statsAfter.stats[i].num_pages == statsBefore.stats[i].num_pages);
+		REQUIRE(statsAfter.stats[i].mem_used == statsBefore.stats[i].mem_used);
+	}
+}
+
+TEST_CASE("Multithreading - ChunkAllocator thread caches") {
+	auto& allocator = ecs::ChunkAllocator::get();
+	allocator.flush();
+	const auto statsBefore = allocator.stats();
+
+	// A thread that keeps running after it releases its blocks. Some of them stay in its cache.
+	std::atomic_bool released = false;
+	std::atomic_bool quit = false;
+	std::thread thread([&]() {
+		cnt::darr<void*> blocks;
+		GAIA_FOR(62 * 2) blocks.push_back(allocator.alloc(ecs::MaxMemoryBlockSize - ecs::MemoryBlockUsableOffset));
+		for (auto* pBlock: blocks)
+			allocator.free(pBlock);
+		released = true;
+		while (!quit)
+			std::this_thread::yield();
+
+		// The cache keeps working after it was drained
+		allocator.free(allocator.alloc(ecs::MaxMemoryBlockSize - ecs::MemoryBlockUsableOffset));
+	});
+	while (!released)
+		std::this_thread::yield();
+
+	// Cached blocks are not in use
+	const auto statsCached = allocator.stats();
+	GAIA_FOR(ecs::MemoryBlockSizeTypes) {
+		REQUIRE(statsCached.stats[i].mem_used == statsBefore.stats[i].mem_used);
+	}
+
+	// The main thread returns blocks cached by the other thread so all new pages can be released
+	allocator.flush();
+	const auto statsAfter = allocator.stats();
+	GAIA_FOR(ecs::MemoryBlockSizeTypes) {
+		REQUIRE(statsAfter.stats[i].num_pages == statsBefore.stats[i].num_pages);
+		REQUIRE(statsAfter.stats[i].mem_used == statsBefore.stats[i].mem_used);
+	}
+
+	quit = true;
+	thread.join();
+	allocator.flush();
+}
+
+TEST_CASE("ChunkAllocator - trimming") {
+	auto& allocator = ecs::ChunkAllocator::get();
+	const auto policyBefore = allocator.trim_policy();
+	allocator.flush();
+
+	constexpr uint32_t SizeType = ecs::MemoryBlockSizeTypes - 1;
+	constexpr uint64_t PageBytes = (uint64_t)ecs::MaxMemoryBlockSize * 62;
+
+	// Fill a few pages and release all their blocks again. The pages end up empty once
+	// blocks kept in the thread's cache are returned by trim().
+	{
+		cnt::darr<void*> blocks;
+		GAIA_FOR(62 * 4) blocks.push_back(allocator.alloc(ecs::MaxMemoryBlockSize - ecs::MemoryBlockUsableOffset));
+		for (auto* pBlock: blocks)
+			allocator.free(pBlock);
+	}
+	const auto statsBefore = allocator.stats();
+	const auto pagesBefore = statsBefore.stats[SizeType].num_pages;
+	REQUIRE(pagesBefore >= 4);
+
+	SECTION("Decay") {
+		ecs::ChunkAllocatorTrimPolicy policy;
+		policy.low_watermark = PageBytes;
+		policy.high_watermark = UINT64_MAX;
+		policy.decay_ticks = 3;
+		policy.auto_trim = false;
+		allocator.trim_policy(policy);
+
+		REQUIRE(allocator.trim() == 0);
+		REQUIRE(allocator.trim() == 0);
+		const auto released = allocator.trim();
+		REQUIRE(released >= PageBytes * 2);
+		REQUIRE(released % PageBytes == 0);
+		REQUIRE(allocator.trim() == 0);
+
+		// One empty page is kept
+		const auto statsAfter = allocator.stats();
+		REQUIRE(statsAfter.stats[SizeType].num_pages == pagesBefore - (uint32_t)(released / PageBytes));
+		REQUIRE(statsAfter.stats[SizeType].num_pages >= 1);
+		REQUIRE(statsAfter.mem_trimmed == statsBefore.mem_trimmed + released);
+	}
+
+	SECTION("High watermark") {
+		ecs::ChunkAllocatorTrimPolicy policy;
+		policy.low_watermark = 0;
+		policy.high_watermark = PageBytes;
+		policy.decay_ticks = 0;
+		policy.auto_trim = false;
+		allocator.trim_policy(policy);
+
+		// Everything is released right away
+		const auto released = allocator.trim();
+		REQUIRE(released >= PageBytes * 3);
+		REQUIRE(allocator.trim() == 0);
+
+		const auto statsAfter = allocator.stats();
+		REQUIRE(statsAfter.stats[SizeType].num_pages == pagesBefore - (uint32_t)(released / PageBytes));
+		REQUIRE(statsAfter.stats[SizeType].num_pages_free == statsAfter.stats[SizeType].num_pages);
+	}
+
+	SECTION("No decay") {
+		ecs::ChunkAllocatorTrimPolicy policy;
+		policy.low_watermark = 0;
+		policy.high_watermark = UINT64_MAX;
+		policy.decay_ticks = 0;
+		policy.auto_trim = false;
+		allocator.trim_policy(policy);
+
+		GAIA_FOR(10) REQUIRE(allocator.trim() == 0);
+		REQUIRE(allocator.stats().stats[SizeType].num_pages == pagesBefore);
+	}
+
+	allocator.trim_policy(policyBefore);
+	allocator.flush();
+}
+#endif
+
 TEST_CASE("Multithreading - Schedule") {
 	auto& tp = mt::ThreadPool::get();
 
@@ -5499,6 +7472,62 @@ TEST_CASE("Multithreading - Schedule") {
 	}
 }
 
+TEST_CASE("Multithreading - Query matching") {
+	auto& tp = mt::ThreadPool::get();
+	TestWorld twld;
+
+	constexpr uint32_t TagCnt = 8;
+	cnt::sarr<ecs::Entity, TagCnt> tags;
+	GAIA_FOR(TagCnt) tags[i] = wld.add();
+	(void)wld.add<Position>();
+
+	// Register the queries while there are no archetypes to match yet
+	cnt::darr<ecs::Query> queries;
+	queries.push_back(wld.query().all<Position>());
+	GAIA_FOR(TagCnt) {
+		queries.push_back(wld.query().all(tags[i]));
+		queries.push_back(wld.query().all<Position>().no(tags[i]));
+		queries.push_back(wld.query().all(tags[i]).any(tags[(i + 1) % TagCnt]));
+	}
+	for (auto& q: queries)
+		REQUIRE(q.count() == 0);
+
+	// Create an archetype for every combination of tags
+	constexpr uint32_t N = 1U << TagCnt;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e);
+		GAIA_FOR_(TagCnt, j) {
+			if ((i & (1U << j)) != 0)
+				wld.add(e, tags[j]);
+		}
+	}
+
+	auto check = [&]() {
+		wld.match_queries();
+
+		uint32_t idx = 0;
+		REQUIRE(queries[idx++].fetch().cache_size() == N);
+		GAIA_FOR(TagCnt) {
+			REQUIRE(queries[idx++].fetch().cache_size() == N / 2);
+			REQUIRE(queries[idx++].fetch().cache_size() == N / 2);
+			REQUIRE(queries[idx++].fetch().cache_size() == N / 4);
+		}
+		for (auto& q: queries)
+			REQUIRE(q.count() == q.fetch().cache_size());
+	};
+
+	SECTION("Max workers") {
+		const auto threads = tp.hw_thread_cnt();
+		tp.set_max_workers(threads, threads);
+		check();
+	}
+	SECTION("0 workers") {
+		tp.set_max_workers(0, 0);
+		check();
+	}
+}
+
 TEST_CASE("Multithreading - ScheduleParallel") {
 	auto& tp = mt::ThreadPool::get();
 
@@ -5630,4 +7659,172 @@ TEST_CASE("Multithreading - CompleteMany") {
 	}
 }
 
+
+TEST_CASE("Multithreading - Query each_par") {
+	auto& tp = mt::ThreadPool::get();
+
+	TestWorld twld;
+
+	constexpr uint32_t N = 10'000;
+	cnt::darr<ecs::Entity> ents;
+	ents.reserve(N);
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, 0, 0});
+		ents.push_back(e);
+	}
+
+	auto q = wld.query().all<Position&>();
+
+	auto work = [&]() {
+		GAIA_FOR(N) wld.set<Position>(ents[i], {(float)i, 0, 0});
+
+		auto jobHandle = q.each_par(
+				[](Position& p) {
+					p.y = p.x * 2.f;
+				},
+				4);
+		tp.wait(jobHandle);
+
+		std::atomic_uint32_t cnt = 0;
+		jobHandle = q.each_par([&cnt](ecs::Iter it) {
+			auto p = it.view<Position>();
+			GAIA_EACH(it) {
+				if (p[i].y == p[i].x * 2.f)
+					++cnt;
+			}
+		});
+		tp.wait(jobHandle);
+		REQUIRE(cnt == N);
+
+		// All chunks need to be unlocked once the jobs finish
+		for (auto e: ents)
+			REQUIRE_FALSE(wld.get_chunk(e)->locked());
+
+		// The same query can be run again before the previous jobs finish.
+		// Chunks stay locked by all of them.
+		constexpr uint32_t Runs = 10;
+		std::atomic_uint32_t cnts[Runs]{};
+		mt::JobHandle jobHandles[Runs];
+		GAIA_FOR(Runs) {
+			auto& c = cnts[i];
+			jobHandles[i] = q.each_par([&c](ecs::Iter it) {
+				c += it.size();
+			});
+		}
+		for (auto h: jobHandles)
+			tp.wait(h);
+		for (const auto& c: cnts)
+			REQUIRE(c == N);
+		for (auto e: ents)
+			REQUIRE_FALSE(wld.get_chunk(e)->locked());
+
+		// Functors bigger than GAIA_JOB_FUNC_SIZE are supported
+		{
+			float coefs[32];
+			GAIA_FOR(32) coefs[i] = 1.f;
+			static_assert(sizeof(coefs) > GAIA_JOB_FUNC_SIZE);
+
+			std::atomic_uint32_t cntBig = 0;
+			jobHandle = q.each_par([&cntBig, coefs](ecs::Iter it) {
+				if (coefs[31] == 1.f)
+					cntBig += it.size();
+			});
+			tp.wait(jobHandle);
+			REQUIRE(cntBig == N);
+		}
+
+		// Nothing to process
+		auto qEmpty = wld.query().all<Acceleration>();
+		jobHandle = qEmpty.each_par([](const Acceleration&) {});
+		REQUIRE(jobHandle == mt::JobNull);
+		tp.wait(jobHandle);
+
+		tp.wait_all();
+	};
+
+	SECTION("Max workers") {
+		const auto threads = tp.hw_thread_cnt();
+		tp.set_max_workers(threads, threads);
+
+		work();
+	}
+	SECTION("0 workers") {
+		tp.set_max_workers(0, 0);
+
+		work();
+	}
+}
+
+TEST_CASE("Multithreading - ThreadCommandBuffer") {
+	auto& tp = mt::ThreadPool::get();
+
+	TestWorld twld;
+
+	constexpr uint32_t N = 10'000;
+	GAIA_FOR(N) {
+		auto e = wld.add();
+		wld.add<Position>(e, {(float)i, 0, 0});
+	}
+
+	// Components used by command buffers on worker threads need to be registered up front
+	(void)wld.add<Acceleration>();
+	(void)wld.add<Scale>();
+
+	auto q = wld.query().all<Position>();
+
+	auto work = [&]() {
+		ecs::ThreadCommandBuffer cb(wld);
+
+		auto jobHandle = q.each_par([&cb](ecs::Iter it) {
+			auto& buffer = cb.get();
+			auto ents = it.view<ecs::Entity>();
+			auto p = it.view<Position>();
+			GAIA_EACH(it) {
+				buffer.add<Acceleration>(ents[i], {p[i].x, 0, 0});
+
+				auto e = buffer.add();
+				buffer.add<Scale>(e, {p[i].x, 0, 0});
+			}
+		});
+		tp.wait(jobHandle);
+
+		// Nothing is applied before the commit
+		REQUIRE(wld.query().all<Acceleration>().count() == 0);
+		cb.commit();
+
+		uint32_t cnt = 0;
+		wld.query().all<Position>().all<Acceleration>().each([&](const Position& p, const Acceleration& a) {
+			if (p.x == a.x)
+				++cnt;
+		});
+		REQUIRE(cnt == N);
+
+		uint64_t sum = 0;
+		wld.query().all<Scale>().each([&](const Scale& s) {
+			sum += (uint64_t)s.x;
+		});
+		REQUIRE(wld.query().all<Scale>().count() == N);
+		REQUIRE(sum == (uint64_t)N * (N - 1) / 2);
+
+		// Committing again does nothing
+		cb.commit();
+		REQUIRE(wld.query().all<Scale>().count() == N);
+
+		tp.wait_all();
+	};
+
+	SECTION("Max workers") {
+		const auto threads = tp.hw_thread_cnt();
+		tp.set_max_workers(threads, threads);
+
+		work();
+	}
+	SECTION("0 workers") {
+		tp.set_max_workers(0, 0);
+
+		work();
+	}
+}
+
 //------------------------------------------------------------------------------